@@ -0,0 +1,86 @@
+#include "admission.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+
+// Free disk space is rechecked after this long, a rejected client waits at least as much
+#define ADMISSION_DISK_RETRY_MS 5000
+
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int workers = 1;
+static size_t inflight_bytes = 0;
+static int inflight_requests = 0;
+static double inflight_cost = 0;
+
+void admission_init(int worker_count) {
+    workers = worker_count > 0 ? worker_count : 1;
+}
+
+// Both the upload and the converted output end up in the temporary directory
+static int disk_has_room(size_t bytes) {
+    struct statvfs fs;
+    if (statvfs(ADMISSION_TEMP_DIR, &fs) != 0) {
+        return 1;
+    }
+    unsigned long long available = (unsigned long long)fs.f_bavail * fs.f_frsize;
+    unsigned long long needed = (unsigned long long)(inflight_bytes + bytes) * 2 + ADMISSION_MIN_FREE_DISK;
+    return available >= needed;
+}
+
+static uint32_t clamp_retry(double retry_ms) {
+    if (retry_ms < ADMISSION_MIN_RETRY_MS) {
+        return ADMISSION_MIN_RETRY_MS;
+    }
+    if (retry_ms > ADMISSION_MAX_RETRY_MS) {
+        return ADMISSION_MAX_RETRY_MS;
+    }
+    return (uint32_t)retry_ms;
+}
+
+int admission_acquire(size_t bytes, double cost, int force, uint32_t *retry_after_ms) {
+    pthread_mutex_lock(&admission_mutex);
+
+    double backlog = (inflight_cost + cost) / workers;
+    // Roughly the time until one of the admitted requests finishes
+    double next_slot = inflight_requests > 0 ? inflight_cost / workers / inflight_requests : 0;
+    double retry = -1;
+
+    if (!force) {
+        if (!disk_has_room(bytes)) {
+            retry = ADMISSION_DISK_RETRY_MS;
+        } else if (backlog > ADMISSION_MAX_BACKLOG_MS && inflight_requests > 0) {
+            retry = backlog - ADMISSION_MAX_BACKLOG_MS;
+        } else if (inflight_requests >= ADMISSION_MAX_INFLIGHT_REQUESTS) {
+            retry = next_slot;
+        } else if (inflight_bytes + bytes > ADMISSION_MAX_INFLIGHT_BYTES && inflight_requests > 0) {
+            retry = next_slot;
+        }
+    }
+
+    if (retry >= 0) {
+        *retry_after_ms = clamp_retry(retry);
+        metrics_add(METRIC_ADMISSION_REJECTED, 1);
+        printf("Admission: busy (%d requests, %zu bytes, %.0f ms of work in flight), retry in %u ms\n",
+               inflight_requests, inflight_bytes, inflight_cost, *retry_after_ms);
+        pthread_mutex_unlock(&admission_mutex);
+        return -1;
+    }
+
+    inflight_bytes += bytes;
+    inflight_requests++;
+    inflight_cost += cost;
+    pthread_mutex_unlock(&admission_mutex);
+    return 0;
+}
+
+void admission_release(size_t bytes, double cost) {
+    pthread_mutex_lock(&admission_mutex);
+    inflight_bytes -= bytes < inflight_bytes ? bytes : inflight_bytes;
+    inflight_requests--;
+    inflight_cost -= cost;
+    if (inflight_cost < 0 || inflight_requests == 0) {
+        inflight_cost = 0;
+    }
+    pthread_mutex_unlock(&admission_mutex);
+}
@@ -0,0 +1,28 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Limits for requests that are uploading, queued or converting at the same time
+#define ADMISSION_MAX_INFLIGHT_BYTES (1024UL * 1024 * 1024)
+#define ADMISSION_MAX_INFLIGHT_REQUESTS 64
+#define ADMISSION_MAX_BACKLOG_MS 30000.0    // estimated work per worker
+#define ADMISSION_TEMP_DIR "/tmp"
+#define ADMISSION_MIN_FREE_DISK (256UL * 1024 * 1024)
+
+// Bounds for the delay suggested to rejected clients
+#define ADMISSION_MIN_RETRY_MS 250
+#define ADMISSION_MAX_RETRY_MS 60000
+
+void admission_init(int worker_count);
+
+// Reserves room for a request of the given size and estimated cost. Returns 0 when
+// it's admitted, otherwise -1 and how long the client should wait before retrying.
+// Forced requests (admin connections) are always admitted but still counted.
+int admission_acquire(size_t bytes, double cost, int force, uint32_t *retry_after_ms);
+
+// Gives back what admission_acquire reserved, once the request is done
+void admission_release(size_t bytes, double cost);
+
+#endif // ADMISSION_H
@@ -0,0 +1,369 @@
+#include "audio_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libavutil/channel_layout.h>
+
+typedef enum {
+    CODEC_DECODER = 0,
+    CODEC_ENCODER
+} CodecRole;
+
+// What a codec context was opened with. Keys are zeroed before they are filled in,
+// so they can be compared with memcmp.
+typedef struct {
+    const AVCodec *codec;
+    CodecRole role;
+    int sample_rate;
+    int channels;
+    int format;                 // sample format of the encoder, format of the coded stream for decoders
+    uint64_t channel_layout;
+    int64_t bit_rate;
+    int quality;                // VBR quality of the encoder, -1 for a constant bit rate
+    int block_align;
+} CodecKey;
+
+typedef struct {
+    CodecKey key;
+    AVCodecContext *context;    // NULL while a spare is wanted
+    int in_use;
+    int spare_wanted;
+    uint64_t last_used;
+} CodecSlot;
+
+typedef struct {
+    int64_t out_layout;
+    int64_t in_layout;
+    int out_fmt;
+    int out_rate;
+    int in_fmt;
+    int in_rate;
+} ResamplerKey;
+
+typedef struct {
+    ResamplerKey key;
+    SwrContext *context;
+    int in_use;
+    uint64_t last_used;
+} ResamplerSlot;
+
+typedef struct {
+    CodecSlot codecs[AUDIO_POOL_CODECS];
+    ResamplerSlot resamplers[AUDIO_POOL_RESAMPLERS];
+    uint64_t clock;             // for least recently used eviction
+} AudioPool;
+
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static _Thread_local AudioPool *thread_pool = NULL;
+
+static void release_pool(void *arg) {
+    AudioPool *pool = arg;
+    for (int i = 0; i < AUDIO_POOL_CODECS; i++) {
+        avcodec_free_context(&pool->codecs[i].context);
+    }
+    for (int i = 0; i < AUDIO_POOL_RESAMPLERS; i++) {
+        swr_free(&pool->resamplers[i].context);
+    }
+    free(pool);
+}
+
+static void create_pool_key(void) {
+    pthread_key_create(&pool_key, release_pool);
+}
+
+// NULL when it can't be allocated, the contexts are then simply not kept
+static AudioPool *current_pool(void) {
+    if (!thread_pool) {
+        pthread_once(&pool_key_once, create_pool_key);
+        thread_pool = calloc(1, sizeof(AudioPool));
+        if (thread_pool) {
+            pthread_setspecific(pool_key, thread_pool);
+        }
+    }
+    return thread_pool;
+}
+
+// Only encoders that declare it can be flushed; the others refuse input for good once drained
+static int encoder_can_flush(const AVCodecContext *context) {
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+    return (context->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH) != 0;
+#else
+    (void)context;
+    return 0;
+#endif
+}
+
+static CodecSlot *find_codec(AudioPool *pool, const CodecKey *key) {
+    for (int i = 0; i < AUDIO_POOL_CODECS; i++) {
+        CodecSlot *slot = &pool->codecs[i];
+        if (slot->context && !slot->in_use && memcmp(&slot->key, key, sizeof(*key)) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+// The slot waiting for a spare of this key, an empty one, or the least recently used idle one
+static CodecSlot *codec_slot_for(AudioPool *pool, const CodecKey *key) {
+    CodecSlot *empty = NULL;
+    CodecSlot *victim = NULL;
+    for (int i = 0; i < AUDIO_POOL_CODECS; i++) {
+        CodecSlot *slot = &pool->codecs[i];
+        if (slot->in_use) {
+            continue;
+        }
+        if (slot->spare_wanted && !slot->context && memcmp(&slot->key, key, sizeof(*key)) == 0) {
+            return slot;
+        }
+        if (!slot->context && !slot->spare_wanted) {
+            empty = empty ? empty : slot;
+        } else if (!victim || slot->last_used < victim->last_used) {
+            victim = slot;
+        }
+    }
+    if (empty) {
+        return empty;
+    }
+    if (victim) {
+        avcodec_free_context(&victim->context);
+    }
+    return victim;
+}
+
+static void keep_codec(const CodecKey *key, AVCodecContext *context) {
+    AudioPool *pool = current_pool();
+    CodecSlot *slot = pool ? codec_slot_for(pool, key) : NULL;
+    if (!slot) {
+        return;
+    }
+    slot->key = *key;
+    slot->context = context;
+    slot->in_use = 1;
+    slot->spare_wanted = 0;
+    slot->last_used = ++pool->clock;
+}
+
+static int take_codec(AVCodecContext **context, const CodecKey *key) {
+    AudioPool *pool = current_pool();
+    CodecSlot *slot = pool ? find_codec(pool, key) : NULL;
+    if (!slot) {
+        return 0;
+    }
+    slot->in_use = 1;
+    slot->last_used = ++pool->clock;
+    *context = slot->context;
+    return 1;
+}
+
+int audio_pool_open_decoder(AVCodecContext **context, const AVCodec *codec, const AVCodecParameters *codecpar) {
+    CodecKey key;
+    memset(&key, 0, sizeof(key));
+    key.codec = codec;
+    key.role = CODEC_DECODER;
+    key.sample_rate = codecpar->sample_rate;
+    key.channels = codecpar->channels;
+    key.format = codecpar->format;
+    key.channel_layout = codecpar->channel_layout;
+    key.bit_rate = codecpar->bit_rate;
+    key.block_align = codecpar->block_align;
+    key.quality = -1;
+
+    // Extradata configures the decoder as well, such streams aren't kept
+    int poolable = codecpar->extradata_size == 0;
+    if (poolable && take_codec(context, &key)) {
+        return 0;
+    }
+
+    AVCodecContext *decoder = avcodec_alloc_context3(codec);
+    if (!decoder) {
+        return AVERROR(ENOMEM);
+    }
+    int ret = avcodec_parameters_to_context(decoder, codecpar);
+    if (ret >= 0) {
+        ret = avcodec_open2(decoder, codec, NULL);
+    }
+    if (ret < 0) {
+        avcodec_free_context(&decoder);
+        return ret;
+    }
+
+    if (poolable) {
+        keep_codec(&key, decoder);
+    }
+    *context = decoder;
+    return 0;
+}
+
+static int open_encoder(AVCodecContext **context, const CodecKey *key) {
+    AVCodecContext *encoder = avcodec_alloc_context3(key->codec);
+    if (!encoder) {
+        return AVERROR(ENOMEM);
+    }
+    encoder->channels = key->channels;
+    encoder->channel_layout = key->channel_layout;
+    encoder->sample_rate = key->sample_rate;
+    encoder->sample_fmt = key->format;
+    encoder->bit_rate = key->bit_rate;
+    encoder->time_base = (AVRational){1, key->sample_rate};
+    if (key->quality >= 0) {
+        encoder->flags |= AV_CODEC_FLAG_QSCALE;
+        encoder->global_quality = key->quality * FF_QP2LAMBDA;
+    }
+
+    int ret = avcodec_open2(encoder, key->codec, NULL);
+    if (ret < 0) {
+        avcodec_free_context(&encoder);
+        return ret;
+    }
+    *context = encoder;
+    return 0;
+}
+
+int audio_pool_open_encoder(AVCodecContext **context, const AVCodec *codec, int sample_rate,
+                            uint64_t channel_layout, enum AVSampleFormat sample_fmt, int64_t bit_rate,
+                            int vbr_quality) {
+    CodecKey key;
+    memset(&key, 0, sizeof(key));
+    key.codec = codec;
+    key.role = CODEC_ENCODER;
+    key.sample_rate = sample_rate;
+    key.channels = av_get_channel_layout_nb_channels(channel_layout);
+    key.format = sample_fmt;
+    key.channel_layout = channel_layout;
+    key.bit_rate = bit_rate;
+    key.quality = vbr_quality;
+
+    if (take_codec(context, &key)) {
+        return 0;
+    }
+
+    int ret = open_encoder(context, &key);
+    if (ret < 0) {
+        return ret;
+    }
+    keep_codec(&key, *context);
+    return 0;
+}
+
+void audio_pool_close_codec(AVCodecContext **context) {
+    if (!*context) {
+        return;
+    }
+
+    CodecSlot *slot = NULL;
+    for (int i = 0; thread_pool && i < AUDIO_POOL_CODECS; i++) {
+        if (thread_pool->codecs[i].context == *context) {
+            slot = &thread_pool->codecs[i];
+        }
+    }
+    if (!slot) {
+        avcodec_free_context(context);
+        return;
+    }
+
+    slot->in_use = 0;
+    if (slot->key.role == CODEC_DECODER || encoder_can_flush(slot->context)) {
+        avcodec_flush_buffers(slot->context);
+    } else {
+        avcodec_free_context(&slot->context);
+        slot->spare_wanted = 1;
+    }
+    *context = NULL;
+}
+
+void audio_pool_refill(void) {
+    if (!thread_pool) {
+        return;
+    }
+    for (int i = 0; i < AUDIO_POOL_CODECS; i++) {
+        CodecSlot *slot = &thread_pool->codecs[i];
+        if (slot->spare_wanted && !slot->context && !slot->in_use) {
+            // A key that can't be opened any more is dropped instead of retried on every idle turn
+            if (open_encoder(&slot->context, &slot->key) < 0) {
+                memset(slot, 0, sizeof(*slot));
+            } else {
+                slot->spare_wanted = 0;
+            }
+        }
+    }
+}
+
+int audio_pool_open_resampler(SwrContext **context,
+                              int64_t out_layout, enum AVSampleFormat out_fmt, int out_rate,
+                              int64_t in_layout, enum AVSampleFormat in_fmt, int in_rate) {
+    ResamplerKey key;
+    memset(&key, 0, sizeof(key));
+    key.out_layout = out_layout;
+    key.in_layout = in_layout;
+    key.out_fmt = out_fmt;
+    key.out_rate = out_rate;
+    key.in_fmt = in_fmt;
+    key.in_rate = in_rate;
+
+    AudioPool *pool = current_pool();
+    ResamplerSlot *empty = NULL;
+    ResamplerSlot *victim = NULL;
+    for (int i = 0; pool && i < AUDIO_POOL_RESAMPLERS; i++) {
+        ResamplerSlot *slot = &pool->resamplers[i];
+        if (slot->in_use) {
+            continue;
+        }
+        if (slot->context && memcmp(&slot->key, &key, sizeof(key)) == 0) {
+            slot->in_use = 1;
+            slot->last_used = ++pool->clock;
+            *context = slot->context;
+            return 0;
+        }
+        if (!slot->context) {
+            empty = empty ? empty : slot;
+        } else if (!victim || slot->last_used < victim->last_used) {
+            victim = slot;
+        }
+    }
+
+    SwrContext *resampler = swr_alloc_set_opts(NULL, out_layout, out_fmt, out_rate, in_layout, in_fmt, in_rate, 0, NULL);
+    if (!resampler) {
+        return AVERROR(ENOMEM);
+    }
+    int ret = swr_init(resampler);
+    if (ret < 0) {
+        swr_free(&resampler);
+        return ret;
+    }
+
+    ResamplerSlot *slot = empty ? empty : victim;
+    if (slot) {
+        swr_free(&slot->context);
+        slot->key = key;
+        slot->context = resampler;
+        slot->in_use = 1;
+        slot->last_used = ++pool->clock;
+    }
+    *context = resampler;
+    return 0;
+}
+
+void audio_pool_close_resampler(SwrContext **context) {
+    if (!*context) {
+        return;
+    }
+
+    ResamplerSlot *slot = NULL;
+    for (int i = 0; thread_pool && i < AUDIO_POOL_RESAMPLERS; i++) {
+        if (thread_pool->resamplers[i].context == *context) {
+            slot = &thread_pool->resamplers[i];
+        }
+    }
+    // Initialising it again drops the samples a cancelled job left buffered
+    if (!slot || swr_init(slot->context) < 0) {
+        if (slot) {
+            memset(slot, 0, sizeof(*slot));
+        }
+        swr_free(context);
+        return;
+    }
+    slot->in_use = 0;
+    *context = NULL;
+}
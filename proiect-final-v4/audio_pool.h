@@ -0,0 +1,35 @@
+#ifndef AUDIO_POOL_H
+#define AUDIO_POOL_H
+
+#include <stdint.h>
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+
+// Opened codec contexts and resamplers kept per thread
+#define AUDIO_POOL_CODECS 8
+#define AUDIO_POOL_RESAMPLERS 8
+
+// Per-thread caches of opened decoders, encoders and resamplers, keyed by codec, sample
+// rate, channel layout, sample format and bit rate. A job takes what it needs and gives it
+// back when it's done, the next job with the same stream parameters then skips the setup.
+// Each open returns 0 or a negative AVERROR like avcodec_open2 and swr_init. Encoders with a
+// vbr_quality of 0 or more run in variable bit rate mode with that global quality instead
+// of the bit rate, -1 keeps the bit rate constant.
+int audio_pool_open_decoder(AVCodecContext **context, const AVCodec *codec, const AVCodecParameters *codecpar);
+int audio_pool_open_encoder(AVCodecContext **context, const AVCodec *codec, int sample_rate,
+                            uint64_t channel_layout, enum AVSampleFormat sample_fmt, int64_t bit_rate,
+                            int vbr_quality);
+int audio_pool_open_resampler(SwrContext **context,
+                              int64_t out_layout, enum AVSampleFormat out_fmt, int out_rate,
+                              int64_t in_layout, enum AVSampleFormat in_fmt, int in_rate);
+
+// Reset the context for the next job and return it to the pool; contexts that didn't
+// come from the pool are freed. The pointer is cleared either way, NULL is ignored.
+void audio_pool_close_codec(AVCodecContext **context);
+void audio_pool_close_resampler(SwrContext **context);
+
+// Encoders that can't be flushed once drained (the native AAC encoder, LAME, ...) are freed
+// instead of reset; this opens a spare with the same parameters. Meant for idle workers.
+void audio_pool_refill(void);
+
+#endif // AUDIO_POOL_H
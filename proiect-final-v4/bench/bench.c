@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "../conversii.h"
+#include "../conversii_audio.h"
+#include "../audio_pool.h"
+#include "../registry.h"
+#include "../planner.h"
+#include "../cost.h"
+#include "../result_metadata.h"
+#include "stats.h"
+
+// Runs every registered conversion in-process, on the sample files and on large generated
+// inputs, and writes throughput, latency percentiles and peak memory per case as JSON.
+//
+// usage: bench [-s samples_dir] [-n iterations] [-O option] [-S] [-P] [-K] [-o output.json]
+//   -S skips the synthetic inputs, -O only runs one conversion option,
+//   -P probes audio inputs fully instead of trusting their format (for comparison),
+//   -K converts all samples with libswresample instead of the SIMD kernels (for comparison)
+
+#define DEFAULT_SAMPLES_DIR "client"
+#define DEFAULT_ITERATIONS 5
+#define MAX_ITERATIONS 1000
+// Runs before the timed ones, so page cache and lazy library setup aren't measured
+#define WARMUP_RUNS 1
+#define CASE_TIMEOUT_MS 300000.0
+#define MAX_INPUTS 32
+
+// Synthetic inputs: two minutes of CD-quality stereo and a 12 megapixel photo
+#define SYNTHETIC_WAV_SECONDS 120
+#define SYNTHETIC_WAV_RATE 44100
+#define SYNTHETIC_BMP_WIDTH 4000
+#define SYNTHETIC_BMP_HEIGHT 3000
+
+typedef struct {
+    char name[64];
+    FileFormat format;
+    char path[PATH_MAX];
+    size_t bytes;
+    uint64_t pixels;
+} BenchInput;
+
+// Sent from the process that ran a case back to the parent
+typedef struct {
+    int runs;
+    int failed;
+    size_t output_bytes;
+    double wall_ms;
+    double latency_ms[MAX_ITERATIONS];
+} CaseResult;
+
+// One sample per input format, relative to the samples directory
+static const struct {
+    FileFormat format;
+    const char *file;
+} samples[] = {
+    {FORMAT_AAC, "sample3.aac"},
+    {FORMAT_MP3, "file_example.mp3"},
+    {FORMAT_WAV, "file_example.wav"},
+    {FORMAT_BMP, "spider-man.bmp"},
+    {FORMAT_BMP, "example.bmp"},
+    {FORMAT_JPEG, "jpeg-home.jpg"},
+    {FORMAT_PNG, "png-home.png"},
+    {FORMAT_TXT, "exemplu_text.txt"},
+    {FORMAT_PDF, "model.pdf"},
+    {FORMAT_ODT, "../test.odt"},
+};
+
+static BenchInput inputs[MAX_INPUTS];
+static int input_count = 0;
+static char scratch_dir[] = "/tmp/bench_XXXXXX";
+
+static int add_input(const char *name, FileFormat format, const char *path) {
+    struct stat st;
+    if (input_count == MAX_INPUTS || stat(path, &st) != 0) {
+        fprintf(stderr, "Skipping input %s: %s not found\n", name, path);
+        return -1;
+    }
+
+    BenchInput *input = &inputs[input_count++];
+    snprintf(input->name, sizeof(input->name), "%s", name);
+    snprintf(input->path, sizeof(input->path), "%s", path);
+    input->format = format;
+    input->bytes = st.st_size;
+    input->pixels = read_image_pixels(path, format);
+    return 0;
+}
+
+// Cheap deterministic noise, so the generated inputs don't compress unrealistically well
+static uint32_t noise(uint32_t *state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 16;
+}
+
+static int write_synthetic_wav(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        perror("Failed to create synthetic WAV");
+        return -1;
+    }
+
+    uint32_t frames = SYNTHETIC_WAV_SECONDS * SYNTHETIC_WAV_RATE;
+    uint32_t data_size = frames * 2 * sizeof(int16_t);
+    uint32_t riff_size = 36 + data_size;
+    uint32_t fmt_size = 16, sample_rate = SYNTHETIC_WAV_RATE, byte_rate = SYNTHETIC_WAV_RATE * 4;
+    uint16_t pcm = 1, channels = 2, block_align = 4, bits = 16;
+
+    fwrite("RIFF", 1, 4, file);
+    fwrite(&riff_size, 4, 1, file);
+    fwrite("WAVEfmt ", 1, 8, file);
+    fwrite(&fmt_size, 4, 1, file);
+    fwrite(&pcm, 2, 1, file);
+    fwrite(&channels, 2, 1, file);
+    fwrite(&sample_rate, 4, 1, file);
+    fwrite(&byte_rate, 4, 1, file);
+    fwrite(&block_align, 2, 1, file);
+    fwrite(&bits, 2, 1, file);
+    fwrite("data", 1, 4, file);
+    fwrite(&data_size, 4, 1, file);
+
+    // A slow chord sweep on each channel with a little noise on top
+    uint32_t state = 1;
+    int16_t frame[2];
+    for (uint32_t i = 0; i < frames; i++) {
+        double t = (double)i / SYNTHETIC_WAV_RATE;
+        double sweep = 1.0 + 0.5 * sin(2 * M_PI * 0.05 * t);
+        frame[0] = (int16_t)(9000 * sin(2 * M_PI * 220 * sweep * t) + 3000 * sin(2 * M_PI * 330 * t) +
+                             (int)(noise(&state) % 1024) - 512);
+        frame[1] = (int16_t)(9000 * sin(2 * M_PI * 277 * sweep * t) + 3000 * sin(2 * M_PI * 440 * t) +
+                             (int)(noise(&state) % 1024) - 512);
+        fwrite(frame, sizeof(frame), 1, file);
+    }
+
+    if (fclose(file) != 0) {
+        perror("Failed to write synthetic WAV");
+        return -1;
+    }
+    return 0;
+}
+
+static int write_synthetic_bmp(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        perror("Failed to create synthetic BMP");
+        return -1;
+    }
+
+    int row_padded = (SYNTHETIC_BMP_WIDTH * 3 + 3) & (~3);
+    BMPFileHeader1 file_header = {0};
+    BMPInfoHeader1 info_header = {0};
+    file_header.type = 0x4D42;
+    file_header.offset = sizeof(file_header) + sizeof(info_header);
+    file_header.size = file_header.offset + row_padded * SYNTHETIC_BMP_HEIGHT;
+    info_header.size = sizeof(info_header);
+    info_header.width = SYNTHETIC_BMP_WIDTH;
+    info_header.height = SYNTHETIC_BMP_HEIGHT;
+    info_header.planes = 1;
+    info_header.bitCount = 24;
+    info_header.sizeImage = row_padded * SYNTHETIC_BMP_HEIGHT;
+    fwrite(&file_header, sizeof(file_header), 1, file);
+    fwrite(&info_header, sizeof(info_header), 1, file);
+
+    // Smooth gradients with some grain, closer to a photo than flat colour or pure noise
+    unsigned char *row = calloc(1, row_padded);
+    if (!row) {
+        fclose(file);
+        return -1;
+    }
+    uint32_t state = 1;
+    for (int y = 0; y < SYNTHETIC_BMP_HEIGHT; y++) {
+        for (int x = 0; x < SYNTHETIC_BMP_WIDTH; x++) {
+            int grain = (int)(noise(&state) % 16);
+            row[x * 3] = (unsigned char)((x * 255 / SYNTHETIC_BMP_WIDTH + grain) & 0xFF);
+            row[x * 3 + 1] = (unsigned char)((y * 255 / SYNTHETIC_BMP_HEIGHT + grain) & 0xFF);
+            row[x * 3 + 2] = (unsigned char)(((x + y) / 32 % 2 ? 200 : 60) + grain);
+        }
+        fwrite(row, row_padded, 1, file);
+    }
+    free(row);
+
+    if (fclose(file) != 0) {
+        perror("Failed to write synthetic BMP");
+        return -1;
+    }
+    return 0;
+}
+
+// Large inputs of the other formats are made from the generated ones with the converters themselves
+static void derive_synthetic(const char *name, const BenchInput *from, FileFormat target) {
+    const Converter *converter = registry_find_route(from->format, target);
+    if (!converter) {
+        return;
+    }
+
+    char input_name[64], path[PATH_MAX];
+    snprintf(input_name, sizeof(input_name), "%s%s", name, converter->output_extension);
+    snprintf(path, sizeof(path), "%s/%s", scratch_dir, input_name);
+    if (planner_run(converter, from->path, path, NULL) != 0) {
+        fprintf(stderr, "Skipping input %s: converting %s failed\n", input_name, from->name);
+        unlink(path);
+        return;
+    }
+    add_input(input_name, target, path);
+}
+
+static void prepare_synthetic_inputs(void) {
+    char path[PATH_MAX];
+
+    fprintf(stderr, "Generating synthetic inputs in %s\n", scratch_dir);
+    snprintf(path, sizeof(path), "%s/synthetic.wav", scratch_dir);
+    if (write_synthetic_wav(path) == 0 && add_input("synthetic.wav", FORMAT_WAV, path) == 0) {
+        BenchInput wav = inputs[input_count - 1];
+        derive_synthetic("synthetic-from-wav", &wav, FORMAT_MP3);
+        derive_synthetic("synthetic-from-wav", &wav, FORMAT_AAC);
+    }
+
+    snprintf(path, sizeof(path), "%s/synthetic.bmp", scratch_dir);
+    if (write_synthetic_bmp(path) == 0 && add_input("synthetic.bmp", FORMAT_BMP, path) == 0) {
+        BenchInput bmp = inputs[input_count - 1];
+        derive_synthetic("synthetic-from-bmp", &bmp, FORMAT_PNG);
+        derive_synthetic("synthetic-from-bmp", &bmp, FORMAT_JPEG);
+    }
+}
+
+// Runs in its own process: a crashing converter or one that calls exit() only loses its case,
+// and the process's peak RSS belongs to this case alone
+static void run_case(const Converter *converter, const BenchInput *input, int iterations, int result_fd) {
+    CaseResult *result = calloc(1, sizeof(CaseResult));
+    if (!result) {
+        _exit(1);
+    }
+    char output_path[PATH_MAX];
+    snprintf(output_path, sizeof(output_path), "%s/output-%d-%d%s", scratch_dir, converter->option, (int)getpid(),
+             converter->output_extension);
+    // The server sends metadata with every result, so the conversions measure their audio here too
+    ResultMetadata metadata;
+    result_metadata_set_current(&metadata);
+
+    double case_start = 0;
+    for (int i = -WARMUP_RUNS; i < iterations; i++) {
+        if (i == 0) {
+            case_start = stats_now_ms();
+        }
+
+        CancelToken token;
+        cancel_token_init(&token, CASE_TIMEOUT_MS);
+        cancel_token_start(&token);
+        double start = stats_now_ms();
+        int status = planner_run(converter, input->path, output_path, &token);
+        double elapsed = stats_now_ms() - start;
+
+        struct stat st;
+        if (status == 0 && stat(output_path, &st) == 0 && st.st_size > 0) {
+            if (i >= 0) {
+                result->latency_ms[result->runs++] = elapsed;
+            }
+            result->output_bytes = st.st_size;
+        } else if (i >= 0) {
+            result->failed++;
+        }
+        unlink(output_path);
+        // What a server worker does while it waits for the next request
+        audio_pool_refill();
+    }
+    result->wall_ms = stats_now_ms() - case_start;
+
+    size_t written = 0;
+    while (written < sizeof(CaseResult)) {
+        ssize_t n = write(result_fd, (char *)result + written, sizeof(CaseResult) - written);
+        if (n <= 0) {
+            _exit(1);
+        }
+        written += n;
+    }
+    // exit() rather than _exit(), so an instrumented build (CONVERTER_PGO=GENERATE) keeps the profile
+    exit(0);
+}
+
+static void bench_case(FILE *out, const Converter *converter, const BenchInput *input, int iterations, int first) {
+    fprintf(stderr, "Option %d (%s -> %s) on %s\n", converter->option, format_name(converter->source),
+            format_name(converter->target), input->name);
+    fflush(NULL);
+
+    CaseResult *result = calloc(1, sizeof(CaseResult));
+    int pipe_fds[2];
+    if (!result || pipe(pipe_fds) != 0) {
+        perror("Failed to set up benchmark case");
+        free(result);
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        run_case(converter, input, iterations, pipe_fds[1]);
+    }
+    close(pipe_fds[1]);
+
+    size_t received = 0;
+    ssize_t n;
+    while (pid > 0 && received < sizeof(CaseResult) &&
+           (n = read(pipe_fds[0], (char *)result + received, sizeof(CaseResult) - received)) > 0) {
+        received += n;
+    }
+    close(pipe_fds[0]);
+
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    if (pid > 0) {
+        wait4(pid, &status, 0, &usage);
+    }
+
+    const ConversionPlan *plan = planner_plan(converter->source, converter->target);
+    fprintf(out, "%s\n    {\"option\":%d,\"source\":\"%s\",\"target\":\"%s\",\"class\":\"%s\",\"hops\":%d,\"input\":",
+            first ? "" : ",", converter->option, format_name(converter->source), format_name(converter->target),
+            cost_class_name(converter->cost_class), converter->convert || !plan ? 1 : plan->hop_count);
+    stats_write_json_string(out, input->name);
+    fprintf(out, ",\"input_bytes\":%zu", input->bytes);
+    if (input->pixels > 0) {
+        fprintf(out, ",\"input_pixels\":%llu", (unsigned long long)input->pixels);
+    }
+
+    if (pid <= 0 || received != sizeof(CaseResult)) {
+        // The converter took the whole process down before it could report
+        fprintf(out, ",\"ok\":false,\"error\":\"%s %d\",\"peak_rss_kb\":%ld}",
+                pid > 0 && WIFSIGNALED(status) ? "killed by signal" : "exited with status",
+                pid > 0 && WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status), usage.ru_maxrss);
+        free(result);
+        return;
+    }
+
+    double total_ms = 0;
+    for (int i = 0; i < result->runs; i++) {
+        total_ms += result->latency_ms[i];
+    }
+    fprintf(out, ",\"ok\":%s,\"runs\":%d,\"failed\":%d,\"output_bytes\":%zu,\"latency_ms\":",
+            result->runs > 0 ? "true" : "false", result->runs, result->failed, result->output_bytes);
+    stats_write_latency_json(out, result->latency_ms, result->runs);
+    if (result->runs > 0) {
+        double mean_s = total_ms / result->runs / 1000.0;
+        fprintf(out, ",\"throughput_mb_s\":%.3f,\"runs_per_s\":%.3f", input->bytes / 1e6 / mean_s,
+                result->wall_ms > 0 ? result->runs * 1000.0 / result->wall_ms : 0);
+        if (input->pixels > 0) {
+            fprintf(out, ",\"megapixels_per_s\":%.3f", input->pixels / 1e6 / mean_s);
+        }
+    }
+    fprintf(out, ",\"peak_rss_kb\":%ld}", usage.ru_maxrss);
+    free(result);
+}
+
+static void remove_scratch_dir(void) {
+    for (int i = 0; i < input_count; i++) {
+        if (strncmp(inputs[i].path, scratch_dir, strlen(scratch_dir)) == 0) {
+            unlink(inputs[i].path);
+        }
+    }
+    rmdir(scratch_dir);
+}
+
+int main(int argc, char *argv[]) {
+    const char *samples_dir = DEFAULT_SAMPLES_DIR;
+    const char *output_path = NULL;
+    int iterations = DEFAULT_ITERATIONS;
+    int only_option = 0;
+    int synthetic = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:O:SPKo:")) != -1) {
+        switch (opt) {
+            case 's': samples_dir = optarg; break;
+            case 'n': iterations = atoi(optarg); break;
+            case 'O': only_option = atoi(optarg); break;
+            case 'S': synthetic = 0; break;
+            case 'P': audio_set_hinted_probing(0); break;
+            case 'K': audio_set_sample_kernels(0); break;
+            case 'o': output_path = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-s samples_dir] [-n iterations] [-O option] [-S] [-P] [-K] [-o output.json]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (iterations < 1 || iterations > MAX_ITERATIONS) {
+        fprintf(stderr, "Iterations must be between 1 and %d\n", MAX_ITERATIONS);
+        return 1;
+    }
+
+    FILE *out = output_path ? fopen(output_path, "w") : stdout;
+    if (!out) {
+        perror("Failed to open output file");
+        return 1;
+    }
+
+    register_audio_converters();
+    register_image_converters();
+    register_document_converters();
+    planner_init();
+
+    if (!mkdtemp(scratch_dir)) {
+        perror("Failed to create scratch directory");
+        return 1;
+    }
+
+    char path[PATH_MAX];
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", samples_dir, samples[i].file);
+        add_input(samples[i].file, samples[i].format, path);
+    }
+    if (synthetic) {
+        prepare_synthetic_inputs();
+    }
+
+    fprintf(out, "{\n  \"iterations\":%d,\n  \"warmup_runs\":%d,\n  \"cpus\":%ld,\n  \"cases\":[", iterations,
+            WARMUP_RUNS, sysconf(_SC_NPROCESSORS_ONLN));
+    int first = 1;
+    for (int option = 1; option <= MAX_CONVERSION_OPTIONS; option++) {
+        const Converter *converter = registry_find(option);
+        if (!converter || (only_option && option != only_option)) {
+            continue;
+        }
+        for (int i = 0; i < input_count; i++) {
+            if (inputs[i].format == converter->source) {
+                bench_case(out, converter, &inputs[i], iterations, first);
+                first = 0;
+            }
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    remove_scratch_dir();
+    return 0;
+}
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../hash.h"
+#include "../protocol.h"
+#include "stats.h"
+
+// Drives a running server with concurrent simulated clients over TCP and writes the
+// request latencies, throughput and error counts as JSON.
+//
+// usage: loadgen -f file -O option [-c clients] [-n requests] [-H host] [-p port] [-u] [-o output.json]
+//   -u makes every upload unique by appending a few bytes to the file, so the server's result
+//      cache can't answer it; only use it with formats that ignore trailing data (BMP, PNG, JPEG, TXT, WAV)
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 8080
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_REQUESTS 10
+#define BUFFER_SIZE 4096
+#define MAX_BUSY_RETRIES 6
+#define UNIQUE_TRAILER_SIZE 16
+
+typedef struct {
+    const char *host;
+    int port;
+    int option;
+    const char *extension;
+    const unsigned char *content;
+    size_t content_size;
+    int requests;
+    int unique;
+    uint32_t run_id;    // keeps unique uploads from matching those of an earlier run
+} LoadConfig;
+
+// Filled in by one simulated client
+typedef struct {
+    pthread_t thread;
+    int index;
+    const LoadConfig *config;
+    double *latency_ms;
+    int completed;
+    int failed;
+    int busy_retries;
+    int uploads_skipped;
+    size_t bytes_sent;
+    size_t bytes_received;
+    double eta_error_ms;    // sum of |estimated - actual| over the completed requests
+} LoadClient;
+
+static int write_all(int fd, const void *buf, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, (const char *)buf + written, size - written);
+        if (n <= 0) {
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = read(fd, (char *)buf + total, size - total);
+        if (n <= 0) {
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+static int connect_to_server(const LoadConfig *config) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(config->port);
+    if (inet_pton(AF_INET, config->host, &address.sin_addr) <= 0) {
+        return -1;
+    }
+
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd < 0) {
+        return -1;
+    }
+    if (connect(socket_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+static void sleep_ms(double ms) {
+    struct timespec delay = {(time_t)(ms / 1000), (long)((long long)ms % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+}
+
+// One conversion on its own connection, the way the interactive client does it; returns 0 on success
+static int run_request(LoadClient *client, const unsigned char *content, size_t content_size, double *eta_ms) {
+    const LoadConfig *config = client->config;
+    char buffer[BUFFER_SIZE];
+
+    int socket_fd = connect_to_server(config);
+    if (socket_fd < 0) {
+        return -1;
+    }
+
+    // Extension, then the menu comes back, then the option
+    if (write_all(socket_fd, config->extension, strlen(config->extension) + 1) != 0 ||
+        read(socket_fd, buffer, sizeof(buffer)) <= 0) {
+        close(socket_fd);
+        return -1;
+    }
+    int length = snprintf(buffer, sizeof(buffer), "%d", config->option);
+    if (write_all(socket_fd, buffer, length + 1) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    UploadHeader header;
+    memset(&header, 0, sizeof(header));
+    header.file_size = content_size;
+    digest_bytes(content, content_size, header.input_digest);
+    header.prefix_len = content_size < sizeof(header.prefix) ? content_size : sizeof(header.prefix);
+    memcpy(header.prefix, content, header.prefix_len);
+    size_t tag_size = sniff_id3_size(header.prefix, header.prefix_len);
+    if (tag_size > 0 && tag_size + SNIFF_FRAME_SIZE > header.prefix_len && tag_size < content_size) {
+        size_t after_tag_len = content_size - tag_size < SNIFF_FRAME_SIZE ? content_size - tag_size : SNIFF_FRAME_SIZE;
+        memcpy(header.after_tag, content + tag_size, after_tag_len);
+    }
+
+    uint8_t upload_status = UPLOAD_REJECT;
+    for (int attempt = 0; attempt <= MAX_BUSY_RETRIES; attempt++) {
+        if (write_all(socket_fd, &header, sizeof(header)) != 0 ||
+            read_all(socket_fd, &upload_status, sizeof(upload_status)) != 0) {
+            close(socket_fd);
+            return -1;
+        }
+        if (upload_status != UPLOAD_BUSY) {
+            break;
+        }
+
+        uint32_t retry_after_ms;
+        if (read_all(socket_fd, &retry_after_ms, sizeof(retry_after_ms)) != 0) {
+            close(socket_fd);
+            return -1;
+        }
+        client->busy_retries++;
+        sleep_ms(retry_after_ms * (0.5 + (double)rand() / RAND_MAX));
+    }
+
+    if (upload_status == UPLOAD_SKIP) {
+        client->uploads_skipped++;
+    } else if (upload_status == UPLOAD_SEND) {
+        if (write_all(socket_fd, content, content_size) != 0) {
+            close(socket_fd);
+            return -1;
+        }
+        client->bytes_sent += content_size;
+    } else {
+        close(socket_fd);
+        return -1;
+    }
+
+    // Estimate, extension, size, the converted file and its metadata
+    ResultEta eta;
+    size_t file_size;
+    if (read_all(socket_fd, &eta, sizeof(eta)) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+    *eta_ms = eta;
+    size_t ext_length = 0;
+    do {
+        if (ext_length == sizeof(buffer) || read_all(socket_fd, buffer + ext_length, 1) != 0) {
+            close(socket_fd);
+            return -1;
+        }
+    } while (buffer[ext_length++] != '\0');
+    if (read_all(socket_fd, &file_size, sizeof(file_size)) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    size_t received = 0;
+    while (received < file_size) {
+        size_t want = file_size - received < sizeof(buffer) ? file_size - received : sizeof(buffer);
+        ssize_t n = read(socket_fd, buffer, want);
+        if (n <= 0) {
+            break;
+        }
+        received += n;
+    }
+    ResultMetadata metadata;
+    int complete = received == file_size && read_all(socket_fd, &metadata, sizeof(metadata)) == 0;
+    close(socket_fd);
+
+    client->bytes_received += received;
+    return complete ? 0 : -1;
+}
+
+static void *run_client(void *arg) {
+    LoadClient *client = arg;
+    const LoadConfig *config = client->config;
+
+    // A private copy of the input with room for the bytes that make each upload unique
+    size_t content_size = config->content_size;
+    unsigned char *content = malloc(content_size + UNIQUE_TRAILER_SIZE);
+    if (!content) {
+        client->failed = config->requests;
+        return NULL;
+    }
+    memcpy(content, config->content, content_size);
+
+    for (int i = 0; i < config->requests; i++) {
+        size_t size = content_size;
+        if (config->unique) {
+            uint32_t trailer[UNIQUE_TRAILER_SIZE / sizeof(uint32_t)] = {config->run_id, client->index, i, 0};
+            memcpy(content + content_size, trailer, UNIQUE_TRAILER_SIZE);
+            size += UNIQUE_TRAILER_SIZE;
+        }
+
+        double eta_ms = 0;
+        double start = stats_now_ms();
+        if (run_request(client, content, size, &eta_ms) == 0) {
+            double elapsed = stats_now_ms() - start;
+            client->latency_ms[client->completed++] = elapsed;
+            client->eta_error_ms += eta_ms > elapsed ? eta_ms - elapsed : elapsed - eta_ms;
+        } else {
+            client->failed++;
+        }
+    }
+
+    free(content);
+    return NULL;
+}
+
+static unsigned char *load_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Failed to open input file");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    unsigned char *content = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (!content || read_all(fd, content, st.st_size) != 0) {
+        perror("Failed to read input file");
+        free(content);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    *size = st.st_size;
+    return content;
+}
+
+int main(int argc, char *argv[]) {
+    LoadConfig config = {DEFAULT_HOST, DEFAULT_PORT, 0, NULL, NULL, 0, DEFAULT_REQUESTS, 0, 0};
+    const char *input_path = NULL;
+    const char *output_path = NULL;
+    int clients = DEFAULT_CLIENTS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:O:c:n:H:p:uo:")) != -1) {
+        switch (opt) {
+            case 'f': input_path = optarg; break;
+            case 'O': config.option = atoi(optarg); break;
+            case 'c': clients = atoi(optarg); break;
+            case 'n': config.requests = atoi(optarg); break;
+            case 'H': config.host = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 'u': config.unique = 1; break;
+            case 'o': output_path = optarg; break;
+            default: input_path = NULL; optind = argc; break;
+        }
+    }
+    const char *dot = input_path ? strrchr(input_path, '.') : NULL;
+    if (!dot || config.option <= 0 || clients < 1 || config.requests < 1) {
+        fprintf(stderr, "usage: %s -f file -O option [-c clients] [-n requests] [-H host] [-p port] [-u] "
+                        "[-o output.json]\n", argv[0]);
+        return 1;
+    }
+    config.extension = dot + 1;
+
+    unsigned char *content = load_file(input_path, &config.content_size);
+    if (!content) {
+        return 1;
+    }
+    config.content = content;
+
+    FILE *out = output_path ? fopen(output_path, "w") : stdout;
+    if (!out) {
+        perror("Failed to open output file");
+        return 1;
+    }
+
+    srand(time(NULL) ^ getpid());
+    config.run_id = (uint32_t)rand();
+    LoadClient *load_clients = calloc(clients, sizeof(LoadClient));
+    double *latencies = calloc((size_t)clients * config.requests, sizeof(double));
+    if (!load_clients || !latencies) {
+        perror("Failed to allocate clients");
+        return 1;
+    }
+
+    fprintf(stderr, "Running %d clients x %d requests of option %d on %s against %s:%d\n", clients,
+            config.requests, config.option, input_path, config.host, config.port);
+    double start = stats_now_ms();
+    int started = 0;
+    for (int i = 0; i < clients; i++) {
+        load_clients[i].index = i;
+        load_clients[i].config = &config;
+        load_clients[i].latency_ms = latencies + (size_t)i * config.requests;
+        if (pthread_create(&load_clients[i].thread, NULL, run_client, &load_clients[i]) != 0) {
+            perror("Failed to start client thread");
+            break;
+        }
+        started++;
+    }
+
+    int completed = 0, failed = 0, busy_retries = 0, uploads_skipped = 0;
+    size_t bytes_sent = 0, bytes_received = 0;
+    double eta_error_ms = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(load_clients[i].thread, NULL);
+        // Pack the latencies of all clients together for the percentiles
+        memmove(latencies + completed, load_clients[i].latency_ms, load_clients[i].completed * sizeof(double));
+        completed += load_clients[i].completed;
+        failed += load_clients[i].failed;
+        busy_retries += load_clients[i].busy_retries;
+        uploads_skipped += load_clients[i].uploads_skipped;
+        bytes_sent += load_clients[i].bytes_sent;
+        bytes_received += load_clients[i].bytes_received;
+        eta_error_ms += load_clients[i].eta_error_ms;
+    }
+    double elapsed_s = (stats_now_ms() - start) / 1000.0;
+
+    fprintf(out, "{\n  \"option\":%d,\n  \"input\":", config.option);
+    stats_write_json_string(out, input_path);
+    fprintf(out, ",\n  \"input_bytes\":%zu,\n  \"clients\":%d,\n  \"requests\":%d,\n  \"unique\":%s,\n",
+            config.content_size, started, started * config.requests, config.unique ? "true" : "false");
+    fprintf(out, "  \"completed\":%d,\n  \"failed\":%d,\n  \"busy_retries\":%d,\n  \"uploads_skipped\":%d,\n",
+            completed, failed, busy_retries, uploads_skipped);
+    fprintf(out, "  \"elapsed_s\":%.3f,\n  \"requests_per_s\":%.3f,\n  \"upload_mb_s\":%.3f,\n"
+                 "  \"download_mb_s\":%.3f,\n  \"mean_eta_error_ms\":%.3f,\n  \"latency_ms\":",
+            elapsed_s, completed / elapsed_s, bytes_sent / 1e6 / elapsed_s, bytes_received / 1e6 / elapsed_s,
+            completed > 0 ? eta_error_ms / completed : 0);
+    stats_write_latency_json(out, latencies, completed);
+    fprintf(out, "\n}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    free(latencies);
+    free(load_clients);
+    free(content);
+    return failed > 0 ? 2 : 0;
+}
@@ -0,0 +1,117 @@
+#!/bin/sh
+# Profile-guided optimisation of the server and the conversion library.
+#
+# Builds a plain -O2 baseline and an instrumented -O2 build, trains the instrumented one on a
+# mix of image, audio and text conversions (in-process with bench, and through the server with
+# loadgen), rebuilds it with the profiles and compares both builds with bench.
+#
+# usage: bench/pgo.sh [build_dir]
+#   PGO_BENCH_ARGS  extra bench arguments for the comparison, e.g. "-n 20" (default: -n 10 -S)
+#
+# The training run starts a server, so no other server may be running on this machine.
+# The optimised binaries end up in <build_dir>/pgo, the report in <build_dir>/pgo-report.txt.
+
+set -eu
+
+SOURCE_DIR=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_DIR=${1:-$SOURCE_DIR/build-pgo}
+BENCH_ARGS=${PGO_BENCH_ARGS:--n 10 -S}
+JOBS=$(nproc 2>/dev/null || echo 4)
+O2_FLAGS="-O2 -DNDEBUG"
+
+# Training mix: file in client/ and conversion option
+TRAINING_REQUESTS="png-home.png:11 example.bmp:7 jpeg-home.jpg:10 file_example.wav:6 sample3.aac:2 exemplu_text.txt:15"
+
+configure() {
+    cmake -S "$SOURCE_DIR" -B "$1" -DCMAKE_BUILD_TYPE=Release -DCMAKE_C_FLAGS_RELEASE="$O2_FLAGS" "$2" >/dev/null
+    cmake --build "$1" -j "$JOBS" >/dev/null
+}
+
+echo "== Baseline -O2 build"
+configure "$BUILD_DIR/o2" -DCONVERTER_PGO=OFF
+
+echo "== Instrumented build"
+rm -rf "$BUILD_DIR/pgo/pgo-profiles"
+configure "$BUILD_DIR/pgo" -DCONVERTER_PGO=GENERATE
+
+echo "== Training: conversions in-process"
+cd "$SOURCE_DIR"
+"$BUILD_DIR/pgo/bench" -s client -n 3 -S -o /dev/null >/dev/null 2>&1
+
+echo "== Training: conversions through the server"
+"$BUILD_DIR/pgo/server" >/dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null || true' EXIT
+sleep 1
+for request in $TRAINING_REQUESTS; do
+    # -u appends bytes to the upload, which only the formats that ignore trailing data survive;
+    # the other inputs are converted once and then come from the result cache
+    case "${request%%:*}" in
+        *.aac|*.mp3|*.m4a) UNIQUE= ;;
+        *) UNIQUE=-u ;;
+    esac
+    # shellcheck disable=SC2086
+    "$BUILD_DIR/pgo/loadgen" -f "client/${request%%:*}" -O "${request##*:}" -c 4 -n 5 $UNIQUE -o /dev/null 2>/dev/null || true
+done
+# The server writes its profile when it exits
+kill -TERM $SERVER_PID
+wait $SERVER_PID || true
+trap - EXIT
+
+# Clang writes raw profiles that have to be merged first
+if ls "$BUILD_DIR/pgo/pgo-profiles"/*.profraw >/dev/null 2>&1; then
+    llvm-profdata merge -o "$BUILD_DIR/pgo/pgo-profiles/default.profdata" "$BUILD_DIR/pgo/pgo-profiles"/*.profraw
+fi
+
+echo "== Optimised build"
+configure "$BUILD_DIR/pgo" -DCONVERTER_PGO=USE
+
+echo "== Comparing"
+# shellcheck disable=SC2086
+"$BUILD_DIR/o2/bench" -s client $BENCH_ARGS -o "$BUILD_DIR/o2.json" >/dev/null 2>&1
+# shellcheck disable=SC2086
+"$BUILD_DIR/pgo/bench" -s client $BENCH_ARGS -o "$BUILD_DIR/pgo.json" >/dev/null 2>&1
+
+# bench writes one case per line; pair them up by option and input and compare the medians
+awk '
+    function field(line, name,    rest) {
+        if (!match(line, "\"" name "\":[^,}]*")) {
+            return ""
+        }
+        rest = substr(line, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+        gsub(/"/, "", rest)
+        return rest
+    }
+    /"option":/ && /"ok":true/ {
+        key = field($0, "option") " " field($0, "input")
+        median = field($0, "p50")
+        if (FILENAME == ARGV[1]) {
+            baseline[key] = median
+            order[++count] = key
+        } else {
+            optimised[key] = median
+        }
+    }
+    END {
+        printf "%-40s %12s %12s %9s\n", "option input", "-O2 p50 ms", "PGO p50 ms", "speedup"
+        compared = 0
+        log_sum = 0
+        for (i = 1; i <= count; i++) {
+            key = order[i]
+            if (!(key in optimised) || optimised[key] <= 0) {
+                continue
+            }
+            speedup = baseline[key] / optimised[key]
+            printf "%-40s %12.3f %12.3f %8.3fx\n", key, baseline[key], optimised[key], speedup
+            log_sum += log(speedup)
+            compared++
+        }
+        if (compared == 0) {
+            print "No conversion succeeded in both builds"
+            exit 1
+        }
+        overall = exp(log_sum / compared)
+        printf "\nGeometric mean speedup over %d cases: %.3fx\n", compared, overall
+        print (overall > 1 ? "PGO build is faster than -O2" : "PGO build is NOT faster than -O2")
+    }
+' "$BUILD_DIR/o2.json" "$BUILD_DIR/pgo.json" | tee "$BUILD_DIR/pgo-report.txt"
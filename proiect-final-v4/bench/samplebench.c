@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+#include "../sample_convert.h"
+#include "stats.h"
+
+// Times the sample conversion kernels against libswresample on the conversions the audio
+// engine does at an unchanged sample rate, one encoder frame at a time, and checks that
+// both give the same samples. Writes the timings per case as JSON and exits with 1 when
+// a case fails or its samples differ by more than the tolerance.
+//
+// usage: samplebench [-n iterations] [-s seconds] [-o output.json]
+
+#define DEFAULT_ITERATIONS 20
+#define MAX_ITERATIONS 1000
+#define DEFAULT_SECONDS 30
+#define SAMPLE_RATE 44100
+// The frame size of the AAC encoder, what the conversions mostly hand over at a time
+#define BLOCK_SAMPLES 1024
+// Largest difference accepted between the kernels and libswresample: a rounding step of
+// s16 output, float rounding otherwise
+#define TOLERANCE_S16 (1.0 / 32768)
+#define TOLERANCE_FLOAT 1e-6
+
+typedef struct {
+    const char *name;
+    enum AVSampleFormat in_fmt;
+    int in_channels;
+    enum AVSampleFormat out_fmt;
+    int out_channels;
+} BenchCase;
+
+static const BenchCase cases[] = {
+    {"s16 stereo -> fltp stereo", AV_SAMPLE_FMT_S16, 2, AV_SAMPLE_FMT_FLTP, 2},
+    {"s16 mono -> fltp mono", AV_SAMPLE_FMT_S16, 1, AV_SAMPLE_FMT_FLTP, 1},
+    {"flt stereo -> fltp stereo", AV_SAMPLE_FMT_FLT, 2, AV_SAMPLE_FMT_FLTP, 2},
+    {"fltp stereo -> s16 stereo", AV_SAMPLE_FMT_FLTP, 2, AV_SAMPLE_FMT_S16, 2},
+    {"fltp mono -> s16 mono", AV_SAMPLE_FMT_FLTP, 1, AV_SAMPLE_FMT_S16, 1},
+    {"s16 stereo -> fltp mono", AV_SAMPLE_FMT_S16, 2, AV_SAMPLE_FMT_FLTP, 1},
+    {"fltp stereo -> s16 mono", AV_SAMPLE_FMT_FLTP, 2, AV_SAMPLE_FMT_S16, 1},
+    {"fltp stereo -> fltp mono", AV_SAMPLE_FMT_FLTP, 2, AV_SAMPLE_FMT_FLTP, 1},
+    {"fltp mono -> fltp stereo", AV_SAMPLE_FMT_FLTP, 1, AV_SAMPLE_FMT_FLTP, 2},
+};
+
+// Samples of a whole run, as one buffer per plane
+typedef struct {
+    enum AVSampleFormat format;
+    int channels;
+    int planes;
+    int bytes_per_sample;
+    uint8_t *data[SAMPLE_CONVERT_MAX_CHANNELS];
+} SampleBuffer;
+
+static int buffer_alloc(SampleBuffer *buffer, enum AVSampleFormat format, int channels, int samples) {
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->format = format;
+    buffer->channels = channels;
+    buffer->planes = av_sample_fmt_is_planar(format) ? channels : 1;
+    buffer->bytes_per_sample = av_get_bytes_per_sample(format);
+    size_t plane_size = (size_t)samples * buffer->bytes_per_sample * (channels / buffer->planes);
+    for (int p = 0; p < buffer->planes; p++) {
+        if (!(buffer->data[p] = calloc(1, plane_size))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void buffer_free(SampleBuffer *buffer) {
+    for (int p = 0; p < buffer->planes; p++) {
+        free(buffer->data[p]);
+    }
+}
+
+// Plane pointers of the block that starts at sample offset
+static void buffer_block(const SampleBuffer *buffer, int offset, uint8_t **planes) {
+    size_t step = (size_t)buffer->bytes_per_sample * (buffer->channels / buffer->planes);
+    for (int p = 0; p < buffer->planes; p++) {
+        planes[p] = buffer->data[p] + offset * step;
+    }
+}
+
+static float buffer_sample(const SampleBuffer *buffer, int channel, int index) {
+    int plane = buffer->planes > 1 ? channel : 0;
+    int position = buffer->planes > 1 ? index : index * buffer->channels + channel;
+    if (buffer->format == AV_SAMPLE_FMT_S16 || buffer->format == AV_SAMPLE_FMT_S16P) {
+        return ((const int16_t *)buffer->data[plane])[position] / 32768.0f;
+    }
+    return ((const float *)buffer->data[plane])[position];
+}
+
+// Cheap deterministic noise on top of two tones, loud enough to clip now and then
+static void fill_input(SampleBuffer *buffer, int samples) {
+    uint32_t state = 1;
+    for (int i = 0; i < samples; i++) {
+        for (int c = 0; c < buffer->channels; c++) {
+            state = state * 1664525u + 1013904223u;
+            double t = (double)i / SAMPLE_RATE;
+            float value = (float)(0.8 * sin(2 * M_PI * (220 + 57 * c) * t) + 0.3 * sin(2 * M_PI * 3000 * t) +
+                                  ((int)(state >> 16) % 2048 - 1024) / 32768.0);
+            int plane = buffer->planes > 1 ? c : 0;
+            int position = buffer->planes > 1 ? i : i * buffer->channels + c;
+            if (buffer->bytes_per_sample == 2) {
+                float scaled = value * 32768.0f;
+                ((int16_t *)buffer->data[plane])[position] =
+                        (int16_t)(scaled > 32767.0f ? 32767 : scaled < -32768.0f ? -32768 : lrintf(scaled));
+            } else {
+                ((float *)buffer->data[plane])[position] = value;
+            }
+        }
+    }
+}
+
+static int convert_with_kernels(SampleConversion *conversion, const SampleBuffer *in, SampleBuffer *out, int samples) {
+    uint8_t *in_planes[SAMPLE_CONVERT_MAX_CHANNELS], *out_planes[SAMPLE_CONVERT_MAX_CHANNELS];
+    for (int offset = 0; offset < samples; offset += BLOCK_SAMPLES) {
+        int count = samples - offset < BLOCK_SAMPLES ? samples - offset : BLOCK_SAMPLES;
+        buffer_block(in, offset, in_planes);
+        buffer_block(out, offset, out_planes);
+        if (sample_conversion_run(conversion, out_planes, (const uint8_t *const *)in_planes, count) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int convert_with_swr(SwrContext *swr_ctx, const SampleBuffer *in, SampleBuffer *out, int samples) {
+    uint8_t *in_planes[SAMPLE_CONVERT_MAX_CHANNELS], *out_planes[SAMPLE_CONVERT_MAX_CHANNELS];
+    for (int offset = 0; offset < samples; offset += BLOCK_SAMPLES) {
+        int count = samples - offset < BLOCK_SAMPLES ? samples - offset : BLOCK_SAMPLES;
+        buffer_block(in, offset, in_planes);
+        buffer_block(out, offset, out_planes);
+        if (swr_convert(swr_ctx, out_planes, count, (const uint8_t **)in_planes, count) != count) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static SampleFormat kernel_format(enum AVSampleFormat format) {
+    switch (format) {
+        case AV_SAMPLE_FMT_S16: return SAMPLE_FORMAT_S16;
+        case AV_SAMPLE_FMT_S16P: return SAMPLE_FORMAT_S16P;
+        case AV_SAMPLE_FMT_FLT: return SAMPLE_FORMAT_FLT;
+        default: return SAMPLE_FORMAT_FLTP;
+    }
+}
+
+// Returns -1 when the case failed or its samples are off by more than the tolerance
+static int bench_case(FILE *out, const BenchCase *bench, int samples, int iterations, int first) {
+    fprintf(stderr, "%s\n", bench->name);
+    fprintf(out, "%s\n    {\"case\":", first ? "" : ",");
+    stats_write_json_string(out, bench->name);
+
+    SampleBuffer input, kernel_output, swr_output;
+    SampleConversion conversion;
+    SwrContext *swr_ctx = NULL;
+    double *kernel_ms = calloc(iterations, sizeof(double));
+    double *swr_ms = calloc(iterations, sizeof(double));
+    const char *error = NULL;
+    int result = -1;
+
+    memset(&input, 0, sizeof(input));
+    memset(&kernel_output, 0, sizeof(kernel_output));
+    memset(&swr_output, 0, sizeof(swr_output));
+    memset(&conversion, 0, sizeof(conversion));
+    if (!kernel_ms || !swr_ms ||
+        buffer_alloc(&input, bench->in_fmt, bench->in_channels, samples) != 0 ||
+        buffer_alloc(&kernel_output, bench->out_fmt, bench->out_channels, samples) != 0 ||
+        buffer_alloc(&swr_output, bench->out_fmt, bench->out_channels, samples) != 0) {
+        error = "out of memory";
+        goto end;
+    }
+    fill_input(&input, samples);
+
+    if (sample_conversion_init(&conversion, kernel_format(bench->in_fmt), bench->in_channels,
+                               kernel_format(bench->out_fmt), bench->out_channels) != 0) {
+        error = "not handled by the kernels";
+        goto end;
+    }
+    swr_ctx = swr_alloc_set_opts(NULL, av_get_default_channel_layout(bench->out_channels), bench->out_fmt,
+                                 SAMPLE_RATE, av_get_default_channel_layout(bench->in_channels), bench->in_fmt,
+                                 SAMPLE_RATE, 0, NULL);
+    if (!swr_ctx || swr_init(swr_ctx) < 0) {
+        error = "could not open the resampler";
+        goto end;
+    }
+
+    // Untimed first runs, so page faults on the output buffers aren't measured
+    if (convert_with_kernels(&conversion, &input, &kernel_output, samples) != 0 ||
+        convert_with_swr(swr_ctx, &input, &swr_output, samples) != 0) {
+        error = "conversion failed";
+        goto end;
+    }
+    for (int i = 0; i < iterations; i++) {
+        double start = stats_now_ms();
+        convert_with_kernels(&conversion, &input, &kernel_output, samples);
+        kernel_ms[i] = stats_now_ms() - start;
+        start = stats_now_ms();
+        convert_with_swr(swr_ctx, &input, &swr_output, samples);
+        swr_ms[i] = stats_now_ms() - start;
+    }
+
+    double difference = 0;
+    for (int c = 0; c < bench->out_channels; c++) {
+        for (int i = 0; i < samples; i++) {
+            double d = fabs(buffer_sample(&kernel_output, c, i) - buffer_sample(&swr_output, c, i));
+            difference = d > difference ? d : difference;
+        }
+    }
+
+    double tolerance = av_get_bytes_per_sample(bench->out_fmt) == 2 ? TOLERANCE_S16 : TOLERANCE_FLOAT;
+    int within_tolerance = difference <= tolerance;
+    if (!within_tolerance) {
+        fprintf(stderr, "%s: samples differ from libswresample by %g, more than %g\n", bench->name, difference,
+                tolerance);
+    }
+
+    double kernel_total = 0, swr_total = 0;
+    for (int i = 0; i < iterations; i++) {
+        kernel_total += kernel_ms[i];
+        swr_total += swr_ms[i];
+    }
+    double kernel_mean = kernel_total / iterations, swr_mean = swr_total / iterations;
+    fprintf(out, ",\"ok\":true,\"kernel_ms\":");
+    stats_write_latency_json(out, kernel_ms, iterations);
+    fprintf(out, ",\"swr_ms\":");
+    stats_write_latency_json(out, swr_ms, iterations);
+    fprintf(out, ",\"kernel_msamples_per_s\":%.1f,\"swr_msamples_per_s\":%.1f,\"speedup\":%.2f,\"max_difference\":%g,"
+                 "\"tolerance\":%g,\"within_tolerance\":%s}",
+            samples / 1e3 / kernel_mean, samples / 1e3 / swr_mean, kernel_mean > 0 ? swr_mean / kernel_mean : 0,
+            difference, tolerance, within_tolerance ? "true" : "false");
+    result = within_tolerance ? 0 : -1;
+
+    end:
+    if (error) {
+        fprintf(out, ",\"ok\":false,\"error\":\"%s\"}", error);
+    }
+    swr_free(&swr_ctx);
+    sample_conversion_free(&conversion);
+    buffer_free(&input);
+    buffer_free(&kernel_output);
+    buffer_free(&swr_output);
+    free(kernel_ms);
+    free(swr_ms);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const char *output_path = NULL;
+    int iterations = DEFAULT_ITERATIONS;
+    int seconds = DEFAULT_SECONDS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:o:")) != -1) {
+        switch (opt) {
+            case 'n': iterations = atoi(optarg); break;
+            case 's': seconds = atoi(optarg); break;
+            case 'o': output_path = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n iterations] [-s seconds] [-o output.json]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (iterations < 1 || iterations > MAX_ITERATIONS) {
+        fprintf(stderr, "Iterations must be between 1 and %d\n", MAX_ITERATIONS);
+        return 1;
+    }
+    if (seconds < 1 || seconds > 3600) {
+        fprintf(stderr, "Seconds must be between 1 and 3600\n");
+        return 1;
+    }
+
+    FILE *out = output_path ? fopen(output_path, "w") : stdout;
+    if (!out) {
+        perror("Failed to open output file");
+        return 1;
+    }
+
+    int samples = seconds * SAMPLE_RATE;
+    fprintf(out, "{\n  \"kernels\":\"%s\",\n  \"sample_rate\":%d,\n  \"samples\":%d,\n  \"block_samples\":%d,\n"
+                 "  \"iterations\":%d,\n  \"cases\":[",
+            sample_convert_kernels(), SAMPLE_RATE, samples, BLOCK_SAMPLES, iterations);
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (bench_case(out, &cases[i], samples, iterations, i == 0) != 0) {
+            failed = 1;
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return failed;
+}
@@ -0,0 +1,58 @@
+#include "stats.h"
+#include <stdlib.h>
+#include <time.h>
+
+double stats_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const double *sorted, size_t count, double p) {
+    size_t rank = (size_t)(p / 100.0 * count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > count) {
+        rank = count;
+    }
+    return sorted[rank - 1];
+}
+
+void stats_write_latency_json(FILE *out, double *samples_ms, size_t count) {
+    if (count == 0) {
+        fprintf(out, "null");
+        return;
+    }
+
+    qsort(samples_ms, count, sizeof(double), compare_doubles);
+    double total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += samples_ms[i];
+    }
+
+    fprintf(out, "{\"min\":%.3f,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+            samples_ms[0], total / count, percentile(samples_ms, count, 50), percentile(samples_ms, count, 90),
+            percentile(samples_ms, count, 99), samples_ms[count - 1]);
+}
+
+void stats_write_json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
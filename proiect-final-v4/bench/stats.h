@@ -0,0 +1,18 @@
+#ifndef BENCH_STATS_H
+#define BENCH_STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Shared by the in-process benchmark (bench.c) and the load generator (loadgen.c)
+
+double stats_now_ms(void);
+
+// Sorts the samples in place and writes them as a JSON object:
+// {"min":..,"mean":..,"p50":..,"p90":..,"p99":..,"max":..}, all in milliseconds
+void stats_write_latency_json(FILE *out, double *samples_ms, size_t count);
+
+// Writes a quoted JSON string, escaping what needs to be escaped
+void stats_write_json_string(FILE *out, const char *text);
+
+#endif // BENCH_STATS_H
@@ -0,0 +1,307 @@
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define CACHE_EXT_SIZE 16
+// The metadata of a result is kept next to it, in a file named after the entry with this suffix
+#define CACHE_METADATA_SUFFIX ".meta"
+// The directory, then "/", the key as the content digest, the option and the parameter hash, and the extension
+#define CACHE_PATH_SIZE (PATH_MAX + 1 + 2 * CONTENT_DIGEST_SIZE + 1 + 11 + 1 + 16 + CACHE_EXT_SIZE)
+#define CACHE_METADATA_PATH_SIZE (CACHE_PATH_SIZE + sizeof(CACHE_METADATA_SUFFIX) - 1)
+
+typedef struct {
+    CacheKey key;
+    char extension[CACHE_EXT_SIZE];
+    size_t size;
+    unsigned long last_used;
+} CacheEntry;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char cache_dir[PATH_MAX] = CACHE_DIR;
+static size_t cache_max_bytes = CACHE_MAX_BYTES;
+static size_t cache_bytes_used = 0;
+static CacheEntry *entries = NULL;
+static size_t entry_count = 0;
+static size_t entry_capacity = 0;
+static unsigned long use_clock = 0;
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+
+void cache_key_init(CacheKey *key, const uint8_t *input_digest, int conversion_option, uint64_t params_hash) {
+    memcpy(key->input_digest, input_digest, sizeof(key->input_digest));
+    key->conversion_option = conversion_option;
+    key->params_hash = params_hash;
+}
+
+// Returns -1 when the path doesn't fit; a truncated one could name another entry
+static int entry_path(const CacheKey *key, const char *extension, char *path, size_t path_size) {
+    char digest[2 * CONTENT_DIGEST_SIZE + 1];
+    for (int i = 0; i < CONTENT_DIGEST_SIZE; i++) {
+        snprintf(digest + 2 * i, 3, "%02x", key->input_digest[i]);
+    }
+    int length = snprintf(path, path_size, "%s/%s-%d-%016llx%s", cache_dir, digest, key->conversion_option,
+                          (unsigned long long)key->params_hash, extension);
+    return length < 0 || (size_t)length >= path_size ? -1 : 0;
+}
+
+// Reads the digest an entry name starts with; returns the characters it took, 0 when there is none
+static int parse_digest(const char *name, uint8_t digest[CONTENT_DIGEST_SIZE]) {
+    for (int i = 0; i < CONTENT_DIGEST_SIZE; i++) {
+        unsigned int byte;
+        if (!isxdigit((unsigned char)name[2 * i]) || !isxdigit((unsigned char)name[2 * i + 1]) ||
+            sscanf(name + 2 * i, "%2x", &byte) != 1) {
+            return 0;
+        }
+        digest[i] = (uint8_t)byte;
+    }
+    return 2 * CONTENT_DIGEST_SIZE;
+}
+
+static int metadata_path(const char *path, char *metadata_file, size_t metadata_file_size) {
+    int length = snprintf(metadata_file, metadata_file_size, "%s%s", path, CACHE_METADATA_SUFFIX);
+    return length < 0 || (size_t)length >= metadata_file_size ? -1 : 0;
+}
+
+static void read_metadata(const char *path, ResultMetadata *metadata) {
+    char metadata_file[CACHE_METADATA_PATH_SIZE];
+    int fd = metadata_path(path, metadata_file, sizeof(metadata_file)) == 0 ? open(metadata_file, O_RDONLY) : -1;
+    if (fd == -1 || read(fd, metadata, sizeof(*metadata)) != (ssize_t)sizeof(*metadata)) {
+        memset(metadata, 0, sizeof(*metadata));
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+// Results without metadata don't get the file, one left over from an earlier run goes
+static void write_metadata(const char *path, const ResultMetadata *metadata) {
+    char metadata_file[CACHE_METADATA_PATH_SIZE];
+    if (metadata_path(path, metadata_file, sizeof(metadata_file)) != 0) {
+        return;
+    }
+    if (!metadata || metadata->flags == 0) {
+        unlink(metadata_file);
+        return;
+    }
+    int fd = open(metadata_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        return;
+    }
+    if (write(fd, metadata, sizeof(*metadata)) != (ssize_t)sizeof(*metadata)) {
+        unlink(metadata_file);
+    }
+    close(fd);
+}
+
+static int key_equal(const CacheKey *a, const CacheKey *b) {
+    return memcmp(a->input_digest, b->input_digest, sizeof(a->input_digest)) == 0 &&
+           a->conversion_option == b->conversion_option &&
+           a->params_hash == b->params_hash;
+}
+
+static CacheEntry *find_entry(const CacheKey *key) {
+    for (size_t i = 0; i < entry_count; i++) {
+        if (key_equal(&entries[i].key, key)) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void remove_entry(size_t index) {
+    char path[CACHE_PATH_SIZE];
+    char metadata_file[CACHE_METADATA_PATH_SIZE];
+    if (entry_path(&entries[index].key, entries[index].extension, path, sizeof(path)) == 0) {
+        unlink(path);
+        if (metadata_path(path, metadata_file, sizeof(metadata_file)) == 0) {
+            unlink(metadata_file);
+        }
+    }
+    cache_bytes_used -= entries[index].size;
+    entries[index] = entries[--entry_count];
+}
+
+// Drop least recently used entries until the cache fits within its size cap
+static void evict_to_fit(void) {
+    while (cache_bytes_used > cache_max_bytes && entry_count > 0) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < entry_count; i++) {
+            if (entries[i].last_used < entries[oldest].last_used) {
+                oldest = i;
+            }
+        }
+        remove_entry(oldest);
+    }
+}
+
+static CacheEntry *add_entry(const CacheKey *key, const char *extension, size_t size) {
+    if (entry_count == entry_capacity) {
+        size_t new_capacity = entry_capacity ? entry_capacity * 2 : 64;
+        CacheEntry *grown = realloc(entries, new_capacity * sizeof(CacheEntry));
+        if (!grown) {
+            return NULL;
+        }
+        entries = grown;
+        entry_capacity = new_capacity;
+    }
+
+    CacheEntry *entry = &entries[entry_count++];
+    entry->key = *key;
+    snprintf(entry->extension, sizeof(entry->extension), "%s", extension);
+    entry->size = size;
+    entry->last_used = ++use_clock;
+    cache_bytes_used += size;
+    return entry;
+}
+
+void cache_init(const char *dir, size_t max_bytes) {
+    pthread_mutex_lock(&cache_mutex);
+    if (strlen(dir) >= sizeof(cache_dir)) {
+        fprintf(stderr, "Cache directory path too long, using %s\n", CACHE_DIR);
+        dir = CACHE_DIR;
+    }
+    snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+    cache_max_bytes = max_bytes;
+
+    if (mkdir(cache_dir, 0700) < 0 && errno != EEXIST) {
+        perror("Failed to create cache directory");
+    }
+
+    // Rebuild the index from results left by a previous run
+    DIR *d = opendir(cache_dir);
+    if (d) {
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            size_t name_length = strlen(de->d_name);
+            size_t suffix_length = strlen(CACHE_METADATA_SUFFIX);
+            if (name_length > suffix_length &&
+                strcmp(de->d_name + name_length - suffix_length, CACHE_METADATA_SUFFIX) == 0) {
+                continue;
+            }
+
+            uint8_t digest[CONTENT_DIGEST_SIZE];
+            unsigned long long params_hash;
+            int option, consumed = 0;
+            int digest_length = parse_digest(de->d_name, digest);
+            if (digest_length == 0 ||
+                sscanf(de->d_name + digest_length, "-%d-%16llx%n", &option, &params_hash, &consumed) != 2 ||
+                strlen(de->d_name + digest_length + consumed) >= CACHE_EXT_SIZE) {
+                continue;
+            }
+
+            char path[sizeof(cache_dir) + sizeof(de->d_name)];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+            if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+
+            CacheKey key;
+            cache_key_init(&key, digest, option, params_hash);
+            add_entry(&key, de->d_name + digest_length + consumed, st.st_size);
+        }
+        closedir(d);
+    }
+
+    evict_to_fit();
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+int cache_lookup(const CacheKey *key, char *extension, size_t extension_size, ResultMetadata *metadata) {
+    int fd = -1;
+
+    pthread_mutex_lock(&cache_mutex);
+    CacheEntry *entry = find_entry(key);
+    if (entry) {
+        char path[CACHE_PATH_SIZE];
+        // The open descriptor keeps the data readable even if the entry is evicted meanwhile
+        fd = entry_path(key, entry->extension, path, sizeof(path)) == 0 ? open(path, O_RDONLY) : -1;
+        if (fd == -1) {
+            remove_entry(entry - entries);
+        } else {
+            entry->last_used = ++use_clock;
+            snprintf(extension, extension_size, "%s", entry->extension);
+            if (metadata) {
+                read_metadata(path, metadata);
+            }
+        }
+    }
+
+    if (fd == -1) {
+        cache_misses++;
+    } else {
+        cache_hits++;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return fd;
+}
+
+int cache_store(const CacheKey *key, const char *output_file, const char *extension,
+                const ResultMetadata *metadata) {
+    struct stat st;
+    char path[CACHE_PATH_SIZE];
+    if (stat(output_file, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        strlen(extension) >= CACHE_EXT_SIZE) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+    if (entry_path(key, extension, path, sizeof(path)) != 0) {
+        pthread_mutex_unlock(&cache_mutex);
+        return -1;
+    }
+
+    CacheEntry *existing = find_entry(key);
+    if (existing) {
+        remove_entry(existing - entries);
+    }
+
+    if (rename(output_file, path) < 0) {
+        perror("Failed to move result into cache");
+        pthread_mutex_unlock(&cache_mutex);
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || !add_entry(key, extension, st.st_size)) {
+        unlink(path);
+    } else {
+        write_metadata(path, metadata);
+        evict_to_fit();
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return fd;
+}
+
+int cache_link(const CacheKey *key, const char *dest_path) {
+    int ret = -1;
+
+    pthread_mutex_lock(&cache_mutex);
+    CacheEntry *entry = find_entry(key);
+    if (entry) {
+        char path[CACHE_PATH_SIZE];
+        if (entry_path(key, entry->extension, path, sizeof(path)) == 0 && link(path, dest_path) == 0) {
+            entry->last_used = ++use_clock;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return ret;
+}
+
+void cache_get_stats(unsigned long *hits, unsigned long *misses, size_t *bytes_used) {
+    pthread_mutex_lock(&cache_mutex);
+    *hits = cache_hits;
+    *misses = cache_misses;
+    *bytes_used = cache_bytes_used;
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,40 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hash.h"
+#include "protocol.h"
+
+#define CACHE_DIR "/tmp/converter_cache"
+#define CACHE_MAX_BYTES (512UL * 1024 * 1024)
+
+// Uploaded inputs are kept under this option, keyed by content digest and size
+#define CACHE_INPUT_OPTION 0
+
+// A cached result is identified by the input content, the conversion and the encoder parameters
+typedef struct {
+    uint8_t input_digest[CONTENT_DIGEST_SIZE];
+    int conversion_option;
+    uint64_t params_hash;
+} CacheKey;
+
+void cache_key_init(CacheKey *key, const uint8_t *input_digest, int conversion_option, uint64_t params_hash);
+
+void cache_init(const char *dir, size_t max_bytes);
+
+// Returns an open read-only descriptor for the cached output, or -1 on a miss. The metadata
+// stored with it is copied to metadata unless that is NULL, all zero when there is none.
+int cache_lookup(const CacheKey *key, char *extension, size_t extension_size, ResultMetadata *metadata);
+
+// Moves output_file into the cache, with its metadata unless that is NULL; returns an open
+// descriptor for the stored copy, or -1
+int cache_store(const CacheKey *key, const char *output_file, const char *extension,
+                const ResultMetadata *metadata);
+
+// Hard-links a cached entry to dest_path so it survives eviction; returns 0 on success
+int cache_link(const CacheKey *key, const char *dest_path);
+
+void cache_get_stats(unsigned long *hits, unsigned long *misses, size_t *bytes_used);
+
+#endif // CACHE_H
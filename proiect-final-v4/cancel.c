@@ -0,0 +1,59 @@
+#include "cancel.h"
+#include <stddef.h>
+#include <time.h>
+
+static _Thread_local CancelToken *current_token = NULL;
+
+double cancel_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+void cancel_token_init(CancelToken *token, double timeout_ms) {
+    atomic_init(&token->cancelled, 0);
+    token->timeout_ms = timeout_ms;
+    atomic_init(&token->deadline, 0);
+}
+
+void cancel_token_start(CancelToken *token) {
+    if (token->timeout_ms > 0) {
+        atomic_store(&token->deadline, cancel_now_ms() + token->timeout_ms);
+    }
+}
+
+void cancel_token_cancel(CancelToken *token) {
+    atomic_store(&token->cancelled, 1);
+}
+
+int cancel_token_expired(CancelToken *token) {
+    if (!token) {
+        return 0;
+    }
+    if (atomic_load(&token->cancelled)) {
+        return 1;
+    }
+    double deadline = atomic_load(&token->deadline);
+    return deadline > 0 && cancel_now_ms() >= deadline;
+}
+
+double cancel_token_remaining_ms(CancelToken *token) {
+    double deadline = token ? atomic_load(&token->deadline) : 0;
+    if (deadline <= 0) {
+        return -1;
+    }
+    double remaining = deadline - cancel_now_ms();
+    return remaining > 0 ? remaining : 0;
+}
+
+void cancel_set_current(CancelToken *token) {
+    current_token = token;
+}
+
+CancelToken *cancel_current(void) {
+    return current_token;
+}
+
+int cancel_requested(void) {
+    return cancel_token_expired(current_token);
+}
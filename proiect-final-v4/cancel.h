@@ -0,0 +1,36 @@
+#ifndef CANCEL_H
+#define CANCEL_H
+
+#include <stdatomic.h>
+
+// Stops a conversion when its client goes away or it runs past its deadline
+typedef struct {
+    atomic_int cancelled;
+    double timeout_ms;          // 0 for no deadline
+    _Atomic double deadline;    // monotonic milliseconds, set when the conversion starts
+} CancelToken;
+
+void cancel_token_init(CancelToken *token, double timeout_ms);
+
+// Arms the deadline; called when a worker starts running the conversion
+void cancel_token_start(CancelToken *token);
+
+void cancel_token_cancel(CancelToken *token);
+
+// Nonzero once the token was cancelled or its deadline has passed
+int cancel_token_expired(CancelToken *token);
+
+// Milliseconds left before the deadline, negative if there is none
+double cancel_token_remaining_ms(CancelToken *token);
+
+// Converters have a fixed signature, so the token of the conversion running on
+// a thread is published for them here
+void cancel_set_current(CancelToken *token);
+CancelToken *cancel_current(void);
+
+// Shorthand for converters: is the conversion on this thread still wanted
+int cancel_requested(void);
+
+double cancel_now_ms(void);
+
+#endif // CANCEL_H
@@ -7,55 +7,288 @@
 #include <sys/un.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "../hash.h"
+#include "../protocol.h"
 
 #define PORT 8080
 #define ADMIN_SOCKET_PATH "/tmp/admin_socket"
 #define BUFFER_SIZE 4095
+// How often a busy server is asked again before giving up
+#define MAX_BUSY_RETRIES 6
+#define MAX_RETRY_DELAY_MS 60000.0
 
-void send_file(int socket_fd, const char *file_path);
+void wait_before_retry(uint32_t retry_after_ms, int attempt);
+int parse_encoder_options(const char *text, EncoderOptions *options);
+int send_file(int socket_fd, const char *file_path, const EncoderOptions *options, pthread_t *uploader);
 void receive_file(int socket_fd, const char *input_path);
+void receive_result_metadata(int socket_fd);
 void generate_output_path(const char *input_path, const char *new_extension, char *output_path);
 void communicate_with_server(int socket_fd);
 void connect_to_admin_server();
 void connect_to_simple_server();
+void send_admin_command(const char *command, FILE *out);
 
-void send_file(int socket_fd, const char *file_path) {
+// A file uploaded on its own thread while the result of a streamed conversion comes back
+typedef struct {
+    int socket_fd;
+    int fd;
+} Upload;
+
+// Read exactly size bytes, returns the number of bytes read
+ssize_t read_full(int fd, void *buf, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = read(fd, (char *)buf + total, size - total);
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+// Read a NUL-terminated string without consuming anything that follows it
+ssize_t read_string(int fd, char *buf, size_t size) {
+    size_t total = 0;
+    while (total + 1 < size) {
+        ssize_t n = read(fd, buf + total, 1);
+        if (n <= 0) {
+            break;
+        }
+        if (buf[total++] == '\0') {
+            return total;
+        }
+    }
+    buf[total] = '\0';
+    return total;
+}
+
+// Waits the delay the server asked for, growing with each attempt and randomized
+// so clients that were turned away together don't all come back at once
+void wait_before_retry(uint32_t retry_after_ms, int attempt) {
+    double delay_ms = (double)retry_after_ms * (1 << attempt);
+    if (delay_ms > MAX_RETRY_DELAY_MS) {
+        delay_ms = MAX_RETRY_DELAY_MS;
+    }
+    delay_ms *= 0.5 + (double)rand() / RAND_MAX;
+
+    printf("Server is busy, retrying in %.1f s\n", delay_ms / 1000.0);
+    struct timespec delay = {(time_t)(delay_ms / 1000), (long)((long long)delay_ms % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+}
+
+// Parses settings like "bitrate=128000,rate=44100,quality=90"; "-" keeps every default.
+// Returns -1 on an unknown key, the server clamps the values themselves.
+int parse_encoder_options(const char *text, EncoderOptions *options) {
+    memset(options, 0, sizeof(*options));
+    if (strcmp(text, "-") == 0) {
+        return 0;
+    }
+
+    char copy[BUFFER_SIZE];
+    snprintf(copy, sizeof(copy), "%s", text);
+    for (char *item = strtok(copy, ","); item; item = strtok(NULL, ",")) {
+        char *equals = strchr(item, '=');
+        if (!equals) {
+            return -1;
+        }
+        *equals = '\0';
+        long value = strtol(equals + 1, NULL, 10);
+        if (value < 0) {
+            value = 0;
+        }
+
+        if (strcmp(item, "bitrate") == 0) {
+            options->audio_bit_rate = value;
+        } else if (strcmp(item, "rate") == 0) {
+            options->audio_sample_rate = value;
+        } else if (strcmp(item, "channels") == 0) {
+            options->audio_channels = value > 255 ? 255 : value;
+        } else if (strcmp(item, "vbr") == 0) {
+            options->audio_vbr_quality = value > 255 ? 255 : value;
+        } else if (strcmp(item, "quality") == 0) {
+            options->jpeg_quality = value > 255 ? 255 : value;
+        } else if (strcmp(item, "subsampling") == 0) {
+            options->jpeg_subsampling = value == 444 ? JPEG_SUBSAMPLING_444
+                                      : value == 422 ? JPEG_SUBSAMPLING_422
+                                      : value == 420 ? JPEG_SUBSAMPLING_420 : 0;
+        } else if (strcmp(item, "level") == 0) {
+            options->png_level = value > 255 ? 255 : value;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Sends the file content; the server stops reading once a conversion fails, so a closed
+// connection only ends the upload
+void *upload_file(void *arg) {
+    Upload *upload = arg;
+    char buffer[BUFFER_SIZE];
+    ssize_t bytes_read;
+
+    while ((bytes_read = read(upload->fd, buffer, BUFFER_SIZE)) > 0) {
+        if (send(upload->socket_fd, buffer, bytes_read, MSG_NOSIGNAL) != bytes_read) {
+            perror("Failed to send file");
+            break;
+        }
+    }
+    close(upload->fd);
+    free(upload);
+    return NULL;
+}
+
+// Returns 0 when the server will send back a converted file, 1 when it does so while the file is
+// still being uploaded by *uploader, which the caller joins after receiving the result
+int send_file(int socket_fd, const char *file_path, const EncoderOptions *options, pthread_t *uploader) {
     int fd = open(file_path, O_RDONLY);
     if (fd == -1) {
         perror("Failed to open file");
-        return;
+        return -1;
     }
 
     struct stat file_stat;
     if (fstat(fd, &file_stat) < 0) {
         perror("Failed to get file size");
         close(fd);
-        return;
+        return -1;
     }
     size_t file_size = file_stat.st_size;
-    write(socket_fd, &file_size, sizeof(file_size));
-
-    printf("Size of the file being sent: %zu bytes\n", file_size);
 
     char buffer[BUFFER_SIZE];
     ssize_t bytes_read;
+    UploadHeader header;
+    memset(&header, 0, sizeof(header));
 
+    // Digest the file in a streaming pass so the server can skip uploads it already has,
+    // and keep its first bytes so the server can check the real format
+    DigestState digest;
+    digest_init(&digest);
+    while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
+        if (header.prefix_len < sizeof(header.prefix)) {
+            size_t take = sizeof(header.prefix) - header.prefix_len;
+            if (take > (size_t)bytes_read) {
+                take = bytes_read;
+            }
+            memcpy(header.prefix + header.prefix_len, buffer, take);
+            header.prefix_len += take;
+        }
+        digest_update(&digest, buffer, bytes_read);
+    }
+
+    // A long ID3v2 tag hides the first audio frame from the prefix, so its first bytes go along
+    size_t tag_size = sniff_id3_size(header.prefix, header.prefix_len);
+    if (tag_size > 0 && tag_size + SNIFF_FRAME_SIZE > header.prefix_len &&
+        pread(fd, header.after_tag, SNIFF_FRAME_SIZE, tag_size) < 0) {
+        memset(header.after_tag, 0, sizeof(header.after_tag));
+    }
+
+    header.file_size = file_size;
+    digest_final(&digest, header.input_digest);
+    header.options = *options;
+    header.flags = UPLOAD_FLAG_STREAM;
+
+    uint8_t upload_status;
+    for (int attempt = 0; ; attempt++) {
+        write(socket_fd, &header, sizeof(header));
+        if (read(socket_fd, &upload_status, sizeof(upload_status)) != sizeof(upload_status)) {
+            perror("Failed to read upload status");
+            close(fd);
+            return -1;
+        }
+        if (upload_status != UPLOAD_BUSY) {
+            break;
+        }
+
+        uint32_t retry_after_ms;
+        if (read(socket_fd, &retry_after_ms, sizeof(retry_after_ms)) != sizeof(retry_after_ms)) {
+            perror("Failed to read retry delay");
+            close(fd);
+            return -1;
+        }
+        if (attempt == MAX_BUSY_RETRIES) {
+            printf("Server is busy, giving up\n");
+            close(fd);
+            return -1;
+        }
+        wait_before_retry(retry_after_ms, attempt);
+    }
+    if (upload_status == UPLOAD_REJECT) {
+        printf("Server rejected the file: its content doesn't match the chosen conversion\n");
+        close(fd);
+        return -1;
+    }
+    if (upload_status == UPLOAD_SKIP) {
+        printf("Server already has this file, upload skipped\n");
+        close(fd);
+        return 0;
+    }
+
+    printf("Size of the file being sent: %zu bytes\n", file_size);
+
+    lseek(fd, 0, SEEK_SET);
+    if (upload_status == UPLOAD_STREAM) {
+        // The result starts coming back before the upload is done, so both need to run at once
+        Upload *upload = malloc(sizeof(Upload));
+        if (upload) {
+            upload->socket_fd = socket_fd;
+            upload->fd = fd;
+            if (pthread_create(uploader, NULL, upload_file, upload) == 0) {
+                return 1;
+            }
+            free(upload);
+        }
+        perror("Failed to start the upload");
+        close(fd);
+        return -1;
+    }
     while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
         if (write(socket_fd, buffer, bytes_read) != bytes_read) {
             perror("Failed to send file");
             close(fd);
-            return;
+            return -1;
         }
     }
 
     close(fd);
+    return 0;
+}
+
+// Follows a result that arrived in full
+void receive_result_metadata(int socket_fd) {
+    ResultMetadata metadata;
+    if (read_full(socket_fd, &metadata, sizeof(metadata)) != sizeof(metadata)) {
+        perror("Failed to read result metadata");
+        return;
+    }
+    if (metadata.flags & RESULT_METADATA_LOUDNESS) {
+        printf("Loudness: %.1f LUFS integrated, %.1f dBTP true peak, %.2f s\n", metadata.integrated_lufs,
+               metadata.true_peak_dbtp, metadata.duration_seconds);
+    }
+    if (metadata.flags & RESULT_METADATA_REMUXED) {
+        printf("Audio copied without re-encoding\n");
+    }
 }
 
 void receive_file(int socket_fd, const char *input_path) {
     char buffer[BUFFER_SIZE];
 
+    // The server estimates how long the conversion will take before sending the result
+    ResultEta eta;
+    if (read(socket_fd, &eta, sizeof(eta)) <= 0) {
+        perror("Failed to read conversion estimate");
+        return;
+    }
+    if (eta > 0) {
+        printf("Estimated wait: %.1f s\n", eta / 1000.0);
+    }
+
     // Read the new file extension
-    if (read(socket_fd, buffer, sizeof(buffer)) <= 0) {
+    if (read_string(socket_fd, buffer, sizeof(buffer)) <= 0) {
         perror("Failed to read new file extension");
         return;
     }
@@ -78,12 +311,53 @@ void receive_file(int socket_fd, const char *input_path) {
         return;
     }
 
-    printf("Size of the received file: %zu bytes\n", file_size);
-
     ssize_t bytes_received;
     size_t total_bytes_received = 0;
 
-    while (total_bytes_received < file_size && (bytes_received = read(socket_fd, buffer, BUFFER_SIZE)) > 0) {
+    // A streamed result comes in chunks while the conversion runs
+    if (file_size == RESULT_SIZE_STREAMED) {
+        uint32_t chunk_size;
+        while (1) {
+            if (read_full(socket_fd, &chunk_size, sizeof(chunk_size)) != sizeof(chunk_size)) {
+                chunk_size = RESULT_CHUNK_FAILED;
+                break;
+            }
+            if (chunk_size == 0 || chunk_size == RESULT_CHUNK_FAILED) {
+                break;
+            }
+            while (chunk_size > 0 && (bytes_received = read(socket_fd, buffer, chunk_size < BUFFER_SIZE ? chunk_size : BUFFER_SIZE)) > 0) {
+                if (write(fd, buffer, bytes_received) != bytes_received) {
+                    perror("Failed to write to file");
+                    close(fd);
+                    return;
+                }
+                chunk_size -= bytes_received;
+                total_bytes_received += bytes_received;
+            }
+            if (chunk_size > 0) {
+                chunk_size = RESULT_CHUNK_FAILED;
+                break;
+            }
+        }
+        close(fd);
+
+        if (chunk_size == 0) {
+            printf("File received successfully, %zu bytes\n", total_bytes_received);
+            printf("Converted file saved to: %s\n", output_file_path);
+            receive_result_metadata(socket_fd);
+        } else {
+            printf("Conversion failed after %zu bytes of the result\n", total_bytes_received);
+            unlink(output_file_path);
+        }
+        return;
+    }
+
+    printf("Size of the received file: %zu bytes\n", file_size);
+
+    // Only the content, the metadata follows it
+    while (total_bytes_received < file_size &&
+           (bytes_received = read(socket_fd, buffer, file_size - total_bytes_received < BUFFER_SIZE
+                                                     ? file_size - total_bytes_received : BUFFER_SIZE)) > 0) {
         if (write(fd, buffer, bytes_received) != bytes_received) {
             perror("Failed to write to file");
             close(fd);
@@ -101,6 +375,9 @@ void receive_file(int socket_fd, const char *input_path) {
     }
 
     printf("Converted file saved to: %s\n", output_file_path);
+    if (total_bytes_received == file_size) {
+        receive_result_metadata(socket_fd);
+    }
 }
 
 void generate_output_path(const char *input_path, const char *new_extension, char *output_path) {
@@ -147,11 +424,29 @@ void communicate_with_server(int socket_fd) {
         sprintf(buffer, "%d", option);
         write(socket_fd, buffer, strlen(buffer) + 1);
 
+        // Encoder settings travel with the file, anything left out keeps the server's default
+        EncoderOptions options;
+        char settings[BUFFER_SIZE];
+        printf("Encoder settings (bitrate, rate, channels, vbr, quality, subsampling, level; - for defaults):\n");
+        scanf("%s", settings);
+        while (parse_encoder_options(settings, &options) != 0) {
+            printf("Unknown setting, use e.g. bitrate=128000,channels=1 or quality=90,subsampling=444:\n");
+            scanf("%s", settings);
+        }
+
         // Send the input file to the server
-        send_file(socket_fd, input_path);
+        pthread_t uploader;
+        int uploading = send_file(socket_fd, input_path, &options, &uploader);
+        if (uploading < 0) {
+            close(socket_fd);
+            return;
+        }
 
         // Receive the converted file from the server
         receive_file(socket_fd, input_path);
+        if (uploading) {
+            pthread_join(uploader, NULL);
+        }
     }
 }
 
@@ -204,17 +499,71 @@ void connect_to_simple_server() {
     communicate_with_server(socket_fd);
 }
 
+// Sends a command over the admin socket and copies the reply to out
+void send_admin_command(const char *command, FILE *out) {
+    int socket_fd;
+    struct sockaddr_un address;
+
+    if ((socket_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket failed");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, ADMIN_SOCKET_PATH, sizeof(address.sun_path) - 1);
+
+    if (connect(socket_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("connect failed");
+        close(socket_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    write(socket_fd, command, strlen(command) + 1);
+
+    char buffer[BUFFER_SIZE];
+    ssize_t bytes_read;
+    while ((bytes_read = read(socket_fd, buffer, sizeof(buffer))) > 0) {
+        fwrite(buffer, 1, bytes_read, out);
+    }
+    close(socket_fd);
+}
+
 int main() {
     int choice;
+    srand(time(NULL) ^ getpid());
     printf("Choose server to connect to:\n");
     printf("1. Admin Server\n");
     printf("2. Simple Server\n");
+    printf("3. Server metrics\n");
+    printf("4. Export server trace\n");
+    printf("5. Set trace sample rate\n");
     scanf("%d", &choice);
 
     if (choice == 1) {
         connect_to_admin_server();
     } else if (choice == 2) {
         connect_to_simple_server();
+    } else if (choice == 3) {
+        send_admin_command(ADMIN_COMMAND_METRICS, stdout);
+    } else if (choice == 4) {
+        char trace_path[BUFFER_SIZE];
+        printf("Save trace to (open it in chrome://tracing or Perfetto): ");
+        scanf("%s", trace_path);
+        FILE *trace_file = fopen(trace_path, "w");
+        if (!trace_file) {
+            perror("Failed to open trace file");
+            return 1;
+        }
+        send_admin_command(ADMIN_COMMAND_TRACE, trace_file);
+        fclose(trace_file);
+    } else if (choice == 5) {
+        double rate;
+        char command[64];
+        printf("Fraction of requests to trace (0-1): ");
+        scanf("%lf", &rate);
+        snprintf(command, sizeof(command), "%s%g", ADMIN_COMMAND_TRACE_RATE, rate);
+        send_admin_command(command, stdout);
     } else {
         printf("Invalid choice.\n");
     }
@@ -1,4 +1,10 @@
 #include "conversii.h"
+#include "sniff.h"
+#include "registry.h"
+#include "cancel.h"
+#include "metrics.h"
+#include "trace.h"
+#include "encoder_options.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +15,14 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <limits.h>
+
+// Images are read and written in strips of this many rows, checking for cancellation in between
+#define IMAGE_STRIP_ROWS 64
+// How long LibreOffice gets to exit after SIGTERM before it is killed
+#define CHILD_KILL_GRACE_MS 2000
+#define CHILD_POLL_INTERVAL_US 20000
 
 #pragma pack(push, 1)
 
@@ -84,8 +98,9 @@ int read_BMP_file(const char *filename, unsigned char **data, int *width, int *h
     return 1;
 }
 
-// Write JPEG file
-void write_JPEG_file(const char *filename, unsigned char *img_data, int width, int height, int quality) {
+// Write JPEG file; subsampling is one of JPEG_SUBSAMPLING_*, 0 keeps the libjpeg default (4:2:0)
+int write_JPEG_file(const char *filename, unsigned char *img_data, int width, int height, int quality,
+                     int subsampling) {
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
     FILE *outfile;
@@ -96,7 +111,8 @@ void write_JPEG_file(const char *filename, unsigned char *img_data, int width, i
 
     if ((outfile = fopen(filename, "wb")) == NULL) {
         fprintf(stderr, "Can't open %s for writing\n", filename);
-        exit(1);
+        jpeg_destroy_compress(&cinfo);
+        return 0;
     }
 
     jpeg_stdio_dest(&cinfo, outfile);
@@ -106,21 +122,33 @@ void write_JPEG_file(const char *filename, unsigned char *img_data, int width, i
     cinfo.in_color_space = JCS_RGB;
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality(&cinfo, quality, TRUE);
+    if (subsampling != 0) {
+        // Only the luma component is sampled more finely than the chroma ones
+        cinfo.comp_info[0].h_samp_factor = subsampling == JPEG_SUBSAMPLING_444 ? 1 : 2;
+        cinfo.comp_info[0].v_samp_factor = subsampling == JPEG_SUBSAMPLING_420 ? 2 : 1;
+    }
     jpeg_start_compress(&cinfo, TRUE);
 
     row_pointer[0] = img_data;
     while (cinfo.next_scanline < cinfo.image_height) {
+        if (cinfo.next_scanline % IMAGE_STRIP_ROWS == 0 && cancel_requested()) {
+            jpeg_destroy_compress(&cinfo);
+            fclose(outfile);
+            return 0;
+        }
         row_pointer[0] = &img_data[cinfo.next_scanline * width * 3];
         jpeg_write_scanlines(&cinfo, row_pointer, 1);
     }
 
     jpeg_finish_compress(&cinfo);
-    fclose(outfile);
+    int ok = !ferror(outfile);
+    ok = fclose(outfile) == 0 && ok;
     jpeg_destroy_compress(&cinfo);
+    return ok;
 }
 
-// Write PNG file
-int write_PNG_file(const char *filename, unsigned char *image, int width, int height) {
+// Write PNG file with the given zlib compression level
+int write_PNG_file(const char *filename, unsigned char *image, int width, int height, int level) {
     FILE *fp = fopen(filename, "wb");
     if (!fp) {
         fprintf(stderr, "Cannot open file %s\n", filename);
@@ -147,6 +175,7 @@ int write_PNG_file(const char *filename, unsigned char *image, int width, int he
     }
 
     png_init_io(png_ptr, fp);
+    png_set_compression_level(png_ptr, level);
     png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
     png_write_info(png_ptr, info_ptr);
@@ -155,7 +184,15 @@ int write_PNG_file(const char *filename, unsigned char *image, int width, int he
     for (int y = 0; y < height; y++) {
         row_pointers[y] = (png_byte *)&image[y * width * 3];
     }
-    png_write_image(png_ptr, row_pointers);
+    for (int y = 0; y < height; y += IMAGE_STRIP_ROWS) {
+        if (cancel_requested()) {
+            png_destroy_write_struct(&png_ptr, &info_ptr);
+            fclose(fp);
+            return 0;
+        }
+        int rows = height - y < IMAGE_STRIP_ROWS ? height - y : IMAGE_STRIP_ROWS;
+        png_write_rows(png_ptr, row_pointers + y, rows);
+    }
     png_write_end(png_ptr, NULL);
 
     png_destroy_write_struct(&png_ptr, &info_ptr);
@@ -197,6 +234,12 @@ int read_JPEG_file(const char *filename, unsigned char **image_buffer, int *widt
     buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, row_stride, 1);
 
     while (cinfo.output_scanline < cinfo.output_height) {
+        if (cinfo.output_scanline % IMAGE_STRIP_ROWS == 0 && cancel_requested()) {
+            jpeg_destroy_decompress(&cinfo);
+            fclose(infile);
+            free(*image_buffer);
+            return 0;
+        }
         jpeg_read_scanlines(&cinfo, buffer, 1);
         memcpy(*image_buffer + (cinfo.output_scanline - 1) * row_stride, buffer[0], row_stride);
     }
@@ -263,6 +306,8 @@ int read_PNG_file(const char *filename, unsigned char **image, int *width, int *
         color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
         png_set_gray_to_rgb(png);
 
+    // Interlaced images are read row by row in several passes
+    int passes = png_set_interlace_handling(png);
     png_read_update_info(png, info);
 
     int rowbytes = png_get_rowbytes(png, info);
@@ -273,7 +318,18 @@ int read_PNG_file(const char *filename, unsigned char **image, int *width, int *
         row_pointers[y] = *image + y * rowbytes;
     }
 
-    png_read_image(png, row_pointers);
+    for (int pass = 0; pass < passes; pass++) {
+        for (int y = 0; y < *height; y += IMAGE_STRIP_ROWS) {
+            if (cancel_requested()) {
+                png_destroy_read_struct(&png, &info, NULL);
+                fclose(fp);
+                free(*image);
+                return 0;
+            }
+            int rows = *height - y < IMAGE_STRIP_ROWS ? *height - y : IMAGE_STRIP_ROWS;
+            png_read_rows(png, row_pointers + y, NULL, rows);
+        }
+    }
 
     fclose(fp);
     png_destroy_read_struct(&png, &info, NULL);
@@ -281,11 +337,11 @@ int read_PNG_file(const char *filename, unsigned char **image, int *width, int *
 }
 
 // Write BMP file
-void write_BMP_file(const char *filename, unsigned char *image_buffer, int width, int height) {
+int write_BMP_file(const char *filename, unsigned char *image_buffer, int width, int height) {
     FILE *outfile = fopen(filename, "wb");
     if (!outfile) {
         fprintf(stderr, "Failed to open file for writing\n");
-        return;
+        return 0;
     }
 
     BMPFileHeader1 fileHeader;
@@ -321,6 +377,10 @@ void write_BMP_file(const char *filename, unsigned char *image_buffer, int width
 
     // Write pixel data
     for (int y = height - 1; y >= 0; y--) { // BMP images are stored bottom-to-top
+        if ((height - 1 - y) % IMAGE_STRIP_ROWS == 0 && cancel_requested()) {
+            fclose(outfile);
+            return 0;
+        }
         fwrite(image_buffer + y * width * 3, 3, width, outfile);
         // Pad each row to a multiple of 4 bytes
         if (rowPadding > 0) {
@@ -329,216 +389,306 @@ void write_BMP_file(const char *filename, unsigned char *image_buffer, int width
         }
     }
 
-    fclose(outfile);
+    int ok = !ferror(outfile);
+    return fclose(outfile) == 0 && ok;
+}
+
+// Quality and compression level the client asked for, the defaults otherwise
+static int jpeg_quality(void) {
+    const EncoderOptions *options = encoder_options_current();
+    return options->jpeg_quality ? options->jpeg_quality : DEFAULT_JPEG_QUALITY;
+}
+
+static int png_level(void) {
+    const EncoderOptions *options = encoder_options_current();
+    return options->png_level ? options->png_level : DEFAULT_PNG_LEVEL;
 }
 
 // Conversion functions
-void convert_bmp_to_jpeg(const char *input_file, const char *output_file) {
+int convert_bmp_to_jpeg(const char *input_file, const char *output_file) {
     unsigned char *image_data;
-    int width, height;
-    if (read_BMP_file(input_file, &image_data, &width, &height)) {
-        write_JPEG_file(output_file, image_data, width, height, 75);  // Using a default quality of 75
+    int width, height, written = 0;
+    TraceSpan read_span = trace_span_begin("read_bmp");
+    int ok = read_BMP_file(input_file, &image_data, &width, &height);
+    trace_span_end(&read_span);
+    if (ok) {
+        TraceSpan write_span = trace_span_begin("write_jpeg");
+        written = write_JPEG_file(output_file, image_data, width, height, jpeg_quality(), encoder_options_current()->jpeg_subsampling);
+        trace_span_end(&write_span);
         free(image_data);
     }
+    return written ? 0 : -1;
 }
 
-void convert_bmp_to_png(const char *input_file, const char *output_file) {
+int convert_bmp_to_png(const char *input_file, const char *output_file) {
     unsigned char *image_data;
-    int width, height;
-    if (read_BMP_file(input_file, &image_data, &width, &height)) {
-        write_PNG_file(output_file, image_data, width, height);
+    int width, height, written = 0;
+    TraceSpan read_span = trace_span_begin("read_bmp");
+    int ok = read_BMP_file(input_file, &image_data, &width, &height);
+    trace_span_end(&read_span);
+    if (ok) {
+        TraceSpan write_span = trace_span_begin("write_png");
+        written = write_PNG_file(output_file, image_data, width, height, png_level());
+        trace_span_end(&write_span);
         free(image_data);
     }
+    return written ? 0 : -1;
 }
 
-void convert_jpeg_to_bmp(const char *input_file, const char *output_file) {
+int convert_jpeg_to_bmp(const char *input_file, const char *output_file) {
     unsigned char *image_data;
-    int width, height;
-    if (read_JPEG_file(input_file, &image_data, &width, &height)) {
-        write_BMP_file(output_file, image_data, width, height);
+    int width, height, written = 0;
+    TraceSpan read_span = trace_span_begin("read_jpeg");
+    int ok = read_JPEG_file(input_file, &image_data, &width, &height);
+    trace_span_end(&read_span);
+    if (ok) {
+        TraceSpan write_span = trace_span_begin("write_bmp");
+        written = write_BMP_file(output_file, image_data, width, height);
+        trace_span_end(&write_span);
         free(image_data);
     }
+    return written ? 0 : -1;
 }
 
-void convert_jpeg_to_png(const char *input_file, const char *output_file) {
+int convert_jpeg_to_png(const char *input_file, const char *output_file) {
     unsigned char *image_data;
-    int width, height;
-    if (read_JPEG_file(input_file, &image_data, &width, &height)) {
-        write_PNG_file(output_file, image_data, width, height);
+    int width, height, written = 0;
+    TraceSpan read_span = trace_span_begin("read_jpeg");
+    int ok = read_JPEG_file(input_file, &image_data, &width, &height);
+    trace_span_end(&read_span);
+    if (ok) {
+        TraceSpan write_span = trace_span_begin("write_png");
+        written = write_PNG_file(output_file, image_data, width, height, png_level());
+        trace_span_end(&write_span);
         free(image_data);
     }
+    return written ? 0 : -1;
 }
 
-void convert_png_to_bmp(const char *input_file, const char *output_file) {
+int convert_png_to_bmp(const char *input_file, const char *output_file) {
     unsigned char *image_data;
-    int width, height;
-    if (read_PNG_file(input_file, &image_data, &width, &height)) {
-        write_BMP_file(output_file, image_data, width, height);
+    int width, height, written = 0;
+    TraceSpan read_span = trace_span_begin("read_png");
+    int ok = read_PNG_file(input_file, &image_data, &width, &height);
+    trace_span_end(&read_span);
+    if (ok) {
+        TraceSpan write_span = trace_span_begin("write_bmp");
+        written = write_BMP_file(output_file, image_data, width, height);
+        trace_span_end(&write_span);
         free(image_data);
     }
+    return written ? 0 : -1;
 }
 
-void convert_png_to_jpeg(const char *input_file, const char *output_file) {
+int convert_png_to_jpeg(const char *input_file, const char *output_file) {
     unsigned char *image_data;
-    int width, height;
-    if (read_PNG_file(input_file, &image_data, &width, &height)) {
-        write_JPEG_file(output_file, image_data, width, height, 75);  // Using a default quality of 75
+    int width, height, written = 0;
+    TraceSpan read_span = trace_span_begin("read_png");
+    int ok = read_PNG_file(input_file, &image_data, &width, &height);
+    trace_span_end(&read_span);
+    if (ok) {
+        TraceSpan write_span = trace_span_begin("write_jpeg");
+        written = write_JPEG_file(output_file, image_data, width, height, jpeg_quality(), encoder_options_current()->jpeg_subsampling);
+        trace_span_end(&write_span);
         free(image_data);
     }
+    return written ? 0 : -1;
 }
 
 
-void convert_pdf_to_odt(const char *input_path, const char *output_path) {
-    printf("Converting PDF to ODT: %s to %s\n", input_path, output_path);
+// Wait for a child process, stopping it when the conversion is cancelled or runs past
+// its deadline: SIGTERM to its process group first, SIGKILL after a grace period.
+// Returns 0 if the child exited on its own.
+static int wait_for_child(pid_t pid, int *status) {
+    double kill_at = 0;
+
+    while (1) {
+        pid_t done = waitpid(pid, status, WNOHANG);
+        if (done == pid) {
+            return kill_at > 0 ? -1 : 0;
+        }
+        if (done < 0 && errno != EINTR) {
+            return -1;
+        }
 
-    char *ext = strrchr(input_path, '.');
-    if (ext == NULL || strcmp(ext, ".pdf") != 0) {
-        fprintf(stderr, "Error: Input file %s is not .pdf\n", input_path);
-        return;
+        if (kill_at == 0 && cancel_requested()) {
+            fprintf(stderr, "Stopping LibreOffice (pid %d)\n", (int)pid);
+            kill(-pid, SIGTERM);
+            kill_at = cancel_now_ms() + CHILD_KILL_GRACE_MS;
+        } else if (kill_at > 0 && cancel_now_ms() >= kill_at) {
+            kill(-pid, SIGKILL);
+        }
+        usleep(CHILD_POLL_INTERVAL_US);
     }
-    if (access(input_path, F_OK) != 0) {
-        fprintf(stderr, "Error: Input file %s doesn't exist\n", input_path);
-        return;
+}
+
+// Run LibreOffice headless to convert input_path into output_path, returns 0 on success.
+// LibreOffice only takes an output directory, so convert into a private one next to
+// output_path and move the result to the requested name.
+static int run_libreoffice(const char *input_path, const char *output_path, const char *convert_to,
+                           const char *extension, const char *description) {
+    char outdir[PATH_MAX];
+    const char *slash = strrchr(output_path, '/');
+    int length;
+    if (slash) {
+        length = snprintf(outdir, sizeof(outdir), "%.*s/lo_XXXXXX", (int)(slash - output_path), output_path);
+    } else {
+        length = snprintf(outdir, sizeof(outdir), "lo_XXXXXX");
+    }
+    if (length < 0 || (size_t)length >= sizeof(outdir)) {
+        fprintf(stderr, "Error: output path %s is too long\n", output_path);
+        return -1;
+    }
+    if (!mkdtemp(outdir)) {
+        fprintf(stderr, "Error: mkdtemp failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // LibreOffice names the result after the input, replacing its extension
+    const char *base = strrchr(input_path, '/');
+    base = base ? base + 1 : input_path;
+    const char *dot = strrchr(base, '.');
+    int base_len = dot ? (int)(dot - base) : (int)strlen(base);
+    char produced[sizeof(outdir) + NAME_MAX + 1];
+    length = snprintf(produced, sizeof(produced), "%s/%.*s.%s", outdir, base_len, base, extension);
+    if (length < 0 || (size_t)length >= sizeof(produced)) {
+        fprintf(stderr, "Error: input name %s is too long\n", base);
+        rmdir(outdir);
+        return -1;
     }
 
+    int result = -1;
+    TraceSpan span = trace_span_begin("libreoffice");
+    double spawn_start = cancel_now_ms();
     pid_t pid = fork();
     if (pid == 0) {
-        execl("/usr/bin/libreoffice", "libreoffice", "--headless", "--convert-to", "odt", input_path, "--outdir", output_path, NULL);
+        // Its own process group, so stopping it also stops the processes it starts
+        setpgid(0, 0);
+        // The server blocks SIGTERM and SIGINT to handle them in one thread; exec keeps the mask
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigprocmask(SIG_SETMASK, &signals, NULL);
+        execl("/usr/bin/libreoffice", "libreoffice", "--headless", "--convert-to", convert_to, input_path, "--outdir", outdir, NULL);
         fprintf(stderr, "Error: execl failed: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+        // Not exit(): the copy of the parent must not run its exit handlers
+        _exit(EXIT_FAILURE);
     } else if (pid < 0) {
         fprintf(stderr, "Error: fork failed: %s\n", strerror(errno));
     } else {
         int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-            printf("Successfully converted PDF to ODT.\n");
+        double spawned = cancel_now_ms();
+        metrics_observe(HISTOGRAM_LIBREOFFICE_SPAWN, spawned - spawn_start);
+        setpgid(pid, pid);
+        int waited = wait_for_child(pid, &status);
+        metrics_observe(HISTOGRAM_LIBREOFFICE_RUN, cancel_now_ms() - spawned);
+        if (waited == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 && rename(produced, output_path) == 0) {
+            printf("Successfully converted %s.\n", description);
+            result = 0;
         } else {
             fprintf(stderr, "Error: Conversion failed.\n");
         }
     }
+
+    trace_span_end(&span);
+    unlink(produced);
+    rmdir(outdir);
+    return result;
 }
 
-void convert_odt_to_pdf(const char *input_path, const char *output_path) {
-    printf("Converting ODT to PDF: %s to %s\n", input_path, output_path);
+int convert_pdf_to_odt(const char *input_path, const char *output_path) {
+    printf("Converting PDF to ODT: %s to %s\n", input_path, output_path);
 
-    char *ext = strrchr(input_path, '.');
-    if (ext == NULL || strcmp(ext, ".odt") != 0) {
-        fprintf(stderr, "Error: Input file %s is not .odt\n", input_path);
-        return;
-    }
     if (access(input_path, F_OK) != 0) {
         fprintf(stderr, "Error: Input file %s doesn't exist\n", input_path);
-        return;
+        return -1;
+    }
+    // Check the content rather than the file name
+    if (sniff_file(input_path) != FORMAT_PDF) {
+        fprintf(stderr, "Error: Input file %s is not PDF\n", input_path);
+        return -1;
     }
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        execl("/usr/bin/libreoffice", "libreoffice", "--headless", "--convert-to", "pdf", input_path, "--outdir", output_path, NULL);
-        fprintf(stderr, "Error: execl failed: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        fprintf(stderr, "Error: fork failed: %s\n", strerror(errno));
-    } else {
-        int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-            printf("Successfully converted ODT to PDF.\n");
-        } else {
-            fprintf(stderr, "Error: Conversion failed.\n");
-        }
+    return run_libreoffice(input_path, output_path, "odt", "odt", "PDF to ODT");
+}
+
+int convert_odt_to_pdf(const char *input_path, const char *output_path) {
+    printf("Converting ODT to PDF: %s to %s\n", input_path, output_path);
+
+    if (access(input_path, F_OK) != 0) {
+        fprintf(stderr, "Error: Input file %s doesn't exist\n", input_path);
+        return -1;
+    }
+    // Check the content rather than the file name
+    if (sniff_file(input_path) != FORMAT_ODT) {
+        fprintf(stderr, "Error: Input file %s is not ODT\n", input_path);
+        return -1;
     }
+
+    return run_libreoffice(input_path, output_path, "pdf", "pdf", "ODT to PDF");
 }
 
-void convert_odt_to_txt(const char *input_path, const char *output_path) {
+int convert_odt_to_txt(const char *input_path, const char *output_path) {
     printf("Converting ODT to TXT: %s to %s\n", input_path, output_path);
 
-    char *ext = strrchr(input_path, '.');
-    if (ext == NULL || strcmp(ext, ".odt") != 0) {
-        fprintf(stderr, "Error: Input file %s is not .odt\n", input_path);
-        return;
-    }
     if (access(input_path, F_OK) != 0) {
         fprintf(stderr, "Error: Input file %s doesn't exist\n", input_path);
-        return;
+        return -1;
     }
-
-    pid_t pid = fork();
-    if (pid == 0) {
-        execl("/usr/bin/libreoffice", "libreoffice", "--headless", "--convert-to", "txt", input_path, "--outdir", output_path, NULL);
-        fprintf(stderr, "Error: execl failed: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        fprintf(stderr, "Error: fork failed: %s\n", strerror(errno));
-    } else {
-        int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-            printf("Successfully converted ODT to TXT.\n");
-        } else {
-            fprintf(stderr, "Error: Conversion failed.\n");
-        }
+    // Check the content rather than the file name
+    if (sniff_file(input_path) != FORMAT_ODT) {
+        fprintf(stderr, "Error: Input file %s is not ODT\n", input_path);
+        return -1;
     }
+
+    return run_libreoffice(input_path, output_path, "txt", "txt", "ODT to TXT");
 }
 
-void convert_txt_to_odt(const char *input_path, const char *output_path) {
+int convert_txt_to_odt(const char *input_path, const char *output_path) {
     printf("Converting TXT to ODT: %s to %s\n", input_path, output_path);
 
-    char *ext = strrchr(input_path, '.');
-    if (ext == NULL || strcmp(ext, ".txt") != 0) {
-        fprintf(stderr, "Error: Input file %s is not .txt\n", input_path);
-        return;
-    }
     if (access(input_path, F_OK) != 0) {
         fprintf(stderr, "Error: Input file %s doesn't exist\n", input_path);
-        return;
+        return -1;
     }
-
-    pid_t pid = fork();
-    if (pid == 0) {
-        execl("/usr/bin/libreoffice", "libreoffice", "--headless", "--convert-to", "odt", input_path, "--outdir", output_path, NULL);
-        fprintf(stderr, "Error: execl failed: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        fprintf(stderr, "Error: fork failed: %s\n", strerror(errno));
-    } else {
-        int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-            printf("Successfully converted TXT to ODT.\n");
-        } else {
-            fprintf(stderr, "Error: Conversion failed.\n");
-        }
+    // Check the content rather than the file name
+    if (sniff_file(input_path) != FORMAT_TXT) {
+        fprintf(stderr, "Error: Input file %s is not TXT\n", input_path);
+        return -1;
     }
+
+    return run_libreoffice(input_path, output_path, "odt", "odt", "TXT to ODT");
 }
 
-void convert_txt_to_pdf(const char *input_path, const char *output_path) {
+int convert_txt_to_pdf(const char *input_path, const char *output_path) {
     printf("Converting TXT to PDF: %s to %s\n", input_path, output_path);
 
-    char *ext = strrchr(input_path, '.');
-    if (ext == NULL || strcmp(ext, ".txt") != 0) {
-        fprintf(stderr, "Error: Input file %s is not .txt\n", input_path);
-        return;
-    }
     if (access(input_path, F_OK) != 0) {
         fprintf(stderr, "Error: Input file %s doesn't exist\n", input_path);
-        return;
+        return -1;
     }
-
-    pid_t pid = fork();
-    if (pid == 0) {
-        execl("/usr/bin/libreoffice", "libreoffice", "--headless", "--convert-to", "pdf:writer_pdf_Export", input_path, "--outdir", output_path, NULL);
-        fprintf(stderr, "Error: execl failed: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        fprintf(stderr, "Error: fork failed: %s\n", strerror(errno));
-    } else {
-        int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-            printf("Successfully converted TXT to PDF.\n");
-        } else {
-            fprintf(stderr, "Error: Conversion failed.\n");
-        }
+    // Check the content rather than the file name
+    if (sniff_file(input_path) != FORMAT_TXT) {
+        fprintf(stderr, "Error: Input file %s is not TXT\n", input_path);
+        return -1;
     }
-}
\ No newline at end of file
+
+    return run_libreoffice(input_path, output_path, "pdf:writer_pdf_Export", "pdf", "TXT to PDF");
+}
+
+
+void register_image_converters(void) {
+    register_converter(7, FORMAT_BMP, FORMAT_JPEG, convert_bmp_to_jpeg, ".jpeg", COST_CLASS_IMAGE);
+    register_converter(8, FORMAT_BMP, FORMAT_PNG, convert_bmp_to_png, ".png", COST_CLASS_IMAGE);
+    register_converter(9, FORMAT_JPEG, FORMAT_BMP, convert_jpeg_to_bmp, ".bmp", COST_CLASS_IMAGE);
+    register_converter(10, FORMAT_JPEG, FORMAT_PNG, convert_jpeg_to_png, ".png", COST_CLASS_IMAGE);
+    register_converter(11, FORMAT_PNG, FORMAT_BMP, convert_png_to_bmp, ".bmp", COST_CLASS_IMAGE);
+    register_converter(12, FORMAT_PNG, FORMAT_JPEG, convert_png_to_jpeg, ".jpg", COST_CLASS_IMAGE);
+}
+
+void register_document_converters(void) {
+    register_converter(13, FORMAT_ODT, FORMAT_PDF, convert_odt_to_pdf, ".pdf", COST_CLASS_DOCUMENT);
+    register_converter(14, FORMAT_ODT, FORMAT_TXT, convert_odt_to_txt, ".txt", COST_CLASS_DOCUMENT);
+    register_converter(15, FORMAT_TXT, FORMAT_PDF, convert_txt_to_pdf, ".pdf", COST_CLASS_DOCUMENT);
+    register_converter(16, FORMAT_TXT, FORMAT_ODT, convert_txt_to_odt, ".odt", COST_CLASS_DOCUMENT);
+    register_converter(17, FORMAT_PDF, FORMAT_ODT, convert_pdf_to_odt, ".odt", COST_CLASS_DOCUMENT);
+}
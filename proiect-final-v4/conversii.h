@@ -35,23 +35,29 @@ typedef struct {
 
 // Function prototypes
 int read_BMP_file(const char *filename, unsigned char **data, int *width, int *height);
-void write_JPEG_file(const char *filename, unsigned char *img_data, int width, int height, int quality);
-int write_PNG_file(const char *filename, unsigned char *image, int width, int height);
+int write_JPEG_file(const char *filename, unsigned char *img_data, int width, int height, int quality,
+                    int subsampling);
+int write_PNG_file(const char *filename, unsigned char *image, int width, int height, int level);
 int read_JPEG_file(const char *filename, unsigned char **image_buffer, int *width, int *height);
 int read_PNG_file(const char *filename, unsigned char **image, int *width, int *height);
-void write_BMP_file(const char *filename, unsigned char *image_buffer, int width, int height);
-
-void convert_bmp_to_jpeg(const char *input_file, const char *output_file);
-void convert_bmp_to_png(const char *input_file, const char *output_file);
-void convert_jpeg_to_bmp(const char *input_file, const char *output_file);
-void convert_jpeg_to_png(const char *input_file, const char *output_file);
-void convert_png_to_bmp(const char *input_file, const char *output_file);
-void convert_png_to_jpeg(const char *input_file, const char *output_file);
-
-void convert_pdf_to_odt(const char *input_path, const char *output_path);
-void convert_odt_to_pdf(const char *input_path, const char *output_path);
-void convert_odt_to_txt(const char *input_path, const char *output_path);
-void convert_txt_to_odt(const char *input_path, const char *output_path);
-void convert_txt_to_pdf(const char *input_path, const char *output_path);
+int write_BMP_file(const char *filename, unsigned char *image_buffer, int width, int height);
+
+// The converters return 0 on success
+int convert_bmp_to_jpeg(const char *input_file, const char *output_file);
+int convert_bmp_to_png(const char *input_file, const char *output_file);
+int convert_jpeg_to_bmp(const char *input_file, const char *output_file);
+int convert_jpeg_to_png(const char *input_file, const char *output_file);
+int convert_png_to_bmp(const char *input_file, const char *output_file);
+int convert_png_to_jpeg(const char *input_file, const char *output_file);
+
+int convert_pdf_to_odt(const char *input_path, const char *output_path);
+int convert_odt_to_pdf(const char *input_path, const char *output_path);
+int convert_odt_to_txt(const char *input_path, const char *output_path);
+int convert_txt_to_odt(const char *input_path, const char *output_path);
+int convert_txt_to_pdf(const char *input_path, const char *output_path);
+
+// Adds the image and document conversions to the registry
+void register_image_converters(void);
+void register_document_converters(void);
 
 #endif // CONVERSII_H
@@ -4,366 +4,852 @@
 #include <libavcodec/avcodec.h>
 #include <libswresample/swresample.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "conversii_audio.h"
+#include "registry.h"
+#include "cancel.h"
+#include "trace.h"
+#include "wav.h"
+#include "audio_pool.h"
+#include "spsc_ring.h"
+#include "metrics.h"
+#include "encoder_options.h"
+#include "conversion_stream.h"
+#include "sample_convert.h"
+#include "loudness.h"
+#include "result_metadata.h"
+#include "scheduler.h"
+#include <libavutil/audio_fifo.h>
+
+/* It makes FFmpeg give up blocking reads once the conversion is cancelled */
+static int interrupt_on_cancel(void *opaque) {
+    return cancel_token_expired(opaque);
+}
 
-/* Function to convert from AAC format to MP3 format */
-void convert_aac_to_mp3(const char *input_path, const char *output_path) {
-    /* Pointers declaration for format and codec contexts, streams, packets */
-    AVFormatContext *input_format_context = NULL;
-    AVFormatContext *output_format_context = NULL;
-    AVCodecContext *input_codec_context = NULL;
-    AVCodecContext *output_codec_context = NULL;
-    AVStream *input_stream = NULL;
-    AVStream *output_stream = NULL;
-    AVPacket *packet = NULL;
-    int ret;
-
-    /* It opens the input file and will exit if it's a problem in opening the file */
-    if ((ret = avformat_open_input(&input_format_context, input_path, NULL, NULL)) < 0) {
-        fprintf(stderr, "Could not open input file '%s'\n", input_path);
-        exit(1);
+/* It allocates an input context bound to the cancellation token of the current job */
+static AVFormatContext *alloc_cancellable_input(void) {
+    AVFormatContext *context = avformat_alloc_context();
+    if (context) {
+        context->interrupt_callback.callback = interrupt_on_cancel;
+        context->interrupt_callback.opaque = cancel_current();
     }
+    return context;
+}
 
-    /* It will retrieve stream info from the input file */
-    if ((ret = avformat_find_stream_info(input_format_context, NULL)) < 0) {
-        fprintf(stderr, "Failed to retrieve input stream information\n");
-        exit(1);
-    }
+/* Bytes per read from a streamed upload and at most per chunk of a streamed result */
+#define STREAM_IO_BUFFER_SIZE 65536
 
-    /* It will allocate the output format context */
-    avformat_alloc_output_context2(&output_format_context, NULL, NULL, output_path);
-    if (!output_format_context) {
-        fprintf(stderr, "Could not create output context\n");
-        ret = AVERROR_UNKNOWN;
-        goto end;
+/* It feeds the demuxer from the upload of a streamed conversion */
+static int read_upload(void *opaque, uint8_t *buf, int buf_size) {
+    ssize_t n = conversion_stream_read_input(opaque, buf, buf_size);
+    if (n < 0) {
+        return cancel_requested() ? AVERROR_EXIT : AVERROR(EIO);
     }
+    return n > 0 ? (int)n : AVERROR_EOF;
+}
 
-    /* Find the best stream in the input file and will display the error message if it's an error thrown */
-    int stream_index = av_find_best_stream(input_format_context, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-    if (stream_index < 0) {
-        fprintf(stderr, "Could not find %s stream in input file '%s'\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO), input_path);
-        ret = AVERROR(EINVAL);
-        goto end;
-    }
+/* It sends what the muxer writes straight to the client of a streamed conversion */
+static int write_result(void *opaque, uint8_t *buf, int buf_size) {
+    return conversion_stream_write_output(opaque, buf, buf_size) == 0 ? buf_size : AVERROR(EPIPE);
+}
 
-    /* Get the input stream and find the decoder for the stream */
-    input_stream = input_format_context->streams[stream_index];
-    AVCodec *input_codec = avcodec_find_decoder(input_stream->codecpar->codec_id);
-    if (!input_codec) {
-        fprintf(stderr, "Failed to find %s codec\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        ret = AVERROR(EINVAL);
-        goto end;
+/* It allocates an I/O context over the stream, for reading the upload or for writing the result */
+static AVIOContext *alloc_stream_io(ConversionStream *stream, int write_flag) {
+    unsigned char *buffer = av_malloc(STREAM_IO_BUFFER_SIZE);
+    if (!buffer) {
+        return NULL;
     }
-
-    /* It will allocate the codec context for the decoder */
-    input_codec_context = avcodec_alloc_context3(input_codec);
-    if (!input_codec_context) {
-        fprintf(stderr, "Failed to allocate the %s codec context\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        ret = AVERROR(ENOMEM);
-        goto end;
+    AVIOContext *io = avio_alloc_context(buffer, STREAM_IO_BUFFER_SIZE, write_flag, stream,
+                                         write_flag ? NULL : read_upload, write_flag ? write_result : NULL, NULL);
+    if (!io) {
+        av_free(buffer);
     }
+    return io;
+}
 
-    /* It makes a copy for codec parameters from input stream to codec context */
-    if ((ret = avcodec_parameters_to_context(input_codec_context, input_stream->codecpar)) < 0) {
-        fprintf(stderr, "Failed to copy %s codec parameters to decoder context\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        goto end;
+/* FFmpeg leaves I/O contexts it didn't open to the caller */
+static void free_stream_io(AVIOContext **io) {
+    if (*io) {
+        av_freep(&(*io)->buffer);
+        avio_context_free(io);
     }
+}
 
-    /* Opens the codec */
-    if ((ret = avcodec_open2(input_codec_context, input_codec, NULL)) < 0) {
-        fprintf(stderr, "Failed to open %s codec\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        goto end;
-    }
+/* Limits used when the input format is already known: enough for the demuxer to read its header.
+ * The stream parameters then come from that header or from the first frame instead of from decoding */
+#define HINTED_PROBE_SIZE 32768
+#define HINTED_ANALYZE_DURATION 100000 /* microseconds */
+/* Bytes searched for the first ADTS or MPEG audio frame once an ID3v2 tag has been skipped */
+#define FRAME_HEADER_SCAN_SIZE 65536
+/* FFmpeg's own defaults, restored before a full probe */
+#define DEFAULT_PROBE_SIZE 5000000
+#define DEFAULT_ANALYZE_DURATION 0
 
-    /* Finds the encoder for the output stream for the MP3 required format */
-    AVCodec *output_codec = avcodec_find_encoder(AV_CODEC_ID_MP3);
-    if (!output_codec) {
-        fprintf(stderr, "Necessary encoder not found\n");
-        ret = AVERROR_INVALIDDATA;
+static int hinted_probing = 1;
+
+void audio_set_hinted_probing(int enabled) {
+    hinted_probing = enabled;
+}
+
+/* It reads the sample rate and channels of a raw ADTS or MP3 file from its first frame header */
+static int stream_params_from_first_frame(const char *path, AVCodecParameters *codecpar) {
+    AVCodecParserContext *parser = NULL;
+    AVCodecContext *parsed = NULL;
+    uint8_t *buffer = NULL;
+    int ret = -1;
+
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+    buffer = av_malloc(FRAME_HEADER_SCAN_SIZE + AV_INPUT_BUFFER_PADDING_SIZE);
+    parser = av_parser_init(codecpar->codec_id);
+    parsed = avcodec_alloc_context3(NULL);
+    if (!buffer || !parser || !parsed) {
         goto end;
     }
 
-    /* Creates a new stream for the output file */
-    output_stream = avformat_new_stream(output_format_context, NULL);
-    if (!output_stream) {
-        fprintf(stderr, "Failed allocating output stream\n");
-        ret = AVERROR_UNKNOWN;
+    /* An ID3v2 tag in front of the first frame can hold a whole cover image, so it's skipped by its size */
+    long offset = 0;
+    if (fread(buffer, 1, 10, file) == 10 && memcmp(buffer, "ID3", 3) == 0) {
+        offset = 10 + ((long)(buffer[6] & 0x7F) << 21 | (buffer[7] & 0x7F) << 14 | (buffer[8] & 0x7F) << 7 | (buffer[9] & 0x7F));
+        if (buffer[5] & 0x10) {
+            offset += 10;
+        }
+    }
+    if (fseek(file, offset, SEEK_SET) != 0) {
         goto end;
     }
+    size_t size = fread(buffer, 1, FRAME_HEADER_SCAN_SIZE, file);
+    memset(buffer + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
 
-    /* It will allocate the codec context for the encoder */
-    output_codec_context = avcodec_alloc_context3(output_codec);
-    if (!output_codec_context) {
-        fprintf(stderr, "Failed to allocate the encoder context\n");
-        ret = AVERROR(ENOMEM);
-        goto end;
+    /* The parser fills in the context as soon as it has recognised a frame header */
+    const uint8_t *data = buffer;
+    while (size > 0 && (parsed->sample_rate <= 0 || parsed->channels <= 0)) {
+        uint8_t *frame_data;
+        int frame_size;
+        int used = av_parser_parse2(parser, parsed, &frame_data, &frame_size, data, (int)size,
+                                    AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+        if (used <= 0) {
+            break;
+        }
+        data += used;
+        size -= used;
+    }
+
+    /* An AAC header with channel configuration 0 leaves the layout to the bitstream, that needs a real probe */
+    if (parsed->sample_rate > 0 && parsed->channels > 0) {
+        codecpar->sample_rate = parsed->sample_rate;
+        codecpar->channels = parsed->channels;
+        codecpar->channel_layout = parsed->channel_layout ? parsed->channel_layout
+                                                          : (uint64_t)av_get_default_channel_layout(parsed->channels);
+        if (!codecpar->bit_rate) {
+            codecpar->bit_rate = parsed->bit_rate;
+        }
+        ret = 0;
     }
 
-    /* It set the codec parameters for the output stream */
-    output_codec_context->channels = input_codec_context->channels;
-    output_codec_context->channel_layout = av_get_default_channel_layout(input_codec_context->channels);
-    output_codec_context->sample_rate = input_codec_context->sample_rate;
-    output_codec_context->sample_fmt = output_codec->sample_fmts[0];
-    output_codec_context->bit_rate = 192000;
+    end:
+    av_parser_close(parser);
+    avcodec_free_context(&parsed);
+    av_free(buffer);
+    fclose(file);
+    return ret;
+}
 
-    /* Open the output codec */
-    if ((ret = avcodec_open2(output_codec_context, output_codec, NULL)) < 0) {
-        fprintf(stderr, "Cannot open output codec\n");
-        goto end;
+/* It opens an audio input whose format the caller already knows ("aac", "mp3" or "wav").
+ * The demuxer is picked from the hint instead of by probing, and avformat_find_stream_info,
+ * which decodes frames just to learn the parameters, only runs when the header didn't give them */
+static int open_audio_input(AVFormatContext **context, const char *path, const char *format_name) {
+    ConversionStream *stream = conversion_stream_current();
+    AVInputFormat *input_format = hinted_probing || stream ? av_find_input_format(format_name) : NULL;
+    AVIOContext *stream_io = NULL;
+    int ret;
+
+    *context = alloc_cancellable_input();
+    if (!*context) {
+        return AVERROR(ENOMEM);
+    }
+    if (input_format) {
+        (*context)->probesize = HINTED_PROBE_SIZE;
+        (*context)->max_analyze_duration = HINTED_ANALYZE_DURATION;
     }
 
-    /* It copies stream parameters from codec context to output stream */
-    if ((ret = avcodec_parameters_from_context(output_stream->codecpar, output_codec_context)) < 0) {
-        fprintf(stderr, "Failed to copy encoder parameters to output stream\n");
-        goto end;
+    /* A streamed upload is read as it arrives instead of from the file it is saved to */
+    if (stream) {
+        if (!(stream_io = alloc_stream_io(stream, 0))) {
+            avformat_free_context(*context);
+            *context = NULL;
+            return AVERROR(ENOMEM);
+        }
+        (*context)->pb = stream_io;
+        (*context)->flags |= AVFMT_FLAG_CUSTOM_IO;
     }
 
-    /* Set the time base for the output stream */
-    output_stream->time_base = (AVRational){1, output_codec_context->sample_rate};
+    if ((ret = avformat_open_input(context, stream ? NULL : path, input_format, NULL)) < 0) {
+        fprintf(stderr, "Could not open input file '%s'\n", path);
+        free_stream_io(&stream_io);
+        return ret;
+    }
 
-    /* Open the output file */
-    if (!(output_format_context->oformat->flags & AVFMT_NOFILE)) {
-        if ((ret = avio_open(&output_format_context->pb, output_path, AVIO_FLAG_WRITE)) < 0) {
-            fprintf(stderr, "Could not open output file '%s'\n", output_path);
-            goto end;
+    /* The WAV header has everything; raw ADTS and MP3 have it in every frame header */
+    if (input_format && (*context)->nb_streams == 1) {
+        AVCodecParameters *codecpar = (*context)->streams[0]->codecpar;
+        if (codecpar->sample_rate > 0 && codecpar->channels > 0) {
+            return 0;
+        }
+        if ((codecpar->codec_id == AV_CODEC_ID_AAC || codecpar->codec_id == AV_CODEC_ID_MP3) && !stream &&
+            stream_params_from_first_frame(path, codecpar) == 0) {
+            return 0;
         }
     }
 
-    /* Write the header for the output file */
-    if ((ret = avformat_write_header(output_format_context, NULL)) < 0) {
-        fprintf(stderr, "Error occurred when opening output file\n");
-        goto end;
+    /* An upload can't be read twice, so it is probed with the small limits: the first frames are
+     * enough and the output starts without waiting for megabytes of input */
+    if (!stream) {
+        (*context)->probesize = DEFAULT_PROBE_SIZE;
+        (*context)->max_analyze_duration = DEFAULT_ANALYZE_DURATION;
     }
+    TRACE_STAGE(TRACE_STAGE_DECODE, ret = avformat_find_stream_info(*context, NULL));
+    if (ret < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information\n");
+    }
+    return ret;
+}
 
-    /* It allocates the AVPacket structure */
-    packet = av_packet_alloc();
-    if (!packet) {
-        fprintf(stderr, "Could not allocate AVPacket\n");
-        ret = AVERROR(ENOMEM);
-        goto end;
+static void close_audio_input(AVFormatContext **context) {
+    AVIOContext *stream_io = *context && ((*context)->flags & AVFMT_FLAG_CUSTOM_IO) ? (*context)->pb : NULL;
+    avformat_close_input(context);
+    free_stream_io(&stream_io);
+}
+
+/* Returned by encode_wav_file when the file needs FFmpeg's own WAV support */
+#define WAV_FALLBACK 1
+/* Samples per block for encoders that take frames of any size */
+#define WAV_BLOCK_SAMPLES 4096
+
+/* It gives the bit rate the client asked for, or the default of the conversion */
+static int64_t requested_bit_rate(int64_t default_bit_rate) {
+    uint32_t bit_rate = encoder_options_current()->audio_bit_rate;
+    return bit_rate ? bit_rate : default_bit_rate;
+}
+
+/* It gives the VBR quality the client asked for on the LAME scale, -1 for a constant bit rate */
+static int requested_vbr_quality(enum AVCodecID codec_id) {
+    int quality = encoder_options_current()->audio_vbr_quality;
+    return codec_id == AV_CODEC_ID_MP3 && quality > 0 ? quality - 1 : -1;
+}
+
+/* It picks planar float for encoders that take it, so that their input comes from the sample kernels */
+static enum AVSampleFormat encoder_sample_format(const AVCodec *codec) {
+    for (const enum AVSampleFormat *format = codec->sample_fmts; *format != AV_SAMPLE_FMT_NONE; format++) {
+        if (*format == AV_SAMPLE_FMT_FLTP) {
+            return AV_SAMPLE_FMT_FLTP;
+        }
     }
+    return codec->sample_fmts[0];
+}
 
-    /* It read frames from the input file */
-    while (av_read_frame(input_format_context, packet) >= 0) {
-        /* Checks if the packet belongs to the audio stream */
-        if (packet->stream_index == stream_index) {
-            /* It sends the packet to the decoder */
-            ret = avcodec_send_packet(input_codec_context, packet);
-            if (ret < 0) {
-                fprintf(stderr, "Error while sending a packet to the decoder\n");
-                break;
-            }
+/* Converts samples with the kernels of sample_convert.c when the sample rate stays the same and they
+ * handle both formats and layouts, with libswresample otherwise */
+typedef struct {
+    SwrContext *swr_ctx;            /* NULL when the kernels convert */
+    SampleConversion kernels;
+} SampleConverter;
 
-            /* It will allocate a new frame for the decoded data */
-            AVFrame *frame = av_frame_alloc();
-            if (!frame) {
-                fprintf(stderr, "Could not allocate AVFrame\n");
-                ret = AVERROR(ENOMEM);
-                break;
-            }
+static int sample_kernels_enabled = 1;
 
-            /* Receives decoded frames */
-            ret = avcodec_receive_frame(input_codec_context, frame);
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                av_frame_free(&frame);
-                continue;
-            } else if (ret < 0) {
-                fprintf(stderr, "Error while receiving a frame from the decoder\n");
-                av_frame_free(&frame);
-                break;
-            }
+void audio_set_sample_kernels(int enabled) {
+    sample_kernels_enabled = enabled;
+}
 
-            /* Set the presentation timestamp for the frame */
-            frame->pts = frame->best_effort_timestamp;
+/* It maps an FFmpeg sample format to one the kernels handle, -1 for the others */
+static int kernel_sample_format(enum AVSampleFormat sample_fmt, SampleFormat *format) {
+    switch (sample_fmt) {
+        case AV_SAMPLE_FMT_S16: *format = SAMPLE_FORMAT_S16; return 0;
+        case AV_SAMPLE_FMT_S16P: *format = SAMPLE_FORMAT_S16P; return 0;
+        case AV_SAMPLE_FMT_FLT: *format = SAMPLE_FORMAT_FLT; return 0;
+        case AV_SAMPLE_FMT_FLTP: *format = SAMPLE_FORMAT_FLTP; return 0;
+        default: return -1;
+    }
+}
 
-            /* Send the frame to the encoder */
-            ret = avcodec_send_frame(output_codec_context, frame);
-            if (ret < 0) {
-                fprintf(stderr, "Error while sending a frame to the encoder\n");
-                av_frame_free(&frame);
-                break;
-            }
+/* It opens the kernels or a pooled resampler for the conversion. The kernels only mix mono and stereo,
+ * other layouts have to stay the same */
+static int open_sample_converter(SampleConverter *converter,
+                                 int64_t out_layout, enum AVSampleFormat out_fmt, int out_rate,
+                                 int64_t in_layout, enum AVSampleFormat in_fmt, int in_rate) {
+    SampleFormat out_format, in_format;
+    int mixable = (out_layout == AV_CH_LAYOUT_MONO || out_layout == AV_CH_LAYOUT_STEREO) &&
+                  (in_layout == AV_CH_LAYOUT_MONO || in_layout == AV_CH_LAYOUT_STEREO);
+
+    memset(converter, 0, sizeof(*converter));
+    if (sample_kernels_enabled && out_rate == in_rate && (out_layout == in_layout || mixable) &&
+        kernel_sample_format(out_fmt, &out_format) == 0 && kernel_sample_format(in_fmt, &in_format) == 0 &&
+        sample_conversion_init(&converter->kernels, in_format, av_get_channel_layout_nb_channels(in_layout),
+                               out_format, av_get_channel_layout_nb_channels(out_layout)) == 0) {
+        return 0;
+    }
+    return audio_pool_open_resampler(&converter->swr_ctx, out_layout, out_fmt, out_rate, in_layout, in_fmt, in_rate);
+}
 
-            /* It will allocate a new packet for the encoded data */
-            AVPacket *output_packet = av_packet_alloc();
-            if (!output_packet) {
-                fprintf(stderr, "Could not allocate AVPacket\n");
-                av_frame_free(&frame);
-                ret = AVERROR(ENOMEM);
-                break;
-            }
+/* It gives an upper bound for the samples that in_samples more input turns into */
+static int converted_sample_bound(SampleConverter *converter, int in_samples) {
+    return converter->swr_ctx ? swr_get_out_samples(converter->swr_ctx, in_samples) : in_samples;
+}
 
-            /* It receives encoded packets */
-            ret = avcodec_receive_packet(output_codec_context, output_packet);
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                av_packet_free(&output_packet);
-                av_frame_free(&frame);
-                continue;
-            } else if (ret < 0) {
-                fprintf(stderr, "Error while receiving a packet from the encoder\n");
-                av_packet_free(&output_packet);
-                av_frame_free(&frame);
-                break;
-            }
+/* It works like swr_convert, the kernels hold nothing back so draining them without input gives nothing */
+static int convert_samples(SampleConverter *converter, uint8_t **out, int out_count, const uint8_t **in, int in_count) {
+    if (converter->swr_ctx) {
+        return swr_convert(converter->swr_ctx, out, out_count, in, in_count);
+    }
+    int count = !in ? 0 : in_count < out_count ? in_count : out_count;
+    if (sample_conversion_run(&converter->kernels, out, in, count) < 0) {
+        return AVERROR(ENOMEM);
+    }
+    return count;
+}
 
-            /* It will rescale the packet timestamp */
-            av_packet_rescale_ts(output_packet, output_codec_context->time_base, output_stream->time_base);
-            output_packet->stream_index = output_stream->index;
-
-            /* It will write the packet to the output file */
-            ret = av_interleaved_write_frame(output_format_context, output_packet);
-            if (ret < 0) {
-                fprintf(stderr, "Error while writing a packet to the output file\n");
-                av_packet_free(&output_packet);
-                av_frame_free(&frame);
-                break;
-            }
+static void close_sample_converter(SampleConverter *converter) {
+    audio_pool_close_resampler(&converter->swr_ctx);
+    sample_conversion_free(&converter->kernels);
+}
 
-            av_packet_free(&output_packet);
-            av_frame_free(&frame);
-        }
-        av_packet_unref(packet);
+/* It starts measuring the loudness of the decoded samples when the metadata of the result is sent and the
+ * kernels read their format; the meter has no channels otherwise. As in BS.1770, surround channels count
+ * 1.41 times and the LFE not at all */
+static void open_loudness_meter(LoudnessMeter *meter, int sample_rate, int64_t channel_layout,
+                                enum AVSampleFormat sample_fmt) {
+    double weights[SAMPLE_CONVERT_MAX_CHANNELS];
+    int channels = av_get_channel_layout_nb_channels(channel_layout);
+    SampleFormat format;
+
+    memset(meter, 0, sizeof(*meter));
+    if (!result_metadata_current() || kernel_sample_format(sample_fmt, &format) < 0 ||
+        channels < 1 || channels > SAMPLE_CONVERT_MAX_CHANNELS) {
+        return;
+    }
+    for (int i = 0; i < channels; i++) {
+        uint64_t channel = av_channel_layout_extract_channel(channel_layout, i);
+        weights[i] = channel == AV_CH_LOW_FREQUENCY ? 0.0 :
+                     channel & (AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT | AV_CH_BACK_LEFT | AV_CH_BACK_RIGHT) ? 1.41 : 1.0;
+    }
+    loudness_meter_init(meter, sample_rate, channels, weights, format);
+}
+
+/* It adds samples to the measurement. Running out of memory only ends the measurement, not the conversion */
+static void measure_loudness(LoudnessMeter *meter, const uint8_t *const *data, int samples) {
+    int ret;
+    if (meter->channels == 0) {
+        return;
+    }
+    TRACE_STAGE(TRACE_STAGE_ANALYZE, ret = loudness_meter_add(meter, data, samples));
+    if (ret < 0) {
+        loudness_meter_free(meter);
+        memset(meter, 0, sizeof(*meter));
     }
+}
 
-    /* It flushes the encoder */
-    ret = avcodec_send_frame(output_codec_context, NULL);
-    while (ret >= 0) {
-        AVPacket *output_packet = av_packet_alloc();
-        if (!output_packet) {
-            fprintf(stderr, "Could not allocate AVPacket\n");
-            ret = AVERROR(ENOMEM);
-            break;
-        }
+/* It hands the measurement of a finished conversion to the metadata of the result */
+static void publish_loudness(const LoudnessMeter *meter) {
+    ResultMetadata *metadata = result_metadata_current();
+    LoudnessResult result;
+    if (!metadata || meter->channels == 0) {
+        return;
+    }
+    loudness_meter_result(meter, &result);
+    metadata->flags |= RESULT_METADATA_LOUDNESS;
+    metadata->duration_seconds = result.duration_seconds;
+    metadata->integrated_lufs = result.integrated_lufs;
+    metadata->true_peak_dbtp = result.true_peak_dbtp;
+}
 
-        ret = avcodec_receive_packet(output_codec_context, output_packet);
-        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
-            av_packet_free(&output_packet);
-            break;
+/* It maps the sample layout of a WAV file to the FFmpeg sample format,
+ * 24-bit samples have no FFmpeg equivalent and are left to the demuxer */
+static enum AVSampleFormat wav_sample_format(const WavReader *wav) {
+    if (wav->sample_type == WAV_SAMPLE_FLOAT) {
+        return wav->bits_per_sample == 32 ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_DBL;
+    }
+    switch (wav->bits_per_sample) {
+        case 8:
+            return AV_SAMPLE_FMT_U8;
+        case 16:
+            return AV_SAMPLE_FMT_S16;
+        case 32:
+            return AV_SAMPLE_FMT_S32;
+        default:
+            return AV_SAMPLE_FMT_NONE;
+    }
+}
+
+/* It writes every packet the encoder has ready to the output file */
+static int write_encoded_packets(AVCodecContext *codec_context, AVFormatContext *format_context, AVStream *stream,
+                                 AVPacket *packet) {
+    int ret;
+    while (1) {
+        TRACE_STAGE(TRACE_STAGE_ENCODE, ret = avcodec_receive_packet(codec_context, packet));
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return 0;
         } else if (ret < 0) {
             fprintf(stderr, "Error while receiving a packet from the encoder\n");
-            av_packet_free(&output_packet);
-            break;
+            return ret;
         }
 
-        /* It rescales the packet timestamp */
-        av_packet_rescale_ts(output_packet, output_codec_context->time_base, output_stream->time_base);
-        output_packet->stream_index = output_stream->index;
+        av_packet_rescale_ts(packet, codec_context->time_base, stream->time_base);
+        packet->stream_index = stream->index;
 
-        /* It will write the packet to the output file */
-        ret = av_interleaved_write_frame(output_format_context, output_packet);
+        /* The muxer takes over the packet data, so the packet can be reused */
+        TRACE_STAGE(TRACE_STAGE_MUX, ret = av_interleaved_write_frame(format_context, packet));
         if (ret < 0) {
             fprintf(stderr, "Error while writing a packet to the output file\n");
-            av_packet_free(&output_packet);
-            break;
+            return ret;
         }
-
-        av_packet_free(&output_packet);
     }
+}
 
-    /* It will write the trailer for the output file */
-    av_write_trailer(output_format_context);
+/* Long WAV files are cut into segments of about this length, which are encoded in parallel */
+#define SEGMENT_SECONDS 30
+/* Encoder frames fed in front of a segment, so the encoder state at the seam is close to that of a single pass */
+#define SEGMENT_PRIMING_FRAMES 4
+/* Encoder frames fed past the end of a segment on top of the encoder delay, for the transform overlap */
+#define SEGMENT_LOOKAHEAD_FRAMES 2
+
+typedef struct {
+    int64_t start;                  /* first sample */
+    int64_t end;                    /* one past the last sample */
+    AVPacket **packets;             /* kept until the segments before this one are written */
+    int packet_count;
+    int packet_capacity;
+    int ret;
+    int done;
+} WavSegment;
+
+typedef struct {
+    const WavReader *wav;
+    enum AVSampleFormat input_sample_fmt;
+    int64_t channel_layout;
+    const AVCodec *codec;
+    int64_t bit_rate;
+    int vbr_quality;
+    int frame_samples;
+    int64_t delay;                  /* encoder delay in samples, the same for every segment */
+    WavSegment *segments;
+    int segment_count;
+    atomic_int next_segment;
+    atomic_int failed;
+    CancelToken *token;
+    TraceContext trace;
+    CostClass job_class;            /* the helpers' slots are lent to it */
+    pthread_mutex_t lock;
+    pthread_cond_t segment_done;
+    AVFormatContext *output_format_context;
+    AVStream *output_stream;
+} SegmentedEncode;
+
+/* It decides in how many segments a WAV file is encoded, 1 when it is too short to be worth it */
+static int wav_segment_count(const WavReader *wav, int frame_samples) {
+    if (frame_samples <= 0 || sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        return 1;
+    }
+    int64_t count = (int64_t)wav->frames / ((int64_t)SEGMENT_SECONDS * wav->sample_rate);
+    return count < 2 ? 1 : count > INT_MAX ? INT_MAX : (int)count;
+}
 
-    end:
-    /* Free the memory */
-    av_packet_free(&packet);
-    avcodec_free_context(&input_codec_context);
-    avcodec_free_context(&output_codec_context);
-    /* Close the input and output file */
-    avformat_close_input(&input_format_context);
-    if (output_format_context && !(output_format_context->oformat->flags & AVFMT_NOFILE))
-        avio_closep(&output_format_context->pb);
-    avformat_free_context(output_format_context);
+/* It opens the encoder of a segment after the first. An MP3 frame can borrow bits from the frames
+ * before it, which after a seam belong to another encoder, so these segments don't use the bit reservoir */
+static int open_segment_encoder(SegmentedEncode *job, AVCodecContext **context) {
+    AVCodecContext *encoder = avcodec_alloc_context3(job->codec);
+    if (!encoder) {
+        return AVERROR(ENOMEM);
+    }
+    encoder->channels = job->wav->channels;
+    encoder->channel_layout = job->channel_layout;
+    encoder->sample_rate = job->wav->sample_rate;
+    encoder->sample_fmt = encoder_sample_format(job->codec);
+    encoder->bit_rate = job->bit_rate;
+    encoder->time_base = (AVRational){1, job->wav->sample_rate};
+    if (job->vbr_quality >= 0) {
+        encoder->flags |= AV_CODEC_FLAG_QSCALE;
+        encoder->global_quality = job->vbr_quality * FF_QP2LAMBDA;
+    }
+
+    AVDictionary *options = NULL;
+    if (job->codec->id == AV_CODEC_ID_MP3) {
+        av_dict_set(&options, "reservoir", "0", 0);
+    }
+    int ret = avcodec_open2(encoder, job->codec, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot open output codec\n");
+        avcodec_free_context(&encoder);
+        return ret;
+    }
+    *context = encoder;
+    return 0;
+}
 
-    /* It will print the error message if an error exists */
-    if (ret < 0 && ret != AVERROR_EOF) {
-        fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
-        exit(1);
+/* It hands one packet of a segment to the muxer */
+static int write_segment_packet(SegmentedEncode *job, AVPacket *packet) {
+    int ret;
+    av_packet_rescale_ts(packet, (AVRational){1, job->wav->sample_rate}, job->output_stream->time_base);
+    packet->stream_index = job->output_stream->index;
+    TRACE_STAGE(TRACE_STAGE_MUX, ret = av_interleaved_write_frame(job->output_format_context, packet));
+    if (ret < 0) {
+        fprintf(stderr, "Error while writing a packet to the output file\n");
     }
+    return ret;
 }
 
+/* It takes the packets the encoder has ready and keeps those inside [keep_from, keep_until),
+ * either writing them right away or holding them in the segment */
+static int keep_segment_packets(SegmentedEncode *job, WavSegment *segment, AVCodecContext *encoder, AVPacket *packet,
+                                int64_t keep_from, int64_t keep_until, int write_directly) {
+    int ret;
+    while (1) {
+        TRACE_STAGE(TRACE_STAGE_ENCODE, ret = avcodec_receive_packet(encoder, packet));
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return 0;
+        } else if (ret < 0) {
+            fprintf(stderr, "Error while receiving a packet from the encoder\n");
+            return ret;
+        }
 
-/* Function to convert from AAC format to WAV format */
-void convert_aac_to_wav(const char *input_path, const char *output_path) {
-    /* Pointers declaration for format and codec contexts, streams, packets, frames, and the resampler context */
-    AVFormatContext *input_format_context = NULL;
-    AVFormatContext *output_format_context = NULL;
-    AVCodecContext *input_codec_context = NULL;
-    AVCodecContext *output_codec_context = NULL;
-    AVStream *input_stream = NULL;
-    AVStream *output_stream = NULL;
-    AVPacket *packet = NULL;
+        if (packet->pts < keep_from || packet->pts >= keep_until) {
+            av_packet_unref(packet);
+            continue;
+        }
+        if (write_directly) {
+            if ((ret = write_segment_packet(job, packet)) < 0) {
+                return ret;
+            }
+            continue;
+        }
+
+        if (segment->packet_count == segment->packet_capacity) {
+            int capacity = segment->packet_capacity ? segment->packet_capacity * 2 : 256;
+            AVPacket **packets = realloc(segment->packets, capacity * sizeof(AVPacket *));
+            if (!packets) {
+                av_packet_unref(packet);
+                return AVERROR(ENOMEM);
+            }
+            segment->packets = packets;
+            segment->packet_capacity = capacity;
+        }
+        AVPacket *kept = av_packet_alloc();
+        if (!kept) {
+            av_packet_unref(packet);
+            return AVERROR(ENOMEM);
+        }
+        av_packet_move_ref(kept, packet);
+        segment->packets[segment->packet_count++] = kept;
+    }
+}
+
+/* It encodes one segment. Segments start on encoder frame boundaries and the frames carry their sample
+ * position as pts, so the packets of every segment fall on the grid of a single pass: the packets of the
+ * priming and lookahead frames are the ones outside the segment and are dropped. The encoder delay and
+ * the trailing padding are those of the first and the last segment, as in a single pass. */
+static int encode_segment(SegmentedEncode *job, int index, AVCodecContext *encoder) {
+    WavSegment *segment = &job->segments[index];
+    const WavReader *wav = job->wav;
+    int first = index == 0;
+    int last = index == job->segment_count - 1;
+    int64_t frame_samples = job->frame_samples;
+    int64_t lookahead = (SEGMENT_LOOKAHEAD_FRAMES + (job->delay + frame_samples - 1) / frame_samples) * frame_samples;
+    int64_t position = first ? 0 : segment->start - SEGMENT_PRIMING_FRAMES * frame_samples;
+    int64_t feed_end = last || segment->end + lookahead > (int64_t)wav->frames ? (int64_t)wav->frames
+                                                                                : segment->end + lookahead;
+    int64_t keep_from = first ? INT64_MIN : segment->start - job->delay;
+    int64_t keep_until = last ? INT64_MAX : segment->end - job->delay;
+    SampleConverter converter;
     AVFrame *frame = NULL;
-    SwrContext *swr_ctx = NULL;
+    AVPacket *packet = NULL;
     int ret;
 
-    /* It will try to open the source (input) file and
-     * in case when it's an error in opening the file it will display this message,
-     * then it will exit with an error status */
-    if ((ret = avformat_open_input(&input_format_context, input_path, NULL, NULL)) < 0) {
-        fprintf(stderr, "Could not open input file '%s'\n", input_path);
-        exit(1);
+    if ((ret = open_sample_converter(&converter,
+                                     job->channel_layout, encoder->sample_fmt, wav->sample_rate,
+                                     job->channel_layout, job->input_sample_fmt, wav->sample_rate)) < 0) {
+        fprintf(stderr, "Could not allocate or initialize the resampler context\n");
+        goto end;
     }
 
-    /* This retrieve stream information from the input file and will treat the error case */
-    if ((ret = avformat_find_stream_info(input_format_context, NULL)) < 0) {
-        fprintf(stderr, "Failed to retrieve input stream information\n");
+    frame = av_frame_alloc();
+    packet = av_packet_alloc();
+    if (!frame || !packet) {
+        fprintf(stderr, "Could not allocate AVFrame or AVPacket\n");
+        ret = AVERROR(ENOMEM);
         goto end;
     }
-
-    /* It will allocate the output format context and will treat the error case */
-    avformat_alloc_output_context2(&output_format_context, NULL, NULL, output_path);
-    if (!output_format_context) {
-        fprintf(stderr, "Could not create output context\n");
-        ret = AVERROR_UNKNOWN;
+    frame->nb_samples = job->frame_samples;
+    frame->format = encoder->sample_fmt;
+    frame->channel_layout = job->channel_layout;
+    frame->sample_rate = wav->sample_rate;
+    if ((ret = av_frame_get_buffer(frame, 0)) < 0) {
+        fprintf(stderr, "Could not allocate buffer for the audio frame\n");
         goto end;
     }
 
-    /* Find the best stream in the source (input) file and will treat the error case */
-    int stream_index = av_find_best_stream(input_format_context, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-    if (stream_index < 0) {
-        fprintf(stderr, "Could not find %s stream in input file '%s'\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO), input_path);
-        ret = AVERROR(EINVAL);
-        goto end;
+    while (position < feed_end) {
+        /* It gives up when the job was cancelled or another segment failed */
+        if (cancel_requested() || atomic_load(&job->failed)) {
+            ret = AVERROR_EXIT;
+            goto end;
+        }
+
+        int count = feed_end - position < frame_samples ? (int)(feed_end - position) : (int)frame_samples;
+        const uint8_t *source = wav->data + position * wav->block_align;
+        if ((ret = av_frame_make_writable(frame)) < 0) {
+            fprintf(stderr, "Could not make the audio frame writable\n");
+            goto end;
+        }
+
+        TRACE_STAGE(TRACE_STAGE_RESAMPLE, ret = convert_samples(&converter, frame->data, count, &source, count));
+        if (ret < 0) {
+            fprintf(stderr, "Error while resampling\n");
+            goto end;
+        }
+        frame->nb_samples = ret;
+        frame->pts = position;
+        position += count;
+
+        TRACE_STAGE(TRACE_STAGE_ENCODE, ret = avcodec_send_frame(encoder, frame));
+        if (ret < 0) {
+            fprintf(stderr, "Error while sending a frame to the encoder\n");
+            goto end;
+        }
+        if ((ret = keep_segment_packets(job, segment, encoder, packet, keep_from, keep_until, first)) < 0) {
+            goto end;
+        }
     }
 
-    /* Get the input stream and find the decoder for the stream */
-    input_stream = input_format_context->streams[stream_index];
-    AVCodec *input_codec = avcodec_find_decoder(input_stream->codecpar->codec_id);
-    if (!input_codec) {
-        fprintf(stderr, "Failed to find %s codec\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        ret = AVERROR(EINVAL);
-        goto end;
+    /* The flush gives the last packets of the segment; after the lookahead they are all dropped */
+    TRACE_STAGE(TRACE_STAGE_ENCODE, ret = avcodec_send_frame(encoder, NULL));
+    if (ret >= 0) {
+        ret = keep_segment_packets(job, segment, encoder, packet, keep_from, keep_until, first);
     }
 
-    /* It will allocate the codec context for the decoder */
-    input_codec_context = avcodec_alloc_context3(input_codec);
-    if (!input_codec_context) {
-        fprintf(stderr, "Failed to allocate the %s codec context\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        ret = AVERROR(ENOMEM);
-        goto end;
+    end:
+    close_sample_converter(&converter);
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    return ret;
+}
+
+/* It claims the next segment nobody is encoding yet and encodes it; returns 0 when none are left */
+static int encode_next_segment(SegmentedEncode *job) {
+    int index = atomic_fetch_add(&job->next_segment, 1);
+    if (index >= job->segment_count) {
+        return 0;
     }
 
-    /* It will copy codec parameters from input stream to codec context */
-    if ((ret = avcodec_parameters_to_context(input_codec_context, input_stream->codecpar)) < 0) {
-        fprintf(stderr, "Failed to copy %s codec parameters to decoder context\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        goto end;
+    AVCodecContext *encoder = NULL;
+    TraceSpan span = trace_span_begin("encode_segment");
+    trace_span_set_arg(&span, "segment", index);
+    int ret = open_segment_encoder(job, &encoder);
+    if (ret >= 0) {
+        ret = encode_segment(job, index, encoder);
     }
+    avcodec_free_context(&encoder);
+    trace_span_end(&span);
 
-    /* Opens the codec */
-    if ((ret = avcodec_open2(input_codec_context, input_codec, NULL)) < 0) {
-        fprintf(stderr, "Failed to open %s codec\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
+    if (ret < 0) {
+        atomic_store(&job->failed, 1);
+    }
+    pthread_mutex_lock(&job->lock);
+    job->segments[index].ret = ret;
+    job->segments[index].done = 1;
+    pthread_cond_broadcast(&job->segment_done);
+    pthread_mutex_unlock(&job->lock);
+    return 1;
+}
+
+/* A helper runs on a worker slot lent by the scheduler and gives it back as soon as no segment is left,
+ * or earlier when a queued job needs the slot; the calling thread encodes what the helpers leave */
+static void *segment_worker(void *arg) {
+    SegmentedEncode *job = arg;
+    cancel_set_current(job->token);
+    trace_set_current(job->trace);
+    while (!atomic_load(&job->failed) && !scheduler_workers_wanted() && encode_next_segment(job)) {
+    }
+    trace_clear_current();
+    scheduler_return_workers(job->job_class, 1);
+    return NULL;
+}
+
+/* It measures the samples of a segment, in the order of the file */
+static void measure_segment_loudness(LoudnessMeter *meter, const WavReader *wav, const WavSegment *segment) {
+    for (int64_t position = segment->start; position < segment->end && meter->channels; position += WAV_BLOCK_SAMPLES) {
+        int count = segment->end - position < WAV_BLOCK_SAMPLES ? (int)(segment->end - position) : WAV_BLOCK_SAMPLES;
+        const uint8_t *source = wav->data + position * wav->block_align;
+        measure_loudness(meter, &source, count);
+    }
+}
+
+/* It encodes a long WAV file in segments on the calling thread and helper_count helpers, whose worker
+ * slots the caller borrowed from the scheduler, and writes the packets in order.
+ * The calling thread encodes the first segment with the encoder it already opened, straight into
+ * the muxer, then writes the other segments as they are finished and encodes some itself meanwhile.
+ * It measures the loudness of each segment as it writes it */
+static int encode_wav_segments(const WavReader *wav, enum AVSampleFormat input_sample_fmt, int64_t channel_layout,
+                               AVCodecContext *encoder, int64_t bit_rate, int vbr_quality, int segment_count,
+                               int helper_count, AVFormatContext *output_format_context, AVStream *output_stream,
+                               LoudnessMeter *loudness) {
+    SegmentedEncode job;
+    memset(&job, 0, sizeof(job));
+    job.wav = wav;
+    job.input_sample_fmt = input_sample_fmt;
+    job.channel_layout = channel_layout;
+    job.codec = encoder->codec;
+    job.bit_rate = bit_rate;
+    job.vbr_quality = vbr_quality;
+    job.frame_samples = encoder->frame_size;
+    job.delay = encoder->initial_padding;
+    job.segment_count = segment_count;
+    job.token = cancel_current();
+    job.trace = trace_current();
+    job.job_class = scheduler_current_class();
+    job.output_format_context = output_format_context;
+    job.output_stream = output_stream;
+    atomic_init(&job.next_segment, 1);
+    atomic_init(&job.failed, 0);
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.segment_done, NULL);
+
+    job.segments = calloc(segment_count, sizeof(WavSegment));
+    if (!job.segments) {
+        pthread_mutex_destroy(&job.lock);
+        pthread_cond_destroy(&job.segment_done);
+        scheduler_return_workers(job.job_class, helper_count);
+        return AVERROR(ENOMEM);
+    }
+    int64_t segment_samples = (int64_t)wav->frames / segment_count / job.frame_samples * job.frame_samples;
+    for (int i = 0; i < segment_count; i++) {
+        job.segments[i].start = i * segment_samples;
+        job.segments[i].end = i == segment_count - 1 ? (int64_t)wav->frames : (i + 1) * segment_samples;
+    }
+
+    /* Fewer helpers only make it slower, the slots of those that don't start go back right away */
+    pthread_t *helpers = calloc(helper_count > 0 ? helper_count : 1, sizeof(pthread_t));
+    int helpers_started = 0;
+    while (helpers && helpers_started < helper_count &&
+           pthread_create(&helpers[helpers_started], NULL, segment_worker, &job) == 0) {
+        helpers_started++;
+    }
+    scheduler_return_workers(job.job_class, helper_count - helpers_started);
+
+    int ret = encode_segment(&job, 0, encoder);
+    if (ret >= 0) {
+        measure_segment_loudness(loudness, wav, &job.segments[0]);
+    }
+    for (int next = 1; ret >= 0 && next < segment_count;) {
+        pthread_mutex_lock(&job.lock);
+        int done = job.segments[next].done;
+        pthread_mutex_unlock(&job.lock);
+
+        if (done) {
+            WavSegment *segment = &job.segments[next];
+            ret = segment->ret;
+            for (int i = 0; i < segment->packet_count; i++) {
+                if (ret >= 0) {
+                    ret = write_segment_packet(&job, segment->packets[i]);
+                }
+                av_packet_free(&segment->packets[i]);
+            }
+            segment->packet_count = 0;
+            if (ret >= 0) {
+                measure_segment_loudness(loudness, wav, segment);
+            }
+            next++;
+        } else if (!encode_next_segment(&job)) {
+            /* Every segment is taken, the next one to write is still being encoded by a helper */
+            pthread_mutex_lock(&job.lock);
+            while (!job.segments[next].done) {
+                pthread_cond_wait(&job.segment_done, &job.lock);
+            }
+            pthread_mutex_unlock(&job.lock);
+        }
+    }
+
+    if (ret < 0) {
+        atomic_store(&job.failed, 1);
+    }
+    for (int i = 0; i < helpers_started; i++) {
+        pthread_join(helpers[i], NULL);
+    }
+    /* Segments that stopped because another one failed report that failure, not a cancellation */
+    for (int i = 0; ret == AVERROR_EXIT && !cancel_requested() && i < segment_count; i++) {
+        if (job.segments[i].done && job.segments[i].ret < 0 && job.segments[i].ret != AVERROR_EXIT) {
+            ret = job.segments[i].ret;
+        }
+    }
+    free(helpers);
+    for (int i = 0; i < segment_count; i++) {
+        for (int j = 0; j < job.segments[i].packet_count; j++) {
+            av_packet_free(&job.segments[i].packets[j]);
+        }
+        free(job.segments[i].packets);
+    }
+    free(job.segments);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.segment_done);
+    return ret;
+}
+
+/* It encodes a PCM WAV file without the WAV demuxer and the PCM decoder:
+ * the samples are taken straight from the memory-mapped file, one encoder frame at a time,
+ * and only go through the resampler to get the sample format the encoder wants */
+static int encode_wav_file(const char *input_path, const char *output_path, enum AVCodecID codec_id, int64_t bit_rate) {
+    WavReader wav;
+    AVFormatContext *output_format_context = NULL;
+    AVCodecContext *output_codec_context = NULL;
+    AVStream *output_stream = NULL;
+    AVPacket *packet = NULL;
+    AVFrame *frame = NULL;
+    SampleConverter converter;
+    LoudnessMeter loudness;
+    int ret;
+
+    memset(&converter, 0, sizeof(converter));
+    memset(&loudness, 0, sizeof(loudness));
+    /* Compressed, 24-bit or damaged files go the usual way */
+    if (wav_open(&wav, input_path) != 0) {
+        return WAV_FALLBACK;
+    }
+    enum AVSampleFormat input_sample_fmt = wav_sample_format(&wav);
+    if (input_sample_fmt == AV_SAMPLE_FMT_NONE) {
+        wav_close(&wav);
+        return WAV_FALLBACK;
+    }
+    /* Another sample rate or channel count needs the resampler of the transcode pipeline */
+    const EncoderOptions *options = encoder_options_current();
+    if ((options->audio_sample_rate && (int)options->audio_sample_rate != wav.sample_rate) ||
+        (options->audio_channels && options->audio_channels != wav.channels)) {
+        wav_close(&wav);
+        return WAV_FALLBACK;
+    }
+    int64_t channel_layout = av_get_default_channel_layout(wav.channels);
+    int vbr_quality = requested_vbr_quality(codec_id);
+    bit_rate = requested_bit_rate(bit_rate);
+    open_loudness_meter(&loudness, wav.sample_rate, channel_layout, input_sample_fmt);
+
+    avformat_alloc_output_context2(&output_format_context, NULL, NULL, output_path);
+    if (!output_format_context) {
+        fprintf(stderr, "Could not create output context\n");
+        ret = AVERROR_UNKNOWN;
         goto end;
     }
 
-    /* It will find the encoder for the output stream  for the required WAV format */
-    AVCodec *output_codec = avcodec_find_encoder(AV_CODEC_ID_PCM_S16LE);
+    AVCodec *output_codec = avcodec_find_encoder(codec_id);
     if (!output_codec) {
         fprintf(stderr, "Necessary encoder not found\n");
         ret = AVERROR_INVALIDDATA;
         goto end;
     }
 
-    /* It creates a new stream for the output file */
     output_stream = avformat_new_stream(output_format_context, NULL);
     if (!output_stream) {
         fprintf(stderr, "Failed allocating output stream\n");
@@ -371,37 +857,21 @@ void convert_aac_to_wav(const char *input_path, const char *output_path) {
         goto end;
     }
 
-    /* It will allocate the codec context for the encoder */
-    output_codec_context = avcodec_alloc_context3(output_codec);
-    if (!output_codec_context) {
-        fprintf(stderr, "Failed to allocate the encoder context\n");
-        ret = AVERROR(ENOMEM);
-        goto end;
-    }
-
-    /* Set the codec parameters for the output stream */
-    output_codec_context->channels = input_codec_context->channels;
-    output_codec_context->channel_layout = av_get_default_channel_layout(input_codec_context->channels);
-    output_codec_context->sample_rate = input_codec_context->sample_rate;
-    output_codec_context->sample_fmt = output_codec->sample_fmts[0];
-    output_codec_context->bit_rate = 16 * output_codec_context->sample_rate * output_codec_context->channels;
-
-    /* Opens the output codec */
-    if ((ret = avcodec_open2(output_codec_context, output_codec, NULL)) < 0) {
+    /* The stream parameters come from the fmt chunk instead of a probe */
+    if ((ret = audio_pool_open_encoder(&output_codec_context, output_codec, wav.sample_rate,
+                                       channel_layout, encoder_sample_format(output_codec), bit_rate,
+                                       vbr_quality)) < 0) {
         fprintf(stderr, "Cannot open output codec\n");
         goto end;
     }
 
-    /* It copies the stream parameters from codec context to the output stream */
     if ((ret = avcodec_parameters_from_context(output_stream->codecpar, output_codec_context)) < 0) {
         fprintf(stderr, "Failed to copy encoder parameters to output stream\n");
         goto end;
     }
 
-    /* It will set the time base for the output stream */
-    output_stream->time_base = (AVRational){1, output_codec_context->sample_rate};
+    output_stream->time_base = (AVRational){1, wav.sample_rate};
 
-    /* Opens the output file */
     if (!(output_format_context->oformat->flags & AVFMT_NOFILE)) {
         if ((ret = avio_open(&output_format_context->pb, output_path, AVIO_FLAG_WRITE)) < 0) {
             fprintf(stderr, "Could not open output file '%s'\n", output_path);
@@ -409,504 +879,554 @@ void convert_aac_to_wav(const char *input_path, const char *output_path) {
         }
     }
 
-    /* Write the header for the output file */
     if ((ret = avformat_write_header(output_format_context, NULL)) < 0) {
         fprintf(stderr, "Error occurred when opening output file\n");
         goto end;
     }
 
-    /* It allocates the AVPacket and AVFrame structures */
-    packet = av_packet_alloc();
-    if (!packet) {
-        fprintf(stderr, "Could not allocate AVPacket\n");
-        ret = AVERROR(ENOMEM);
+    /* Long files are cut into segments that are encoded in parallel, on this thread and on worker slots
+     * the scheduler has idle; without any, segments would only cost the seams */
+    int segment_count = wav_segment_count(&wav, output_codec_context->frame_size);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int helpers_wanted = (cores < segment_count ? (int)cores : segment_count) - 1;
+    int helper_count = segment_count > 1 ? scheduler_borrow_workers(scheduler_current_class(), helpers_wanted) : 0;
+    if (helper_count > 0) {
+        ret = encode_wav_segments(&wav, input_sample_fmt, channel_layout, output_codec_context, bit_rate, vbr_quality,
+                                  segment_count, helper_count, output_format_context, output_stream, &loudness);
+        if (ret >= 0) {
+            ret = av_write_trailer(output_format_context);
+        }
         goto end;
     }
 
-    frame = av_frame_alloc();
-    if (!frame) {
-        fprintf(stderr, "Could not allocate AVFrame\n");
-        ret = AVERROR(ENOMEM);
+    /* The sample rate stays the same, so only the sample format is converted */
+    if ((ret = open_sample_converter(&converter,
+                                     channel_layout, output_codec_context->sample_fmt, wav.sample_rate,
+                                     channel_layout, input_sample_fmt, wav.sample_rate)) < 0) {
+        fprintf(stderr, "Could not allocate or initialize the resampler context\n");
         goto end;
     }
 
-    /* It will initialize the context for the resampler */
-    swr_ctx = swr_alloc_set_opts(NULL,
-                                 av_get_default_channel_layout(output_codec_context->channels), output_codec_context->sample_fmt, output_codec_context->sample_rate,
-                                 av_get_default_channel_layout(input_codec_context->channels), input_codec_context->sample_fmt, input_codec_context->sample_rate,
-                                 0, NULL);
-    if (!swr_ctx || swr_init(swr_ctx) < 0) {
-        fprintf(stderr, "Could not allocate or initialize the resampler context\n");
+    /* Every frame but the last has exactly the size the encoder expects */
+    int frame_samples = output_codec_context->frame_size > 0 ? output_codec_context->frame_size : WAV_BLOCK_SAMPLES;
+    frame = av_frame_alloc();
+    packet = av_packet_alloc();
+    if (!frame || !packet) {
+        fprintf(stderr, "Could not allocate AVFrame or AVPacket\n");
         ret = AVERROR(ENOMEM);
         goto end;
     }
-
-    /* It will ead frames from the source (input) file */
-    while (av_read_frame(input_format_context, packet) >= 0) {
-        /* It will check if the packet belongs to the audio stream */
-        if (packet->stream_index == stream_index) {
-            /* Send the packet to the decoder */
-            ret = avcodec_send_packet(input_codec_context, packet);
-            if (ret < 0) {
-                fprintf(stderr, "Error while sending a packet to the decoder\n");
-                break;
-            }
-
-            /* Receive decoded frames */
-            while (ret >= 0) {
-                ret = avcodec_receive_frame(input_codec_context, frame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    break;
-                } else if (ret < 0) {
-                    fprintf(stderr, "Error while receiving a frame from the decoder\n");
-                    goto end;
-                }
-
-                /* Allocate a new frame for the resampled data */
-                AVFrame *resampled_frame = av_frame_alloc();
-                if (!resampled_frame) {
-                    fprintf(stderr, "Could not allocate resampled AVFrame\n");
-                    ret = AVERROR(ENOMEM);
-                    goto end;
-                }
-
-                /* It Sets the parameters for the resampled frame */
-                resampled_frame->channel_layout = output_codec_context->channel_layout;
-                resampled_frame->format = output_codec_context->sample_fmt;
-                resampled_frame->sample_rate = output_codec_context->sample_rate;
-                resampled_frame->nb_samples = frame->nb_samples;
-
-                /* Allocate buffer for the resampled frame */
-                if ((ret = av_frame_get_buffer(resampled_frame, 0)) < 0) {
-                    fprintf(stderr, "Could not allocate buffer for resampled frame\n");
-                    av_frame_free(&resampled_frame);
-                    goto end;
-                }
-
-                /* Resample the audio data */
-                ret = swr_convert(swr_ctx,
-                                  resampled_frame->data, resampled_frame->nb_samples,
-                                  (const uint8_t **)frame->data, frame->nb_samples);
-                if (ret < 0) {
-                    fprintf(stderr, "Error while resampling\n");
-                    av_frame_free(&resampled_frame);
-                    goto end;
-                }
-
-                /* It sets the presentation timestamp for the resampled frame */
-                resampled_frame->pts = av_rescale_q(frame->pts, input_codec_context->time_base, output_codec_context->time_base);
-
-                /* It will send the resampled frame to the encoder */
-                ret = avcodec_send_frame(output_codec_context, resampled_frame);
-                if (ret < 0) {
-                    fprintf(stderr, "Error while sending a frame to the encoder\n");
-                    av_frame_free(&resampled_frame);
-                    goto end;
-                }
-
-                /* Receive encoded packets */
-                while (ret >= 0) {
-                    AVPacket *output_packet = av_packet_alloc();
-                    if (!output_packet) {
-                        fprintf(stderr, "Could not allocate AVPacket\n");
-                        ret = AVERROR(ENOMEM);
-                        av_frame_free(&resampled_frame);
-                        goto end;
-                    }
-
-                    ret = avcodec_receive_packet(output_codec_context, output_packet);
-                    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                        av_packet_free(&output_packet);
-                        break;
-                    } else if (ret < 0) {
-                        fprintf(stderr, "Error while receiving a packet from the encoder\n");
-                        av_packet_free(&output_packet);
-                        av_frame_free(&resampled_frame);
-                        goto end;
-                    }
-
-                    /* Rescale the packet timestamp */
-                    av_packet_rescale_ts(output_packet, output_codec_context->time_base, output_stream->time_base);
-                    output_packet->stream_index = output_stream->index;
-
-                    /* Writes the packet to the output file */
-                    ret = av_interleaved_write_frame(output_format_context, output_packet);
-                    if (ret < 0) {
-                        fprintf(stderr, "Error while writing a packet to the output file\n");
-                        av_packet_free(&output_packet);
-                        av_frame_free(&resampled_frame);
-                        goto end;
-                    }
-
-                    av_packet_free(&output_packet);
-                }
-
-                av_frame_free(&resampled_frame);
-            }
-        }
-        av_packet_unref(packet);
+    frame->nb_samples = frame_samples;
+    frame->format = output_codec_context->sample_fmt;
+    frame->channel_layout = channel_layout;
+    frame->sample_rate = wav.sample_rate;
+    if ((ret = av_frame_get_buffer(frame, 0)) < 0) {
+        fprintf(stderr, "Could not allocate buffer for the audio frame\n");
+        goto end;
     }
 
-    /* It will flush the encoder */
-    ret = avcodec_send_frame(output_codec_context, NULL);
-    while (ret >= 0) {
-        AVPacket *output_packet = av_packet_alloc();
-        if (!output_packet) {
-            fprintf(stderr, "Could not allocate AVPacket\n");
-            ret = AVERROR(ENOMEM);
-            break;
-        }
+    int64_t position = 0;
+    while (position < (int64_t)wav.frames && !cancel_requested()) {
+        int count = wav.frames - position < (size_t)frame_samples ? (int)(wav.frames - position) : frame_samples;
+        const uint8_t *source = wav.data + position * wav.block_align;
 
-        ret = avcodec_receive_packet(output_codec_context, output_packet);
-        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
-            av_packet_free(&output_packet);
-            break;
-        } else if (ret < 0) {
-            fprintf(stderr, "Error while receiving a packet from the encoder\n");
-            av_packet_free(&output_packet);
-            break;
+        /* The encoder may still hold a reference to the previous block */
+        if ((ret = av_frame_make_writable(frame)) < 0) {
+            fprintf(stderr, "Could not make the audio frame writable\n");
+            goto end;
         }
 
-        /* It will rescale the packet timestamp */
-        av_packet_rescale_ts(output_packet, output_codec_context->time_base, output_stream->time_base);
-        output_packet->stream_index = output_stream->index;
+        TRACE_STAGE(TRACE_STAGE_RESAMPLE, ret = convert_samples(&converter, frame->data, count, &source, count));
+        if (ret < 0) {
+            fprintf(stderr, "Error while resampling\n");
+            goto end;
+        }
+        frame->nb_samples = ret;
+        frame->pts = position;
+        position += count;
+        measure_loudness(&loudness, &source, count);
 
-        /* It writes the packet to the output file */
-        ret = av_interleaved_write_frame(output_format_context, output_packet);
+        TRACE_STAGE(TRACE_STAGE_ENCODE, ret = avcodec_send_frame(output_codec_context, frame));
         if (ret < 0) {
-            fprintf(stderr, "Error while writing a packet to the output file\n");
-            av_packet_free(&output_packet);
-            break;
+            fprintf(stderr, "Error while sending a frame to the encoder\n");
+            goto end;
+        }
+        if ((ret = write_encoded_packets(output_codec_context, output_format_context, output_stream, packet)) < 0) {
+            goto end;
         }
+    }
 
-        av_packet_free(&output_packet);
+    /* It stops without flushing when the job was cancelled or ran out of time */
+    if (cancel_requested()) {
+        ret = AVERROR_EXIT;
+        goto end;
     }
 
-    /* It writes the trailer for the output file */
-    av_write_trailer(output_format_context);
+    /* It flushes the encoder */
+    TRACE_STAGE(TRACE_STAGE_ENCODE, ret = avcodec_send_frame(output_codec_context, NULL));
+    if (ret >= 0) {
+        ret = write_encoded_packets(output_codec_context, output_format_context, output_stream, packet);
+    }
+    if (ret >= 0) {
+        ret = av_write_trailer(output_format_context);
+    }
 
     end:
-    /* It will free the memory then it will close the input file */
-    swr_free(&swr_ctx);
+    close_sample_converter(&converter);
     av_packet_free(&packet);
     av_frame_free(&frame);
-    avcodec_free_context(&input_codec_context);
-    avcodec_free_context(&output_codec_context);
-    avformat_close_input(&input_format_context);
-    /* Close the output file if it's necessary */
+    audio_pool_close_codec(&output_codec_context);
     if (output_format_context && !(output_format_context->oformat->flags & AVFMT_NOFILE))
         avio_closep(&output_format_context->pb);
     avformat_free_context(output_format_context);
+    wav_close(&wav);
 
-    /* It will print the error message if an error exists */
-    if (ret < 0 && ret != AVERROR_EOF) {
+    /* A partial output must not look like a result */
+    if (ret == AVERROR_EXIT) {
+        fprintf(stderr, "Conversion of '%s' was cancelled\n", input_path);
+    } else if (ret < 0) {
         fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
-        exit(1);
     }
+    if (ret < 0) {
+        unlink(output_path);
+    } else {
+        publish_loudness(&loudness);
+    }
+    loudness_meter_free(&loudness);
+    return ret < 0 ? ret : 0;
 }
 
-
-void convert_mp3_to_wav(const char *input_path, const char *output_path) {
-    AVFormatContext *input_format_context = NULL;
-    AVFormatContext *output_format_context = NULL;
-    AVCodecContext *input_codec_context = NULL;
-    AVCodecContext *output_codec_context = NULL;
-    AVStream *input_stream = NULL;
-    AVStream *output_stream = NULL;
-    AVPacket *packet = NULL;
-    AVFrame *frame = NULL;
-    SwrContext *swr_ctx = NULL;
-    int ret;
-
-    if ((ret = avformat_open_input(&input_format_context, input_path, NULL, NULL)) < 0) {
-        fprintf(stderr, "Could not open input file '%s'\n", input_path);
-        exit(1);
+/* Packets or frames in flight between two stages of a transcode */
+#define PIPELINE_DEPTH 8
+
+struct AudioPipeline;
+
+/* Connects two stages of a transcode. Its packets or frames are allocated once and go around:
+ * the producer fills spare ones and queues them as filled, the consumer empties them and queues them as spare.
+ * A consumer without a thread of its own takes each item on the producer's thread instead */
+typedef struct PipelineLink {
+    SpscRing filled;
+    SpscRing spare;
+    void *items[PIPELINE_DEPTH];    /* owned here, whichever ring or stage holds them at the moment */
+    int holds_packets;
+    int ready;
+    int threaded;                   /* the consumer runs on a worker slot lent by the scheduler */
+    int stopped;                    /* the consumer's thread is done with the link, under handback_lock */
+    const char *stage_name;
+    int (*consume)(struct AudioPipeline *pipeline, void *item);
+    int (*finish)(struct AudioPipeline *pipeline);  /* once the producer is done */
+    struct PipelineLink *output;    /* of the consumer, NULL for the encoder */
+    struct AudioPipeline *pipeline;
+} PipelineLink;
+
+typedef struct AudioPipeline {
+    AVFormatContext *input_format_context;
+    int stream_index;
+    AVCodecContext *decoder;
+    LoudnessMeter loudness;         /* of the decoded frames, in the decode stage */
+    enum AVSampleFormat loudness_sample_fmt;
+    SampleConverter converter;
+    AVFrame *converted;             /* resampler output of one decoded frame */
+    AVAudioFifo *fifo;              /* resampled samples not handed on yet */
+    enum AVSampleFormat output_sample_fmt;
+    int64_t output_layout;
+    int output_sample_rate;
+    int frame_samples;              /* size of the resampled frames, only the last one can be shorter */
+    AVCodecContext *encoder;        /* NULL when the output is a WAV file */
+    AVFormatContext *output_format_context;
+    AVStream *output_stream;
+    WavWriter *wav;
+    PipelineLink packets;           /* demuxer to decoder */
+    PipelineLink decoded;           /* decoder to resampler */
+    PipelineLink resampled;         /* resampler to encoder */
+    AVFrame *decoded_frame;         /* taken from the spare ones, not handed on yet */
+    AVFrame *resampled_frame;
+    AVPacket *encoded_packet;
+    int64_t next_pts;
+    atomic_int error;               /* first error of any stage */
+    CancelToken *token;
+    TraceContext trace;
+    CostClass job_class;            /* the stage threads' slots are lent to it */
+    pthread_mutex_t handback_lock;
+    pthread_cond_t stage_stopped;
+} AudioPipeline;
+
+static void pipeline_link_destroy(PipelineLink *link) {
+    if (!link->ready) {
+        return;
+    }
+    for (int i = 0; i < PIPELINE_DEPTH; i++) {
+        if (link->holds_packets) {
+            AVPacket *packet = link->items[i];
+            av_packet_free(&packet);
+        } else {
+            AVFrame *frame = link->items[i];
+            av_frame_free(&frame);
+        }
     }
+    spsc_ring_destroy(&link->filled);
+    spsc_ring_destroy(&link->spare);
+    link->ready = 0;
+}
 
-    if ((ret = avformat_find_stream_info(input_format_context, NULL)) < 0) {
-        fprintf(stderr, "Failed to retrieve input stream information\n");
-        goto end;
+/* It allocates the packets or frames of a link and queues all of them as spare */
+static int pipeline_link_init(PipelineLink *link, int holds_packets) {
+    memset(link, 0, sizeof(*link));
+    if (spsc_ring_init(&link->filled, PIPELINE_DEPTH) < 0) {
+        return AVERROR(ENOMEM);
     }
-
-    avformat_alloc_output_context2(&output_format_context, NULL, NULL, output_path);
-    if (!output_format_context) {
-        fprintf(stderr, "Could not create output context\n");
-        ret = AVERROR_UNKNOWN;
-        goto end;
+    if (spsc_ring_init(&link->spare, PIPELINE_DEPTH) < 0) {
+        spsc_ring_destroy(&link->filled);
+        return AVERROR(ENOMEM);
     }
+    link->holds_packets = holds_packets;
+    link->ready = 1;
 
-    int stream_index = av_find_best_stream(input_format_context, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-    if (stream_index < 0) {
-        fprintf(stderr, "Could not find %s stream in input file '%s'\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO), input_path);
-        ret = AVERROR(EINVAL);
-        goto end;
+    for (int i = 0; i < PIPELINE_DEPTH; i++) {
+        link->items[i] = holds_packets ? (void *)av_packet_alloc() : (void *)av_frame_alloc();
+        if (!link->items[i]) {
+            pipeline_link_destroy(link);
+            return AVERROR(ENOMEM);
+        }
+        spsc_ring_push(&link->spare, link->items[i]);
     }
+    return 0;
+}
 
-    input_stream = input_format_context->streams[stream_index];
-    AVCodec *input_codec = avcodec_find_decoder(input_stream->codecpar->codec_id);
-    if (!input_codec) {
-        fprintf(stderr, "Failed to find %s codec\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        ret = AVERROR(EINVAL);
-        goto end;
-    }
+/* It records the first error and closes every ring, so the stages waiting on one of them stop */
+static void pipeline_fail(AudioPipeline *pipeline, int error) {
+    int expected = 0;
+    atomic_compare_exchange_strong(&pipeline->error, &expected, error);
 
-    input_codec_context = avcodec_alloc_context3(input_codec);
-    if (!input_codec_context) {
-        fprintf(stderr, "Failed to allocate the %s codec context\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        ret = AVERROR(ENOMEM);
-        goto end;
+    PipelineLink *links[] = {&pipeline->packets, &pipeline->decoded, &pipeline->resampled};
+    for (int i = 0; i < 3; i++) {
+        if (links[i]->ready) {
+            spsc_ring_close(&links[i]->filled);
+            spsc_ring_close(&links[i]->spare);
+        }
     }
+}
 
-    if ((ret = avcodec_parameters_to_context(input_codec_context, input_stream->codecpar)) < 0) {
-        fprintf(stderr, "Failed to copy %s codec parameters to decoder context\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        goto end;
-    }
+static int pipeline_failed(AudioPipeline *pipeline) {
+    return atomic_load(&pipeline->error) != 0;
+}
 
-    if ((ret = avcodec_open2(input_codec_context, input_codec, NULL)) < 0) {
-        fprintf(stderr, "Failed to open %s codec\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        goto end;
+/* A stage that is done tells the next one there is nothing more to come; the stages after it
+ * that run on its thread finish right here */
+static void pipeline_stage_done(AudioPipeline *pipeline, PipelineLink *output, int ret) {
+    while (ret >= 0 && output && !output->threaded) {
+        if (pipeline_failed(pipeline)) {
+            return;
+        }
+        ret = output->finish(pipeline);
+        output = output->output;
     }
-
-    AVCodec *output_codec = avcodec_find_encoder(AV_CODEC_ID_PCM_S16LE);
-    if (!output_codec) {
-        fprintf(stderr, "Necessary encoder not found\n");
-        ret = AVERROR_INVALIDDATA;
-        goto end;
+    if (ret < 0) {
+        pipeline_fail(pipeline, ret);
+    } else if (output) {
+        spsc_ring_close(&output->filled);
     }
+}
 
-    output_stream = avformat_new_stream(output_format_context, NULL);
-    if (!output_stream) {
-        fprintf(stderr, "Failed allocating output stream\n");
-        ret = AVERROR_UNKNOWN;
-        goto end;
+/* A queued job needs the slot of the next stage's thread: that thread consumes what is queued up to
+ * the link itself, which marks the end, and stops; from then on the stage runs on this thread */
+static void pipeline_take_back(AudioPipeline *pipeline, PipelineLink *link) {
+    if (spsc_ring_push(&link->filled, link) < 0) {
+        return;
     }
-
-    output_codec_context = avcodec_alloc_context3(output_codec);
-    if (!output_codec_context) {
-        fprintf(stderr, "Failed to allocate the encoder context\n");
-        ret = AVERROR(ENOMEM);
-        goto end;
+    pthread_mutex_lock(&pipeline->handback_lock);
+    while (!link->stopped) {
+        pthread_cond_wait(&pipeline->stage_stopped, &pipeline->handback_lock);
     }
+    pthread_mutex_unlock(&pipeline->handback_lock);
+    link->threaded = 0;
+}
 
-    output_codec_context->channels = input_codec_context->channels;
-    output_codec_context->channel_layout = av_get_default_channel_layout(input_codec_context->channels);
-    output_codec_context->sample_rate = input_codec_context->sample_rate;
-    output_codec_context->sample_fmt = output_codec->sample_fmts[0];
-    output_codec_context->bit_rate = 16 * output_codec_context->sample_rate * output_codec_context->channels;
-
-    if ((ret = avcodec_open2(output_codec_context, output_codec, NULL)) < 0) {
-        fprintf(stderr, "Cannot open output codec\n");
-        goto end;
+/* It hands a filled item on: queued for the next stage's thread, or taken by that stage right away */
+static int pipeline_hand(AudioPipeline *pipeline, PipelineLink *link, void *item) {
+    if (link->threaded && scheduler_workers_wanted()) {
+        pipeline_take_back(pipeline, link);
     }
-
-    if ((ret = avcodec_parameters_from_context(output_stream->codecpar, output_codec_context)) < 0) {
-        fprintf(stderr, "Failed to copy encoder parameters to output stream\n");
-        goto end;
+    if (link->threaded) {
+        return spsc_ring_push(&link->filled, item) < 0 ? AVERROR_EXIT : 0;
     }
-
-    output_stream->time_base = (AVRational){1, output_codec_context->sample_rate};
-
-    if (!(output_format_context->oformat->flags & AVFMT_NOFILE)) {
-        if ((ret = avio_open(&output_format_context->pb, output_path, AVIO_FLAG_WRITE)) < 0) {
-            fprintf(stderr, "Could not open output file '%s'\n", output_path);
-            goto end;
-        }
+    if (pipeline_failed(pipeline)) {
+        spsc_ring_push(&link->spare, item);
+        return AVERROR_EXIT;
     }
+    int ret = link->consume(pipeline, item);
+    spsc_ring_push(&link->spare, item);
+    return ret;
+}
 
-    if ((ret = avformat_write_header(output_format_context, NULL)) < 0) {
-        fprintf(stderr, "Error occurred when opening output file\n");
-        goto end;
+/* It reads the packets of the audio stream and hands them to the decoder */
+static int demux_packets(AudioPipeline *pipeline) {
+    AVPacket *packet = NULL;
+    int ret;
+    while (!pipeline_failed(pipeline)) {
+        if (cancel_requested()) {
+            return AVERROR_EXIT;
+        }
+        if (!packet && !(packet = spsc_ring_pop(&pipeline->packets.spare))) {
+            break;
+        }
+        /* A read error ends a file like its end, but an upload that broke off is no complete input */
+        if ((ret = av_read_frame(pipeline->input_format_context, packet)) < 0) {
+            if (ret != AVERROR_EOF && conversion_stream_current()) {
+                return ret;
+            }
+            break;
+        }
+        if (packet->stream_index != pipeline->stream_index) {
+            av_packet_unref(packet);
+            continue;
+        }
+        ret = pipeline_hand(pipeline, &pipeline->packets, packet);
+        packet = NULL;
+        if (ret < 0) {
+            return ret;
+        }
     }
+    return 0;
+}
 
-    packet = av_packet_alloc();
-    if (!packet) {
-        fprintf(stderr, "Could not allocate AVPacket\n");
-        ret = AVERROR(ENOMEM);
-        goto end;
+/* It hands every frame the decoder has ready to the resampler */
+static int pass_decoded_frames(AudioPipeline *pipeline, AVFrame **frame) {
+    int ret;
+    while (1) {
+        if (!*frame && !(*frame = spsc_ring_pop(&pipeline->decoded.spare))) {
+            return AVERROR_EXIT;
+        }
+        TRACE_STAGE(TRACE_STAGE_DECODE, ret = avcodec_receive_frame(pipeline->decoder, *frame));
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return 0;
+        } else if (ret < 0) {
+            fprintf(stderr, "Error while receiving a frame from the decoder\n");
+            return ret;
+        }
+        /* A decoder that changes its output midway ends the measurement */
+        AVFrame *decoded = *frame;
+        if (pipeline->loudness.channels &&
+            (decoded->format != pipeline->loudness_sample_fmt || decoded->sample_rate != pipeline->loudness.sample_rate ||
+             decoded->channels != pipeline->loudness.channels)) {
+            loudness_meter_free(&pipeline->loudness);
+            memset(&pipeline->loudness, 0, sizeof(pipeline->loudness));
+        }
+        measure_loudness(&pipeline->loudness, (const uint8_t *const *)decoded->extended_data, decoded->nb_samples);
+        ret = pipeline_hand(pipeline, &pipeline->decoded, *frame);
+        *frame = NULL;
+        if (ret < 0) {
+            return ret;
+        }
     }
+}
 
-    frame = av_frame_alloc();
-    if (!frame) {
-        fprintf(stderr, "Could not allocate AVFrame\n");
-        ret = AVERROR(ENOMEM);
-        goto end;
+static int decode_packet(AudioPipeline *pipeline, void *item) {
+    AVPacket *packet = item;
+    int ret;
+    TRACE_STAGE(TRACE_STAGE_DECODE, ret = avcodec_send_packet(pipeline->decoder, packet));
+    av_packet_unref(packet);
+    if (ret < 0) {
+        fprintf(stderr, "Error while sending a packet to the decoder\n");
+        return ret;
     }
+    return pass_decoded_frames(pipeline, &pipeline->decoded_frame);
+}
 
-    swr_ctx = swr_alloc_set_opts(NULL,
-                                 output_codec_context->channel_layout, output_codec_context->sample_fmt, output_codec_context->sample_rate,
-                                 input_codec_context->channel_layout, input_codec_context->sample_fmt, input_codec_context->sample_rate,
-                                 0, NULL);
-    if (!swr_ctx || swr_init(swr_ctx) < 0) {
-        fprintf(stderr, "Could not allocate or initialize the resampler context\n");
-        ret = AVERROR(ENOMEM);
-        goto end;
+/* It drains the frames the decoder still holds once the demuxer is done */
+static int decode_finish(AudioPipeline *pipeline) {
+    int ret;
+    TRACE_STAGE(TRACE_STAGE_DECODE, ret = avcodec_send_packet(pipeline->decoder, NULL));
+    if (ret >= 0) {
+        ret = pass_decoded_frames(pipeline, &pipeline->decoded_frame);
     }
+    return ret;
+}
 
-    while (av_read_frame(input_format_context, packet) >= 0) {
-        if (packet->stream_index == stream_index) {
-            ret = avcodec_send_packet(input_codec_context, packet);
-            if (ret < 0) {
-                fprintf(stderr, "Error while sending a packet to the decoder\n");
-                break;
-            }
-
-            while (ret >= 0) {
-                ret = avcodec_receive_frame(input_codec_context, frame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    break;
-                } else if (ret < 0) {
-                    fprintf(stderr, "Error while receiving a frame from the decoder\n");
-                    goto end;
-                }
-
-                AVFrame *resampled_frame = av_frame_alloc();
-                if (!resampled_frame) {
-                    fprintf(stderr, "Could not allocate resampled AVFrame\n");
-                    ret = AVERROR(ENOMEM);
-                    goto end;
-                }
-
-                resampled_frame->channel_layout = output_codec_context->channel_layout;
-                resampled_frame->format = output_codec_context->sample_fmt;
-                resampled_frame->sample_rate = output_codec_context->sample_rate;
-                resampled_frame->nb_samples = frame->nb_samples;
-
-                if ((ret = av_frame_get_buffer(resampled_frame, 0)) < 0) {
-                    fprintf(stderr, "Could not allocate buffer for resampled frame\n");
-                    av_frame_free(&resampled_frame);
-                    goto end;
-                }
-
-                if ((ret = swr_convert_frame(swr_ctx, resampled_frame, frame)) < 0) {
-                    fprintf(stderr, "Error while resampling\n");
-                    av_frame_free(&resampled_frame);
-                    goto end;
-                }
-
-                resampled_frame->pts = frame->pts;
-
-                ret = avcodec_send_frame(output_codec_context, resampled_frame);
-                if (ret < 0) {
-                    fprintf(stderr, "Error while sending a frame to the encoder\n");
-                    av_frame_free(&resampled_frame);
-                    goto end;
-                }
-
-                while (ret >= 0) {
-                    AVPacket *output_packet = av_packet_alloc();
-                    if (!output_packet) {
-                        fprintf(stderr, "Could not allocate AVPacket\n");
-                        ret = AVERROR(ENOMEM);
-                        av_frame_free(&resampled_frame);
-                        goto end;
-                    }
-
-                    ret = avcodec_receive_packet(output_codec_context, output_packet);
-                    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                        av_packet_free(&output_packet);
-                        break;
-                    } else if (ret < 0) {
-                        fprintf(stderr, "Error while receiving a packet from the encoder\n");
-                        av_packet_free(&output_packet);
-                        av_frame_free(&resampled_frame);
-                        goto end;
-                    }
-
-                    av_packet_rescale_ts(output_packet, output_codec_context->time_base, output_stream->time_base);
-                    output_packet->stream_index = output_stream->index;
-
-                    ret = av_interleaved_write_frame(output_format_context, output_packet);
-                    if (ret < 0) {
-                        fprintf(stderr, "Error while writing a packet to the output file\n");
-                        av_packet_free(&output_packet);
-                        av_frame_free(&resampled_frame);
-                        goto end;
-                    }
-
-                    av_packet_free(&output_packet);
-                }
+/* It resamples one decoded frame into the FIFO; without a frame it drains what the resampler still holds */
+static int resample_into_fifo(AudioPipeline *pipeline, const AVFrame *frame) {
+    AVFrame *converted = pipeline->converted;
+    int in_samples = frame ? frame->nb_samples : 0;
+    int ret;
 
-                av_frame_free(&resampled_frame);
-            }
+    int out_samples = converted_sample_bound(&pipeline->converter, in_samples);
+    if (out_samples <= 0) {
+        return out_samples;
+    }
+    /* The buffer only grows, frames of the same stream have about the same size */
+    if (out_samples > converted->nb_samples) {
+        av_frame_unref(converted);
+        converted->nb_samples = out_samples;
+        converted->format = pipeline->output_sample_fmt;
+        converted->channel_layout = pipeline->output_layout;
+        converted->sample_rate = pipeline->output_sample_rate;
+        if ((ret = av_frame_get_buffer(converted, 0)) < 0) {
+            fprintf(stderr, "Could not allocate buffer for the audio frame\n");
+            return ret;
         }
-        av_packet_unref(packet);
     }
 
-    // Golim coada encoderului
-    ret = avcodec_send_frame(output_codec_context, NULL);
-    while (ret >= 0) {
-        AVPacket *output_packet = av_packet_alloc();
-        if (!output_packet) {
-            fprintf(stderr, "Could not allocate AVPacket\n");
-            ret = AVERROR(ENOMEM);
-            break;
+    TRACE_STAGE(TRACE_STAGE_RESAMPLE,
+                ret = convert_samples(&pipeline->converter, converted->data, out_samples,
+                                      frame ? (const uint8_t **)frame->extended_data : NULL, in_samples));
+    if (ret < 0) {
+        fprintf(stderr, "Error while resampling\n");
+        return ret;
+    }
+    if (ret > 0 && av_audio_fifo_write(pipeline->fifo, (void **)converted->data, ret) < ret) {
+        fprintf(stderr, "Could not buffer the resampled samples\n");
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+/* It hands the resampled samples on in frames of the size the encoder takes; at the end of the stream
+ * the samples that are left go out as a last, shorter frame */
+static int pass_resampled_frames(AudioPipeline *pipeline, AVFrame **frame, int end_of_stream) {
+    int ret;
+    while (av_audio_fifo_size(pipeline->fifo) >= pipeline->frame_samples ||
+           (end_of_stream && av_audio_fifo_size(pipeline->fifo) > 0)) {
+        if (!*frame && !(*frame = spsc_ring_pop(&pipeline->resampled.spare))) {
+            return AVERROR_EXIT;
+        }
+        /* The encoder may still hold a reference to what the frame carried last time */
+        (*frame)->nb_samples = pipeline->frame_samples;
+        if ((ret = av_frame_make_writable(*frame)) < 0) {
+            fprintf(stderr, "Could not make the audio frame writable\n");
+            return ret;
         }
 
-        ret = avcodec_receive_packet(output_codec_context, output_packet);
-        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
-            av_packet_free(&output_packet);
-            break;
-        } else if (ret < 0) {
-            fprintf(stderr, "Error while receiving a packet from the encoder\n");
-            av_packet_free(&output_packet);
-            break;
+        ret = av_audio_fifo_read(pipeline->fifo, (void **)(*frame)->data, pipeline->frame_samples);
+        if (ret < 0) {
+            return ret;
+        }
+        (*frame)->nb_samples = ret;
+        ret = pipeline_hand(pipeline, &pipeline->resampled, *frame);
+        *frame = NULL;
+        if (ret < 0) {
+            return ret;
         }
+    }
+    return 0;
+}
+
+static int resample_frame(AudioPipeline *pipeline, void *item) {
+    AVFrame *frame = item;
+    int ret = resample_into_fifo(pipeline, frame);
+    av_frame_unref(frame);
+    if (ret >= 0) {
+        ret = pass_resampled_frames(pipeline, &pipeline->resampled_frame, 0);
+    }
+    return ret;
+}
 
-        av_packet_rescale_ts(output_packet, output_codec_context->time_base, output_stream->time_base);
-        output_packet->stream_index = output_stream->index;
+/* A resampler that changes the sample rate holds back a few samples for its filter */
+static int resample_finish(AudioPipeline *pipeline) {
+    int ret = resample_into_fifo(pipeline, NULL);
+    if (ret >= 0) {
+        ret = pass_resampled_frames(pipeline, &pipeline->resampled_frame, 1);
+    }
+    return ret;
+}
 
-        ret = av_interleaved_write_frame(output_format_context, output_packet);
+/* It encodes a resampled frame and muxes the packets, or appends the samples to the WAV file */
+static int encode_frame(AudioPipeline *pipeline, void *item) {
+    AVFrame *frame = item;
+    int ret;
+    if (pipeline->encoder) {
+        frame->pts = pipeline->next_pts;
+        pipeline->next_pts += frame->nb_samples;
+        TRACE_STAGE(TRACE_STAGE_ENCODE, ret = avcodec_send_frame(pipeline->encoder, frame));
         if (ret < 0) {
-            fprintf(stderr, "Error while writing a packet to the output file\n");
-            av_packet_free(&output_packet);
-            break;
+            fprintf(stderr, "Error while sending a frame to the encoder\n");
+            return ret;
         }
-
-        av_packet_free(&output_packet);
+        return write_encoded_packets(pipeline->encoder, pipeline->output_format_context,
+                                     pipeline->output_stream, pipeline->encoded_packet);
+    }
+    TRACE_STAGE(TRACE_STAGE_MUX,
+                ret = wav_writer_write(pipeline->wav, frame->data[0], (size_t)frame->nb_samples * pipeline->wav->block_align));
+    if (ret < 0) {
+        fprintf(stderr, "Error while writing to the output file\n");
+        return AVERROR(EIO);
     }
+    return 0;
+}
 
-    av_write_trailer(output_format_context);
+static int encode_finish(AudioPipeline *pipeline) {
+    int ret = 0;
 
-    end:
-    swr_free(&swr_ctx);
-    av_packet_free(&packet);
-    av_frame_free(&frame);
-    avcodec_free_context(&input_codec_context);
-    avcodec_free_context(&output_codec_context);
-    avformat_close_input(&input_format_context);
-    if (output_format_context && !(output_format_context->oformat->flags & AVFMT_NOFILE))
-        avio_closep(&output_format_context->pb);
-    avformat_free_context(output_format_context);
+    /* It stops without flushing when the job was cancelled or ran out of time */
+    if (cancel_requested()) {
+        return AVERROR_EXIT;
+    }
 
-    if (ret < 0 && ret != AVERROR_EOF) {
-        fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
-        exit(1);
+    /* It flushes the encoder */
+    if (pipeline->encoder) {
+        TRACE_STAGE(TRACE_STAGE_ENCODE, ret = avcodec_send_frame(pipeline->encoder, NULL));
+        if (ret >= 0) {
+            ret = write_encoded_packets(pipeline->encoder, pipeline->output_format_context,
+                                        pipeline->output_stream, pipeline->encoded_packet);
+        }
     }
+    return ret;
+}
+
+/* It sets up the stage that consumes a link and the link it feeds */
+static void pipeline_link_connect(PipelineLink *link, AudioPipeline *pipeline, const char *stage_name,
+                                  int (*consume)(AudioPipeline *, void *), int (*finish)(AudioPipeline *),
+                                  PipelineLink *output) {
+    link->pipeline = pipeline;
+    link->stage_name = stage_name;
+    link->consume = consume;
+    link->finish = finish;
+    link->output = output;
 }
 
+/* The thread of a stage, on a worker slot the scheduler lent; the slot goes back when the stage is done
+ * or when the producer takes the stage back */
+static void *pipeline_stage(void *arg) {
+    PipelineLink *link = arg;
+    AudioPipeline *pipeline = link->pipeline;
+    void *item = NULL;
+    int ret = 0;
+
+    cancel_set_current(pipeline->token);
+    trace_set_current(pipeline->trace);
+    TraceSpan span = trace_span_begin(link->stage_name);
+    while (ret >= 0 && !pipeline_failed(pipeline) && (item = spsc_ring_pop(&link->filled)) && item != link) {
+        ret = link->consume(pipeline, item);
+        spsc_ring_push(&link->spare, item);
+    }
+    int taken_back = item == link;
+    if (!taken_back && ret >= 0 && !pipeline_failed(pipeline)) {
+        ret = link->finish(pipeline);
+    }
+    trace_span_end(&span);
+    if (!taken_back) {
+        pipeline_stage_done(pipeline, link->output, ret);
+    }
+
+    pthread_mutex_lock(&pipeline->handback_lock);
+    link->stopped = 1;
+    pthread_cond_broadcast(&pipeline->stage_stopped);
+    pthread_mutex_unlock(&pipeline->handback_lock);
+    trace_clear_current();
+    scheduler_return_workers(pipeline->job_class, 1);
+    return NULL;
+}
 
-void convert_wav_to_aac(const char *input_path, const char *output_path) {
-    AVFormatContext *input_format_context = NULL;
+/* It copies the packets of the audio stream into the output container without decoding them, for
+ * conversions that only change the container. The muxer adds the bitstream filter it needs itself,
+ * e.g. to turn the ADTS headers of raw AAC into the AudioSpecificConfig of an M4A file. */
+static int remux_audio(AVFormatContext *input_format_context, int stream_index, const char *output_path) {
     AVFormatContext *output_format_context = NULL;
-    AVCodecContext *input_codec_context = NULL;
-    AVCodecContext *output_codec_context = NULL;
-    AVStream *input_stream = NULL;
+    AVStream *input_stream = input_format_context->streams[stream_index];
     AVStream *output_stream = NULL;
     AVPacket *packet = NULL;
-    AVFrame *frame = NULL;
-    SwrContext *swr_ctx = NULL;
     int ret;
 
-    if ((ret = avformat_open_input(&input_format_context, input_path, NULL, NULL)) < 0) {
-        fprintf(stderr, "Could not open input file '%s'\n", input_path);
-        exit(1);
-    }
-
-    if ((ret = avformat_find_stream_info(input_format_context, NULL)) < 0) {
-        fprintf(stderr, "Failed to retrieve input stream information\n");
-        goto end;
-    }
-
+    TraceSpan span = trace_span_begin("remux");
     avformat_alloc_output_context2(&output_format_context, NULL, NULL, output_path);
     if (!output_format_context) {
         fprintf(stderr, "Could not create output context\n");
@@ -914,45 +1434,6 @@ void convert_wav_to_aac(const char *input_path, const char *output_path) {
         goto end;
     }
 
-    int stream_index = av_find_best_stream(input_format_context, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-    if (stream_index < 0) {
-        fprintf(stderr, "Could not find %s stream in input file '%s'\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO), input_path);
-        ret = AVERROR(EINVAL);
-        goto end;
-    }
-
-    input_stream = input_format_context->streams[stream_index];
-    AVCodec *input_codec = avcodec_find_decoder(input_stream->codecpar->codec_id);
-    if (!input_codec) {
-        fprintf(stderr, "Failed to find %s codec\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        ret = AVERROR(EINVAL);
-        goto end;
-    }
-
-    input_codec_context = avcodec_alloc_context3(input_codec);
-    if (!input_codec_context) {
-        fprintf(stderr, "Failed to allocate the %s codec context\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        ret = AVERROR(ENOMEM);
-        goto end;
-    }
-
-    if ((ret = avcodec_parameters_to_context(input_codec_context, input_stream->codecpar)) < 0) {
-        fprintf(stderr, "Failed to copy %s codec parameters to decoder context\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        goto end;
-    }
-
-    if ((ret = avcodec_open2(input_codec_context, input_codec, NULL)) < 0) {
-        fprintf(stderr, "Failed to open %s codec\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        goto end;
-    }
-
-    AVCodec *output_codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
-    if (!output_codec) {
-        fprintf(stderr, "Necessary encoder not found\n");
-        ret = AVERROR_INVALIDDATA;
-        goto end;
-    }
-
     output_stream = avformat_new_stream(output_format_context, NULL);
     if (!output_stream) {
         fprintf(stderr, "Failed allocating output stream\n");
@@ -960,30 +1441,13 @@ void convert_wav_to_aac(const char *input_path, const char *output_path) {
         goto end;
     }
 
-    output_codec_context = avcodec_alloc_context3(output_codec);
-    if (!output_codec_context) {
-        fprintf(stderr, "Failed to allocate the encoder context\n");
-        ret = AVERROR(ENOMEM);
-        goto end;
-    }
-
-    output_codec_context->channels = input_codec_context->channels;
-    output_codec_context->channel_layout = av_get_default_channel_layout(input_codec_context->channels);
-    output_codec_context->sample_rate = input_codec_context->sample_rate;
-    output_codec_context->sample_fmt = output_codec->sample_fmts[0];
-    output_codec_context->bit_rate = 192000;
-
-    if ((ret = avcodec_open2(output_codec_context, output_codec, NULL)) < 0) {
-        fprintf(stderr, "Cannot open output codec\n");
-        goto end;
-    }
-
-    if ((ret = avcodec_parameters_from_context(output_stream->codecpar, output_codec_context)) < 0) {
-        fprintf(stderr, "Failed to copy encoder parameters to output stream\n");
+    /* The tag of the input container means nothing in the output one */
+    if ((ret = avcodec_parameters_copy(output_stream->codecpar, input_stream->codecpar)) < 0) {
+        fprintf(stderr, "Failed to copy the stream parameters\n");
         goto end;
     }
-
-    output_stream->time_base = (AVRational){1, output_codec_context->sample_rate};
+    output_stream->codecpar->codec_tag = 0;
+    output_stream->time_base = input_stream->time_base;
 
     if (!(output_format_context->oformat->flags & AVFMT_NOFILE)) {
         if ((ret = avio_open(&output_format_context->pb, output_path, AVIO_FLAG_WRITE)) < 0) {
@@ -992,6 +1456,7 @@ void convert_wav_to_aac(const char *input_path, const char *output_path) {
         }
     }
 
+    /* The muxer may pick another time base for the stream here */
     if ((ret = avformat_write_header(output_format_context, NULL)) < 0) {
         fprintf(stderr, "Error occurred when opening output file\n");
         goto end;
@@ -1004,207 +1469,90 @@ void convert_wav_to_aac(const char *input_path, const char *output_path) {
         goto end;
     }
 
-    frame = av_frame_alloc();
-    if (!frame) {
-        fprintf(stderr, "Could not allocate AVFrame\n");
-        ret = AVERROR(ENOMEM);
-        goto end;
-    }
-
-    // Set explicit input and output channel layouts for the resampler context
-    swr_ctx = swr_alloc_set_opts(NULL,
-                                 av_get_default_channel_layout(output_codec_context->channels), output_codec_context->sample_fmt, output_codec_context->sample_rate,
-                                 av_get_default_channel_layout(input_codec_context->channels), input_codec_context->sample_fmt, input_codec_context->sample_rate,
-                                 0, NULL);
-    if (!swr_ctx || swr_init(swr_ctx) < 0) {
-        fprintf(stderr, "Could not allocate or initialize the resampler context\n");
-        ret = AVERROR(ENOMEM);
-        goto end;
-    }
-
-    while (av_read_frame(input_format_context, packet) >= 0) {
-        if (packet->stream_index == stream_index) {
-            ret = avcodec_send_packet(input_codec_context, packet);
-            if (ret < 0) {
-                fprintf(stderr, "Error while sending a packet to the decoder\n");
-                break;
-            }
-
-            while (ret >= 0) {
-                ret = avcodec_receive_frame(input_codec_context, frame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    break;
-                } else if (ret < 0) {
-                    fprintf(stderr, "Error while receiving a frame from the decoder\n");
-                    goto end;
-                }
-
-                AVFrame *resampled_frame = av_frame_alloc();
-                if (!resampled_frame) {
-                    fprintf(stderr, "Could not allocate resampled AVFrame\n");
-                    ret = AVERROR(ENOMEM);
-                    goto end;
-                }
-
-                resampled_frame->channel_layout = output_codec_context->channel_layout;
-                resampled_frame->format = output_codec_context->sample_fmt;
-                resampled_frame->sample_rate = output_codec_context->sample_rate;
-                resampled_frame->nb_samples = frame->nb_samples;
-
-                if ((ret = av_frame_get_buffer(resampled_frame, 0)) < 0) {
-                    fprintf(stderr, "Could not allocate buffer for resampled frame\n");
-                    av_frame_free(&resampled_frame);
-                    goto end;
-                }
-
-                // Resample the audio data
-                ret = swr_convert(swr_ctx,
-                                  resampled_frame->data, resampled_frame->nb_samples,
-                                  (const uint8_t **)frame->data, frame->nb_samples);
-                if (ret < 0) {
-                    fprintf(stderr, "Error while resampling\n");
-                    av_frame_free(&resampled_frame);
-                    goto end;
-                }
-
-                resampled_frame->pts = av_rescale_q(frame->pts, input_codec_context->time_base, output_codec_context->time_base);
-
-                ret = avcodec_send_frame(output_codec_context, resampled_frame);
-                if (ret < 0) {
-                    fprintf(stderr, "Error while sending a frame to the encoder\n");
-                    av_frame_free(&resampled_frame);
-                    goto end;
-                }
-
-                while (ret >= 0) {
-                    AVPacket *output_packet = av_packet_alloc();
-                    if (!output_packet) {
-                        fprintf(stderr, "Could not allocate AVPacket\n");
-                        ret = AVERROR(ENOMEM);
-                        av_frame_free(&resampled_frame);
-                        goto end;
-                    }
-
-                    ret = avcodec_receive_packet(output_codec_context, output_packet);
-                    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                        av_packet_free(&output_packet);
-                        break;
-                    } else if (ret < 0) {
-                        fprintf(stderr, "Error while receiving a packet from the encoder\n");
-                        av_packet_free(&output_packet);
-                        av_frame_free(&resampled_frame);
-                        goto end;
-                    }
-
-                    av_packet_rescale_ts(output_packet, output_codec_context->time_base, output_stream->time_base);
-                    output_packet->stream_index = output_stream->index;
-
-                    ret = av_interleaved_write_frame(output_format_context, output_packet);
-                    if (ret < 0) {
-                        fprintf(stderr, "Error while writing a packet to the output file\n");
-                        av_packet_free(&output_packet);
-                        av_frame_free(&resampled_frame);
-                        goto end;
-                    }
-
-                    av_packet_free(&output_packet);
-                }
-
-                av_frame_free(&resampled_frame);
-            }
-        }
-        av_packet_unref(packet);
-    }
-
-    // Golim coada encoderului
-    ret = avcodec_send_frame(output_codec_context, NULL);
-    while (ret >= 0) {
-        AVPacket *output_packet = av_packet_alloc();
-        if (!output_packet) {
-            fprintf(stderr, "Could not allocate AVPacket\n");
-            ret = AVERROR(ENOMEM);
-            break;
-        }
-
-        ret = avcodec_receive_packet(output_codec_context, output_packet);
-        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
-            av_packet_free(&output_packet);
-            break;
-        } else if (ret < 0) {
-            fprintf(stderr, "Error while receiving a packet from the encoder\n");
-            av_packet_free(&output_packet);
-            break;
+    while (!cancel_requested() && av_read_frame(input_format_context, packet) >= 0) {
+        if (packet->stream_index != stream_index) {
+            av_packet_unref(packet);
+            continue;
         }
+        av_packet_rescale_ts(packet, input_stream->time_base, output_stream->time_base);
+        packet->stream_index = output_stream->index;
+        packet->pos = -1;
 
-        av_packet_rescale_ts(output_packet, output_codec_context->time_base, output_stream->time_base);
-        output_packet->stream_index = output_stream->index;
-
-        ret = av_interleaved_write_frame(output_format_context, output_packet);
+        /* The muxer takes over the packet data, so the packet can be reused */
+        TRACE_STAGE(TRACE_STAGE_MUX, ret = av_interleaved_write_frame(output_format_context, packet));
         if (ret < 0) {
             fprintf(stderr, "Error while writing a packet to the output file\n");
-            av_packet_free(&output_packet);
-            break;
+            goto end;
         }
-
-        av_packet_free(&output_packet);
     }
 
-    av_write_trailer(output_format_context);
+    /* It stops without the trailer when the job was cancelled or ran out of time */
+    if (cancel_requested()) {
+        ret = AVERROR_EXIT;
+        goto end;
+    }
+    ret = av_write_trailer(output_format_context);
 
     end:
-    swr_free(&swr_ctx);
     av_packet_free(&packet);
-    av_frame_free(&frame);
-    avcodec_free_context(&input_codec_context);
-    avcodec_free_context(&output_codec_context);
-    avformat_close_input(&input_format_context);
     if (output_format_context && !(output_format_context->oformat->flags & AVFMT_NOFILE))
         avio_closep(&output_format_context->pb);
     avformat_free_context(output_format_context);
-
-    if (ret < 0 && ret != AVERROR_EOF) {
-        fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
-        exit(1);
+    trace_span_end(&span);
+    if (ret >= 0) {
+        ResultMetadata *metadata = result_metadata_current();
+        if (metadata) {
+            metadata->flags |= RESULT_METADATA_REMUXED;
+        }
+        metrics_add(METRIC_AUDIO_REMUXED, 1);
     }
+    return ret;
 }
 
-void convert_wav_to_mp3(const char *input_path, const char *output_path) {
-    AVFormatContext *input_format_context = NULL;
-    AVFormatContext *output_format_context = NULL;
-    AVCodecContext *input_codec_context = NULL;
-    AVCodecContext *output_codec_context = NULL;
-    AVStream *input_stream = NULL;
-    AVStream *output_stream = NULL;
-    AVPacket *packet = NULL;
-    AVFrame *frame = NULL;
-    SwrContext *swr_ctx = NULL;
+/* It converts an audio file in a pipeline: this thread demuxes while the decoder, the resampler and
+ * the encoder each run on a thread of their own, so one conversion keeps up to four cores busy even
+ * with codecs that run on a single thread. With AV_CODEC_ID_NONE the output is a 16-bit PCM WAV file,
+ * which needs no muxer and no PCM encoder: the header is written up front and the samples go out in
+ * large blocks through the WAV writer. The encoder options of the request can change the sample rate,
+ * the channel count and the bit rate or VBR quality; bit_rate is the default when they leave it out.
+ * When the input already has the target codec, the conversion has no bit rate of its own (bit_rate 0)
+ * and the request sets no audio option, the packets are copied into the new container instead. */
+static int transcode_audio(const char *input_path, const char *format_name, const char *output_path,
+                           enum AVCodecID codec_id, int64_t bit_rate) {
+    const EncoderOptions *options = encoder_options_current();
+    AudioPipeline pipeline;
+    WavWriter wav;
+    int wav_opened = 0;
+    pthread_t stages[3];
+    int stages_started = 0;
     int ret;
 
-    if ((ret = avformat_open_input(&input_format_context, input_path, NULL, NULL)) < 0) {
-        fprintf(stderr, "Could not open input file '%s'\n", input_path);
-        exit(1);
-    }
+    memset(&pipeline, 0, sizeof(pipeline));
+    atomic_init(&pipeline.error, 0);
+    pipeline.token = cancel_current();
+    pipeline.trace = trace_current();
+    pipeline.job_class = scheduler_current_class();
+    pthread_mutex_init(&pipeline.handback_lock, NULL);
+    pthread_cond_init(&pipeline.stage_stopped, NULL);
 
-    if ((ret = avformat_find_stream_info(input_format_context, NULL)) < 0) {
-        fprintf(stderr, "Failed to retrieve input stream information\n");
+    /* It opens the input file and reads the stream information */
+    if ((ret = open_audio_input(&pipeline.input_format_context, input_path, format_name)) < 0) {
         goto end;
     }
 
-    avformat_alloc_output_context2(&output_format_context, NULL, NULL, output_path);
-    if (!output_format_context) {
-        fprintf(stderr, "Could not create output context\n");
-        ret = AVERROR_UNKNOWN;
+    pipeline.stream_index = av_find_best_stream(pipeline.input_format_context, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (pipeline.stream_index < 0) {
+        fprintf(stderr, "Could not find %s stream in input file '%s'\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO), input_path);
+        ret = AVERROR(EINVAL);
         goto end;
     }
 
-    int stream_index = av_find_best_stream(input_format_context, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-    if (stream_index < 0) {
-        fprintf(stderr, "Could not find %s stream in input file '%s'\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO), input_path);
-        ret = AVERROR(EINVAL);
+    AVStream *input_stream = pipeline.input_format_context->streams[pipeline.stream_index];
+    if (input_stream->codecpar->codec_id == codec_id && bit_rate == 0 && !encoder_options_audio_set(options)) {
+        ret = remux_audio(pipeline.input_format_context, pipeline.stream_index, output_path);
         goto end;
     }
 
-    input_stream = input_format_context->streams[stream_index];
     AVCodec *input_codec = avcodec_find_decoder(input_stream->codecpar->codec_id);
     if (!input_codec) {
         fprintf(stderr, "Failed to find %s codec\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
@@ -1212,241 +1560,271 @@ void convert_wav_to_mp3(const char *input_path, const char *output_path) {
         goto end;
     }
 
-    input_codec_context = avcodec_alloc_context3(input_codec);
-    if (!input_codec_context) {
-        fprintf(stderr, "Failed to allocate the %s codec context\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        ret = AVERROR(ENOMEM);
+    /* It opens the decoder, or takes the one this thread already has for the same stream parameters */
+    if ((ret = audio_pool_open_decoder(&pipeline.decoder, input_codec, input_stream->codecpar)) < 0) {
+        fprintf(stderr, "Failed to open %s codec\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
         goto end;
     }
 
-    if ((ret = avcodec_parameters_to_context(input_codec_context, input_stream->codecpar)) < 0) {
-        fprintf(stderr, "Failed to copy %s codec parameters to decoder context\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        goto end;
-    }
+    int channels = options->audio_channels ? options->audio_channels : pipeline.decoder->channels;
+    int sample_rate = options->audio_sample_rate ? (int)options->audio_sample_rate : pipeline.decoder->sample_rate;
+    int64_t input_layout = pipeline.decoder->channel_layout ? (int64_t)pipeline.decoder->channel_layout
+                                                            : av_get_default_channel_layout(channels);
+    int64_t output_layout = av_get_default_channel_layout(channels);
+    enum AVSampleFormat output_sample_fmt = AV_SAMPLE_FMT_S16;
+    pipeline.frame_samples = WAV_BLOCK_SAMPLES;
 
-    if ((ret = avcodec_open2(input_codec_context, input_codec, NULL)) < 0) {
-        fprintf(stderr, "Failed to open %s codec\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
-        goto end;
-    }
+    /* The loudness is measured on the frames the decoder gives anyway, the input is only decoded once */
+    int64_t decoded_layout = pipeline.decoder->channel_layout ? (int64_t)pipeline.decoder->channel_layout
+                                                              : av_get_default_channel_layout(pipeline.decoder->channels);
+    open_loudness_meter(&pipeline.loudness, pipeline.decoder->sample_rate, decoded_layout, pipeline.decoder->sample_fmt);
+    pipeline.loudness_sample_fmt = pipeline.decoder->sample_fmt;
 
-    AVCodec *output_codec = avcodec_find_encoder(AV_CODEC_ID_MP3);
-    if (!output_codec) {
-        fprintf(stderr, "Necessary encoder not found\n");
-        ret = AVERROR_INVALIDDATA;
-        goto end;
-    }
+    if (codec_id == AV_CODEC_ID_NONE) {
+        if (wav_writer_open(&wav, output_path, channels, sample_rate, 16) != 0) {
+            fprintf(stderr, "Could not open output file '%s'\n", output_path);
+            ret = AVERROR(EIO);
+            goto end;
+        }
+        wav_opened = 1;
+        pipeline.wav = &wav;
+    } else {
+        avformat_alloc_output_context2(&pipeline.output_format_context, NULL, NULL, output_path);
+        if (!pipeline.output_format_context) {
+            fprintf(stderr, "Could not create output context\n");
+            ret = AVERROR_UNKNOWN;
+            goto end;
+        }
 
-    output_stream = avformat_new_stream(output_format_context, NULL);
-    if (!output_stream) {
-        fprintf(stderr, "Failed allocating output stream\n");
-        ret = AVERROR_UNKNOWN;
-        goto end;
-    }
+        AVCodec *output_codec = avcodec_find_encoder(codec_id);
+        if (!output_codec) {
+            fprintf(stderr, "Necessary encoder not found\n");
+            ret = AVERROR_INVALIDDATA;
+            goto end;
+        }
 
-    output_codec_context = avcodec_alloc_context3(output_codec);
-    if (!output_codec_context) {
-        fprintf(stderr, "Failed to allocate the encoder context\n");
-        ret = AVERROR(ENOMEM);
-        goto end;
-    }
+        pipeline.output_stream = avformat_new_stream(pipeline.output_format_context, NULL);
+        if (!pipeline.output_stream) {
+            fprintf(stderr, "Failed allocating output stream\n");
+            ret = AVERROR_UNKNOWN;
+            goto end;
+        }
 
-    output_codec_context->channels = input_codec_context->channels;
-    output_codec_context->channel_layout = av_get_default_channel_layout(input_codec_context->channels);
-    output_codec_context->sample_rate = input_codec_context->sample_rate;
-    output_codec_context->sample_fmt = output_codec->sample_fmts[0];
-    output_codec_context->bit_rate = 192000;
+        if ((ret = audio_pool_open_encoder(&pipeline.encoder, output_codec, sample_rate, output_layout,
+                                           encoder_sample_format(output_codec), requested_bit_rate(bit_rate),
+                                           requested_vbr_quality(codec_id))) < 0) {
+            fprintf(stderr, "Cannot open output codec\n");
+            goto end;
+        }
 
-    if ((ret = avcodec_open2(output_codec_context, output_codec, NULL)) < 0) {
-        fprintf(stderr, "Cannot open output codec\n");
-        goto end;
-    }
+        if ((ret = avcodec_parameters_from_context(pipeline.output_stream->codecpar, pipeline.encoder)) < 0) {
+            fprintf(stderr, "Failed to copy encoder parameters to output stream\n");
+            goto end;
+        }
 
-    if ((ret = avcodec_parameters_from_context(output_stream->codecpar, output_codec_context)) < 0) {
-        fprintf(stderr, "Failed to copy encoder parameters to output stream\n");
-        goto end;
-    }
+        pipeline.output_stream->time_base = (AVRational){1, sample_rate};
 
-    output_stream->time_base = (AVRational){1, output_codec_context->sample_rate};
+        /* A streamed result goes to the client as the muxer writes it */
+        ConversionStream *stream = conversion_stream_current();
+        if (stream) {
+            if (!(pipeline.output_format_context->pb = alloc_stream_io(stream, 1))) {
+                fprintf(stderr, "Could not allocate the output I/O context\n");
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            pipeline.output_format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+        } else if (!(pipeline.output_format_context->oformat->flags & AVFMT_NOFILE)) {
+            if ((ret = avio_open(&pipeline.output_format_context->pb, output_path, AVIO_FLAG_WRITE)) < 0) {
+                fprintf(stderr, "Could not open output file '%s'\n", output_path);
+                goto end;
+            }
+        }
 
-    if (!(output_format_context->oformat->flags & AVFMT_NOFILE)) {
-        if ((ret = avio_open(&output_format_context->pb, output_path, AVIO_FLAG_WRITE)) < 0) {
-            fprintf(stderr, "Could not open output file '%s'\n", output_path);
+        if ((ret = avformat_write_header(pipeline.output_format_context, NULL)) < 0) {
+            fprintf(stderr, "Error occurred when opening output file\n");
             goto end;
         }
+
+        output_sample_fmt = pipeline.encoder->sample_fmt;
+        if (pipeline.encoder->frame_size > 0) {
+            pipeline.frame_samples = pipeline.encoder->frame_size;
+        }
     }
 
-    if ((ret = avformat_write_header(output_format_context, NULL)) < 0) {
-        fprintf(stderr, "Error occurred when opening output file\n");
+    /* The resampler converts the sample format, the channel layout and, when asked for, the sample rate */
+    if ((ret = open_sample_converter(&pipeline.converter, output_layout, output_sample_fmt, sample_rate,
+                                     input_layout, pipeline.decoder->sample_fmt,
+                                     pipeline.decoder->sample_rate)) < 0) {
+        fprintf(stderr, "Could not allocate or initialize the resampler context\n");
         goto end;
     }
-
-    packet = av_packet_alloc();
-    if (!packet) {
-        fprintf(stderr, "Could not allocate AVPacket\n");
+    pipeline.output_sample_fmt = output_sample_fmt;
+    pipeline.output_layout = output_layout;
+    pipeline.output_sample_rate = sample_rate;
+    pipeline.converted = av_frame_alloc();
+    pipeline.fifo = av_audio_fifo_alloc(output_sample_fmt, channels, pipeline.frame_samples);
+    if (!pipeline.converted || !pipeline.fifo) {
+        fprintf(stderr, "Could not allocate the resampling buffers\n");
         ret = AVERROR(ENOMEM);
         goto end;
     }
 
-    frame = av_frame_alloc();
-    if (!frame) {
-        fprintf(stderr, "Could not allocate AVFrame\n");
-        ret = AVERROR(ENOMEM);
+    if ((ret = pipeline_link_init(&pipeline.packets, 1)) < 0 ||
+        (ret = pipeline_link_init(&pipeline.decoded, 0)) < 0 ||
+        (ret = pipeline_link_init(&pipeline.resampled, 0)) < 0) {
+        fprintf(stderr, "Could not allocate AVPacket or AVFrame\n");
         goto end;
     }
+    for (int i = 0; i < PIPELINE_DEPTH; i++) {
+        AVFrame *frame = pipeline.resampled.items[i];
+        frame->nb_samples = pipeline.frame_samples;
+        frame->format = output_sample_fmt;
+        frame->channel_layout = output_layout;
+        frame->sample_rate = sample_rate;
+        if ((ret = av_frame_get_buffer(frame, 0)) < 0) {
+            fprintf(stderr, "Could not allocate buffer for the audio frame\n");
+            goto end;
+        }
+    }
 
-    // Set explicit input and output channel layouts for the resampler context
-    swr_ctx = swr_alloc_set_opts(NULL,
-                                 av_get_default_channel_layout(output_codec_context->channels), output_codec_context->sample_fmt, output_codec_context->sample_rate,
-                                 av_get_default_channel_layout(input_codec_context->channels), input_codec_context->sample_fmt, input_codec_context->sample_rate,
-                                 0, NULL);
-    if (!swr_ctx || swr_init(swr_ctx) < 0) {
-        fprintf(stderr, "Could not allocate or initialize the resampler context\n");
+    if (pipeline.encoder && !(pipeline.encoded_packet = av_packet_alloc())) {
+        fprintf(stderr, "Could not allocate AVPacket\n");
         ret = AVERROR(ENOMEM);
         goto end;
     }
+    pipeline_link_connect(&pipeline.packets, &pipeline, "decode", decode_packet, decode_finish, &pipeline.decoded);
+    pipeline_link_connect(&pipeline.decoded, &pipeline, "resample", resample_frame, resample_finish, &pipeline.resampled);
+    pipeline_link_connect(&pipeline.resampled, &pipeline, "encode", encode_frame, encode_finish, NULL);
 
-    while (av_read_frame(input_format_context, packet) >= 0) {
-        if (packet->stream_index == stream_index) {
-            ret = avcodec_send_packet(input_codec_context, packet);
-            if (ret < 0) {
-                fprintf(stderr, "Error while sending a packet to the decoder\n");
-                break;
-            }
-
-            while (ret >= 0) {
-                ret = avcodec_receive_frame(input_codec_context, frame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    break;
-                } else if (ret < 0) {
-                    fprintf(stderr, "Error while receiving a frame from the decoder\n");
-                    goto end;
-                }
-
-                AVFrame *resampled_frame = av_frame_alloc();
-                if (!resampled_frame) {
-                    fprintf(stderr, "Could not allocate resampled AVFrame\n");
-                    ret = AVERROR(ENOMEM);
-                    goto end;
-                }
-
-                resampled_frame->channel_layout = output_codec_context->channel_layout;
-                resampled_frame->format = output_codec_context->sample_fmt;
-                resampled_frame->sample_rate = output_codec_context->sample_rate;
-                resampled_frame->nb_samples = frame->nb_samples;
+    /* The stages get their own threads as far as the scheduler has idle worker slots, the encoder first;
+     * the others run on the thread of the stage before them, this one at the start. A stage whose slot
+     * a queued job needs moves onto the thread before it */
+    PipelineLink *stage_links[3] = {&pipeline.resampled, &pipeline.decoded, &pipeline.packets};
+    int lent = scheduler_borrow_workers(pipeline.job_class, 3);
+    for (int i = 0; i < lent; i++) {
+        stage_links[i]->threaded = 1;
+    }
+    for (; stages_started < lent; stages_started++) {
+        if (pthread_create(&stages[stages_started], NULL, pipeline_stage, stage_links[stages_started]) != 0) {
+            fprintf(stderr, "Could not start the conversion threads\n");
+            pipeline_fail(&pipeline, AVERROR(EAGAIN));
+            break;
+        }
+    }
+    scheduler_return_workers(pipeline.job_class, lent - stages_started);
+    pipeline_stage_done(&pipeline, &pipeline.packets, demux_packets(&pipeline));
+    for (int i = 0; i < stages_started; i++) {
+        pthread_join(stages[i], NULL);
+    }
 
-                if ((ret = av_frame_get_buffer(resampled_frame, 0)) < 0) {
-                    fprintf(stderr, "Could not allocate buffer for resampled frame\n");
-                    av_frame_free(&resampled_frame);
-                    goto end;
-                }
+    ret = atomic_load(&pipeline.error);
+    if (ret >= 0 && pipeline.encoder) {
+        ret = av_write_trailer(pipeline.output_format_context);
+    }
 
-                // Resample the audio data
-                ret = swr_convert(swr_ctx,
-                                  resampled_frame->data, resampled_frame->nb_samples,
-                                  (const uint8_t **)frame->data, frame->nb_samples);
-                if (ret < 0) {
-                    fprintf(stderr, "Error while resampling\n");
-                    av_frame_free(&resampled_frame);
-                    goto end;
-                }
+    end:
+    /* The frames still in the links may hold buffers of the decoder, they go first */
+    pipeline_link_destroy(&pipeline.packets);
+    pipeline_link_destroy(&pipeline.decoded);
+    pipeline_link_destroy(&pipeline.resampled);
+    av_packet_free(&pipeline.encoded_packet);
+    av_frame_free(&pipeline.converted);
+    if (pipeline.fifo) {
+        av_audio_fifo_free(pipeline.fifo);
+    }
+    close_sample_converter(&pipeline.converter);
+    audio_pool_close_codec(&pipeline.decoder);
+    audio_pool_close_codec(&pipeline.encoder);
+    close_audio_input(&pipeline.input_format_context);
+    if (pipeline.output_format_context && (pipeline.output_format_context->flags & AVFMT_FLAG_CUSTOM_IO))
+        free_stream_io(&pipeline.output_format_context->pb);
+    else if (pipeline.output_format_context && !(pipeline.output_format_context->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&pipeline.output_format_context->pb);
+    avformat_free_context(pipeline.output_format_context);
+    /* Closing the writer completes the sizes in the header */
+    if (wav_opened && wav_writer_close(&wav) != 0 && ret >= 0) {
+        fprintf(stderr, "Error while writing to the output file\n");
+        ret = AVERROR(EIO);
+    }
+
+    /* A partial output must not look like a result */
+    if (ret == AVERROR_EXIT) {
+        fprintf(stderr, "Conversion of '%s' was cancelled\n", input_path);
+    } else if (ret < 0) {
+        fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
+    }
+    if (ret < 0) {
+        unlink(output_path);
+    } else {
+        publish_loudness(&pipeline.loudness);
+    }
+    loudness_meter_free(&pipeline.loudness);
+    pthread_mutex_destroy(&pipeline.handback_lock);
+    pthread_cond_destroy(&pipeline.stage_stopped);
+    return ret < 0 ? ret : 0;
+}
 
-                resampled_frame->pts = av_rescale_q(frame->pts, input_codec_context->time_base, output_codec_context->time_base);
+/* Function to convert from AAC format to MP3 format */
+int convert_aac_to_mp3(const char *input_path, const char *output_path) {
+    return transcode_audio(input_path, "aac", output_path, AV_CODEC_ID_MP3, DEFAULT_AUDIO_BIT_RATE);
+}
 
-                ret = avcodec_send_frame(output_codec_context, resampled_frame);
-                if (ret < 0) {
-                    fprintf(stderr, "Error while sending a frame to the encoder\n");
-                    av_frame_free(&resampled_frame);
-                    goto end;
-                }
 
-                while (ret >= 0) {
-                    AVPacket *output_packet = av_packet_alloc();
-                    if (!output_packet) {
-                        fprintf(stderr, "Could not allocate AVPacket\n");
-                        ret = AVERROR(ENOMEM);
-                        av_frame_free(&resampled_frame);
-                        goto end;
-                    }
-
-                    ret = avcodec_receive_packet(output_codec_context, output_packet);
-                    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                        av_packet_free(&output_packet);
-                        break;
-                    } else if (ret < 0) {
-                        fprintf(stderr, "Error while receiving a packet from the encoder\n");
-                        av_packet_free(&output_packet);
-                        av_frame_free(&resampled_frame);
-                        goto end;
-                    }
-
-                    av_packet_rescale_ts(output_packet, output_codec_context->time_base, output_stream->time_base);
-                    output_packet->stream_index = output_stream->index;
-
-                    ret = av_interleaved_write_frame(output_format_context, output_packet);
-                    if (ret < 0) {
-                        fprintf(stderr, "Error while writing a packet to the output file\n");
-                        av_packet_free(&output_packet);
-                        av_frame_free(&resampled_frame);
-                        goto end;
-                    }
-
-                    av_packet_free(&output_packet);
-                }
+/* Function to convert from AAC format to WAV format */
+int convert_aac_to_wav(const char *input_path, const char *output_path) {
+    return transcode_audio(input_path, "aac", output_path, AV_CODEC_ID_NONE, 0);
+}
 
-                av_frame_free(&resampled_frame);
-            }
-        }
-        av_packet_unref(packet);
-    }
+/* Function to convert from MP3 format to WAV format */
+int convert_mp3_to_wav(const char *input_path, const char *output_path) {
+    return transcode_audio(input_path, "mp3", output_path, AV_CODEC_ID_NONE, 0);
+}
 
-    // Golim coada encoderului
-    ret = avcodec_send_frame(output_codec_context, NULL);
-    while (ret >= 0) {
-        AVPacket *output_packet = av_packet_alloc();
-        if (!output_packet) {
-            fprintf(stderr, "Could not allocate AVPacket\n");
-            ret = AVERROR(ENOMEM);
-            break;
-        }
 
-        ret = avcodec_receive_packet(output_codec_context, output_packet);
-        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
-            av_packet_free(&output_packet);
-            break;
-        } else if (ret < 0) {
-            fprintf(stderr, "Error while receiving a packet from the encoder\n");
-            av_packet_free(&output_packet);
-            break;
-        }
+/* Function to convert from AAC format to M4A format, the AAC stream is copied as it is */
+int convert_aac_to_m4a(const char *input_path, const char *output_path) {
+    return transcode_audio(input_path, "aac", output_path, AV_CODEC_ID_AAC, 0);
+}
 
-        av_packet_rescale_ts(output_packet, output_codec_context->time_base, output_stream->time_base);
-        output_packet->stream_index = output_stream->index;
+/* Function to convert from M4A format to AAC format */
+int convert_m4a_to_aac(const char *input_path, const char *output_path) {
+    return transcode_audio(input_path, "m4a", output_path, AV_CODEC_ID_AAC, 0);
+}
 
-        ret = av_interleaved_write_frame(output_format_context, output_packet);
-        if (ret < 0) {
-            fprintf(stderr, "Error while writing a packet to the output file\n");
-            av_packet_free(&output_packet);
-            break;
-        }
 
-        av_packet_free(&output_packet);
+int convert_wav_to_aac(const char *input_path, const char *output_path) {
+    /* Plain PCM files skip the WAV demuxer and the PCM decoder, a streamed upload isn't a file yet */
+    int ret;
+    if (!conversion_stream_current() &&
+        (ret = encode_wav_file(input_path, output_path, AV_CODEC_ID_AAC, DEFAULT_AUDIO_BIT_RATE)) != WAV_FALLBACK) {
+        return ret;
     }
+    return transcode_audio(input_path, "wav", output_path, AV_CODEC_ID_AAC, DEFAULT_AUDIO_BIT_RATE);
+}
 
-    av_write_trailer(output_format_context);
+int convert_wav_to_mp3(const char *input_path, const char *output_path) {
+    /* Plain PCM files skip the WAV demuxer and the PCM decoder, a streamed upload isn't a file yet */
+    int ret;
+    if (!conversion_stream_current() &&
+        (ret = encode_wav_file(input_path, output_path, AV_CODEC_ID_MP3, DEFAULT_AUDIO_BIT_RATE)) != WAV_FALLBACK) {
+        return ret;
+    }
+    return transcode_audio(input_path, "wav", output_path, AV_CODEC_ID_MP3, DEFAULT_AUDIO_BIT_RATE);
+}
 
-    end:
-    swr_free(&swr_ctx);
-    av_packet_free(&packet);
-    av_frame_free(&frame);
-    avcodec_free_context(&input_codec_context);
-    avcodec_free_context(&output_codec_context);
-    avformat_close_input(&input_format_context);
-    if (output_format_context && !(output_format_context->oformat->flags & AVFMT_NOFILE))
-        avio_closep(&output_format_context->pb);
-    avformat_free_context(output_format_context);
 
-    if (ret < 0 && ret != AVERROR_EOF) {
-        fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
-        exit(1);
-    }
+/* Adds the audio conversions to the registry, MP3 to AAC (option 3) is planned through WAV.
+ * Conversions to MP3 and AAC can stream; WAV output has its sizes written last, M4A needs seeking. */
+void register_audio_converters(void) {
+    register_converter(1, FORMAT_AAC, FORMAT_MP3, convert_aac_to_mp3, ".mp3", COST_CLASS_AUDIO);
+    register_converter(2, FORMAT_AAC, FORMAT_WAV, convert_aac_to_wav, ".wav", COST_CLASS_AUDIO);
+    register_converter(3, FORMAT_MP3, FORMAT_AAC, NULL, ".aac", COST_CLASS_AUDIO);
+    register_converter(4, FORMAT_MP3, FORMAT_WAV, convert_mp3_to_wav, ".wav", COST_CLASS_AUDIO);
+    register_converter(5, FORMAT_WAV, FORMAT_AAC, convert_wav_to_aac, ".aac", COST_CLASS_AUDIO);
+    register_converter(6, FORMAT_WAV, FORMAT_MP3, convert_wav_to_mp3, ".mp3", COST_CLASS_AUDIO);
+    register_converter(18, FORMAT_AAC, FORMAT_M4A, convert_aac_to_m4a, ".m4a", COST_CLASS_AUDIO);
+    register_converter(19, FORMAT_M4A, FORMAT_AAC, convert_m4a_to_aac, ".aac", COST_CLASS_AUDIO);
+    registry_set_streaming(1);
+    registry_set_streaming(5);
+    registry_set_streaming(6);
 }
@@ -8,11 +8,24 @@
 #ifndef PROIECT_FINAL_CONVERSII_AUDIO_H
 #define PROIECT_FINAL_CONVERSII_AUDIO_H
 
-// AUDIO
-void convert_aac_to_mp3(const char *input_path, const char *output_path);
-void convert_aac_to_wav(const char *input_path, const char *output_path);
-void convert_mp3_to_wav(const char *input_path, const char *output_path);
-void convert_wav_to_aac(const char *input_path, const char *output_path);
-void convert_wav_to_mp3(const char *input_path, const char *output_path);
+// AUDIO, the converters return 0 on success and a negative AVERROR code on failure
+int convert_aac_to_mp3(const char *input_path, const char *output_path);
+int convert_aac_to_wav(const char *input_path, const char *output_path);
+int convert_mp3_to_wav(const char *input_path, const char *output_path);
+int convert_wav_to_aac(const char *input_path, const char *output_path);
+int convert_wav_to_mp3(const char *input_path, const char *output_path);
+int convert_aac_to_m4a(const char *input_path, const char *output_path);
+int convert_m4a_to_aac(const char *input_path, const char *output_path);
+
+// Adds the audio conversions to the registry
+void register_audio_converters(void);
+
+// On by default: each converter opens its input with the demuxer of the format it expects and
+// takes the stream parameters from the headers. Off restores full probing with avformat_find_stream_info
+void audio_set_hinted_probing(int enabled);
+
+// On by default: a conversion that keeps the sample rate converts the sample format and mixes
+// mono and stereo with the SIMD kernels of sample_convert.c. Off leaves it all to libswresample
+void audio_set_sample_kernels(int enabled);
 
 #endif //PROIECT_FINAL_CONVERSII_AUDIO_H
@@ -0,0 +1,182 @@
+#include "conversion_stream.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "cancel.h"
+#include "metrics.h"
+#include "protocol.h"
+
+#define STREAM_INPUT_OPEN 0
+#define STREAM_INPUT_ENDED 1
+#define STREAM_INPUT_FAILED 2
+
+// How often a converter waiting for upload bytes checks whether it was cancelled
+#define STREAM_CANCEL_POLL_MS 200
+
+static _Thread_local ConversionStream *current_stream = NULL;
+
+int conversion_stream_init(ConversionStream *stream, int client_fd) {
+    stream->data = malloc(CONVERSION_STREAM_BUFFER_SIZE);
+    if (!stream->data) {
+        return -1;
+    }
+    stream->capacity = CONVERSION_STREAM_BUFFER_SIZE;
+    stream->start = 0;
+    stream->length = 0;
+    stream->input_state = STREAM_INPUT_OPEN;
+    stream->reader_done = 0;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->changed, NULL);
+    stream->client_fd = client_fd;
+    stream->output_fd = -1;
+    stream->copy_failed = 0;
+    stream->bytes_sent = 0;
+    stream->send_failed = 0;
+    return 0;
+}
+
+void conversion_stream_destroy(ConversionStream *stream) {
+    free(stream->data);
+    stream->data = NULL;
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->changed);
+}
+
+int conversion_stream_write_input(ConversionStream *stream, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    pthread_mutex_lock(&stream->lock);
+    while (size > 0 && !stream->reader_done) {
+        if (stream->length == stream->capacity) {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+            continue;
+        }
+        size_t end = (stream->start + stream->length) % stream->capacity;
+        size_t take = stream->capacity - stream->length;
+        if (take > stream->capacity - end) {
+            take = stream->capacity - end;
+        }
+        if (take > size) {
+            take = size;
+        }
+        memcpy(stream->data + end, bytes, take);
+        stream->length += take;
+        bytes += take;
+        size -= take;
+        pthread_cond_broadcast(&stream->changed);
+    }
+    int result = stream->reader_done ? -1 : 0;
+    pthread_mutex_unlock(&stream->lock);
+    return result;
+}
+
+void conversion_stream_end_input(ConversionStream *stream, int failed) {
+    pthread_mutex_lock(&stream->lock);
+    stream->input_state = failed ? STREAM_INPUT_FAILED : STREAM_INPUT_ENDED;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+ssize_t conversion_stream_read_input(ConversionStream *stream, void *data, size_t size) {
+    pthread_mutex_lock(&stream->lock);
+    // A stalled upload must not keep the worker past the deadline of the conversion
+    while (stream->length == 0 && stream->input_state == STREAM_INPUT_OPEN && !cancel_requested()) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += STREAM_CANCEL_POLL_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&stream->changed, &stream->lock, &until);
+    }
+
+    ssize_t result;
+    if (stream->input_state == STREAM_INPUT_FAILED || cancel_requested()) {
+        result = -1;
+    } else {
+        size_t take = stream->length;
+        if (take > stream->capacity - stream->start) {
+            take = stream->capacity - stream->start;
+        }
+        if (take > size) {
+            take = size;
+        }
+        memcpy(data, stream->data + stream->start, take);
+        stream->start = (stream->start + take) % stream->capacity;
+        stream->length -= take;
+        pthread_cond_broadcast(&stream->changed);
+        result = take;
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return result;
+}
+
+void conversion_stream_stop_reading(ConversionStream *stream) {
+    pthread_mutex_lock(&stream->lock);
+    stream->reader_done = 1;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+// The client may be gone, which must fail the conversion instead of raising SIGPIPE
+static int send_all(int fd, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    while (size > 0) {
+        ssize_t n = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int conversion_stream_write_output(ConversionStream *stream, const void *data, size_t size) {
+    if (stream->send_failed) {
+        return -1;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    // The copy for the cache is best effort, the client's result is what counts
+    if (stream->output_fd != -1 && !stream->copy_failed &&
+        write(stream->output_fd, data, size) != (ssize_t)size) {
+        stream->copy_failed = 1;
+    }
+
+    uint32_t chunk_size = size;
+    if (send_all(stream->client_fd, &chunk_size, sizeof(chunk_size)) != 0 ||
+        send_all(stream->client_fd, data, size) != 0) {
+        stream->send_failed = 1;
+        return -1;
+    }
+    stream->bytes_sent += size;
+    metrics_add(METRIC_BYTES_SENT, size);
+    return 0;
+}
+
+void conversion_stream_end_output(ConversionStream *stream, int failed, const ResultMetadata *metadata) {
+    uint32_t end = failed ? RESULT_CHUNK_FAILED : 0;
+    if (!stream->send_failed && send_all(stream->client_fd, &end, sizeof(end)) != 0) {
+        stream->send_failed = 1;
+    }
+    if (!failed && !stream->send_failed && send_all(stream->client_fd, metadata, sizeof(*metadata)) != 0) {
+        stream->send_failed = 1;
+    }
+}
+
+void conversion_stream_set_current(ConversionStream *stream) {
+    current_stream = stream;
+}
+
+ConversionStream *conversion_stream_current(void) {
+    return current_stream;
+}
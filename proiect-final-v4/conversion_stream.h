@@ -0,0 +1,58 @@
+#ifndef CONVERSION_STREAM_H
+#define CONVERSION_STREAM_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "protocol.h"
+
+// Upload bytes buffered between the connection thread and the worker
+#define CONVERSION_STREAM_BUFFER_SIZE (1 << 20)
+
+// A conversion that starts on the first bytes of the upload: the connection thread passes the
+// upload on as it arrives, and the converter sends its output to the client in chunks while
+// it is still reading. A copy of the output goes to a file for the cache.
+typedef struct {
+    uint8_t *data;              // ring buffer of upload bytes
+    size_t capacity;
+    size_t start;               // next byte the converter reads
+    size_t length;              // bytes buffered
+    int input_state;            // STREAM_INPUT_*
+    int reader_done;            // the converter reads no more, further input is dropped
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    int client_fd;
+    int output_fd;              // copy of the output, -1 for none; owned by the caller
+    int copy_failed;            // the copy is incomplete and must not be cached
+    size_t bytes_sent;
+    int send_failed;
+} ConversionStream;
+
+// Returns -1 when out of memory; the caller sets output_fd once the output file exists
+int conversion_stream_init(ConversionStream *stream, int client_fd);
+void conversion_stream_destroy(ConversionStream *stream);
+
+// Connection thread. Blocks while the buffer is full; returns -1 once the converter stopped reading.
+int conversion_stream_write_input(ConversionStream *stream, const void *data, size_t size);
+// No more input follows; failed when the upload broke off or didn't match its header
+void conversion_stream_end_input(ConversionStream *stream, int failed);
+// Ends the chunked result once the worker is done: a 0 chunk followed by the metadata of the
+// result, or RESULT_CHUNK_FAILED
+void conversion_stream_end_output(ConversionStream *stream, int failed, const ResultMetadata *metadata);
+
+// Worker. Blocks while the buffer is empty; returns 0 at the end of the upload and -1 when
+// it failed or the conversion was cancelled.
+ssize_t conversion_stream_read_input(ConversionStream *stream, void *data, size_t size);
+// Sends one chunk of output to the client and appends it to the copy; -1 once the client is gone
+int conversion_stream_write_output(ConversionStream *stream, const void *data, size_t size);
+// The conversion finished, successful or not; wakes a connection thread waiting for room
+void conversion_stream_stop_reading(ConversionStream *stream);
+
+// Converters have a fixed signature, so the stream of the conversion running on a thread is
+// published for them here. NULL when the conversion reads and writes files.
+void conversion_stream_set_current(ConversionStream *stream);
+ConversionStream *conversion_stream_current(void);
+
+#endif // CONVERSION_STREAM_H
@@ -0,0 +1,174 @@
+#include "cost.h"
+#include "planner.h"
+#include "sniff.h"
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Observations needed before the fitted model replaces the registry estimate
+#define COST_MIN_SAMPLES 3
+// Older observations fade out so the model follows load and hardware changes
+#define COST_DECAY 0.98
+// Estimates are clamped to this, no conversion is expected to take longer
+#define COST_MAX_ESTIMATE_MS (60 * 60 * 1000.0)
+
+// Running sums for a least-squares line: elapsed_ms = intercept + slope * x
+typedef struct {
+    double n;
+    double sum_x;
+    double sum_y;
+    double sum_xx;
+    double sum_xy;
+    unsigned long samples;
+} CostFit;
+
+static pthread_mutex_t cost_mutex = PTHREAD_MUTEX_INITIALIZER;
+static CostFit fits[MAX_CONVERSION_OPTIONS];
+
+// Megapixels for images when known, megabytes otherwise
+static double cost_feature(size_t input_bytes, uint64_t pixels) {
+    if (pixels > 0) {
+        return pixels / 1e6;
+    }
+    return input_bytes / (1024.0 * 1024.0);
+}
+
+double cost_model_estimate(const Converter *converter, size_t input_bytes, uint64_t pixels) {
+    double x = cost_feature(input_bytes, pixels);
+    double estimate = -1;
+
+    pthread_mutex_lock(&cost_mutex);
+    const CostFit *fit = &fits[converter->option];
+    if (fit->samples >= COST_MIN_SAMPLES) {
+        double mean_x = fit->sum_x / fit->n;
+        double mean_y = fit->sum_y / fit->n;
+        double var_x = fit->sum_xx / fit->n - mean_x * mean_x;
+        double slope, intercept;
+
+        if (var_x > 1e-9) {
+            slope = (fit->sum_xy / fit->n - mean_x * mean_y) / var_x;
+            intercept = mean_y - slope * mean_x;
+        } else {
+            // All inputs had the same size so far, scale the mean time instead
+            slope = mean_x > 0 ? mean_y / mean_x : 0;
+            intercept = mean_x > 0 ? 0 : mean_y;
+        }
+        if (slope < 0) {
+            slope = 0;
+            intercept = mean_y;
+        }
+        if (intercept < 0) {
+            intercept = 0;
+        }
+        estimate = intercept + slope * x;
+    }
+    pthread_mutex_unlock(&cost_mutex);
+
+    if (estimate < 0) {
+        estimate = planner_estimate_cost(converter, input_bytes);
+    }
+    return estimate < COST_MAX_ESTIMATE_MS ? estimate : COST_MAX_ESTIMATE_MS;
+}
+
+void cost_model_observe(const Converter *converter, size_t input_bytes, uint64_t pixels, double elapsed_ms) {
+    double x = cost_feature(input_bytes, pixels);
+
+    pthread_mutex_lock(&cost_mutex);
+    CostFit *fit = &fits[converter->option];
+    fit->n = fit->n * COST_DECAY + 1;
+    fit->sum_x = fit->sum_x * COST_DECAY + x;
+    fit->sum_y = fit->sum_y * COST_DECAY + elapsed_ms;
+    fit->sum_xx = fit->sum_xx * COST_DECAY + x * x;
+    fit->sum_xy = fit->sum_xy * COST_DECAY + x * elapsed_ms;
+    fit->samples++;
+    pthread_mutex_unlock(&cost_mutex);
+}
+
+static uint32_t read_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint32_t read_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Walk the JPEG markers up to the start-of-frame segment holding the dimensions, 0 if it isn't in the buffer
+static uint64_t jpeg_pixels_from_header(const uint8_t *header, size_t length) {
+    size_t offset = 2;
+
+    if (length < 2 || header[0] != 0xFF || header[1] != 0xD8) {
+        return 0;
+    }
+    while (offset + 4 <= length) {
+        if (header[offset] != 0xFF) {
+            return 0;
+        }
+        uint8_t marker = header[offset + 1];
+        size_t segment_length = (header[offset + 2] << 8) | header[offset + 3];
+        int is_sof = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+
+        if (is_sof) {
+            if (offset + 9 > length) {
+                return 0;
+            }
+            uint32_t height = (header[offset + 5] << 8) | header[offset + 6];
+            uint32_t width = (header[offset + 7] << 8) | header[offset + 8];
+            return (uint64_t)width * height;
+        }
+        if (segment_length < 2) {
+            return 0;
+        }
+        offset += 2 + segment_length;
+    }
+    return 0;
+}
+
+static uint64_t clamp_pixels(uint64_t pixels) {
+    return pixels < COST_MAX_PIXELS ? pixels : COST_MAX_PIXELS;
+}
+
+uint64_t image_pixels_from_header(const uint8_t *header, size_t length, FileFormat format, uint64_t file_size) {
+    if (format == FORMAT_BMP && length >= 26) {
+        int32_t width = (int32_t)read_le32(header + 18);
+        int32_t height = (int32_t)read_le32(header + 22);
+        uint64_t pixels = (uint64_t)(width < 0 ? -(int64_t)width : width) *
+                          (uint64_t)(height < 0 ? -(int64_t)height : height);
+        // The pixels are stored uncompressed, at least one bit each
+        if (pixels / 8 > file_size) {
+            pixels = file_size * 8;
+        }
+        return clamp_pixels(pixels);
+    }
+    if (format == FORMAT_PNG && length >= 24) {
+        // IHDR is always the first PNG chunk
+        return clamp_pixels((uint64_t)read_be32(header + 16) * read_be32(header + 20));
+    }
+    if (format == FORMAT_JPEG) {
+        return clamp_pixels(jpeg_pixels_from_header(header, length));
+    }
+    return 0;
+}
+
+uint64_t read_image_pixels(const char *path, FileFormat format) {
+    // Only the bytes the client announces before the upload, so admission sees the same pixel count
+    unsigned char header[SNIFF_PREFIX_SIZE];
+
+    if (format != FORMAT_BMP && format != FORMAT_PNG && format != FORMAT_JPEG) {
+        return 0;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0) {
+        fclose(file);
+        return 0;
+    }
+
+    size_t length = fread(header, 1, sizeof(header), file);
+    fclose(file);
+    return image_pixels_from_header(header, length, format, st.st_size);
+}
@@ -0,0 +1,24 @@
+#ifndef COST_H
+#define COST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "registry.h"
+
+// Per-converter model of the conversion time, fitted online from observed durations.
+// Image conversions are modelled on the pixel count, the others on the input size.
+
+double cost_model_estimate(const Converter *converter, size_t input_bytes, uint64_t pixels);
+void cost_model_observe(const Converter *converter, size_t input_bytes, uint64_t pixels, double elapsed_ms);
+
+// Pixel counts above this are taken as this, the headers come from the client
+#define COST_MAX_PIXELS (1ULL << 28)
+
+// Pixel count from the image header in the first SNIFF_PREFIX_SIZE bytes of the file, like the upload prefix.
+// 0 if the file isn't a BMP, PNG or JPEG or its dimensions aren't in those bytes; it is then modelled on its size.
+uint64_t read_image_pixels(const char *path, FileFormat format);
+
+// Same for the first bytes of a BMP, PNG or JPEG file of file_size bytes, e.g. an upload prefix
+uint64_t image_pixels_from_header(const uint8_t *header, size_t length, FileFormat format, uint64_t file_size);
+
+#endif // COST_H
@@ -0,0 +1,51 @@
+#include "encoder_options.h"
+#include <string.h>
+#include "hash.h"
+
+static const EncoderOptions default_options;
+static _Thread_local const EncoderOptions *current_options = NULL;
+
+void encoder_options_sanitize(EncoderOptions *options) {
+    if (options->audio_bit_rate < AUDIO_BIT_RATE_MIN || options->audio_bit_rate > AUDIO_BIT_RATE_MAX) {
+        options->audio_bit_rate = 0;
+    }
+    if (options->audio_sample_rate < AUDIO_SAMPLE_RATE_MIN || options->audio_sample_rate > AUDIO_SAMPLE_RATE_MAX) {
+        options->audio_sample_rate = 0;
+    }
+    if (options->audio_channels > 2) {
+        options->audio_channels = 0;
+    }
+    if (options->audio_vbr_quality > 10) {
+        options->audio_vbr_quality = 0;
+    }
+    if (options->jpeg_quality > 100) {
+        options->jpeg_quality = 0;
+    }
+    if (options->jpeg_subsampling > JPEG_SUBSAMPLING_420) {
+        options->jpeg_subsampling = 0;
+    }
+    if (options->png_level > 9) {
+        options->png_level = 0;
+    }
+    memset(options->reserved, 0, sizeof(options->reserved));
+}
+
+uint64_t encoder_options_hash(const EncoderOptions *options) {
+    if (memcmp(options, &default_options, sizeof(*options)) == 0) {
+        return 0;
+    }
+    return hash_bytes(options, sizeof(*options), 0);
+}
+
+int encoder_options_audio_set(const EncoderOptions *options) {
+    return options->audio_bit_rate || options->audio_sample_rate || options->audio_channels ||
+           options->audio_vbr_quality;
+}
+
+void encoder_options_set_current(const EncoderOptions *options) {
+    current_options = options;
+}
+
+const EncoderOptions *encoder_options_current(void) {
+    return current_options ? current_options : &default_options;
+}
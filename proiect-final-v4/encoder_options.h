@@ -0,0 +1,31 @@
+#ifndef ENCODER_OPTIONS_H
+#define ENCODER_OPTIONS_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+// Defaults when the client leaves a setting at 0
+#define DEFAULT_AUDIO_BIT_RATE 192000
+#define DEFAULT_JPEG_QUALITY 75
+#define DEFAULT_PNG_LEVEL 6
+
+#define AUDIO_SAMPLE_RATE_MIN 8000
+#define AUDIO_SAMPLE_RATE_MAX 192000
+#define AUDIO_BIT_RATE_MIN 8000
+#define AUDIO_BIT_RATE_MAX 640000
+
+// Resets the values the server doesn't accept to 0, i.e. to the default
+void encoder_options_sanitize(EncoderOptions *options);
+
+// Part of the cache key of a result; 0 for the defaults, so those results keep their entries
+uint64_t encoder_options_hash(const EncoderOptions *options);
+
+// Nonzero if any audio setting differs from the default
+int encoder_options_audio_set(const EncoderOptions *options);
+
+// Converters have a fixed signature, so the options of the conversion running on a
+// thread are published for them here. Never NULL: all defaults when none were set.
+void encoder_options_set_current(const EncoderOptions *options);
+const EncoderOptions *encoder_options_current(void);
+
+#endif // ENCODER_OPTIONS_H
@@ -0,0 +1,245 @@
+#include "hash.h"
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t merge_round64(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+void hash_init(HashState *state, uint64_t seed) {
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->v[0] = seed + PRIME64_1 + PRIME64_2;
+    state->v[1] = seed + PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - PRIME64_1;
+}
+
+void hash_update(HashState *state, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + len;
+
+    state->total_len += len;
+
+    // Not enough for a full stripe yet, keep it for later
+    if (state->mem_size + len < 32) {
+        memcpy(state->mem + state->mem_size, p, len);
+        state->mem_size += (uint32_t)len;
+        return;
+    }
+
+    // Complete the buffered stripe first
+    if (state->mem_size) {
+        size_t fill = 32 - state->mem_size;
+        memcpy(state->mem + state->mem_size, p, fill);
+        state->v[0] = round64(state->v[0], read64(state->mem));
+        state->v[1] = round64(state->v[1], read64(state->mem + 8));
+        state->v[2] = round64(state->v[2], read64(state->mem + 16));
+        state->v[3] = round64(state->v[3], read64(state->mem + 24));
+        p += fill;
+        state->mem_size = 0;
+    }
+
+    // Process full 32-byte stripes straight from the input
+    while (p + 32 <= end) {
+        state->v[0] = round64(state->v[0], read64(p));
+        state->v[1] = round64(state->v[1], read64(p + 8));
+        state->v[2] = round64(state->v[2], read64(p + 16));
+        state->v[3] = round64(state->v[3], read64(p + 24));
+        p += 32;
+    }
+
+    if (p < end) {
+        memcpy(state->mem, p, end - p);
+        state->mem_size = (uint32_t)(end - p);
+    }
+}
+
+uint64_t hash_final(const HashState *state) {
+    uint64_t h;
+    const uint8_t *p = state->mem;
+    const uint8_t *end = p + state->mem_size;
+
+    if (state->total_len >= 32) {
+        h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) + rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        h = merge_round64(h, state->v[0]);
+        h = merge_round64(h, state->v[1]);
+        h = merge_round64(h, state->v[2]);
+        h = merge_round64(h, state->v[3]);
+    } else {
+        h = state->seed + PRIME64_5;
+    }
+    h += state->total_len;
+
+    while (p + 8 <= end) {
+        h ^= round64(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    // Final avalanche
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed) {
+    HashState state;
+    hash_init(&state, seed);
+    hash_update(&state, data, len);
+    return hash_final(&state);
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_block(uint32_t h[8], const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+void digest_init(DigestState *state) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memset(state, 0, sizeof(*state));
+    memcpy(state->h, initial, sizeof(initial));
+}
+
+void digest_update(DigestState *state, const void *data, size_t len) {
+    const uint8_t *p = data;
+    state->total_len += len;
+
+    if (state->block_size > 0) {
+        size_t take = sizeof(state->block) - state->block_size;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(state->block + state->block_size, p, take);
+        state->block_size += take;
+        p += take;
+        len -= take;
+        if (state->block_size < sizeof(state->block)) {
+            return;
+        }
+        sha256_block(state->h, state->block);
+        state->block_size = 0;
+    }
+
+    for (; len >= sizeof(state->block); p += sizeof(state->block), len -= sizeof(state->block)) {
+        sha256_block(state->h, p);
+    }
+    memcpy(state->block, p, len);
+    state->block_size = len;
+}
+
+void digest_final(const DigestState *state, uint8_t digest[CONTENT_DIGEST_SIZE]) {
+    // Padding works on a copy, so the state can take more data afterwards like the hash above
+    DigestState last = *state;
+    uint64_t bits = last.total_len * 8;
+    static const uint8_t padding[64] = {0x80};
+    size_t pad = last.block_size < 56 ? 56 - last.block_size : 120 - last.block_size;
+    uint8_t length[8];
+    for (int i = 0; i < 8; i++) {
+        length[i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    digest_update(&last, padding, pad);
+    digest_update(&last, length, sizeof(length));
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t)(last.h[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(last.h[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(last.h[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)last.h[i];
+    }
+}
+
+void digest_bytes(const void *data, size_t len, uint8_t digest[CONTENT_DIGEST_SIZE]) {
+    DigestState state;
+    digest_init(&state);
+    digest_update(&state, data, len);
+    digest_final(&state, digest);
+}
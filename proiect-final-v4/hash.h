@@ -0,0 +1,38 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming 64-bit hash (XXH64 algorithm), for keys that no client controls
+typedef struct {
+    uint64_t total_len;
+    uint64_t v[4];
+    uint8_t mem[32];
+    uint32_t mem_size;
+    uint64_t seed;
+} HashState;
+
+void hash_init(HashState *state, uint64_t seed);
+void hash_update(HashState *state, const void *data, size_t len);
+uint64_t hash_final(const HashState *state);
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed);
+
+#define CONTENT_DIGEST_SIZE 32
+
+// Streaming SHA-256, the digest that keys uploaded content in the shared cache. A client can
+// name content without uploading it, so matching another client's file must be infeasible,
+// which a 64-bit hash doesn't guarantee.
+typedef struct {
+    uint32_t h[8];
+    uint64_t total_len;
+    uint8_t block[64];
+    uint32_t block_size;
+} DigestState;
+
+void digest_init(DigestState *state);
+void digest_update(DigestState *state, const void *data, size_t len);
+void digest_final(const DigestState *state, uint8_t digest[CONTENT_DIGEST_SIZE]);
+void digest_bytes(const void *data, size_t len, uint8_t digest[CONTENT_DIGEST_SIZE]);
+
+#endif // HASH_H
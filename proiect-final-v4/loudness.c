@@ -0,0 +1,260 @@
+#include "loudness.h"
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOUDNESS_BLOCK_STEPS 4
+#define LOUDNESS_ABSOLUTE_GATE_LUFS -70.0
+#define LOUDNESS_RELATIVE_GATE_LU -10.0
+// The K-weighting adds about this much at 1 kHz, the loudness of a full-scale sine is 0 LUFS
+#define LOUDNESS_OFFSET -0.691
+
+static double energy_to_lufs(double energy) {
+    return LOUDNESS_OFFSET + 10.0 * log10(energy);
+}
+
+static double lufs_to_energy(double lufs) {
+    return pow(10.0, (lufs - LOUDNESS_OFFSET) / 10.0);
+}
+
+// The filter coefficients of BS.1770 are given for 48 kHz; these are the analog prototypes
+// they come from, taken to the actual sample rate by the bilinear transform
+static void init_k_weighting(LoudnessMeter *meter) {
+    double f0 = 1681.974450955533;
+    double gain_db = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / meter->sample_rate);
+    double vh = pow(10.0, gain_db / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    meter->shelf_b[0] = (vh + vb * k / q + k * k) / a0;
+    meter->shelf_b[1] = 2.0 * (k * k - vh) / a0;
+    meter->shelf_b[2] = (vh - vb * k / q + k * k) / a0;
+    meter->shelf_a[0] = 1.0;
+    meter->shelf_a[1] = 2.0 * (k * k - 1.0) / a0;
+    meter->shelf_a[2] = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / meter->sample_rate);
+    a0 = 1.0 + k / q + k * k;
+    meter->highpass_b[0] = 1.0;
+    meter->highpass_b[1] = -2.0;
+    meter->highpass_b[2] = 1.0;
+    meter->highpass_a[0] = 1.0;
+    meter->highpass_a[1] = 2.0 * (k * k - 1.0) / a0;
+    meter->highpass_a[2] = (1.0 - k / q + k * k) / a0;
+}
+
+// Hann-windowed sinc interpolator, split into one filter per phase of the oversampled signal
+static void init_peak_filter(LoudnessMeter *meter) {
+    int factor = meter->oversampling;
+    int taps = factor * LOUDNESS_PEAK_TAPS;
+    for (int j = 0; j < taps; j++) {
+        double m = j - (taps - 1) / 2.0;
+        double x = M_PI * m / factor;
+        double window = 0.5 * (1.0 - cos(2.0 * M_PI * (j + 1) / (taps + 1)));
+        meter->peak_filter[j % factor][j / factor] = (float)((fabs(x) < 1e-9 ? 1.0 : sin(x) / x) * window);
+    }
+}
+
+int loudness_meter_init(LoudnessMeter *meter, int sample_rate, int channels, const double *weights,
+                        SampleFormat format) {
+    memset(meter, 0, sizeof(*meter));
+    if (channels < 1 || channels > SAMPLE_CONVERT_MAX_CHANNELS || sample_rate < 8000 || sample_rate > 768000) {
+        return -1;
+    }
+    if (format != SAMPLE_FORMAT_FLTP &&
+        sample_conversion_init(&meter->conversion, format, channels, SAMPLE_FORMAT_FLTP, channels) != 0) {
+        return -1;
+    }
+    meter->sample_rate = sample_rate;
+    meter->channels = channels;
+    meter->format = format;
+    for (int c = 0; c < channels; c++) {
+        meter->weights[c] = weights ? weights[c] : 1.0;
+    }
+    meter->step_samples = (sample_rate + 5) / 10;
+    meter->oversampling = sample_rate < 96000 ? 4 : sample_rate < 192000 ? 2 : 1;
+    init_k_weighting(meter);
+    init_peak_filter(meter);
+    return 0;
+}
+
+void loudness_meter_free(LoudnessMeter *meter) {
+    sample_conversion_free(&meter->conversion);
+    free(meter->converted);
+    free(meter->blocks);
+    meter->converted = NULL;
+    meter->blocks = NULL;
+}
+
+// Returns the sum of squares of the K-weighted samples
+static double weighted_energy(LoudnessMeter *meter, int channel, const float *in, int samples) {
+    const double *sb = meter->shelf_b, *sa = meter->shelf_a;
+    const double *hb = meter->highpass_b, *ha = meter->highpass_a;
+    double *s = meter->filter_state[channel];
+    double sum = 0;
+    for (int i = 0; i < samples; i++) {
+        double x = in[i];
+        double y = sb[0] * x + s[0];
+        s[0] = sb[1] * x - sa[1] * y + s[1];
+        s[1] = sb[2] * x - sa[2] * y;
+        double z = hb[0] * y + s[2];
+        s[2] = hb[1] * y - ha[1] * z + s[3];
+        s[3] = hb[2] * y - ha[2] * z;
+        sum += z * z;
+    }
+    // Silence after a signal would otherwise leave the states decaying through denormals
+    for (int k = 0; k < 4; k++) {
+        if (fabs(s[k]) < DBL_MIN) {
+            s[k] = 0.0;
+        }
+    }
+    return sum;
+}
+
+static void measure_peak(LoudnessMeter *meter, const float *const *planes, int samples) {
+    float peak = meter->peak;
+    if (meter->oversampling == 1) {
+        for (int c = 0; c < meter->channels; c++) {
+            for (int i = 0; i < samples; i++) {
+                peak = fabsf(planes[c][i]) > peak ? fabsf(planes[c][i]) : peak;
+            }
+        }
+        meter->peak = peak;
+        return;
+    }
+
+    int position = meter->history_position;
+    for (int i = 0; i < samples; i++) {
+        position = position == 0 ? LOUDNESS_PEAK_TAPS - 1 : position - 1;
+        for (int c = 0; c < meter->channels; c++) {
+            float *history = meter->history[c];
+            history[position] = history[position + LOUDNESS_PEAK_TAPS] = planes[c][i];
+            const float *window = history + position;
+            peak = fabsf(window[0]) > peak ? fabsf(window[0]) : peak;
+            for (int phase = 0; phase < meter->oversampling; phase++) {
+                const float *filter = meter->peak_filter[phase];
+                float y = 0;
+                for (int k = 0; k < LOUDNESS_PEAK_TAPS; k++) {
+                    y += filter[k] * window[k];
+                }
+                peak = fabsf(y) > peak ? fabsf(y) : peak;
+            }
+        }
+    }
+    meter->history_position = position;
+    meter->peak = peak;
+}
+
+// A step completes a 400 ms block with the three before it
+static int finish_step(LoudnessMeter *meter) {
+    if (meter->previous_count == LOUDNESS_BLOCK_STEPS - 1) {
+        if (meter->block_count == meter->block_capacity) {
+            size_t capacity = meter->block_capacity ? meter->block_capacity * 2 : 1024;
+            double *blocks = realloc(meter->blocks, capacity * sizeof(double));
+            if (!blocks) {
+                return -1;
+            }
+            meter->blocks = blocks;
+            meter->block_capacity = capacity;
+        }
+        double energy = meter->step_energy;
+        for (int i = 0; i < LOUDNESS_BLOCK_STEPS - 1; i++) {
+            energy += meter->previous_steps[i];
+        }
+        meter->blocks[meter->block_count++] = energy / ((double)LOUDNESS_BLOCK_STEPS * meter->step_samples);
+    } else {
+        meter->previous_count++;
+    }
+    memmove(meter->previous_steps + 1, meter->previous_steps,
+            (LOUDNESS_BLOCK_STEPS - 2) * sizeof(meter->previous_steps[0]));
+    meter->previous_steps[0] = meter->step_energy;
+    meter->step_energy = 0;
+    meter->step_position = 0;
+    return 0;
+}
+
+static int measure(LoudnessMeter *meter, const float *const *planes, int samples) {
+    measure_peak(meter, planes, samples);
+    for (int done = 0; done < samples;) {
+        int count = meter->step_samples - meter->step_position;
+        count = count < samples - done ? count : samples - done;
+        for (int c = 0; c < meter->channels; c++) {
+            if (meter->weights[c] > 0) {
+                meter->step_energy += meter->weights[c] * weighted_energy(meter, c, planes[c] + done, count);
+            }
+        }
+        meter->step_position += count;
+        done += count;
+        if (meter->step_position == meter->step_samples && finish_step(meter) != 0) {
+            return -1;
+        }
+    }
+    meter->samples += samples;
+    return 0;
+}
+
+int loudness_meter_add(LoudnessMeter *meter, const uint8_t *const *data, int samples) {
+    if (meter->format == SAMPLE_FORMAT_FLTP) {
+        return measure(meter, (const float *const *)data, samples);
+    }
+
+    int channels = meter->channels;
+    if (!meter->converted &&
+        !(meter->converted = malloc((size_t)channels * LOUDNESS_CHUNK_SAMPLES * sizeof(float)))) {
+        return -1;
+    }
+
+    int planar = meter->format == SAMPLE_FORMAT_S16P;
+    size_t sample_size = meter->format == SAMPLE_FORMAT_FLT ? sizeof(float) : sizeof(int16_t);
+    uint8_t *planes[SAMPLE_CONVERT_MAX_CHANNELS];
+    const uint8_t *chunk[SAMPLE_CONVERT_MAX_CHANNELS];
+    for (int c = 0; c < channels; c++) {
+        planes[c] = (uint8_t *)(meter->converted + (size_t)c * LOUDNESS_CHUNK_SAMPLES);
+    }
+    for (int done = 0; done < samples; done += LOUDNESS_CHUNK_SAMPLES) {
+        int count = samples - done < LOUDNESS_CHUNK_SAMPLES ? samples - done : LOUDNESS_CHUNK_SAMPLES;
+        for (int c = 0; c < (planar ? channels : 1); c++) {
+            chunk[c] = data[c] + (size_t)done * sample_size * (planar ? 1 : channels);
+        }
+        if (sample_conversion_run(&meter->conversion, planes, chunk, count) != 0 ||
+            measure(meter, (const float *const *)planes, count) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void loudness_meter_result(const LoudnessMeter *meter, LoudnessResult *result) {
+    double absolute_gate = lufs_to_energy(LOUDNESS_ABSOLUTE_GATE_LUFS);
+    double sum = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < meter->block_count; i++) {
+        if (meter->blocks[i] > absolute_gate) {
+            sum += meter->blocks[i];
+            count++;
+        }
+    }
+
+    result->integrated_lufs = -HUGE_VAL;
+    if (count > 0) {
+        double relative_gate = lufs_to_energy(energy_to_lufs(sum / count) + LOUDNESS_RELATIVE_GATE_LU);
+        double gate = relative_gate > absolute_gate ? relative_gate : absolute_gate;
+        sum = 0;
+        count = 0;
+        for (size_t i = 0; i < meter->block_count; i++) {
+            if (meter->blocks[i] > gate) {
+                sum += meter->blocks[i];
+                count++;
+            }
+        }
+        if (count > 0) {
+            result->integrated_lufs = energy_to_lufs(sum / count);
+        }
+    }
+    result->true_peak_dbtp = meter->peak > 0 ? 20.0 * log10(meter->peak) : -HUGE_VAL;
+    result->duration_seconds = meter->sample_rate ? (double)meter->samples / meter->sample_rate : 0;
+}
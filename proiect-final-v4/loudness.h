@@ -0,0 +1,68 @@
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sample_convert.h"
+
+// Oversampled true peak filter: taps per phase, and the most phases (at rates under 96 kHz)
+#define LOUDNESS_PEAK_TAPS 12
+#define LOUDNESS_MAX_OVERSAMPLING 4
+// Samples converted to planar float at a time, for input in other formats
+#define LOUDNESS_CHUNK_SAMPLES 4096
+
+// Measures a stream as it is decoded, without a second pass: integrated loudness after
+// ITU-R BS.1770-4 / EBU R128 (K-weighting, 400 ms blocks every 100 ms, absolute gate at
+// -70 LUFS and relative gate 10 LU below), the true peak on the signal oversampled 4 times
+// (2 times from 96 kHz, not at all from 192 kHz), and the duration.
+typedef struct {
+    int sample_rate;
+    int channels;
+    SampleFormat format;
+    double weights[SAMPLE_CONVERT_MAX_CHANNELS];    // 1.41 for surround channels, 0 for the LFE
+    SampleConversion conversion;    // into planar float, for other input formats
+    float *converted;               // LOUDNESS_CHUNK_SAMPLES per channel
+
+    // K-weighting, a high shelf then a high pass; two transposed direct form II states each
+    double shelf_b[3], shelf_a[3];
+    double highpass_b[3], highpass_a[3];
+    double filter_state[SAMPLE_CONVERT_MAX_CHANNELS][4];
+
+    // Gating blocks are built from 100 ms steps
+    int step_samples;
+    int step_position;
+    double step_energy;             // channel-weighted sum of squares of the current step
+    double previous_steps[3];
+    int previous_count;
+    double *blocks;                 // mean square of each complete 400 ms block
+    size_t block_count;
+    size_t block_capacity;
+
+    int oversampling;
+    float peak_filter[LOUDNESS_MAX_OVERSAMPLING][LOUDNESS_PEAK_TAPS];  // per phase, newest sample first
+    float history[SAMPLE_CONVERT_MAX_CHANNELS][2 * LOUDNESS_PEAK_TAPS]; // the last samples, stored twice
+    int history_position;
+    float peak;                     // linear, over all channels
+
+    uint64_t samples;
+} LoudnessMeter;
+
+typedef struct {
+    double integrated_lufs;         // -HUGE_VAL when nothing is above the gates, e.g. silence
+    double true_peak_dbtp;          // -HUGE_VAL for digital silence
+    double duration_seconds;
+} LoudnessResult;
+
+// Samples arrive in the given format, any the sample kernels handle; weights may be NULL for
+// all 1. Returns -1 when the channel count or sample rate isn't supported.
+int loudness_meter_init(LoudnessMeter *meter, int sample_rate, int channels, const double *weights,
+                        SampleFormat format);
+void loudness_meter_free(LoudnessMeter *meter);
+
+// Adds samples per channel, a plane pointer per channel or a single pointer for interleaved
+// samples. Returns -1 when out of memory, the meter is then unusable.
+int loudness_meter_add(LoudnessMeter *meter, const uint8_t *const *data, int samples);
+
+void loudness_meter_result(const LoudnessMeter *meter, LoudnessResult *result);
+
+#endif // LOUDNESS_H
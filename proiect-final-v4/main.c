@@ -10,112 +10,407 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include "conversii_audio.h"
+#include "audio_pool.h"
 #include "conversii.h"
+#include "hash.h"
+#include "cache.h"
+#include "protocol.h"
+#include "sniff.h"
+#include "registry.h"
+#include "planner.h"
+#include "scheduler.h"
+#include "cost.h"
+#include "admission.h"
+#include "cancel.h"
+#include "encoder_options.h"
+#include "conversion_stream.h"
+#include "result_metadata.h"
+#include "metrics.h"
+#include "trace.h"
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
 
 #define PORT 8080
 #define ADMIN_SOCKET_PATH "/tmp/admin_socket"
 #define BUFFER_SIZE 4096
-
-void handle_client(int client_fd);
-void process_conversion(int client_fd, const char *input_file, int conversion_option);
+#define RESERVED_ADMIN_WORKERS 1
+// Admission control decides what gets processed, the accept queue only absorbs bursts
+#define LISTEN_BACKLOG 128
+// A conversion may run this many times its estimate, but never less than the minimum
+#define JOB_TIMEOUT_MIN_MS 60000.0
+#define JOB_TIMEOUT_COST_FACTOR 10.0
+// How often a waiting connection checks whether its client is still there
+#define DISCONNECT_POLL_MS 200
+
+// A connection and the priority its conversions get in the scheduler
+typedef struct {
+    int client_fd;
+    JobPriority priority;
+    unsigned long client_id;    // peer address, used for fair queuing between clients
+} ClientConnection;
+
+// A conversion handed to a worker thread
+typedef struct {
+    Job job;
+    const Converter *converter;
+    const char *input_file;
+    size_t input_size;
+    uint64_t pixels;
+    char output_template[BUFFER_SIZE];
+    char output_file[BUFFER_SIZE];
+    EncoderOptions options;
+    ConversionStream *stream;   // NULL unless the conversion runs during the upload
+    CancelToken cancel;
+    TraceContext trace;
+    ResultMetadata metadata;    // what the converter measured, sent after the result
+    int status;
+} ConversionJob;
+
+void handle_client(const ClientConnection *connection);
+void process_conversion(const ClientConnection *connection, const char *input_file, int conversion_option,
+                        const EncoderOptions *options, const CacheKey *cache_key);
+int start_conversion(const ClientConnection *connection, ConversionJob *conversion, const char *input_file,
+                     int conversion_option, const EncoderOptions *options, ConversionStream *stream,
+                     size_t input_size);
+void finish_conversion(const ClientConnection *connection, ConversionJob *conversion, const CacheKey *cache_key);
+void send_file_fd_to_client(int client_fd, int fd, const char *extension, const ResultMetadata *metadata);
+void send_eta(int client_fd, double eta_ms);
 
 void send_conversion_options(int client_fd, const char *extension) {
     char options[BUFFER_SIZE] = {0};
 
-    if (strcmp(extension, "aac") == 0) {
-        strcpy(options, "1. AAC to MP3\n2. AAC to WAV\n");
-    } else if (strcmp(extension, "mp3") == 0) {
-        strcpy(options, "3. MP3 to AAC (IN LUCRU)\n4. MP3 to WAV\n");
-    } else if (strcmp(extension, "wav") == 0) {
-        strcpy(options, "5. WAV to AAC\n6. WAV to MP3\n");
-    } else if (strcmp(extension, "bmp") == 0) {
-        strcpy(options, "7. BMP to JPEG\n8. BMP to PNG\n");
-    } else if (strcmp(extension, "jpeg") == 0 || strcmp(extension, "jpg") == 0) {
-        strcpy(options, "9. JPEG to BMP\n10. JPEG to PNG\n");
-    } else if (strcmp(extension, "png") == 0) {
-        strcpy(options, "11. PNG to BMP\n12. PNG to JPEG\n");
-    } else if (strcmp(extension, "odt") == 0) {
-        strcpy(options, "13. ODT to PDF\n14. ODT to TXT\n");
-    } else if (strcmp(extension, "txt") == 0) {
-        strcpy(options, "15. TXT to PDF\n16. TXT to ODT\n");
-    } else if (strcmp(extension, "pdf") == 0) {
-        strcpy(options, "17. PDF to ODT\n");
-    } else {
+    // The menu is built from the conversions registered for this format
+    if (registry_build_menu(format_from_extension(extension), options, sizeof(options)) == 0) {
         strcpy(options, "Unsupported file extension.\n");
     }
 
     write(client_fd, options, strlen(options));
 }
 
-void handle_client(int client_fd) {
+// Read exactly size bytes, returns the number of bytes read
+ssize_t read_full(int fd, void *buf, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = read(fd, (char *)buf + total, size - total);
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+// Read a NUL-terminated string without consuming anything that follows it
+ssize_t read_string(int fd, char *buf, size_t size) {
+    size_t total = 0;
+    while (total + 1 < size) {
+        ssize_t n = read(fd, buf + total, 1);
+        if (n <= 0) {
+            break;
+        }
+        if (buf[total++] == '\0') {
+            return total;
+        }
+    }
+    buf[total] = '\0';
+    return total;
+}
+
+// Commands start with '!', which no file extension does; returns 1 if one was handled
+int handle_admin_command(int client_fd, const char *command) {
+    if (strcmp(command, ADMIN_COMMAND_METRICS) == 0) {
+        metrics_write(client_fd);
+    } else if (strcmp(command, ADMIN_COMMAND_TRACE) == 0) {
+        trace_write_json(client_fd);
+    } else if (strncmp(command, ADMIN_COMMAND_TRACE_RATE, strlen(ADMIN_COMMAND_TRACE_RATE)) == 0) {
+        trace_set_sample_rate(atof(command + strlen(ADMIN_COMMAND_TRACE_RATE)));
+        dprintf(client_fd, "Tracing %g of the requests\n", trace_get_sample_rate());
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Reads the upload into the input file and, for a streamed conversion, on to the converter.
+// Returns the bytes received, or -1 when the content doesn't match the announced prefix.
+ssize_t receive_upload(int client_fd, int input_fd, const UploadHeader *header, ConversionStream *stream,
+                       uint8_t input_digest[CONTENT_DIGEST_SIZE]) {
+    char buffer[BUFFER_SIZE];
+    ssize_t bytes_received;
+    size_t total_bytes_received = 0;
+    DigestState digest;
+    digest_init(&digest);
+    size_t tag_size = sniff_id3_size(header->prefix, header->prefix_len);
+    size_t after_tag_end =
+        tag_size > 0 && tag_size + SNIFF_FRAME_SIZE > header->prefix_len ? tag_size + SNIFF_FRAME_SIZE : 0;
+    TraceSpan upload_span = trace_span_begin("upload");
+
+    while (total_bytes_received < header->file_size && (bytes_received = read(client_fd, buffer, BUFFER_SIZE)) > 0) {
+        // The announced prefix must match what is actually uploaded
+        if (total_bytes_received < header->prefix_len) {
+            size_t overlap = header->prefix_len - total_bytes_received;
+            if (overlap > (size_t)bytes_received) {
+                overlap = bytes_received;
+            }
+            if (memcmp(buffer, header->prefix + total_bytes_received, overlap) != 0) {
+                fprintf(stderr, "Aborted upload: content doesn't match the announced prefix\n");
+                trace_span_end(&upload_span);
+                return -1;
+            }
+        }
+        // So must the bytes announced after a long ID3v2 tag, the format was sniffed from them
+        if (total_bytes_received < after_tag_end && total_bytes_received + bytes_received > tag_size) {
+            size_t start = total_bytes_received > tag_size ? total_bytes_received : tag_size;
+            size_t end = total_bytes_received + bytes_received < after_tag_end ? total_bytes_received + bytes_received
+                                                                                 : after_tag_end;
+            if (memcmp(buffer + (start - total_bytes_received), header->after_tag + (start - tag_size), end - start) != 0) {
+                fprintf(stderr, "Aborted upload: content doesn't match the announced prefix\n");
+                trace_span_end(&upload_span);
+                return -1;
+            }
+        }
+        TRACE_STAGE(TRACE_STAGE_TEMP_WRITE, write(input_fd, buffer, bytes_received));
+        digest_update(&digest, buffer, bytes_received);
+        total_bytes_received += bytes_received;
+
+        // A converter that gave up reads no more, the rest is still saved for the input cache
+        if (stream) {
+            conversion_stream_write_input(stream, buffer, bytes_received);
+        }
+    }
+    trace_span_set_arg(&upload_span, "bytes", total_bytes_received);
+    trace_span_end(&upload_span);
+    metrics_add(METRIC_BYTES_RECEIVED, total_bytes_received);
+    digest_final(&digest, input_digest);
+    return total_bytes_received;
+}
+
+// Runs the conversion while the upload is still arriving; the result goes out in chunks as the
+// converter writes it. Returns -1 when the upload was cut short or didn't match its header.
+int stream_conversion(const ClientConnection *connection, ConversionStream *stream, int input_fd,
+                      const UploadHeader *header, int conversion_option, CacheKey *cache_key, CacheKey *input_key,
+                      const char *input_file) {
+    ConversionJob conversion;
+    if (start_conversion(connection, &conversion, input_file, conversion_option, &header->options, stream,
+                         header->file_size) != 0) {
+        receive_upload(connection->client_fd, input_fd, header, NULL, input_key->input_digest);
+        return -1;
+    }
+
+    ssize_t received = receive_upload(connection->client_fd, input_fd, header, stream, input_key->input_digest);
+    int complete = received == (ssize_t)header->file_size;
+    conversion_stream_end_input(stream, !complete);
+
+    // The result is cached under the content that was actually received
+    input_key->params_hash = received > 0 ? received : 0;
+    memcpy(cache_key->input_digest, input_key->input_digest, sizeof(cache_key->input_digest));
+    finish_conversion(connection, &conversion, complete ? cache_key : NULL);
+    return complete ? 0 : -1;
+}
+
+void handle_client(const ClientConnection *connection) {
+    int client_fd = connection->client_fd;
     char buffer[BUFFER_SIZE] = {0};
     char extension[BUFFER_SIZE] = {0};
     int conversion_option;
 
     // Read the file extension from the client
-    if (read(client_fd, extension, sizeof(extension)) <= 0) {
+    if (read_string(client_fd, extension, sizeof(extension)) <= 0) {
         perror("Failed to read file extension");
         close(client_fd);
         return;
     }
 
+    // Admin tools can send a command instead of converting a file
+    if (connection->priority == JOB_PRIORITY_HIGH && handle_admin_command(client_fd, extension)) {
+        close(client_fd);
+        return;
+    }
+
     // Send the conversion options based on the extension
     send_conversion_options(client_fd, extension);
 
     // Read the conversion option from the client
-    if (read(client_fd, buffer, sizeof(buffer)) <= 0) {
+    if (read_string(client_fd, buffer, sizeof(buffer)) <= 0) {
         perror("Failed to read conversion option");
         close(client_fd);
         return;
     }
     conversion_option = atoi(buffer);
 
-    // Read the file size from the client
-    size_t file_size;
-    if (read(client_fd, &file_size, sizeof(file_size)) <= 0) {
-        perror("Failed to read file size");
-        close(client_fd);
-        return;
+    UploadHeader header;
+    uint8_t upload_status;
+    FileFormat input_format;
+    CacheKey cache_key;
+    char cached_extension[BUFFER_SIZE];
+    ResultMetadata cached_metadata;
+    int cached_fd;
+    double admitted_cost;
+
+    while (1) {
+        // Read the file size and content digest from the client
+        if (read_full(client_fd, &header, sizeof(header)) != sizeof(header)) {
+            perror("Failed to read upload header");
+            close(client_fd);
+            return;
+        }
+
+        // Check the real format from the first bytes instead of trusting the extension
+        if (header.prefix_len > sizeof(header.prefix)) {
+            header.prefix_len = sizeof(header.prefix);
+        }
+        input_format = sniff_format(header.prefix, header.prefix_len, header.file_size, header.after_tag);
+        int routed_option = registry_route(conversion_option, input_format);
+        if (routed_option < 0) {
+            fprintf(stderr, "Rejected upload: .%s file contains %s data\n", extension, format_name(input_format));
+            upload_status = UPLOAD_REJECT;
+            write(client_fd, &upload_status, sizeof(upload_status));
+            close(client_fd);
+            return;
+        }
+        if (routed_option != conversion_option) {
+            printf("Re-routed option %d to %d for %s content\n", conversion_option, routed_option, format_name(input_format));
+            conversion_option = routed_option;
+        }
+
+        // The same input converted with other encoder settings is another result
+        encoder_options_sanitize(&header.options);
+        cache_key_init(&cache_key, header.input_digest, conversion_option, encoder_options_hash(&header.options));
+
+        // The result is already cached, skip the upload entirely
+        cached_fd = cache_lookup(&cache_key, cached_extension, sizeof(cached_extension), &cached_metadata);
+        if (cached_fd != -1) {
+            metrics_add(METRIC_UPLOADS_SKIPPED, 1);
+            upload_status = UPLOAD_SKIP;
+            write(client_fd, &upload_status, sizeof(upload_status));
+            send_eta(client_fd, 0);
+            send_file_fd_to_client(client_fd, cached_fd, cached_extension, &cached_metadata);
+            close(cached_fd);
+            close(client_fd);
+            return;
+        }
+
+        // Only take the upload if it can be processed soon, otherwise tell the client when to come back
+        const Converter *converter = registry_find(conversion_option);
+        uint64_t pixels = image_pixels_from_header(header.prefix, header.prefix_len, input_format, header.file_size);
+        admitted_cost = converter ? cost_model_estimate(converter, header.file_size, pixels) : 0;
+        uint32_t retry_after_ms;
+        if (admission_acquire(header.file_size, admitted_cost, connection->priority == JOB_PRIORITY_HIGH,
+                              &retry_after_ms) == 0) {
+            break;
+        }
+        upload_status = UPLOAD_BUSY;
+        write(client_fd, &upload_status, sizeof(upload_status));
+        write(client_fd, &retry_after_ms, sizeof(retry_after_ms));
     }
+    size_t file_size = header.file_size;
+    CacheKey input_key;
+    cache_key_init(&input_key, header.input_digest, CACHE_INPUT_OPTION, header.file_size);
 
-    // Read file from client
     char input_file_template[BUFFER_SIZE] = "/tmp/input_file_XXXXXX";
     int input_fd = mkstemp(input_file_template);
     if (input_fd == -1) {
         perror("Failed to create temporary input file");
+        admission_release(file_size, admitted_cost);
         close(client_fd);
         return;
     }
 
-    ssize_t bytes_received;
-    size_t total_bytes_received = 0;
+    // The template and a format extension always fit
+    char input_file_with_extension[sizeof(input_file_template) + 8];
+    snprintf(input_file_with_extension, sizeof(input_file_with_extension), "%s.%.6s", input_file_template,
+             format_extension(input_format));
+
+    // Clients that can read while they upload get the result of a streaming conversion as it is made
+    const Converter *converter = registry_find(conversion_option);
+    ConversionStream stream;
+    int streamed = (header.flags & UPLOAD_FLAG_STREAM) && converter && converter->streams;
+
+    if (cache_link(&input_key, input_file_with_extension) == 0) {
+        // The same input was uploaded before, convert the stored copy
+        close(input_fd);
+        unlink(input_file_template);
+        metrics_add(METRIC_UPLOADS_SKIPPED, 1);
+        upload_status = UPLOAD_SKIP;
+        write(client_fd, &upload_status, sizeof(upload_status));
+        streamed = 0;
+    } else if (streamed && conversion_stream_init(&stream, client_fd) == 0) {
+        upload_status = UPLOAD_STREAM;
+        write(client_fd, &upload_status, sizeof(upload_status));
+
+        int status = stream_conversion(connection, &stream, input_fd, &header, conversion_option, &cache_key,
+                                       &input_key, input_file_with_extension);
+        conversion_stream_destroy(&stream);
+        close(input_fd);
+        if (status != 0) {
+            unlink(input_file_template);
+            admission_release(file_size, admitted_cost);
+            close(client_fd);
+            return;
+        }
+        rename(input_file_template, input_file_with_extension);
+    } else {
+        streamed = 0;
+        upload_status = UPLOAD_SEND;
+        write(client_fd, &upload_status, sizeof(upload_status));
+
+        // Read file from client
+        ssize_t total_bytes_received = receive_upload(client_fd, input_fd, &header, NULL, input_key.input_digest);
+        close(input_fd);
+        if (total_bytes_received < 0) {
+            unlink(input_file_template);
+            admission_release(file_size, admitted_cost);
+            close(client_fd);
+            return;
+        }
 
-    while (total_bytes_received < file_size && (bytes_received = read(client_fd, buffer, BUFFER_SIZE)) > 0) {
-        write(input_fd, buffer, bytes_received);
-        total_bytes_received += bytes_received;
-    }
-    close(input_fd);
+        // Only trust the digest of what was actually received
+        input_key.params_hash = total_bytes_received;
+        if (memcmp(input_key.input_digest, cache_key.input_digest, sizeof(cache_key.input_digest)) != 0) {
+            memcpy(cache_key.input_digest, input_key.input_digest, sizeof(cache_key.input_digest));
+            cached_fd = cache_lookup(&cache_key, cached_extension, sizeof(cached_extension), &cached_metadata);
+            if (cached_fd != -1) {
+                send_eta(client_fd, 0);
+                send_file_fd_to_client(client_fd, cached_fd, cached_extension, &cached_metadata);
+                close(cached_fd);
+                unlink(input_file_template);
+                admission_release(file_size, admitted_cost);
+                close(client_fd);
+                return;
+            }
+        }
 
-    // Rename the temporary file to include the original extension
-    char input_file_with_extension[BUFFER_SIZE];
-    snprintf(input_file_with_extension, sizeof(input_file_with_extension), "%s.%s", input_file_template, extension);
-    rename(input_file_template, input_file_with_extension);
+        // Rename the temporary file to include the original extension
+        rename(input_file_template, input_file_with_extension);
+    }
 
-    process_conversion(client_fd, input_file_with_extension, conversion_option);
+    if (!streamed) {
+        process_conversion(connection, input_file_with_extension, conversion_option, &header.options, &cache_key);
+    }
 
-    // Delete the temporary input file
-    unlink(input_file_with_extension);
+    // Keep the input for later uploads of the same content, otherwise delete it
+    char input_extension[BUFFER_SIZE];
+    snprintf(input_extension, sizeof(input_extension), ".%s", format_extension(input_format));
+    int stored_fd = cache_store(&input_key, input_file_with_extension, input_extension, NULL);
+    if (stored_fd != -1) {
+        close(stored_fd);
+    } else {
+        unlink(input_file_with_extension);
+    }
 
+    admission_release(file_size, admitted_cost);
     close(client_fd);
 }
 
 
-void send_file_to_client(int client_fd, const char *file_path, const char *extension) {
-    int fd = open(file_path, O_RDONLY);
-    if (fd == -1) {
-        perror("Failed to open file");
-        return;
-    }
+void send_eta(int client_fd, double eta_ms) {
+    ResultEta eta = eta_ms > UINT32_MAX ? UINT32_MAX : (ResultEta)eta_ms;
+    write(client_fd, &eta, sizeof(eta));
+}
+
+// The metadata follows the content, only when all of it went out
+void send_file_fd_to_client(int client_fd, int fd, const char *extension, const ResultMetadata *metadata) {
     // Send the file extension first
     write(client_fd, extension, strlen(extension) + 1);
     sleep(0.2);
@@ -123,7 +418,6 @@ void send_file_to_client(int client_fd, const char *file_path, const char *exten
     struct stat file_stat;
     if (fstat(fd, &file_stat) < 0) {
         perror("Failed to get file size");
-        close(fd);
         return;
     }
     size_t file_size = file_stat.st_size;
@@ -136,120 +430,243 @@ void send_file_to_client(int client_fd, const char *file_path, const char *exten
     while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
         if (write(client_fd, buffer, bytes_read) != bytes_read) {
             perror("Failed to send file");
-            close(fd);
             return;
         }
+        metrics_add(METRIC_BYTES_SENT, bytes_read);
+    }
+    if (bytes_read == 0) {
+        write(client_fd, metadata, sizeof(*metadata));
     }
+}
 
+void send_file_to_client(int client_fd, const char *file_path, const char *extension,
+                         const ResultMetadata *metadata) {
+    int fd = open(file_path, O_RDONLY);
+    if (fd == -1) {
+        perror("Failed to open file");
+        return;
+    }
+    send_file_fd_to_client(client_fd, fd, extension, metadata);
     close(fd);
 }
 
-void process_conversion(int client_fd, const char *input_file, int conversion_option) {
-    char output_file_template[BUFFER_SIZE] = "/tmp/output_file_XXXXXX";
-    int output_fd = mkstemp(output_file_template);
+// A closed connection reads as end of file; nothing else is expected while the client waits
+int client_disconnected(int client_fd) {
+    char byte;
+    ssize_t n = recv(client_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+void run_conversion_job(Job *job) {
+    ConversionJob *conversion = (ConversionJob *)job;
+    struct timespec start, end;
+
+    // Cancelled while still queued
+    if (cancel_token_expired(&conversion->cancel)) {
+        conversion->status = -1;
+        if (conversion->stream) {
+            conversion_stream_stop_reading(conversion->stream);
+        }
+        return;
+    }
+
+    // The spans of this conversion belong to the request of the connection thread
+    trace_set_current(conversion->trace);
+    double queued_us = job->enqueued_at * 1000.0;
+    trace_record("queue_wait", queued_us, trace_now_us() - queued_us);
+
+    cancel_token_start(&conversion->cancel);
+    TraceSpan span = trace_span_begin("convert");
+    trace_span_set_arg(&span, "option", conversion->converter->option);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    encoder_options_set_current(&conversion->options);
+    conversion_stream_set_current(conversion->stream);
+    result_metadata_set_current(&conversion->metadata);
+    conversion->status = planner_run(conversion->converter, conversion->input_file, conversion->output_file,
+                                     &conversion->cancel);
+    result_metadata_set_current(NULL);
+    conversion_stream_set_current(NULL);
+    encoder_options_set_current(NULL);
+    if (conversion->stream) {
+        conversion_stream_stop_reading(conversion->stream);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    trace_span_end(&span);
+    trace_clear_current();
+
+    // Failed runs say nothing about how long a conversion takes
+    double elapsed_ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    if (conversion->status == 0) {
+        cost_model_observe(conversion->converter, conversion->input_size, conversion->pixels, elapsed_ms);
+        metrics_observe_conversion(conversion->converter->option, elapsed_ms);
+    } else if (cancel_token_expired(&conversion->cancel)) {
+        metrics_add(METRIC_CONVERSIONS_CANCELLED, 1);
+    } else {
+        metrics_add(METRIC_CONVERSIONS_FAILED, 1);
+    }
+}
+
+void process_conversion(const ClientConnection *connection, const char *input_file, int conversion_option,
+                        const EncoderOptions *options, const CacheKey *cache_key) {
+    ConversionJob conversion;
+    if (start_conversion(connection, &conversion, input_file, conversion_option, options, NULL, 0) == 0) {
+        finish_conversion(connection, &conversion, cache_key);
+    }
+}
+
+// Queues the conversion on a worker and tells the client how long it will take. A streamed
+// conversion gets the size of its input from the upload header, the file is still being written.
+int start_conversion(const ClientConnection *connection, ConversionJob *conversion, const char *input_file,
+                     int conversion_option, const EncoderOptions *options, ConversionStream *stream,
+                     size_t input_size) {
+    int client_fd = connection->client_fd;
+    snprintf(conversion->output_template, sizeof(conversion->output_template), "/tmp/output_file_XXXXXX");
+    int output_fd = mkstemp(conversion->output_template);
     if (output_fd == -1) {
         perror("Failed to create temporary output file");
-        return;
+        return -1;
     }
     close(output_fd); // Close the file descriptor, we will use the filename
 
-    char output_file[BUFFER_SIZE];
-    const char *extension;
-    switch (conversion_option) {
-        case 1:
-            extension = ".mp3";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_aac_to_mp3(input_file, output_file);
-            break;
-        case 2:
-            extension = ".wav";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_aac_to_wav(input_file, output_file);
-            break;
-        case 3:
-            // extension = ".aac";
-            // snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            // convert_mp3_to_aac(input_file, output_file);
-            return; // Conversion not implemented
-        case 4:
-            extension = ".wav";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_mp3_to_wav(input_file, output_file);
-            break;
-        case 5:
-            extension = ".aac";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_wav_to_aac(input_file, output_file);
-            break;
-        case 6:
-            extension = ".mp3";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_wav_to_mp3(input_file, output_file);
-            break;
-        case 7:
-            extension = ".jpeg";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_bmp_to_jpeg(input_file, output_file);
-            break;
-        case 8:
-            extension = ".png";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_bmp_to_png(input_file, output_file);
-            break;
-        case 9:
-            extension = ".bmp";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_jpeg_to_bmp(input_file, output_file);
-            break;
-        case 10:
-            extension = ".png";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_jpeg_to_png(input_file, output_file);
-            break;
-        case 11:
-            extension = ".bmp";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_png_to_bmp(input_file, output_file);
-            break;
-        case 12:
-            extension = ".jpg";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_png_to_jpeg(input_file, output_file);
-            break;
-        case 13:
-            extension = ".pdf";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_odt_to_pdf(input_file, output_file);
-            break;
-        case 14:
-            extension = ".txt";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_odt_to_txt(input_file, output_file);
-            break;
-        case 15:
-            extension = ".pdf";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_txt_to_pdf(input_file, output_file);
-            break;
-        case 16:
-            extension = ".odt";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_txt_to_odt(input_file, output_file);
-            break;
-        case 17:
-            extension = ".odt";
-            snprintf(output_file, sizeof(output_file), "%s%s", output_file_template, extension);
-            convert_pdf_to_odt(input_file, output_file);
-            break;
-        default:
-            write(client_fd, "Invalid conversion option.\n", 27);
-            return;
+    const Converter *converter = registry_find(conversion_option);
+    if (!converter) {
+        write(client_fd, "Invalid conversion option.\n", 27);
+        unlink(conversion->output_template);
+        return -1;
     }
 
-    send_file_to_client(client_fd, output_file, extension);
+    // The conversion itself runs on a worker, this thread only does the I/O
+    struct stat input_stat;
+    conversion->converter = converter;
+    conversion->input_file = input_file;
+    conversion->options = *options;
+    conversion->stream = stream;
+    memset(&conversion->metadata, 0, sizeof(conversion->metadata));
+    if (stream) {
+        conversion->input_size = input_size;
+        conversion->pixels = 0;
+    } else {
+        conversion->input_size = stat(input_file, &input_stat) == 0 ? (size_t)input_stat.st_size : 0;
+        conversion->pixels = read_image_pixels(input_file, converter->source);
+    }
+    snprintf(conversion->output_file, sizeof(conversion->output_file), "%s%s", conversion->output_template,
+             converter->output_extension);
+
+    // The converter writes to the client, the file only keeps a copy for the cache
+    if (stream && (stream->output_fd = open(conversion->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+        perror("Failed to create the output file");
+        unlink(conversion->output_template);
+        return -1;
+    }
+
+    // Shorter jobs are dispatched first, so the estimate decides the place in the queue
+    double cost = cost_model_estimate(converter, conversion->input_size, conversion->pixels);
+    double eta = connection->priority == JOB_PRIORITY_HIGH ? cost : scheduler_backlog_ms() + cost;
+    double timeout = cost * JOB_TIMEOUT_COST_FACTOR;
+    cancel_token_init(&conversion->cancel, timeout > JOB_TIMEOUT_MIN_MS ? timeout : JOB_TIMEOUT_MIN_MS);
+    conversion->trace = trace_current();
+    job_init(&conversion->job, run_conversion_job, connection->priority, connection->client_id,
+             converter->cost_class, cost);
+
+    // A streamed result may start as soon as the job is queued, so everything before it goes first
+    send_eta(client_fd, eta);
+    if (stream) {
+        size_t result_size = RESULT_SIZE_STREAMED;
+        write(client_fd, converter->output_extension, strlen(converter->output_extension) + 1);
+        write(client_fd, &result_size, sizeof(result_size));
+    }
+    scheduler_submit(&conversion->job);
+    return 0;
+}
+
+// Waits for the conversion, caches the result and sends it, or for a streamed conversion only
+// ends it. Without a cache key the result isn't kept.
+void finish_conversion(const ClientConnection *connection, ConversionJob *conversion, const CacheKey *cache_key) {
+    int client_fd = connection->client_fd;
+    ConversionStream *stream = conversion->stream;
+    TraceSpan wait_span = trace_span_begin("wait_for_conversion");
+
+    // Nobody is waiting for the result once the client is gone, so stop the work
+    int disconnected = 0;
+    while (!scheduler_wait_timeout(&conversion->job, DISCONNECT_POLL_MS)) {
+        if (!disconnected && client_disconnected(client_fd)) {
+            printf("Client disconnected, cancelling conversion %d for %s\n", conversion->converter->option,
+                   conversion->input_file);
+            cancel_token_cancel(&conversion->cancel);
+            disconnected = 1;
+        }
+    }
+    job_destroy(&conversion->job);
+    trace_span_end(&wait_span);
+
+    const char *output_file = conversion->output_file;
+    const char *extension = conversion->converter->output_extension;
+    int cached_fd = -1;
+    if (stream) {
+        close(stream->output_fd);
+        stream->output_fd = -1;
+    }
+    if (conversion->status != 0) {
+        fprintf(stderr, "Conversion %d failed for %s\n", conversion->converter->option, conversion->input_file);
+    } else if (cache_key && !(stream && stream->copy_failed)) {
+        // Keep the result for repeated uploads
+        cached_fd = cache_store(cache_key, output_file, extension, &conversion->metadata);
+    }
+
+    TraceSpan send_span = trace_span_begin("send");
+    if (stream) {
+        // The content went out during the conversion, only the end of the result is left
+        if (!disconnected) {
+            conversion_stream_end_output(stream, conversion->status != 0, &conversion->metadata);
+        }
+        if (cached_fd != -1) {
+            close(cached_fd);
+        }
+    } else if (cached_fd != -1) {
+        if (!disconnected) {
+            send_file_fd_to_client(client_fd, cached_fd, extension, &conversion->metadata);
+        }
+        close(cached_fd);
+    } else if (!disconnected) {
+        send_file_to_client(client_fd, output_file, extension, &conversion->metadata);
+    }
+    trace_span_end(&send_span);
 
     // Delete the temporary output file after sending
     unlink(output_file);
+    unlink(conversion->output_template);
+}
+
+void *handle_connection(void *arg) {
+    ClientConnection *connection = arg;
+    trace_begin_request();
+    TraceSpan span = trace_span_begin("request");
+    handle_client(connection);
+    trace_span_end(&span);
+    trace_clear_current();
+    free(connection);
+    return NULL;
+}
+
+// Each connection gets its own thread, conversions are queued in the scheduler
+void start_connection(int client_fd, JobPriority priority, unsigned long client_id) {
+    ClientConnection *connection = malloc(sizeof(ClientConnection));
+    if (!connection) {
+        close(client_fd);
+        return;
+    }
+    connection->client_fd = client_fd;
+    connection->priority = priority;
+    connection->client_id = client_id;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, handle_connection, connection) != 0) {
+        perror("Failed to start connection thread");
+        close(client_fd);
+        free(connection);
+        return;
+    }
+    pthread_detach(thread);
 }
 
 void *handle_admin_client(void *arg) {
@@ -272,21 +689,23 @@ void *handle_admin_client(void *arg) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_fd, 3) < 0) {
+    if (listen(server_fd, LISTEN_BACKLOG) < 0) {
         perror("listen");
         close(server_fd);
         exit(EXIT_FAILURE);
     }
 
-    if ((client_fd = accept(server_fd, NULL, NULL)) < 0) {
-        perror("accept");
-        close(server_fd);
-        exit(EXIT_FAILURE);
-    }
+    // Admin connections are accepted for the whole lifetime of the server
+    while (1) {
+        if ((client_fd = accept(server_fd, NULL, NULL)) < 0) {
+            perror("accept");
+            continue;
+        }
 
-    handle_client(client_fd);
+        metrics_add(METRIC_CONNECTIONS_ADMIN, 1);
+        start_connection(client_fd, JOB_PRIORITY_HIGH, 0);
+    }
 
-    close(client_fd);
     close(server_fd);
     return NULL;
 }
@@ -318,7 +737,7 @@ void *handle_simple_clients(void *arg) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_fd, 3) < 0) {
+    if (listen(server_fd, LISTEN_BACKLOG) < 0) {
         perror("listen");
         close(server_fd);
         exit(EXIT_FAILURE);
@@ -330,8 +749,8 @@ void *handle_simple_clients(void *arg) {
             continue;
         }
 
-        handle_client(new_socket);
-        close(new_socket);
+        metrics_add(METRIC_CONNECTIONS_TCP, 1);
+        start_connection(new_socket, JOB_PRIORITY_NORMAL, ntohl(address.sin_addr.s_addr));
     }
 
     close(server_fd);
@@ -341,11 +760,32 @@ void *handle_simple_clients(void *arg) {
 int main() {
     pthread_t admin_thread, clients_thread;
 
+    // Stop signals are taken by the main thread only; the threads started below inherit the mask
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    register_audio_converters();
+    register_image_converters();
+    register_document_converters();
+    planner_init();
+    cache_init(CACHE_DIR, CACHE_MAX_BYTES);
+    // Idle workers open replacements for the encoders their last audio job used up
+    scheduler_set_idle_hook(audio_pool_refill);
+    scheduler_init(sysconf(_SC_NPROCESSORS_ONLN) + RESERVED_ADMIN_WORKERS, RESERVED_ADMIN_WORKERS);
+    admission_init(sysconf(_SC_NPROCESSORS_ONLN));
+    metrics_start_http(METRICS_HTTP_PORT);
+
     pthread_create(&admin_thread, NULL, handle_admin_client, NULL);
     pthread_create(&clients_thread, NULL, handle_simple_clients, NULL);
 
-    pthread_join(admin_thread, NULL);
-    pthread_join(clients_thread, NULL);
-
-    return 0;
+    // A normal exit, so exit handlers run (profile and sanitizer output in instrumented builds)
+    int signal_number;
+    sigwait(&stop_signals, &signal_number);
+    printf("Received %s, shutting down\n", strsignal(signal_number));
+    unlink(ADMIN_SOCKET_PATH);
+    fflush(stdout);
+    exit(0);
 }
@@ -0,0 +1,300 @@
+#include "metrics.h"
+#include "registry.h"
+#include "cache.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+// Upper bounds of the histogram buckets in milliseconds, the last bucket is +Inf
+static const double bucket_bounds_ms[] = {1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000};
+#define BUCKET_COUNT (sizeof(bucket_bounds_ms) / sizeof(bucket_bounds_ms[0]) + 1)
+
+// A scraper that stops reading or writing is dropped after this, the endpoint serves one at a time
+#define METRICS_HTTP_TIMEOUT_MS 2000
+
+typedef struct {
+    _Atomic uint64_t buckets[BUCKET_COUNT];
+    _Atomic uint64_t sum_us;
+} HistogramShard;
+
+// One thread's counters. Only the owning thread writes them, so an update is a plain
+// load and store; readers may see a value that is a few updates old.
+typedef struct MetricsShard {
+    _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+    HistogramShard histograms[HISTOGRAM_COUNT];
+    HistogramShard conversions[MAX_CONVERSION_OPTIONS];
+    struct MetricsShard *next;       // all shards ever created
+    struct MetricsShard *next_free;  // shards whose thread has exited
+} MetricsShard;
+
+static const char *counter_names[METRIC_COUNTER_COUNT][2] = {
+    [METRIC_CONNECTIONS_ADMIN] = {"converter_connections_total{listener=\"admin\"}", "Accepted connections"},
+    [METRIC_CONNECTIONS_TCP] = {"converter_connections_total{listener=\"tcp\"}", "Accepted connections"},
+    [METRIC_BYTES_RECEIVED] = {"converter_bytes_received_total", "File bytes received from clients"},
+    [METRIC_BYTES_SENT] = {"converter_bytes_sent_total", "File bytes sent to clients"},
+    [METRIC_UPLOADS_SKIPPED] = {"converter_uploads_skipped_total", "Uploads skipped because the input or result was cached"},
+    [METRIC_ADMISSION_REJECTED] = {"converter_admission_rejected_total", "Requests turned away as busy"},
+    [METRIC_CONVERSIONS_FAILED] = {"converter_conversions_failed_total", "Conversions that produced no output"},
+    [METRIC_CONVERSIONS_CANCELLED] = {"converter_conversions_cancelled_total", "Conversions stopped by a timeout or a disconnect"},
+    [METRIC_AUDIO_REMUXED] = {"converter_audio_remuxed_total", "Audio conversions that copied the stream instead of re-encoding it"},
+};
+
+static const char *histogram_names[HISTOGRAM_COUNT][2] = {
+    [HISTOGRAM_QUEUE_WAIT] = {"converter_queue_wait_seconds", "Time jobs spent queued before a worker took them"},
+    [HISTOGRAM_LIBREOFFICE_SPAWN] = {"converter_libreoffice_spawn_seconds", "Time to fork the LibreOffice child"},
+    [HISTOGRAM_LIBREOFFICE_RUN] = {"converter_libreoffice_run_seconds", "Lifetime of the LibreOffice child"},
+};
+
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static MetricsShard *all_shards = NULL;
+static MetricsShard *free_shards = NULL;
+static _Thread_local MetricsShard *thread_shard = NULL;
+
+// A shard outlives its thread and is handed to the next new thread, so
+// connection threads coming and going don't make the list grow
+static void release_shard(void *shard) {
+    pthread_mutex_lock(&shards_mutex);
+    ((MetricsShard *)shard)->next_free = free_shards;
+    free_shards = shard;
+    pthread_mutex_unlock(&shards_mutex);
+}
+
+static void create_shard_key(void) {
+    pthread_key_create(&shard_key, release_shard);
+}
+
+static MetricsShard *acquire_shard(void) {
+    pthread_once(&shard_key_once, create_shard_key);
+
+    pthread_mutex_lock(&shards_mutex);
+    MetricsShard *shard = free_shards;
+    if (shard) {
+        free_shards = shard->next_free;
+    } else {
+        shard = calloc(1, sizeof(MetricsShard));
+        if (!shard) {
+            perror("Failed to allocate metrics");
+            exit(EXIT_FAILURE);
+        }
+        shard->next = all_shards;
+        all_shards = shard;
+    }
+    pthread_mutex_unlock(&shards_mutex);
+
+    pthread_setspecific(shard_key, shard);
+    return shard;
+}
+
+static inline MetricsShard *current_shard(void) {
+    if (!thread_shard) {
+        thread_shard = acquire_shard();
+    }
+    return thread_shard;
+}
+
+static inline void shard_add(_Atomic uint64_t *value, uint64_t amount) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+static void histogram_record(HistogramShard *histogram, double elapsed_ms) {
+    size_t bucket = 0;
+    while (bucket < BUCKET_COUNT - 1 && elapsed_ms > bucket_bounds_ms[bucket]) {
+        bucket++;
+    }
+    shard_add(&histogram->buckets[bucket], 1);
+    shard_add(&histogram->sum_us, elapsed_ms > 0 ? (uint64_t)(elapsed_ms * 1000) : 0);
+}
+
+void metrics_add(MetricCounter counter, uint64_t value) {
+    shard_add(&current_shard()->counters[counter], value);
+}
+
+void metrics_observe(MetricHistogram histogram, double elapsed_ms) {
+    histogram_record(&current_shard()->histograms[histogram], elapsed_ms);
+}
+
+void metrics_observe_conversion(int option, double elapsed_ms) {
+    if (option > 0 && option < MAX_CONVERSION_OPTIONS) {
+        histogram_record(&current_shard()->conversions[option], elapsed_ms);
+    }
+}
+
+// Sums one histogram over all shards, picked by its offset inside a shard
+static uint64_t sum_histogram(size_t offset, uint64_t buckets[BUCKET_COUNT]) {
+    uint64_t sum_us = 0;
+    memset(buckets, 0, BUCKET_COUNT * sizeof(uint64_t));
+
+    for (MetricsShard *shard = all_shards; shard; shard = shard->next) {
+        HistogramShard *histogram = (HistogramShard *)((char *)shard + offset);
+        for (size_t i = 0; i < BUCKET_COUNT; i++) {
+            buckets[i] += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        }
+        sum_us += atomic_load_explicit(&histogram->sum_us, memory_order_relaxed);
+    }
+    return sum_us;
+}
+
+static void print_histogram(FILE *out, const char *name, const char *labels, size_t offset) {
+    uint64_t buckets[BUCKET_COUNT];
+    uint64_t sum_us = sum_histogram(offset, buckets);
+    uint64_t cumulative = 0;
+    const char *separator = labels[0] ? "," : "";
+
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        cumulative += buckets[i];
+        if (i < BUCKET_COUNT - 1) {
+            fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, separator,
+                    bucket_bounds_ms[i] / 1000.0, (unsigned long long)cumulative);
+        } else {
+            fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, separator, (unsigned long long)cumulative);
+        }
+    }
+    fprintf(out, "%s_sum%s%s%s %.6f\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "", sum_us / 1e6);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+            (unsigned long long)cumulative);
+}
+
+void metrics_write(int fd) {
+    char *text = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&text, &length);
+    if (!out) {
+        perror("Failed to render metrics");
+        return;
+    }
+
+    pthread_mutex_lock(&shards_mutex);
+
+    for (int counter = 0; counter < METRIC_COUNTER_COUNT; counter++) {
+        uint64_t total = 0;
+        for (MetricsShard *shard = all_shards; shard; shard = shard->next) {
+            total += atomic_load_explicit(&shard->counters[counter], memory_order_relaxed);
+        }
+        // Labelled series share the HELP line of their metric
+        const char *name = counter_names[counter][0];
+        int name_length = (int)strcspn(name, "{");
+        if (counter == 0 || strncmp(name, counter_names[counter - 1][0], name_length) != 0) {
+            fprintf(out, "# HELP %.*s %s\n# TYPE %.*s counter\n", name_length, name, counter_names[counter][1],
+                    name_length, name);
+        }
+        fprintf(out, "%s %llu\n", name, (unsigned long long)total);
+    }
+
+    for (int histogram = 0; histogram < HISTOGRAM_COUNT; histogram++) {
+        const char *name = histogram_names[histogram][0];
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_names[histogram][1], name);
+        print_histogram(out, name, "", offsetof(MetricsShard, histograms) + histogram * sizeof(HistogramShard));
+    }
+
+    fprintf(out, "# HELP converter_conversion_seconds Conversion time per option\n"
+                 "# TYPE converter_conversion_seconds histogram\n");
+    for (int option = 1; option < MAX_CONVERSION_OPTIONS; option++) {
+        const Converter *converter = registry_find(option);
+        if (!converter) {
+            continue;
+        }
+        char labels[128];
+        snprintf(labels, sizeof(labels), "option=\"%d\",source=\"%s\",target=\"%s\"", option,
+                 format_name(converter->source), format_name(converter->target));
+        print_histogram(out, "converter_conversion_seconds", labels,
+                        offsetof(MetricsShard, conversions) + option * sizeof(HistogramShard));
+    }
+
+    pthread_mutex_unlock(&shards_mutex);
+
+    // The cache keeps its own counts
+    unsigned long hits, misses;
+    size_t cache_bytes;
+    cache_get_stats(&hits, &misses, &cache_bytes);
+    fprintf(out, "# HELP converter_cache_hits_total Result and input cache hits\n# TYPE converter_cache_hits_total counter\n"
+                 "converter_cache_hits_total %lu\n", hits);
+    fprintf(out, "# HELP converter_cache_misses_total Result and input cache misses\n# TYPE converter_cache_misses_total counter\n"
+                 "converter_cache_misses_total %lu\n", misses);
+    fprintf(out, "# HELP converter_cache_bytes Bytes stored in the cache\n# TYPE converter_cache_bytes gauge\n"
+                 "converter_cache_bytes %zu\n", cache_bytes);
+
+    fclose(out);
+    size_t written = 0;
+    while (written < length) {
+        // The reader may be gone, which must not raise SIGPIPE
+        ssize_t n = send(fd, text + written, length - written, MSG_NOSIGNAL);
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    free(text);
+}
+
+static void *serve_http(void *arg) {
+    int server_fd = (int)(intptr_t)arg;
+
+    while (1) {
+        int client_fd = accept(server_fd, NULL, NULL);
+        if (client_fd < 0) {
+            perror("accept");
+            continue;
+        }
+
+        struct timeval timeout = {.tv_sec = METRICS_HTTP_TIMEOUT_MS / 1000,
+                                  .tv_usec = (METRICS_HTTP_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // Every request gets the metrics, whatever its path
+        char request[1024];
+        if (read(client_fd, request, sizeof(request)) > 0) {
+            const char *header = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+            if (send(client_fd, header, strlen(header), MSG_NOSIGNAL) > 0) {
+                metrics_write(client_fd);
+            }
+        }
+        close(client_fd);
+    }
+    return NULL;
+}
+
+void metrics_start_http(int port) {
+    if (port <= 0) {
+        return;
+    }
+
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("Metrics socket failed");
+        return;
+    }
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    // Only reachable from the machine itself
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(server_fd, 8) < 0) {
+        perror("Metrics endpoint unavailable");
+        close(server_fd);
+        return;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_http, (void *)(intptr_t)server_fd) != 0) {
+        perror("Failed to start metrics thread");
+        close(server_fd);
+        return;
+    }
+    pthread_detach(thread);
+    printf("Metrics: http://127.0.0.1:%d/metrics\n", port);
+}
@@ -0,0 +1,41 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+// Local port for scraping the metrics over HTTP, 0 to only serve them on the admin socket
+#define METRICS_HTTP_PORT 9100
+
+typedef enum {
+    METRIC_CONNECTIONS_ADMIN = 0,
+    METRIC_CONNECTIONS_TCP,
+    METRIC_BYTES_RECEIVED,
+    METRIC_BYTES_SENT,
+    METRIC_UPLOADS_SKIPPED,
+    METRIC_ADMISSION_REJECTED,
+    METRIC_CONVERSIONS_FAILED,
+    METRIC_CONVERSIONS_CANCELLED,
+    METRIC_AUDIO_REMUXED,
+    METRIC_COUNTER_COUNT
+} MetricCounter;
+
+typedef enum {
+    HISTOGRAM_QUEUE_WAIT = 0,
+    HISTOGRAM_LIBREOFFICE_SPAWN,
+    HISTOGRAM_LIBREOFFICE_RUN,
+    HISTOGRAM_COUNT
+} MetricHistogram;
+
+// Recording only touches the calling thread's own counters, without locks or
+// contended atomics; the totals are summed up when the metrics are read.
+void metrics_add(MetricCounter counter, uint64_t value);
+void metrics_observe(MetricHistogram histogram, double elapsed_ms);
+void metrics_observe_conversion(int option, double elapsed_ms);
+
+// Writes all metrics in the Prometheus text exposition format
+void metrics_write(int fd);
+
+// Serves the metrics on http://127.0.0.1:port/metrics from a background thread
+void metrics_start_http(int port);
+
+#endif // METRICS_H
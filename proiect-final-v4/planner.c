@@ -0,0 +1,211 @@
+#include "planner.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <float.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+// Plans are compared on the estimated cost for an input of this size
+#define PLAN_NOMINAL_BYTES (1024 * 1024)
+
+static ConversionPlan plans[FORMAT_COUNT][FORMAT_COUNT];
+static const char *scratch_dir = PLAN_SCRATCH_DIR;
+
+// Dijkstra over the formats, with the direct converters as weighted edges
+static void plan_from(FileFormat source) {
+    double dist[FORMAT_COUNT];
+    const Converter *via[FORMAT_COUNT] = {0};
+    int done[FORMAT_COUNT] = {0};
+
+    for (int f = 0; f < FORMAT_COUNT; f++) {
+        dist[f] = DBL_MAX;
+    }
+    dist[source] = 0;
+
+    while (1) {
+        int u = -1;
+        for (int f = 0; f < FORMAT_COUNT; f++) {
+            if (!done[f] && dist[f] < DBL_MAX && (u < 0 || dist[f] < dist[u])) {
+                u = f;
+            }
+        }
+        if (u < 0) {
+            break;
+        }
+        done[u] = 1;
+
+        for (int option = 1; option < MAX_CONVERSION_OPTIONS; option++) {
+            const Converter *edge = registry_find(option);
+            if (!edge || !edge->convert || edge->source != (FileFormat)u) {
+                continue;
+            }
+            double cost = dist[u] + registry_estimate_cost(edge, PLAN_NOMINAL_BYTES);
+            if (cost < dist[edge->target]) {
+                dist[edge->target] = cost;
+                via[edge->target] = edge;
+            }
+        }
+    }
+
+    for (int target = 0; target < FORMAT_COUNT; target++) {
+        if (target == (int)source || !via[target]) {
+            continue;
+        }
+
+        // Walk back from the target to count the hops, then fill them in order
+        int hop_count = 0;
+        for (int f = target; f != (int)source; f = via[f]->source) {
+            hop_count++;
+        }
+        if (hop_count > MAX_PLAN_HOPS) {
+            continue;
+        }
+
+        ConversionPlan *plan = &plans[source][target];
+        plan->hop_count = hop_count;
+        plan->cost = dist[target];
+        for (int f = target, i = hop_count - 1; f != (int)source; f = via[f]->source, i--) {
+            plan->hops[i] = via[f];
+        }
+    }
+}
+
+void planner_init(void) {
+    struct stat st;
+    if (stat(PLAN_SCRATCH_DIR, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        scratch_dir = "/tmp";
+    }
+
+    for (int source = 1; source < FORMAT_COUNT; source++) {
+        plan_from(source);
+    }
+
+    // Offer every reachable target, not only the direct conversions
+    for (int source = 1; source < FORMAT_COUNT; source++) {
+        for (int target = 1; target < FORMAT_COUNT; target++) {
+            const ConversionPlan *plan = &plans[source][target];
+            if (plan->hop_count < 2 || registry_find_route(source, target)) {
+                continue;
+            }
+
+            // The most expensive hop decides the class
+            CostClass cost_class = plan->hops[0]->cost_class;
+            double max_cost = registry_estimate_cost(plan->hops[0], PLAN_NOMINAL_BYTES);
+            for (int i = 1; i < plan->hop_count; i++) {
+                double cost = registry_estimate_cost(plan->hops[i], PLAN_NOMINAL_BYTES);
+                if (cost > max_cost) {
+                    max_cost = cost;
+                    cost_class = plan->hops[i]->cost_class;
+                }
+            }
+
+            int option = registry_free_option();
+            if (option < 0) {
+                return;
+            }
+            register_converter(option, source, target, NULL,
+                               plan->hops[plan->hop_count - 1]->output_extension, cost_class);
+        }
+    }
+}
+
+const ConversionPlan *planner_plan(FileFormat source, FileFormat target) {
+    if (source >= FORMAT_COUNT || target >= FORMAT_COUNT) {
+        return NULL;
+    }
+    return &plans[source][target];
+}
+
+// A converter that reports success must also have left a regular, non-empty file
+static int output_ok(int converted, const char *path) {
+    struct stat st;
+    return converted == 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+}
+
+static int run_plan(const Converter *converter, const char *input_path, const char *output_path);
+
+int planner_run(const Converter *converter, const char *input_path, const char *output_path, CancelToken *token) {
+    // The converters pick the token up from the thread
+    cancel_set_current(token);
+    int result = run_plan(converter, input_path, output_path);
+    if (result == 0 && cancel_token_expired(token)) {
+        result = -1;
+    }
+    cancel_set_current(NULL);
+    return result;
+}
+
+static int run_plan(const Converter *converter, const char *input_path, const char *output_path) {
+    if (converter->convert) {
+        int converted = converter->convert(input_path, output_path);
+        return output_ok(converted, output_path) ? 0 : -1;
+    }
+
+    const ConversionPlan *plan = planner_plan(converter->source, converter->target);
+    if (!plan || plan->hop_count == 0) {
+        fprintf(stderr, "No conversion path from %s to %s\n", format_name(converter->source), format_name(converter->target));
+        return -1;
+    }
+
+    char hop_input[PATH_MAX], hop_template[PATH_MAX] = "";
+    snprintf(hop_input, sizeof(hop_input), "%s", input_path);
+
+    for (int i = 0; i < plan->hop_count; i++) {
+        const Converter *hop = plan->hops[i];
+        char hop_output[PATH_MAX], previous_template[PATH_MAX];
+        snprintf(previous_template, sizeof(previous_template), "%s", hop_template);
+
+        if (i == plan->hop_count - 1) {
+            snprintf(hop_output, sizeof(hop_output), "%s", output_path);
+        } else {
+            // Intermediate results stay on tmpfs and are removed after the next hop
+            snprintf(hop_template, sizeof(hop_template), "%s/hop_XXXXXX", scratch_dir);
+            int fd = mkstemp(hop_template);
+            if (fd == -1) {
+                perror("Failed to create intermediate file");
+                return -1;
+            }
+            close(fd);
+            snprintf(hop_output, sizeof(hop_output), "%s%s", hop_template, hop->output_extension);
+        }
+
+        printf("Plan %s to %s, step %d/%d: %s to %s\n", format_name(converter->source), format_name(converter->target),
+               i + 1, plan->hop_count, format_name(hop->source), format_name(hop->target));
+        TraceSpan span = trace_span_begin("hop");
+        trace_span_set_arg(&span, "option", hop->option);
+        int converted = hop->convert(hop_input, hop_output);
+        trace_span_end(&span);
+        int ok = output_ok(converted, hop_output);
+
+        // The previous intermediate result is no longer needed
+        if (i > 0) {
+            unlink(hop_input);
+            unlink(previous_template);
+        }
+        if (!ok || cancel_requested()) {
+            if (i < plan->hop_count - 1) {
+                unlink(hop_output);
+                unlink(hop_template);
+            }
+            return -1;
+        }
+        snprintf(hop_input, sizeof(hop_input), "%s", hop_output);
+    }
+    return 0;
+}
+
+double planner_estimate_cost(const Converter *converter, size_t input_bytes) {
+    if (converter->convert) {
+        return registry_estimate_cost(converter, input_bytes);
+    }
+
+    const ConversionPlan *plan = planner_plan(converter->source, converter->target);
+    double cost = 0;
+    for (int i = 0; plan && i < plan->hop_count; i++) {
+        cost += registry_estimate_cost(plan->hops[i], input_bytes);
+    }
+    return cost;
+}
@@ -0,0 +1,33 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include <stddef.h>
+#include "registry.h"
+#include "cancel.h"
+
+#define MAX_PLAN_HOPS 4
+
+// Directory for intermediate results between hops; tmpfs, so they stay in memory
+#define PLAN_SCRATCH_DIR "/dev/shm"
+
+typedef struct {
+    int hop_count;                          // 0 when the target can't be reached
+    const Converter *hops[MAX_PLAN_HOPS];
+    double cost;                            // estimated cost for a 1 MB input
+} ConversionPlan;
+
+// Plans the cheapest chain of registered converters for every (source, target) pair
+// and registers an option for each pair that has no direct converter.
+// Must be called once, after all converters are registered.
+void planner_init(void);
+
+const ConversionPlan *planner_plan(FileFormat source, FileFormat target);
+
+// Runs the conversion behind an option, direct or in several hops; returns 0 on success.
+// A cancelled or expired token stops it between hops and inside the converters.
+int planner_run(const Converter *converter, const char *input_path, const char *output_path, CancelToken *token);
+
+// Estimated time in milliseconds for the whole conversion behind an option
+double planner_estimate_cost(const Converter *converter, size_t input_bytes);
+
+#endif // PLANNER_H
@@ -0,0 +1,78 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include "hash.h"
+#include "sniff.h"
+
+// Shared between the server (main.c) and the client (client/client.c)
+
+// Sent on the admin socket instead of a file extension; the server replies and closes the connection
+#define ADMIN_COMMAND_METRICS "!metrics"        // metrics in the Prometheus text format
+#define ADMIN_COMMAND_TRACE "!trace"            // recent spans as Chrome trace-event JSON
+#define ADMIN_COMMAND_TRACE_RATE "!trace-rate " // followed by the fraction of requests to trace
+
+// Chroma subsampling of JPEG output
+#define JPEG_SUBSAMPLING_444 1
+#define JPEG_SUBSAMPLING_422 2
+#define JPEG_SUBSAMPLING_420 3
+
+// Encoder settings chosen by the client. 0 keeps the server's default, and so does a value
+// the server doesn't accept. Settings that don't apply to the conversion are ignored.
+typedef struct {
+    uint32_t audio_bit_rate;        // bits per second
+    uint32_t audio_sample_rate;     // Hz
+    uint8_t audio_channels;         // 1 downmixes to mono
+    uint8_t audio_vbr_quality;      // MP3 only, 1-10 for LAME -V0 to -V9; replaces the bit rate
+    uint8_t jpeg_quality;           // 1-100
+    uint8_t jpeg_subsampling;       // JPEG_SUBSAMPLING_*
+    uint8_t png_level;              // zlib compression level, 1-9
+    uint8_t reserved[3];
+} EncoderOptions;
+
+// Sent by the client after the conversion option, before any file content
+typedef struct {
+    uint64_t file_size;
+    uint8_t input_digest[CONTENT_DIGEST_SIZE];  // SHA-256 of the content
+    EncoderOptions options;         // part of the key of cached results
+    uint32_t flags;                 // UPLOAD_FLAG_*
+    uint32_t prefix_len;
+    uint8_t prefix[SNIFF_PREFIX_SIZE];   // first bytes of the file, used to check its real format
+    uint8_t after_tag[SNIFF_FRAME_SIZE]; // the bytes after an ID3v2 tag at the start of the file
+                                         // that ends past the prefix, 0 otherwise
+} UploadHeader;
+
+// The client reads the result while it is still uploading, so the server may answer UPLOAD_STREAM
+#define UPLOAD_FLAG_STREAM 1
+
+// Server reply to an UploadHeader
+#define UPLOAD_SEND 0   // the server needs the file content
+#define UPLOAD_SKIP 1   // the server already has the input or the result, don't upload
+#define UPLOAD_REJECT 2 // the content doesn't match any conversion to the requested target
+#define UPLOAD_BUSY 3   // overloaded, followed by a uint32_t retry delay in milliseconds;
+                        // the client may send the UploadHeader again on the same connection
+#define UPLOAD_STREAM 4 // send the file content; the conversion starts on the first bytes and
+                        // the result, sized RESULT_SIZE_STREAMED, arrives during the upload
+
+// Sent before every result: the estimated wait in milliseconds, 0 for cached results
+typedef uint32_t ResultEta;
+
+// Result size of a streamed conversion. The content follows in chunks, each a uint32_t length
+// and that many bytes, up to a chunk of length 0, or of RESULT_CHUNK_FAILED when the conversion
+// failed partway and what arrived must be thrown away.
+#define RESULT_SIZE_STREAMED SIZE_MAX
+#define RESULT_CHUNK_FAILED UINT32_MAX
+
+// Follows every result that arrived in full: after its content, or after the 0 chunk of a
+// streamed result. The flags say which fields the conversion filled in and how it ran.
+#define RESULT_METADATA_LOUDNESS 1  // measured on the decoded audio while it was converted
+#define RESULT_METADATA_REMUXED 2   // the audio was copied into the new container without re-encoding
+typedef struct {
+    uint32_t flags;                 // RESULT_METADATA_*
+    uint32_t reserved;
+    double duration_seconds;
+    double integrated_lufs;         // EBU R128; -inf when nothing is loud enough to be gated in
+    double true_peak_dbtp;          // -inf for digital silence
+} ResultMetadata;
+
+#endif // PROTOCOL_H
@@ -0,0 +1,107 @@
+#include "registry.h"
+#include <stdio.h>
+#include <string.h>
+
+static Converter converters[MAX_CONVERSION_OPTIONS];
+static const Converter *routes[FORMAT_COUNT][FORMAT_COUNT];
+
+// Default estimates per cost class: fixed startup cost and cost per MB of input
+static const struct {
+    const char *name;
+    double base_ms;
+    double ms_per_mb;
+} cost_defaults[COST_CLASS_COUNT] = {
+    [COST_CLASS_IMAGE] = {"image", 5.0, 40.0},
+    [COST_CLASS_AUDIO] = {"audio", 30.0, 400.0},
+    [COST_CLASS_DOCUMENT] = {"document", 1500.0, 200.0},
+};
+
+int register_converter(int option, FileFormat source, FileFormat target, ConverterFn convert,
+                       const char *output_extension, CostClass cost_class) {
+    if (option <= 0 || option >= MAX_CONVERSION_OPTIONS || converters[option].option) {
+        fprintf(stderr, "Cannot register conversion option %d\n", option);
+        return -1;
+    }
+
+    Converter *converter = &converters[option];
+    converter->option = option;
+    converter->source = source;
+    converter->target = target;
+    converter->convert = convert;
+    converter->output_extension = output_extension;
+    converter->cost_class = cost_class;
+
+    // Direct converters take precedence over planned ones for the same pair
+    if (!routes[source][target] || (!routes[source][target]->convert && convert)) {
+        routes[source][target] = converter;
+    }
+    return 0;
+}
+
+int registry_set_streaming(int option) {
+    if (option <= 0 || option >= MAX_CONVERSION_OPTIONS || !converters[option].convert) {
+        return -1;
+    }
+    converters[option].streams = 1;
+    return 0;
+}
+
+const Converter *registry_find(int option) {
+    if (option <= 0 || option >= MAX_CONVERSION_OPTIONS || !converters[option].option) {
+        return NULL;
+    }
+    return &converters[option];
+}
+
+const Converter *registry_find_route(FileFormat source, FileFormat target) {
+    if (source >= FORMAT_COUNT || target >= FORMAT_COUNT) {
+        return NULL;
+    }
+    return routes[source][target];
+}
+
+int registry_free_option(void) {
+    for (int option = 1; option < MAX_CONVERSION_OPTIONS; option++) {
+        if (!converters[option].option) {
+            return option;
+        }
+    }
+    return -1;
+}
+
+int registry_route(int option, FileFormat actual) {
+    const Converter *requested = registry_find(option);
+    if (!requested || requested->source == actual) {
+        return option; // an unknown option is reported by process_conversion
+    }
+    const Converter *rerouted = registry_find_route(actual, requested->target);
+    return rerouted ? rerouted->option : -1;
+}
+
+size_t registry_build_menu(FileFormat source, char *menu, size_t menu_size) {
+    size_t len = 0;
+    menu[0] = '\0';
+
+    for (int option = 1; option < MAX_CONVERSION_OPTIONS; option++) {
+        const Converter *converter = &converters[option];
+        if (!converter->option || converter->source != source) {
+            continue;
+        }
+        int written = snprintf(menu + len, menu_size - len, "%d. %s to %s\n", option,
+                               format_name(converter->source), format_name(converter->target));
+        if (written < 0 || (size_t)written >= menu_size - len) {
+            break;
+        }
+        len += written;
+    }
+    return len;
+}
+
+double registry_estimate_cost(const Converter *converter, size_t input_bytes) {
+    double mb = input_bytes / (1024.0 * 1024.0);
+    return cost_defaults[converter->cost_class].base_ms + cost_defaults[converter->cost_class].ms_per_mb * mb;
+}
+
+const char *cost_class_name(CostClass cost_class) {
+    return cost_class < COST_CLASS_COUNT ? cost_defaults[cost_class].name : "unknown";
+}
@@ -0,0 +1,54 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stddef.h>
+#include "sniff.h"
+
+#define MAX_CONVERSION_OPTIONS 64
+
+// Returns 0 when output_path holds the converted file, a negative value on failure
+typedef int (*ConverterFn)(const char *input_path, const char *output_path);
+
+// Rough cost of a conversion, used by the scheduler to tell cheap jobs from expensive ones
+typedef enum {
+    COST_CLASS_IMAGE = 0,
+    COST_CLASS_AUDIO,
+    COST_CLASS_DOCUMENT,
+    COST_CLASS_COUNT
+} CostClass;
+
+typedef struct {
+    int option;                     // number shown in the menu and sent by the client
+    FileFormat source;
+    FileFormat target;
+    ConverterFn convert;            // NULL when the planner does the conversion in several steps
+    const char *output_extension;   // including the dot, e.g. ".mp3"
+    CostClass cost_class;
+    int streams;                    // can read the upload and send its output while both are in flight
+} Converter;
+
+// Pass convert = NULL to reserve an option for a conversion done by the planner
+int register_converter(int option, FileFormat source, FileFormat target, ConverterFn convert,
+                       const char *output_extension, CostClass cost_class);
+
+// Marks a registered conversion whose converter honours conversion_stream_current()
+int registry_set_streaming(int option);
+
+// First option number that isn't registered yet, or -1
+int registry_free_option(void);
+
+const Converter *registry_find(int option);
+const Converter *registry_find_route(FileFormat source, FileFormat target);
+
+// Pick the conversion matching the sniffed content while keeping the requested target.
+// Returns -1 when the content can't be converted to that target.
+int registry_route(int option, FileFormat actual);
+
+// Writes the menu of conversions available for the source format, returns its length
+size_t registry_build_menu(FileFormat source, char *menu, size_t menu_size);
+
+// Estimated time in milliseconds of a single conversion step for an input of the given size
+double registry_estimate_cost(const Converter *converter, size_t input_bytes);
+const char *cost_class_name(CostClass cost_class);
+
+#endif // REGISTRY_H
@@ -0,0 +1,11 @@
+#include "result_metadata.h"
+
+static _Thread_local ResultMetadata *current_metadata = NULL;
+
+void result_metadata_set_current(ResultMetadata *metadata) {
+    current_metadata = metadata;
+}
+
+ResultMetadata *result_metadata_current(void) {
+    return current_metadata;
+}
@@ -0,0 +1,11 @@
+#ifndef RESULT_METADATA_H
+#define RESULT_METADATA_H
+
+#include "protocol.h"
+
+// Converters have a fixed signature, so the worker publishes where the metadata of the
+// conversion it runs goes. NULL when nobody sends it, converters then skip measuring.
+void result_metadata_set_current(ResultMetadata *metadata);
+ResultMetadata *result_metadata_current(void);
+
+#endif // RESULT_METADATA_H
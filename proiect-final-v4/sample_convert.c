@@ -0,0 +1,512 @@
+#include "sample_convert.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SAMPLE_CONVERT_X86 1
+#endif
+
+#define S16_TO_FLOAT (1.0f / 32768.0f)
+#define FLOAT_TO_S16 32768.0f
+#define S16_HIGHEST 32767.0f
+#define S16_LOWEST -32768.0f
+#define UPMIX_GAIN 0.70710678118654752f
+// libswresample mixes both channels into the centre at -3 dB, and scales its matrix down to
+// unity gain only when the output is an integer format
+#define DOWNMIX_GAIN_FLOAT 0.70710678118654752f
+#define DOWNMIX_GAIN_INT 0.5f
+
+// One set per instruction set; each kernel does what it can in vector registers and leaves
+// the rest to the C one
+typedef struct {
+    const char *name;
+    void (*s16_mono_to_float)(float *out, const int16_t *in, int samples);
+    void (*s16_stereo_to_float)(float *left, float *right, const int16_t *in, int samples);
+    void (*float_stereo_to_planes)(float *left, float *right, const float *in, int samples);
+    void (*float_to_s16_mono)(int16_t *out, const float *in, int samples);
+    void (*float_to_s16_stereo)(int16_t *out, const float *left, const float *right, int samples);
+    void (*planes_to_float_stereo)(float *out, const float *left, const float *right, int samples);
+    void (*downmix)(float *out, const float *left, const float *right, float gain, int samples);
+    void (*scale)(float *out, const float *in, float gain, int samples);
+} SampleKernels;
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static const SampleKernels *kernels = NULL;
+
+// Rounds to nearest like lrintf and the vector conversions; the comparisons are ordered so
+// that NaN ends up as the highest sample, as it does in _mm_min_ps
+static inline int16_t float_to_s16(float sample) {
+    float value = sample * FLOAT_TO_S16;
+    value = value < S16_HIGHEST ? value : S16_HIGHEST;
+    value = value > S16_LOWEST ? value : S16_LOWEST;
+    return (int16_t)lrintf(value);
+}
+
+static void c_s16_mono_to_float(float *out, const int16_t *in, int samples) {
+    for (int i = 0; i < samples; i++) {
+        out[i] = in[i] * S16_TO_FLOAT;
+    }
+}
+
+static void c_s16_stereo_to_float(float *left, float *right, const int16_t *in, int samples) {
+    for (int i = 0; i < samples; i++) {
+        left[i] = in[2 * i] * S16_TO_FLOAT;
+        right[i] = in[2 * i + 1] * S16_TO_FLOAT;
+    }
+}
+
+static void c_float_stereo_to_planes(float *left, float *right, const float *in, int samples) {
+    for (int i = 0; i < samples; i++) {
+        left[i] = in[2 * i];
+        right[i] = in[2 * i + 1];
+    }
+}
+
+static void c_float_to_s16_mono(int16_t *out, const float *in, int samples) {
+    for (int i = 0; i < samples; i++) {
+        out[i] = float_to_s16(in[i]);
+    }
+}
+
+static void c_float_to_s16_stereo(int16_t *out, const float *left, const float *right, int samples) {
+    for (int i = 0; i < samples; i++) {
+        out[2 * i] = float_to_s16(left[i]);
+        out[2 * i + 1] = float_to_s16(right[i]);
+    }
+}
+
+static void c_planes_to_float_stereo(float *out, const float *left, const float *right, int samples) {
+    for (int i = 0; i < samples; i++) {
+        out[2 * i] = left[i];
+        out[2 * i + 1] = right[i];
+    }
+}
+
+static void c_downmix(float *out, const float *left, const float *right, float gain, int samples) {
+    for (int i = 0; i < samples; i++) {
+        out[i] = (left[i] + right[i]) * gain;
+    }
+}
+
+static void c_scale(float *out, const float *in, float gain, int samples) {
+    for (int i = 0; i < samples; i++) {
+        out[i] = in[i] * gain;
+    }
+}
+
+static const SampleKernels c_kernels = {
+    "c",
+    c_s16_mono_to_float,
+    c_s16_stereo_to_float,
+    c_float_stereo_to_planes,
+    c_float_to_s16_mono,
+    c_float_to_s16_stereo,
+    c_planes_to_float_stereo,
+    c_downmix,
+    c_scale,
+};
+
+#ifdef SAMPLE_CONVERT_X86
+
+// The intrinsics below need the instruction set enabled per function, the rest of the
+// program is still built for the baseline CPU
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+// Scaled to s16 and clipped the same way as float_to_s16; the packs saturate as well, but
+// values past the int32 range would convert to INT32_MIN first
+#define SSE2_TO_S16(v) _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(_mm_mul_ps(v, scale), highest), lowest))
+#define AVX2_TO_S16(v) _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(v, scale), highest), lowest))
+
+SSE2 static void sse2_s16_mono_to_float(float *out, const int16_t *in, int samples) {
+    const __m128 scale = _mm_set1_ps(S16_TO_FLOAT);
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+    }
+    c_s16_mono_to_float(out + i, in + i, samples - i);
+}
+
+// A frame of two s16 samples is one int32 with the left sample in the low half
+SSE2 static void sse2_s16_stereo_to_float(float *left, float *right, const int16_t *in, int samples) {
+    const __m128 scale = _mm_set1_ps(S16_TO_FLOAT);
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+        __m128i l = _mm_srai_epi32(_mm_slli_epi32(x, 16), 16);
+        __m128i r = _mm_srai_epi32(x, 16);
+        _mm_storeu_ps(left + i, _mm_mul_ps(_mm_cvtepi32_ps(l), scale));
+        _mm_storeu_ps(right + i, _mm_mul_ps(_mm_cvtepi32_ps(r), scale));
+    }
+    c_s16_stereo_to_float(left + i, right + i, in + 2 * i, samples - i);
+}
+
+SSE2 static void sse2_float_stereo_to_planes(float *left, float *right, const float *in, int samples) {
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        __m128 a = _mm_loadu_ps(in + 2 * i);
+        __m128 b = _mm_loadu_ps(in + 2 * i + 4);
+        _mm_storeu_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(right + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    c_float_stereo_to_planes(left + i, right + i, in + 2 * i, samples - i);
+}
+
+SSE2 static void sse2_float_to_s16_mono(int16_t *out, const float *in, int samples) {
+    const __m128 scale = _mm_set1_ps(FLOAT_TO_S16);
+    const __m128 highest = _mm_set1_ps(S16_HIGHEST);
+    const __m128 lowest = _mm_set1_ps(S16_LOWEST);
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128i a = SSE2_TO_S16(_mm_loadu_ps(in + i));
+        __m128i b = SSE2_TO_S16(_mm_loadu_ps(in + i + 4));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+    }
+    c_float_to_s16_mono(out + i, in + i, samples - i);
+}
+
+SSE2 static void sse2_float_to_s16_stereo(int16_t *out, const float *left, const float *right, int samples) {
+    const __m128 scale = _mm_set1_ps(FLOAT_TO_S16);
+    const __m128 highest = _mm_set1_ps(S16_HIGHEST);
+    const __m128 lowest = _mm_set1_ps(S16_LOWEST);
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        __m128i l = SSE2_TO_S16(_mm_loadu_ps(left + i));
+        __m128i r = SSE2_TO_S16(_mm_loadu_ps(right + i));
+        __m128i frames = _mm_packs_epi32(_mm_unpacklo_epi32(l, r), _mm_unpackhi_epi32(l, r));
+        _mm_storeu_si128((__m128i *)(out + 2 * i), frames);
+    }
+    c_float_to_s16_stereo(out + 2 * i, left + i, right + i, samples - i);
+}
+
+SSE2 static void sse2_planes_to_float_stereo(float *out, const float *left, const float *right, int samples) {
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        __m128 l = _mm_loadu_ps(left + i);
+        __m128 r = _mm_loadu_ps(right + i);
+        _mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(l, r));
+        _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(l, r));
+    }
+    c_planes_to_float_stereo(out + 2 * i, left + i, right + i, samples - i);
+}
+
+SSE2 static void sse2_downmix(float *out, const float *left, const float *right, float gain, int samples) {
+    const __m128 factor = _mm_set1_ps(gain);
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        __m128 sum = _mm_add_ps(_mm_loadu_ps(left + i), _mm_loadu_ps(right + i));
+        _mm_storeu_ps(out + i, _mm_mul_ps(sum, factor));
+    }
+    c_downmix(out + i, left + i, right + i, gain, samples - i);
+}
+
+SSE2 static void sse2_scale(float *out, const float *in, float gain, int samples) {
+    const __m128 factor = _mm_set1_ps(gain);
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(in + i), factor));
+    }
+    c_scale(out + i, in + i, gain, samples - i);
+}
+
+static const SampleKernels sse2_kernels = {
+    "sse2",
+    sse2_s16_mono_to_float,
+    sse2_s16_stereo_to_float,
+    sse2_float_stereo_to_planes,
+    sse2_float_to_s16_mono,
+    sse2_float_to_s16_stereo,
+    sse2_planes_to_float_stereo,
+    sse2_downmix,
+    sse2_scale,
+};
+
+// Most AVX2 shuffles and packs work within each 128-bit half, the permutes put the 64-bit
+// quarters back in order where that mixes up the samples
+AVX2 static void avx2_s16_mono_to_float(float *out, const int16_t *in, int samples) {
+    const __m256 scale = _mm256_set1_ps(S16_TO_FLOAT);
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i)));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+    }
+    c_s16_mono_to_float(out + i, in + i, samples - i);
+}
+
+AVX2 static void avx2_s16_stereo_to_float(float *left, float *right, const int16_t *in, int samples) {
+    const __m256 scale = _mm256_set1_ps(S16_TO_FLOAT);
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(in + 2 * i));
+        __m256i l = _mm256_srai_epi32(_mm256_slli_epi32(x, 16), 16);
+        __m256i r = _mm256_srai_epi32(x, 16);
+        _mm256_storeu_ps(left + i, _mm256_mul_ps(_mm256_cvtepi32_ps(l), scale));
+        _mm256_storeu_ps(right + i, _mm256_mul_ps(_mm256_cvtepi32_ps(r), scale));
+    }
+    c_s16_stereo_to_float(left + i, right + i, in + 2 * i, samples - i);
+}
+
+AVX2 static void avx2_float_stereo_to_planes(float *left, float *right, const float *in, int samples) {
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256 a = _mm256_loadu_ps(in + 2 * i);
+        __m256 b = _mm256_loadu_ps(in + 2 * i + 8);
+        __m256d l = _mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m256d r = _mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        _mm256_storeu_ps(left + i, _mm256_castpd_ps(_mm256_permute4x64_pd(l, _MM_SHUFFLE(3, 1, 2, 0))));
+        _mm256_storeu_ps(right + i, _mm256_castpd_ps(_mm256_permute4x64_pd(r, _MM_SHUFFLE(3, 1, 2, 0))));
+    }
+    c_float_stereo_to_planes(left + i, right + i, in + 2 * i, samples - i);
+}
+
+AVX2 static void avx2_float_to_s16_mono(int16_t *out, const float *in, int samples) {
+    const __m256 scale = _mm256_set1_ps(FLOAT_TO_S16);
+    const __m256 highest = _mm256_set1_ps(S16_HIGHEST);
+    const __m256 lowest = _mm256_set1_ps(S16_LOWEST);
+    int i = 0;
+    for (; i + 16 <= samples; i += 16) {
+        __m256i a = AVX2_TO_S16(_mm256_loadu_ps(in + i));
+        __m256i b = AVX2_TO_S16(_mm256_loadu_ps(in + i + 8));
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *)(out + i), packed);
+    }
+    c_float_to_s16_mono(out + i, in + i, samples - i);
+}
+
+// Interleaving before packing keeps each half in order, no permute needed
+AVX2 static void avx2_float_to_s16_stereo(int16_t *out, const float *left, const float *right, int samples) {
+    const __m256 scale = _mm256_set1_ps(FLOAT_TO_S16);
+    const __m256 highest = _mm256_set1_ps(S16_HIGHEST);
+    const __m256 lowest = _mm256_set1_ps(S16_LOWEST);
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256i l = AVX2_TO_S16(_mm256_loadu_ps(left + i));
+        __m256i r = AVX2_TO_S16(_mm256_loadu_ps(right + i));
+        __m256i frames = _mm256_packs_epi32(_mm256_unpacklo_epi32(l, r), _mm256_unpackhi_epi32(l, r));
+        _mm256_storeu_si256((__m256i *)(out + 2 * i), frames);
+    }
+    c_float_to_s16_stereo(out + 2 * i, left + i, right + i, samples - i);
+}
+
+AVX2 static void avx2_planes_to_float_stereo(float *out, const float *left, const float *right, int samples) {
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256 l = _mm256_loadu_ps(left + i);
+        __m256 r = _mm256_loadu_ps(right + i);
+        __m256 low = _mm256_unpacklo_ps(l, r);
+        __m256 high = _mm256_unpackhi_ps(l, r);
+        _mm256_storeu_ps(out + 2 * i, _mm256_permute2f128_ps(low, high, 0x20));
+        _mm256_storeu_ps(out + 2 * i + 8, _mm256_permute2f128_ps(low, high, 0x31));
+    }
+    c_planes_to_float_stereo(out + 2 * i, left + i, right + i, samples - i);
+}
+
+AVX2 static void avx2_downmix(float *out, const float *left, const float *right, float gain, int samples) {
+    const __m256 factor = _mm256_set1_ps(gain);
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256 sum = _mm256_add_ps(_mm256_loadu_ps(left + i), _mm256_loadu_ps(right + i));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(sum, factor));
+    }
+    c_downmix(out + i, left + i, right + i, gain, samples - i);
+}
+
+AVX2 static void avx2_scale(float *out, const float *in, float gain, int samples) {
+    const __m256 factor = _mm256_set1_ps(gain);
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(in + i), factor));
+    }
+    c_scale(out + i, in + i, gain, samples - i);
+}
+
+static const SampleKernels avx2_kernels = {
+    "avx2",
+    avx2_s16_mono_to_float,
+    avx2_s16_stereo_to_float,
+    avx2_float_stereo_to_planes,
+    avx2_float_to_s16_mono,
+    avx2_float_to_s16_stereo,
+    avx2_planes_to_float_stereo,
+    avx2_downmix,
+    avx2_scale,
+};
+
+#endif // SAMPLE_CONVERT_X86
+
+static void pick_kernels(void) {
+    kernels = &c_kernels;
+#ifdef SAMPLE_CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels = &avx2_kernels;
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernels = &sse2_kernels;
+    }
+#endif
+}
+
+const char *sample_convert_kernels(void) {
+    pthread_once(&kernels_once, pick_kernels);
+    return kernels->name;
+}
+
+int sample_conversion_init(SampleConversion *conversion, SampleFormat in_format, int in_channels,
+                           SampleFormat out_format, int out_channels) {
+    memset(conversion, 0, sizeof(*conversion));
+    if (in_channels < 1 || in_channels > SAMPLE_CONVERT_MAX_CHANNELS ||
+        out_channels < 1 || out_channels > SAMPLE_CONVERT_MAX_CHANNELS) {
+        return -1;
+    }
+    if (in_channels != out_channels && (in_channels > 2 || out_channels > 2)) {
+        return -1;
+    }
+    conversion->in_format = in_format;
+    conversion->in_channels = in_channels;
+    conversion->out_format = out_format;
+    conversion->out_channels = out_channels;
+    pthread_once(&kernels_once, pick_kernels);
+    return 0;
+}
+
+void sample_conversion_free(SampleConversion *conversion) {
+    free(conversion->scratch);
+    conversion->scratch = NULL;
+    conversion->scratch_size = 0;
+}
+
+// Any input layout other than planar float into one float plane per channel
+static void to_float_planes(float *const *planes, SampleFormat format, int channels, const uint8_t *const *in,
+                            int samples) {
+    if (format == SAMPLE_FORMAT_S16P) {
+        for (int c = 0; c < channels; c++) {
+            kernels->s16_mono_to_float(planes[c], (const int16_t *)in[c], samples);
+        }
+    } else if (format == SAMPLE_FORMAT_S16 && channels <= 2) {
+        if (channels == 2) {
+            kernels->s16_stereo_to_float(planes[0], planes[1], (const int16_t *)in[0], samples);
+        } else {
+            kernels->s16_mono_to_float(planes[0], (const int16_t *)in[0], samples);
+        }
+    } else if (format == SAMPLE_FORMAT_S16) {
+        const int16_t *source = (const int16_t *)in[0];
+        for (int i = 0; i < samples; i++) {
+            for (int c = 0; c < channels; c++) {
+                planes[c][i] = source[i * channels + c] * S16_TO_FLOAT;
+            }
+        }
+    } else if (channels == 2) {
+        kernels->float_stereo_to_planes(planes[0], planes[1], (const float *)in[0], samples);
+    } else if (channels == 1) {
+        memcpy(planes[0], in[0], samples * sizeof(float));
+    } else {
+        const float *source = (const float *)in[0];
+        for (int i = 0; i < samples; i++) {
+            for (int c = 0; c < channels; c++) {
+                planes[c][i] = source[i * channels + c];
+            }
+        }
+    }
+}
+
+// Float planes into the output layout; planes that already are the output are left alone
+static void from_float_planes(uint8_t *const *out, SampleFormat format, int channels, const float *const *planes,
+                              int samples) {
+    if (format == SAMPLE_FORMAT_FLTP) {
+        for (int c = 0; c < channels; c++) {
+            if (planes[c] != (const float *)out[c]) {
+                memcpy(out[c], planes[c], samples * sizeof(float));
+            }
+        }
+    } else if (format == SAMPLE_FORMAT_S16P) {
+        for (int c = 0; c < channels; c++) {
+            kernels->float_to_s16_mono((int16_t *)out[c], planes[c], samples);
+        }
+    } else if (format == SAMPLE_FORMAT_S16 && channels <= 2) {
+        if (channels == 2) {
+            kernels->float_to_s16_stereo((int16_t *)out[0], planes[0], planes[1], samples);
+        } else {
+            kernels->float_to_s16_mono((int16_t *)out[0], planes[0], samples);
+        }
+    } else if (format == SAMPLE_FORMAT_S16) {
+        int16_t *target = (int16_t *)out[0];
+        for (int i = 0; i < samples; i++) {
+            for (int c = 0; c < channels; c++) {
+                target[i * channels + c] = float_to_s16(planes[c][i]);
+            }
+        }
+    } else if (channels == 2) {
+        kernels->planes_to_float_stereo((float *)out[0], planes[0], planes[1], samples);
+    } else if (channels == 1) {
+        memcpy(out[0], planes[0], samples * sizeof(float));
+    } else {
+        float *target = (float *)out[0];
+        for (int i = 0; i < samples; i++) {
+            for (int c = 0; c < channels; c++) {
+                target[i * channels + c] = planes[c][i];
+            }
+        }
+    }
+}
+
+int sample_conversion_run(SampleConversion *conversion, uint8_t *const *out, const uint8_t *const *in,
+                          int samples) {
+    if (samples <= 0) {
+        return 0;
+    }
+    int in_channels = conversion->in_channels;
+    int out_channels = conversion->out_channels;
+    // Planar float output doubles as the scratch space of the steps before
+    int direct = conversion->out_format == SAMPLE_FORMAT_FLTP;
+
+    int scratch_planes = 0;
+    if (conversion->in_format != SAMPLE_FORMAT_FLTP && !(direct && in_channels == out_channels)) {
+        scratch_planes = in_channels;
+    } else if (in_channels != out_channels && !direct) {
+        scratch_planes = 1;
+    }
+    size_t scratch_size = (size_t)scratch_planes * samples;
+    if (scratch_size > conversion->scratch_size) {
+        float *scratch = realloc(conversion->scratch, scratch_size * sizeof(float));
+        if (!scratch) {
+            return -1;
+        }
+        conversion->scratch = scratch;
+        conversion->scratch_size = scratch_size;
+    }
+
+    const float *planes[SAMPLE_CONVERT_MAX_CHANNELS];
+    if (conversion->in_format == SAMPLE_FORMAT_FLTP) {
+        for (int c = 0; c < in_channels; c++) {
+            planes[c] = (const float *)in[c];
+        }
+    } else {
+        float *loaded[SAMPLE_CONVERT_MAX_CHANNELS];
+        for (int c = 0; c < in_channels; c++) {
+            loaded[c] = scratch_planes ? conversion->scratch + (size_t)c * samples : (float *)out[c];
+            planes[c] = loaded[c];
+        }
+        to_float_planes(loaded, conversion->in_format, in_channels, in, samples);
+    }
+
+    if (in_channels != out_channels) {
+        float *mixed = direct ? (float *)out[0] : conversion->scratch;
+        if (in_channels == 2) {
+            int float_out = conversion->out_format == SAMPLE_FORMAT_FLT || conversion->out_format == SAMPLE_FORMAT_FLTP;
+            kernels->downmix(mixed, planes[0], planes[1], float_out ? DOWNMIX_GAIN_FLOAT : DOWNMIX_GAIN_INT, samples);
+        } else {
+            kernels->scale(mixed, planes[0], UPMIX_GAIN, samples);
+            planes[1] = mixed;
+        }
+        planes[0] = mixed;
+    }
+
+    from_float_planes(out, conversion->out_format, out_channels, planes, samples);
+    return 0;
+}
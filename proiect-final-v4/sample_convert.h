@@ -0,0 +1,47 @@
+#ifndef SAMPLE_CONVERT_H
+#define SAMPLE_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SAMPLE_CONVERT_MAX_CHANNELS 8
+
+// The sample layouts the kernels handle, interleaved or one plane per channel
+typedef enum {
+    SAMPLE_FORMAT_S16,
+    SAMPLE_FORMAT_S16P,
+    SAMPLE_FORMAT_FLT,
+    SAMPLE_FORMAT_FLTP,
+} SampleFormat;
+
+// Sample format conversion and mono/stereo mixing at an unchanged sample rate, for the cases
+// the encoders and decoders need all the time, without going through libswresample. The
+// results match what libswresample gives with its default settings, within float rounding
+// (samplebench checks it): s16 maps to [-1, 1) by 1/32768, float is rounded to the nearest
+// s16 and clipped, mono is upmixed at -3 dB, and stereo is downmixed at -3 dB per channel
+// into float output and to the mean of both channels into s16 output. Kernels are picked
+// once for the CPU: AVX2, SSE2 or plain C.
+typedef struct {
+    SampleFormat in_format;
+    int in_channels;
+    SampleFormat out_format;
+    int out_channels;
+    float *scratch;             // float planes between the steps, grown as needed
+    size_t scratch_size;        // in floats
+} SampleConversion;
+
+// Returns -1 when the kernels don't handle the conversion; only the channel count may change
+// between mono and stereo
+int sample_conversion_init(SampleConversion *conversion, SampleFormat in_format, int in_channels,
+                           SampleFormat out_format, int out_channels);
+void sample_conversion_free(SampleConversion *conversion);
+
+// Converts samples per channel from in to out, each a plane pointer per channel or a single
+// pointer for interleaved samples. Returns -1 when out of memory.
+int sample_conversion_run(SampleConversion *conversion, uint8_t *const *out, const uint8_t *const *in,
+                          int samples);
+
+// The kernels in use: "avx2", "sse2" or "c"
+const char *sample_convert_kernels(void);
+
+#endif // SAMPLE_CONVERT_H
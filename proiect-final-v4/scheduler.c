@@ -0,0 +1,494 @@
+#include "scheduler.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <stdatomic.h>
+
+// Deficit added to a class per round, scaled by its weight, in estimated milliseconds
+#define CLASS_QUANTUM_MS 200.0
+// Deficit added to each client of a class per round
+#define CLIENT_QUANTUM_MS 200.0
+// Every millisecond spent waiting lowers a job's effective cost by this much
+#define AGING_FACTOR 1.0
+// Estimates above this are clamped, no conversion is expected to take longer
+#define MAX_JOB_COST_MS (60 * 60 * 1000.0)
+
+typedef struct {
+    Job *head;
+    Job *tail;
+} JobQueue;
+
+// Pending jobs of one client within one class
+typedef struct ClientQueue {
+    unsigned long client_id;
+    JobQueue jobs;
+    double deficit;
+    struct ClientQueue *next;
+} ClientQueue;
+
+typedef struct {
+    double weight;
+    double max_running_share;   // fraction of the shared workers the class may occupy
+    int max_running;
+    int running;                // including the worker slots lent to its jobs
+    int lent;
+    double deficit;
+    ClientQueue *active_head;   // clients with pending jobs, in round-robin order
+    ClientQueue *active_tail;
+} JobClassState;
+
+// Small image jobs get the largest share so they stay fast when audio and documents pile up
+static JobClassState classes[COST_CLASS_COUNT] = {
+    [COST_CLASS_IMAGE] = {.weight = 4.0, .max_running_share = 1.0},
+    [COST_CLASS_AUDIO] = {.weight = 2.0, .max_running_share = 0.75},
+    [COST_CLASS_DOCUMENT] = {.weight = 1.0, .max_running_share = 0.5},
+};
+
+static pthread_mutex_t scheduler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+static JobQueue high_queue;
+static int normal_worker_limit;
+static int normal_running = 0;
+static int lent_total = 0;
+static atomic_int workers_wanted = 0;   // a queued job would start if the lent slots came back
+static _Thread_local CostClass current_class = COST_CLASS_AUDIO;
+static int next_class = 0;      // round-robin position between the classes
+static double queued_cost = 0;  // estimated cost of all queued normal jobs
+static int started = 0;
+static void (*idle_hook)(void) = NULL;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void queue_push(JobQueue *queue, Job *job) {
+    job->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = job;
+    } else {
+        queue->head = job;
+    }
+    queue->tail = job;
+}
+
+static Job *queue_pop(JobQueue *queue) {
+    Job *job = queue->head;
+    if (job) {
+        queue->head = job->next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+    }
+    return job;
+}
+
+// Shortest expected job first, with aging
+static Job *queue_best(const JobQueue *queue, double now) {
+    Job *best = queue->head;
+    double best_priority = best ? best->cost - AGING_FACTOR * (now - best->enqueued_at) : 0;
+
+    for (Job *job = best ? best->next : NULL; job; job = job->next) {
+        double priority = job->cost - AGING_FACTOR * (now - job->enqueued_at);
+        if (priority < best_priority) {
+            best = job;
+            best_priority = priority;
+        }
+    }
+    return best;
+}
+
+static void queue_remove(JobQueue *queue, Job *job) {
+    Job *prev = NULL;
+    for (Job *it = queue->head; it && it != job; it = it->next) {
+        prev = it;
+    }
+    if (prev) {
+        prev->next = job->next;
+    } else {
+        queue->head = job->next;
+    }
+    if (queue->tail == job) {
+        queue->tail = prev;
+    }
+    job->next = NULL;
+}
+
+static void class_push_client(JobClassState *cls, ClientQueue *client) {
+    client->next = NULL;
+    if (cls->active_tail) {
+        cls->active_tail->next = client;
+    } else {
+        cls->active_head = client;
+    }
+    cls->active_tail = client;
+}
+
+static ClientQueue *class_pop_client(JobClassState *cls) {
+    ClientQueue *client = cls->active_head;
+    if (client) {
+        cls->active_head = client->next;
+        if (!cls->active_head) {
+            cls->active_tail = NULL;
+        }
+    }
+    return client;
+}
+
+static void enqueue_normal(Job *job) {
+    JobClassState *cls = &classes[job->job_class];
+
+    for (ClientQueue *client = cls->active_head; client; client = client->next) {
+        if (client->client_id == job->client_id) {
+            queue_push(&client->jobs, job);
+            return;
+        }
+    }
+
+    ClientQueue *client = calloc(1, sizeof(ClientQueue));
+    if (!client) {
+        perror("Failed to allocate client queue");
+        exit(EXIT_FAILURE);
+    }
+    client->client_id = job->client_id;
+    queue_push(&client->jobs, job);
+    class_push_client(cls, client);
+}
+
+// Quanta a deficit still needs to cover a cost
+static double rounds_missing(double deficit, double cost, double quantum) {
+    return deficit >= cost ? 0 : ceil((cost - deficit) / quantum);
+}
+
+// Deficit round-robin between the clients of a class: the client at the head may send
+// its next job once its deficit covers the job's cost, otherwise it gets a quantum and
+// goes to the back. The chosen client is left at the head and its job returned.
+static Job *class_select_job(JobClassState *cls, double now) {
+    // Grant the full rounds that pass before any client can send in one step,
+    // the loop below then needs at most one more round
+    double rounds = -1;
+    for (ClientQueue *client = cls->active_head; client; client = client->next) {
+        double missing = rounds_missing(client->deficit, queue_best(&client->jobs, now)->cost, CLIENT_QUANTUM_MS);
+        if (rounds < 0 || missing < rounds) {
+            rounds = missing;
+        }
+    }
+    for (ClientQueue *client = cls->active_head; rounds > 0 && client; client = client->next) {
+        client->deficit += rounds * CLIENT_QUANTUM_MS;
+    }
+
+    while (cls->active_head) {
+        ClientQueue *client = cls->active_head;
+        Job *job = queue_best(&client->jobs, now);
+        if (client->deficit >= job->cost) {
+            return job;
+        }
+        client->deficit += CLIENT_QUANTUM_MS;
+        class_pop_client(cls);
+        class_push_client(cls, client);
+    }
+    return NULL;
+}
+
+static Job *class_take_job(JobClassState *cls, Job *job) {
+    ClientQueue *client = cls->active_head;
+    queue_remove(&client->jobs, job);
+    client->deficit -= job->cost;
+    cls->deficit -= job->cost;
+    queued_cost -= job->cost;
+
+    // A client that has nothing left leaves the round and loses its deficit
+    if (!client->jobs.head) {
+        class_pop_client(cls);
+        free(client);
+    }
+    return job;
+}
+
+// Deficit round-robin between the classes that have work and are below their cap
+static Job *next_normal_job(void) {
+    if (normal_running >= normal_worker_limit) {
+        return NULL;
+    }
+    double now = now_ms();
+
+    // Same for the classes: the rounds before any of them can start a job are granted at once
+    double rounds = -1;
+    for (int i = 0; i < COST_CLASS_COUNT; i++) {
+        JobClassState *cls = &classes[i];
+        if (cls->active_head && cls->running < cls->max_running) {
+            double missing = rounds_missing(cls->deficit, class_select_job(cls, now)->cost, CLASS_QUANTUM_MS * cls->weight);
+            if (rounds < 0 || missing < rounds) {
+                rounds = missing;
+            }
+        }
+    }
+    for (int i = 0; rounds > 0 && i < COST_CLASS_COUNT; i++) {
+        JobClassState *cls = &classes[i];
+        if (cls->active_head && cls->running < cls->max_running) {
+            cls->deficit += rounds * CLASS_QUANTUM_MS * cls->weight;
+        }
+    }
+
+    while (1) {
+        int eligible = 0;
+
+        for (int i = 0; i < COST_CLASS_COUNT; i++) {
+            JobClassState *cls = &classes[next_class];
+            if (!cls->active_head) {
+                cls->deficit = 0;
+            } else if (cls->running < cls->max_running) {
+                eligible = 1;
+                Job *job = class_select_job(cls, now);
+                if (cls->deficit >= job->cost) {
+                    cls->running++;
+                    normal_running++;
+                    return class_take_job(cls, job);
+                }
+                cls->deficit += CLASS_QUANTUM_MS * cls->weight;
+            }
+            next_class = (next_class + 1) % COST_CLASS_COUNT;
+        }
+
+        if (!eligible) {
+            return NULL;
+        }
+    }
+}
+
+// High priority jobs always go first; normal ones only while a non-reserved worker is free
+static Job *next_job(void) {
+    Job *job = queue_pop(&high_queue);
+    if (!job) {
+        job = next_normal_job();
+    }
+    return job;
+}
+
+// Lent slots only hold up a class whose queued job would fit once they are back
+static void update_workers_wanted(void) {
+    int wanted = 0;
+    for (int i = 0; lent_total > 0 && !wanted && i < COST_CLASS_COUNT; i++) {
+        const JobClassState *cls = &classes[i];
+        int blocked = normal_running >= normal_worker_limit || cls->running >= cls->max_running;
+        int fits_without_lent = normal_running - lent_total < normal_worker_limit &&
+                                cls->running - cls->lent < cls->max_running;
+        wanted = cls->active_head && blocked && fits_without_lent;
+    }
+    atomic_store(&workers_wanted, wanted);
+}
+
+static void *worker_main(void *arg) {
+    (void)arg;
+
+    int idle_hook_ran = 0;
+    while (1) {
+        pthread_mutex_lock(&scheduler_mutex);
+        Job *job;
+        while ((job = next_job()) == NULL) {
+            // Once per idle period, and the queue is checked again afterwards
+            if (idle_hook && !idle_hook_ran) {
+                idle_hook_ran = 1;
+                pthread_mutex_unlock(&scheduler_mutex);
+                idle_hook();
+                pthread_mutex_lock(&scheduler_mutex);
+                continue;
+            }
+            pthread_cond_wait(&work_available, &scheduler_mutex);
+        }
+        idle_hook_ran = 0;
+        double waited_ms = now_ms() - job->enqueued_at;
+        update_workers_wanted();
+        pthread_mutex_unlock(&scheduler_mutex);
+
+        metrics_observe(HISTOGRAM_QUEUE_WAIT, waited_ms);
+        JobPriority priority = job->priority;
+        CostClass job_class = job->job_class;
+        current_class = job_class;
+        job->run(job);
+
+        pthread_mutex_lock(&job->lock);
+        job->done = 1;
+        pthread_cond_signal(&job->finished);
+        pthread_mutex_unlock(&job->lock);
+
+        if (priority == JOB_PRIORITY_NORMAL) {
+            pthread_mutex_lock(&scheduler_mutex);
+            normal_running--;
+            classes[job_class].running--;
+            update_workers_wanted();
+            // A normal job may now fit on a shared worker
+            pthread_cond_broadcast(&work_available);
+            pthread_mutex_unlock(&scheduler_mutex);
+        }
+    }
+    return NULL;
+}
+
+void scheduler_set_idle_hook(void (*hook)(void)) {
+    idle_hook = hook;
+}
+
+void scheduler_init(int worker_count, int reserved_workers) {
+    if (worker_count < 2) {
+        worker_count = 2;
+    }
+    if (reserved_workers < 1) {
+        reserved_workers = 1;
+    }
+    if (reserved_workers >= worker_count) {
+        reserved_workers = worker_count - 1;
+    }
+    normal_worker_limit = worker_count - reserved_workers;
+    started = 1;
+
+    for (int i = 0; i < COST_CLASS_COUNT; i++) {
+        classes[i].max_running = (int)(normal_worker_limit * classes[i].max_running_share);
+        if (classes[i].max_running < 1) {
+            classes[i].max_running = 1;
+        }
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, NULL) != 0) {
+            perror("Failed to start worker");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+    printf("Scheduler: %d workers, %d reserved for admin jobs\n", worker_count, reserved_workers);
+}
+
+void job_init(Job *job, void (*run)(Job *job), JobPriority priority,
+              unsigned long client_id, CostClass job_class, double cost) {
+    job->run = run;
+    job->priority = priority;
+    job->client_id = client_id;
+    job->job_class = job_class < COST_CLASS_COUNT ? job_class : COST_CLASS_AUDIO;
+    job->cost = cost > 0 ? (cost < MAX_JOB_COST_MS ? cost : MAX_JOB_COST_MS) : 1.0;
+    job->enqueued_at = 0;
+    job->done = 0;
+    job->next = NULL;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->finished, NULL);
+}
+
+void job_destroy(Job *job) {
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->finished);
+}
+
+void scheduler_submit(Job *job) {
+    pthread_mutex_lock(&scheduler_mutex);
+    job->enqueued_at = now_ms();
+    if (job->priority == JOB_PRIORITY_HIGH) {
+        queue_push(&high_queue, job);
+    } else {
+        queued_cost += job->cost;
+        enqueue_normal(job);
+        update_workers_wanted();
+    }
+    pthread_cond_broadcast(&work_available);
+    pthread_mutex_unlock(&scheduler_mutex);
+}
+
+void scheduler_wait(Job *job) {
+    pthread_mutex_lock(&job->lock);
+    while (!job->done) {
+        pthread_cond_wait(&job->finished, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+int scheduler_wait_timeout(Job *job, int timeout_ms) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->done) {
+        if (pthread_cond_timedwait(&job->finished, &job->lock, &until) != 0) {
+            break;
+        }
+    }
+    int done = job->done;
+    pthread_mutex_unlock(&job->lock);
+    return done;
+}
+
+double scheduler_backlog_ms(void) {
+    pthread_mutex_lock(&scheduler_mutex);
+    double backlog = normal_worker_limit > 0 ? queued_cost / normal_worker_limit : queued_cost;
+    pthread_mutex_unlock(&scheduler_mutex);
+    return backlog;
+}
+
+static int normal_jobs_waiting(void) {
+    for (int i = 0; i < COST_CLASS_COUNT; i++) {
+        if (classes[i].active_head) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int scheduler_borrow_workers(CostClass job_class, int wanted) {
+    if (wanted <= 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&scheduler_mutex);
+    int lent = wanted;
+    if (started) {
+        JobClassState *cls = &classes[job_class < COST_CLASS_COUNT ? job_class : COST_CLASS_AUDIO];
+        int idle = normal_worker_limit - normal_running;
+        if (cls->max_running - cls->running < idle) {
+            idle = cls->max_running - cls->running;
+        }
+        if (normal_jobs_waiting() || idle < 0) {
+            idle = 0;
+        }
+        lent = idle < wanted ? idle : wanted;
+        normal_running += lent;
+        cls->running += lent;
+        cls->lent += lent;
+        lent_total += lent;
+        update_workers_wanted();
+    }
+    pthread_mutex_unlock(&scheduler_mutex);
+    return lent;
+}
+
+void scheduler_return_workers(CostClass job_class, int count) {
+    if (count <= 0) {
+        return;
+    }
+    pthread_mutex_lock(&scheduler_mutex);
+    if (started) {
+        JobClassState *cls = &classes[job_class < COST_CLASS_COUNT ? job_class : COST_CLASS_AUDIO];
+        normal_running -= count;
+        cls->running -= count;
+        cls->lent -= count;
+        lent_total -= count;
+        update_workers_wanted();
+        // A normal job may now fit on a shared worker
+        pthread_cond_broadcast(&work_available);
+    }
+    pthread_mutex_unlock(&scheduler_mutex);
+}
+
+int scheduler_workers_wanted(void) {
+    return atomic_load_explicit(&workers_wanted, memory_order_relaxed);
+}
+
+CostClass scheduler_current_class(void) {
+    return current_class;
+}
@@ -0,0 +1,69 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <pthread.h>
+#include "registry.h"
+
+// Admin and internal jobs go first and have workers reserved for them
+typedef enum {
+    JOB_PRIORITY_HIGH = 0,
+    JOB_PRIORITY_NORMAL
+} JobPriority;
+
+typedef struct Job {
+    void (*run)(struct Job *job);   // executed on a worker thread
+    JobPriority priority;
+    unsigned long client_id;        // jobs of the same client share one fair-queuing slot
+    CostClass job_class;
+    double cost;                    // estimated run time in milliseconds
+
+    // Owned by the scheduler
+    double enqueued_at;             // milliseconds, for aging
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    struct Job *next;
+} Job;
+
+// Starts worker_count workers; reserved_workers of them never take normal priority jobs.
+// Normal jobs are shared between the job classes by weighted deficit round-robin, and
+// between the clients of a class the same way, so a client with many queued jobs
+// can't starve the others. Each client's own jobs run shortest-expected-first, with
+// waiting time lowering a job's effective cost so big jobs aren't postponed forever.
+void scheduler_init(int worker_count, int reserved_workers);
+
+// Called by a worker that found nothing to do before it goes to sleep, for preparing its
+// thread-local state for the next job. Set it before scheduler_init.
+void scheduler_set_idle_hook(void (*hook)(void));
+
+void job_init(Job *job, void (*run)(Job *job), JobPriority priority,
+              unsigned long client_id, CostClass job_class, double cost);
+void job_destroy(Job *job);
+
+void scheduler_submit(Job *job);
+
+// Blocks until the job has run
+void scheduler_wait(Job *job);
+
+// Same with a limit, returns 1 if the job has run and 0 on timeout
+int scheduler_wait_timeout(Job *job, int timeout_ms);
+
+// Estimated time until a newly queued normal job gets a worker, in milliseconds
+double scheduler_backlog_ms(void);
+
+// Lends up to wanted idle normal worker slots to a running job of job_class for its own helper
+// threads, so the process doesn't run more busy threads than there are workers. The slots count
+// against the class's share like jobs of it do, and no normal job starts on a lent slot until it
+// is returned; nothing is lent while normal jobs are waiting. Returns how many were lent. Without
+// a running scheduler, e.g. in bench, the caller has the machine to itself and gets all it wants.
+int scheduler_borrow_workers(CostClass job_class, int wanted);
+void scheduler_return_workers(CostClass job_class, int count);
+
+// Set while a queued job is only held up by lent slots; helpers that keep their slot for long
+// check it between pieces of work and give the slot back. Costs an atomic load.
+int scheduler_workers_wanted(void);
+
+// Class of the job running on this worker thread, for borrowing; COST_CLASS_AUDIO on other threads
+CostClass scheduler_current_class(void);
+
+#endif // SCHEDULER_H
@@ -0,0 +1,189 @@
+#include "sniff.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#define ODT_MIMETYPE "application/vnd.oasis.opendocument.text"
+
+static int starts_with(const unsigned char *data, size_t len, const char *magic, size_t magic_len) {
+    return len >= magic_len && memcmp(data, magic, magic_len) == 0;
+}
+
+// ODT files are zip archives whose first, stored entry is "mimetype"
+static int is_odt(const unsigned char *data, size_t len) {
+    const size_t name_offset = 30;
+    const size_t content_offset = name_offset + 8;
+
+    if (!starts_with(data, len, "PK\x03\x04", 4) || len < content_offset + strlen(ODT_MIMETYPE)) {
+        return 0;
+    }
+    return memcmp(data + name_offset, "mimetype", 8) == 0 &&
+           memcmp(data + content_offset, ODT_MIMETYPE, strlen(ODT_MIMETYPE)) == 0;
+}
+
+// MPEG-1/2 layer III frame sync: 11 set bits, then any version and layer bits 01
+static int is_mp3_frame(const unsigned char *data, size_t len) {
+    return len >= 2 && data[0] == 0xFF && (data[1] & 0xE0) == 0xE0 && (data[1] & 0x06) == 0x02;
+}
+
+// ADTS header: 12 set bits, then the version bit and layer bits 00
+static int is_adts_frame(const unsigned char *data, size_t len) {
+    return len >= 2 && data[0] == 0xFF && (data[1] & 0xF6) == 0xF0;
+}
+
+// ISO base media file (MP4): the file starts with an ftyp box. Video MP4s pass as well,
+// the audio conversions only use their audio stream.
+static int is_m4a(const unsigned char *data, size_t len) {
+    return len >= 12 && memcmp(data + 4, "ftyp", 4) == 0;
+}
+
+static uint32_t read_le32(const unsigned char *data) {
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+// "BM" alone starts plenty of text files, so the file header has to make sense too: reserved
+// fields 0, a known DIB header size and the pixel data inside the file
+static int is_bmp(const unsigned char *data, size_t len, uint64_t file_size) {
+    if (!starts_with(data, len, "BM", 2) || len < 18 || read_le32(data + 6) != 0) {
+        return 0;
+    }
+    uint32_t dib_size = read_le32(data + 14);
+    uint32_t pixel_offset = read_le32(data + 10);
+    if (dib_size != 12 && dib_size != 40 && dib_size != 52 && dib_size != 56 && dib_size != 108 && dib_size != 124) {
+        return 0;
+    }
+    return pixel_offset >= 14 + dib_size && pixel_offset <= file_size;
+}
+
+size_t sniff_id3_size(const unsigned char *data, size_t len) {
+    // "ID3", version and revision below 0xFF, flags, then the size in four 7-bit bytes
+    if (!starts_with(data, len, "ID3", 3) || len < 10 || data[3] == 0xFF || data[4] == 0xFF ||
+        ((data[6] | data[7] | data[8] | data[9]) & 0x80)) {
+        return 0;
+    }
+    size_t size = 10 + ((size_t)data[6] << 21 | (size_t)data[7] << 14 | (size_t)data[8] << 7 | data[9]);
+    if (data[5] & 0x10) {
+        size += 10;
+    }
+    return size;
+}
+
+// Plain text if the prefix has no control characters other than whitespace
+static int is_text(const unsigned char *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] < 0x20 && data[i] != '\n' && data[i] != '\r' && data[i] != '\t' && data[i] != '\f') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+FileFormat sniff_format(const unsigned char *data, size_t len, uint64_t file_size, const unsigned char *after_tag) {
+    if (starts_with(data, len, "\x89PNG\r\n\x1a\n", 8)) {
+        return FORMAT_PNG;
+    }
+    if (starts_with(data, len, "\xFF\xD8\xFF", 3)) {
+        return FORMAT_JPEG;
+    }
+    if (is_bmp(data, len, file_size)) {
+        return FORMAT_BMP;
+    }
+    if (starts_with(data, len, "RIFF", 4) && len >= 12 && memcmp(data + 8, "WAVE", 4) == 0) {
+        return FORMAT_WAV;
+    }
+    if (starts_with(data, len, "%PDF-", 5)) {
+        return FORMAT_PDF;
+    }
+    if (is_odt(data, len)) {
+        return FORMAT_ODT;
+    }
+    if (is_m4a(data, len)) {
+        return FORMAT_M4A;
+    }
+    // ADTS streams carry ID3v2 tags as well; whatever else follows a tag is left to the MP3 demuxer
+    size_t tag_size = sniff_id3_size(data, len);
+    if (tag_size > 0) {
+        const unsigned char *frame = tag_size + SNIFF_FRAME_SIZE <= len ? data + tag_size : after_tag;
+        return frame && is_adts_frame(frame, SNIFF_FRAME_SIZE) ? FORMAT_AAC : FORMAT_MP3;
+    }
+    if (is_mp3_frame(data, len)) {
+        return FORMAT_MP3;
+    }
+    if (is_adts_frame(data, len)) {
+        return FORMAT_AAC;
+    }
+    if (is_text(data, len)) {
+        return FORMAT_TXT;
+    }
+    return FORMAT_UNKNOWN;
+}
+
+FileFormat sniff_file(const char *path) {
+    unsigned char prefix[SNIFF_PREFIX_SIZE];
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return FORMAT_UNKNOWN;
+    }
+    size_t len = fread(prefix, 1, sizeof(prefix), file);
+    struct stat st;
+    uint64_t file_size = fstat(fileno(file), &st) == 0 ? (uint64_t)st.st_size : 0;
+
+    unsigned char after_tag[SNIFF_FRAME_SIZE] = {0};
+    size_t tag_size = sniff_id3_size(prefix, len);
+    if (tag_size > 0 && tag_size + SNIFF_FRAME_SIZE > len && fseek(file, (long)tag_size, SEEK_SET) == 0 &&
+        fread(after_tag, 1, sizeof(after_tag), file) == 0) {
+        memset(after_tag, 0, sizeof(after_tag));
+    }
+    fclose(file);
+    return sniff_format(prefix, len, file_size, after_tag);
+}
+
+FileFormat format_from_extension(const char *extension) {
+    if (strcasecmp(extension, "aac") == 0) return FORMAT_AAC;
+    if (strcasecmp(extension, "mp3") == 0) return FORMAT_MP3;
+    if (strcasecmp(extension, "wav") == 0) return FORMAT_WAV;
+    if (strcasecmp(extension, "bmp") == 0) return FORMAT_BMP;
+    if (strcasecmp(extension, "jpeg") == 0 || strcasecmp(extension, "jpg") == 0) return FORMAT_JPEG;
+    if (strcasecmp(extension, "png") == 0) return FORMAT_PNG;
+    if (strcasecmp(extension, "odt") == 0) return FORMAT_ODT;
+    if (strcasecmp(extension, "txt") == 0) return FORMAT_TXT;
+    if (strcasecmp(extension, "pdf") == 0) return FORMAT_PDF;
+    if (strcasecmp(extension, "m4a") == 0) return FORMAT_M4A;
+    return FORMAT_UNKNOWN;
+}
+
+const char *format_name(FileFormat format) {
+    switch (format) {
+        case FORMAT_AAC: return "AAC";
+        case FORMAT_MP3: return "MP3";
+        case FORMAT_WAV: return "WAV";
+        case FORMAT_BMP: return "BMP";
+        case FORMAT_JPEG: return "JPEG";
+        case FORMAT_PNG: return "PNG";
+        case FORMAT_ODT: return "ODT";
+        case FORMAT_TXT: return "TXT";
+        case FORMAT_PDF: return "PDF";
+        case FORMAT_M4A: return "M4A";
+        default: return "unknown";
+    }
+}
+
+const char *format_extension(FileFormat format) {
+    switch (format) {
+        case FORMAT_AAC: return "aac";
+        case FORMAT_MP3: return "mp3";
+        case FORMAT_WAV: return "wav";
+        case FORMAT_BMP: return "bmp";
+        case FORMAT_JPEG: return "jpeg";
+        case FORMAT_PNG: return "png";
+        case FORMAT_ODT: return "odt";
+        case FORMAT_TXT: return "txt";
+        case FORMAT_PDF: return "pdf";
+        case FORMAT_M4A: return "m4a";
+        default: return "bin";
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef SNIFF_H
+#define SNIFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of leading bytes needed to recognise every supported format
+#define SNIFF_PREFIX_SIZE 128
+// Bytes of the first frame after a leading ID3v2 tag, which tell MP3 from AAC
+#define SNIFF_FRAME_SIZE 4
+
+typedef enum {
+    FORMAT_UNKNOWN = 0,
+    FORMAT_AAC,
+    FORMAT_MP3,
+    FORMAT_WAV,
+    FORMAT_BMP,
+    FORMAT_JPEG,
+    FORMAT_PNG,
+    FORMAT_ODT,
+    FORMAT_TXT,
+    FORMAT_PDF,
+    FORMAT_M4A,
+    FORMAT_COUNT
+} FileFormat;
+
+// Detect the format from the magic bytes at the start of the file. Audio behind an ID3v2 tag is
+// told by the frame after the tag; when the tag ends past data, after_tag holds the first
+// SNIFF_FRAME_SIZE bytes after it, or is NULL when they aren't known and MP3 is assumed.
+FileFormat sniff_format(const unsigned char *data, size_t len, uint64_t file_size, const unsigned char *after_tag);
+FileFormat sniff_file(const char *path);
+
+// Size of the ID3v2 tag at the start of data, header and footer included; 0 when there is none
+size_t sniff_id3_size(const unsigned char *data, size_t len);
+
+FileFormat format_from_extension(const char *extension);
+const char *format_name(FileFormat format);
+const char *format_extension(FileFormat format);
+
+#endif // SNIFF_H
@@ -0,0 +1,95 @@
+#include "spsc_ring.h"
+#include <stdlib.h>
+
+int spsc_ring_init(SpscRing *ring, unsigned int capacity) {
+    unsigned int size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    ring->slots = calloc(size, sizeof(void *));
+    if (!ring->slots) {
+        return -1;
+    }
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
+    atomic_init(&ring->waiting, 0);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->changed, NULL);
+    return 0;
+}
+
+void spsc_ring_destroy(SpscRing *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->changed);
+}
+
+// The sleeping side announces itself before it checks the ring again and the other side
+// checks for it after it has moved its index, so one of them always sees the other
+static void wake(SpscRing *ring) {
+    if (atomic_load(&ring->waiting)) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+static int is_full(SpscRing *ring) {
+    return atomic_load(&ring->tail) - atomic_load(&ring->head) > ring->mask;
+}
+
+static int is_empty(SpscRing *ring) {
+    return atomic_load(&ring->tail) == atomic_load(&ring->head);
+}
+
+int spsc_ring_push(SpscRing *ring, void *item) {
+    if (is_full(ring) && !atomic_load(&ring->closed)) {
+        pthread_mutex_lock(&ring->lock);
+        atomic_fetch_add(&ring->waiting, 1);
+        while (is_full(ring) && !atomic_load(&ring->closed)) {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        }
+        atomic_fetch_sub(&ring->waiting, 1);
+        pthread_mutex_unlock(&ring->lock);
+    }
+    if (atomic_load(&ring->closed)) {
+        return -1;
+    }
+
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring->slots[tail & ring->mask] = item;
+    atomic_store(&ring->tail, tail + 1);
+    wake(ring);
+    return 0;
+}
+
+void *spsc_ring_pop(SpscRing *ring) {
+    if (is_empty(ring) && !atomic_load(&ring->closed)) {
+        pthread_mutex_lock(&ring->lock);
+        atomic_fetch_add(&ring->waiting, 1);
+        while (is_empty(ring) && !atomic_load(&ring->closed)) {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        }
+        atomic_fetch_sub(&ring->waiting, 1);
+        pthread_mutex_unlock(&ring->lock);
+    }
+    if (is_empty(ring)) {
+        return NULL;
+    }
+
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    void *item = ring->slots[head & ring->mask];
+    atomic_store(&ring->head, head + 1);
+    wake(ring);
+    return item;
+}
+
+void spsc_ring_close(SpscRing *ring) {
+    pthread_mutex_lock(&ring->lock);
+    atomic_store(&ring->closed, 1);
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+}
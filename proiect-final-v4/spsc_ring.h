@@ -0,0 +1,34 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Bounded queue of pointers between exactly one producer thread and one consumer thread.
+// Pushing and popping only touch the two indices; a side only takes the lock to sleep when
+// the ring is full or empty, and the other side only to wake it.
+typedef struct {
+    void **slots;
+    unsigned int mask;          // capacity - 1, the capacity is a power of two
+    atomic_uint head;           // next slot to pop, written by the consumer
+    atomic_uint tail;           // next slot to push, written by the producer
+    atomic_int closed;
+    atomic_int waiting;         // a side is asleep on changed
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} SpscRing;
+
+// Capacity is rounded up to a power of two; returns -1 when out of memory
+int spsc_ring_init(SpscRing *ring, unsigned int capacity);
+void spsc_ring_destroy(SpscRing *ring);
+
+// Blocks while the ring is full; returns -1 without pushing once the ring is closed
+int spsc_ring_push(SpscRing *ring, void *item);
+
+// Blocks while the ring is empty; returns NULL once the ring is closed and empty
+void *spsc_ring_pop(SpscRing *ring);
+
+// Either side: no more items will be pushed. Wakes both sides, what is queued can still be popped.
+void spsc_ring_close(SpscRing *ring);
+
+#endif // SPSC_RING_H
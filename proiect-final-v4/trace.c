@@ -0,0 +1,261 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct {
+    const char *name;
+    uint64_t trace_id;
+    double start_us;
+    double duration_us;
+    const char *arg_names[TRACE_MAX_SPAN_ARGS];
+    double arg_values[TRACE_MAX_SPAN_ARGS];
+    int arg_count;
+} TraceEvent;
+
+// Spans of one thread. The lock is only contended while the spans are exported.
+typedef struct TraceRing {
+    pthread_mutex_t lock;
+    int tid;
+    uint64_t written;
+    TraceEvent events[TRACE_RING_SIZE];
+    struct TraceRing *next;         // all rings ever created
+    struct TraceRing *next_free;    // rings whose thread has exited
+} TraceRing;
+
+static _Atomic double sample_rate = TRACE_DEFAULT_SAMPLE_RATE;
+static atomic_uint_fast64_t next_trace_id = 1;
+
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static TraceRing *all_rings = NULL;
+static TraceRing *free_rings = NULL;
+static int ring_count = 0;
+
+static _Thread_local TraceContext current = {0, 0};
+static _Thread_local TraceRing *thread_ring = NULL;
+static _Thread_local double stage_totals_us[TRACE_STAGE_COUNT];
+
+static const char *stage_names[TRACE_STAGE_COUNT] = {
+    [TRACE_STAGE_DECODE] = "decode_ms",
+    [TRACE_STAGE_RESAMPLE] = "resample_ms",
+    [TRACE_STAGE_ENCODE] = "encode_ms",
+    [TRACE_STAGE_MUX] = "mux_ms",
+    [TRACE_STAGE_ANALYZE] = "analyze_ms",
+    [TRACE_STAGE_TEMP_WRITE] = "temp_write_ms",
+};
+
+void trace_set_sample_rate(double rate) {
+    if (rate < 0) {
+        rate = 0;
+    } else if (rate > 1) {
+        rate = 1;
+    }
+    atomic_store(&sample_rate, rate);
+}
+
+double trace_get_sample_rate(void) {
+    return atomic_load(&sample_rate);
+}
+
+// Spreads the sequential ids evenly, so the sampling decision needs no shared random state
+static uint64_t mix_id(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+void trace_begin_request(void) {
+    current.id = atomic_fetch_add(&next_trace_id, 1);
+    current.sampled = (mix_id(current.id) >> 11) * 0x1.0p-53 < atomic_load(&sample_rate);
+}
+
+TraceContext trace_current(void) {
+    return current;
+}
+
+void trace_set_current(TraceContext context) {
+    current = context;
+}
+
+void trace_clear_current(void) {
+    current.id = 0;
+    current.sampled = 0;
+}
+
+double trace_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void release_ring(void *ring) {
+    pthread_mutex_lock(&rings_mutex);
+    ((TraceRing *)ring)->next_free = free_rings;
+    free_rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+static void create_ring_key(void) {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+// Rings are only created for threads that record a sampled span, and reused after they exit
+static TraceRing *current_ring(void) {
+    if (thread_ring) {
+        return thread_ring;
+    }
+    pthread_once(&ring_key_once, create_ring_key);
+
+    pthread_mutex_lock(&rings_mutex);
+    TraceRing *ring = free_rings;
+    if (ring) {
+        free_rings = ring->next_free;
+    } else {
+        ring = calloc(1, sizeof(TraceRing));
+        if (ring) {
+            pthread_mutex_init(&ring->lock, NULL);
+            ring->tid = ++ring_count;
+            ring->next = all_rings;
+            all_rings = ring;
+        }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+
+    if (ring) {
+        pthread_setspecific(ring_key, ring);
+        thread_ring = ring;
+    }
+    return ring;
+}
+
+static void ring_push(const char *name, double start_us, double duration_us,
+                      const char *const *arg_names, const double *arg_values, int arg_count) {
+    TraceRing *ring = current_ring();
+    if (!ring) {
+        return;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    TraceEvent *event = &ring->events[ring->written % TRACE_RING_SIZE];
+    event->name = name;
+    event->trace_id = current.id;
+    event->start_us = start_us;
+    event->duration_us = duration_us;
+    event->arg_count = arg_count;
+    for (int i = 0; i < arg_count; i++) {
+        event->arg_names[i] = arg_names[i];
+        event->arg_values[i] = arg_values[i];
+    }
+    ring->written++;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+TraceSpan trace_span_begin(const char *name) {
+    TraceSpan span;
+    span.name = name;
+    span.arg_count = 0;
+    span.start_us = 0;
+    if (current.sampled) {
+        memcpy(span.stage_us, stage_totals_us, sizeof(span.stage_us));
+        span.start_us = trace_now_us();
+    }
+    return span;
+}
+
+static void span_add_arg(TraceSpan *span, const char *name, double value, int limit) {
+    if (span->start_us > 0 && span->arg_count < limit) {
+        span->arg_names[span->arg_count] = name;
+        span->arg_values[span->arg_count] = value;
+        span->arg_count++;
+    }
+}
+
+void trace_span_set_arg(TraceSpan *span, const char *name, double value) {
+    span_add_arg(span, name, value, TRACE_MAX_ARGS);
+}
+
+void trace_span_end(TraceSpan *span) {
+    if (span->start_us <= 0) {
+        return;
+    }
+    double end_us = trace_now_us();
+
+    for (int stage = 0; stage < TRACE_STAGE_COUNT; stage++) {
+        double spent_us = stage_totals_us[stage] - span->stage_us[stage];
+        if (spent_us > 0) {
+            // Room for every stage is kept past the explicit arguments
+            span_add_arg(span, stage_names[stage], spent_us / 1000.0, TRACE_MAX_SPAN_ARGS);
+        }
+    }
+    ring_push(span->name, span->start_us, end_us - span->start_us, span->arg_names, span->arg_values, span->arg_count);
+    span->start_us = 0;
+}
+
+void trace_record(const char *name, double start_us, double duration_us) {
+    if (current.sampled) {
+        ring_push(name, start_us, duration_us, NULL, NULL, 0);
+    }
+}
+
+double trace_stage_begin(void) {
+    return current.sampled ? trace_now_us() : 0;
+}
+
+void trace_stage_end(TraceStage stage, double start_us) {
+    if (start_us > 0) {
+        stage_totals_us[stage] += trace_now_us() - start_us;
+    }
+}
+
+void trace_write_json(int fd) {
+    char *text = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&text, &length);
+    if (!out) {
+        perror("Failed to export trace");
+        return;
+    }
+
+    fprintf(out, "{\"traceEvents\":[");
+    int first = 1;
+
+    pthread_mutex_lock(&rings_mutex);
+    for (TraceRing *ring = all_rings; ring; ring = ring->next) {
+        pthread_mutex_lock(&ring->lock);
+        uint64_t oldest = ring->written > TRACE_RING_SIZE ? ring->written - TRACE_RING_SIZE : 0;
+        for (uint64_t i = oldest; i < ring->written; i++) {
+            const TraceEvent *event = &ring->events[i % TRACE_RING_SIZE];
+            fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                         "\"args\":{\"request\":%llu",
+                    first ? "" : ",", event->name, (int)getpid(), ring->tid, event->start_us, event->duration_us,
+                    (unsigned long long)event->trace_id);
+            for (int arg = 0; arg < event->arg_count; arg++) {
+                fprintf(out, ",\"%s\":%.3f", event->arg_names[arg], event->arg_values[arg]);
+            }
+            fprintf(out, "}}");
+            first = 0;
+        }
+        pthread_mutex_unlock(&ring->lock);
+    }
+    pthread_mutex_unlock(&rings_mutex);
+
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(out);
+
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = write(fd, text + written, length - written);
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    free(text);
+}
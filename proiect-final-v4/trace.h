@@ -0,0 +1,77 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Fraction of requests that are traced, can be changed at runtime from the admin socket
+#define TRACE_DEFAULT_SAMPLE_RATE 0.01
+// Spans kept per thread; older ones are overwritten
+#define TRACE_RING_SIZE 1024
+// Arguments set with trace_span_set_arg; the stage totals come on top
+#define TRACE_MAX_ARGS 4
+
+// Identifies a request across the threads that work on it
+typedef struct {
+    uint64_t id;
+    int sampled;
+} TraceContext;
+
+// Work inside a span that is too fine-grained for spans of its own (per packet, per
+// chunk) is timed by stage; the totals are attached to the enclosing span as arguments
+typedef enum {
+    TRACE_STAGE_DECODE = 0,
+    TRACE_STAGE_RESAMPLE,
+    TRACE_STAGE_ENCODE,
+    TRACE_STAGE_MUX,
+    TRACE_STAGE_ANALYZE,
+    TRACE_STAGE_TEMP_WRITE,
+    TRACE_STAGE_COUNT
+} TraceStage;
+
+#define TRACE_MAX_SPAN_ARGS (TRACE_MAX_ARGS + TRACE_STAGE_COUNT)
+
+typedef struct {
+    const char *name;           // must be a string literal
+    double start_us;            // 0 when the request isn't sampled
+    double stage_us[TRACE_STAGE_COUNT]; // stage totals of the thread when the span began
+    const char *arg_names[TRACE_MAX_SPAN_ARGS];
+    double arg_values[TRACE_MAX_SPAN_ARGS];
+    int arg_count;
+} TraceSpan;
+
+void trace_set_sample_rate(double rate);
+double trace_get_sample_rate(void);
+
+// Starts a new request on this thread and decides whether it is sampled
+void trace_begin_request(void);
+
+// Context of the request on this thread, to hand over to another thread
+TraceContext trace_current(void);
+void trace_set_current(TraceContext context);
+void trace_clear_current(void);
+
+double trace_now_us(void);
+
+TraceSpan trace_span_begin(const char *name);
+void trace_span_end(TraceSpan *span);
+
+// Attaches a number to the span; at most TRACE_MAX_ARGS, further ones are dropped
+void trace_span_set_arg(TraceSpan *span, const char *name, double value);
+
+// Records a span that has already happened, e.g. time spent queued
+void trace_record(const char *name, double start_us, double duration_us);
+
+double trace_stage_begin(void);
+void trace_stage_end(TraceStage stage, double start_us);
+
+// Times one statement as part of a stage; costs a thread-local check when not sampled
+#define TRACE_STAGE(stage, statement) do {              \
+        double trace_stage_start_ = trace_stage_begin(); \
+        statement;                                       \
+        trace_stage_end(stage, trace_stage_start_);      \
+    } while (0)
+
+// Writes the spans of all threads as Chrome trace-event JSON (chrome://tracing, Perfetto)
+void trace_write_json(int fd);
+
+#endif // TRACE_H
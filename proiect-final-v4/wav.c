@@ -0,0 +1,260 @@
+#include "wav.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_IEEE_FLOAT 0x0003
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+#define WAV_MAX_CHANNELS 8
+#define WAV_HEADER_SIZE 44
+
+static uint16_t read_le16(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t read_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void write_le16(uint8_t *p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void write_le32(uint8_t *p, uint32_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = value >> 24;
+}
+
+// Checks the fmt chunk and fills in the sample layout
+static int parse_fmt(WavReader *reader, const uint8_t *chunk, uint32_t size) {
+    if (size < 16) {
+        return -1;
+    }
+
+    uint16_t format = read_le16(chunk);
+    reader->channels = read_le16(chunk + 2);
+    reader->sample_rate = (int)read_le32(chunk + 4);
+    reader->block_align = read_le16(chunk + 12);
+    reader->bits_per_sample = read_le16(chunk + 14);
+
+    // WAVE_FORMAT_EXTENSIBLE keeps the real format in the first two bytes of the sub-format GUID
+    if (format == WAV_FORMAT_EXTENSIBLE) {
+        if (size < 40) {
+            return -1;
+        }
+        format = read_le16(chunk + 24);
+    }
+
+    if (format == WAV_FORMAT_PCM && (reader->bits_per_sample == 8 || reader->bits_per_sample == 16 ||
+                                     reader->bits_per_sample == 24 || reader->bits_per_sample == 32)) {
+        reader->sample_type = WAV_SAMPLE_INT;
+    } else if (format == WAV_FORMAT_IEEE_FLOAT && (reader->bits_per_sample == 32 || reader->bits_per_sample == 64)) {
+        reader->sample_type = WAV_SAMPLE_FLOAT;
+    } else {
+        return -1;
+    }
+
+    if (reader->channels < 1 || reader->channels > WAV_MAX_CHANNELS || reader->sample_rate <= 0 ||
+        reader->block_align != reader->channels * reader->bits_per_sample / 8) {
+        return -1;
+    }
+    return 0;
+}
+
+int wav_open(WavReader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < WAV_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    reader->map = map;
+    reader->map_size = st.st_size;
+    // The samples are read once from start to end
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const uint8_t *p = reader->map;
+    const uint8_t *end = p + reader->map_size;
+    if (memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0) {
+        wav_close(reader);
+        return -1;
+    }
+
+    // Chunks can come in any order and the ones we don't need (LIST, fact, ...) are skipped
+    int have_fmt = 0;
+    p += 12;
+    while (end - p >= 8) {
+        uint32_t size = read_le32(p + 4);
+        const uint8_t *body = p + 8;
+
+        if (memcmp(p, "fmt ", 4) == 0) {
+            if (size > (size_t)(end - body) || parse_fmt(reader, body, size) != 0) {
+                break;
+            }
+            have_fmt = 1;
+        } else if (memcmp(p, "data", 4) == 0) {
+            if (!have_fmt) {
+                break;
+            }
+            // Writers that stream often leave the size unset or too large, so the file end wins
+            size_t available = end - body;
+            size_t data_size = size < available ? size : available;
+            reader->data = body;
+            reader->frames = data_size / reader->block_align;
+            return 0;
+        }
+
+        // Chunks are padded to an even size
+        size_t advance = 8 + (size_t)size + (size & 1);
+        if (advance > (size_t)(end - p)) {
+            break;
+        }
+        p += advance;
+    }
+
+    wav_close(reader);
+    return -1;
+}
+
+void wav_close(WavReader *reader) {
+    if (reader->map) {
+        munmap((void *)reader->map, reader->map_size);
+    }
+    memset(reader, 0, sizeof(*reader));
+}
+
+static int write_all(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static void fill_header(uint8_t *header, int channels, int sample_rate, int bits_per_sample, uint64_t data_bytes) {
+    // RIFF sizes are 32 bits; longer files keep the maximum, which readers treat as "until the end"
+    uint32_t data_size = data_bytes > UINT32_MAX - 36 ? UINT32_MAX - 36 : (uint32_t)data_bytes;
+    int block_align = channels * bits_per_sample / 8;
+
+    memcpy(header, "RIFF", 4);
+    write_le32(header + 4, 36 + data_size);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    write_le32(header + 16, 16);
+    write_le16(header + 20, WAV_FORMAT_PCM);
+    write_le16(header + 22, channels);
+    write_le32(header + 24, sample_rate);
+    write_le32(header + 28, sample_rate * block_align);
+    write_le16(header + 32, block_align);
+    write_le16(header + 34, bits_per_sample);
+    memcpy(header + 36, "data", 4);
+    write_le32(header + 40, data_size);
+}
+
+int wav_writer_open(WavWriter *writer, const char *path, int channels, int sample_rate, int bits_per_sample) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+    writer->block_align = channels * bits_per_sample / 8;
+
+    writer->buffer = malloc(WAV_WRITE_BUFFER_SIZE);
+    if (!writer->buffer) {
+        return -1;
+    }
+
+    // The header goes in front of the first block, the sizes are patched when the writer is closed
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0) {
+        perror("Failed to create WAV file");
+        free(writer->buffer);
+        writer->buffer = NULL;
+        return -1;
+    }
+    fill_header(writer->buffer, channels, sample_rate, bits_per_sample, 0);
+    writer->buffered = WAV_HEADER_SIZE;
+    return 0;
+}
+
+int wav_writer_write(WavWriter *writer, const void *samples, size_t bytes) {
+    const uint8_t *data = samples;
+    writer->data_bytes += bytes;
+
+    while (bytes > 0) {
+        size_t space = WAV_WRITE_BUFFER_SIZE - writer->buffered;
+        // Blocks at least as large as the buffer skip the copy
+        if (writer->buffered == 0 && bytes >= WAV_WRITE_BUFFER_SIZE) {
+            size_t direct = bytes - bytes % WAV_WRITE_BUFFER_SIZE;
+            if (write_all(writer->fd, data, direct) != 0) {
+                return -1;
+            }
+            data += direct;
+            bytes -= direct;
+            continue;
+        }
+
+        size_t take = bytes < space ? bytes : space;
+        memcpy(writer->buffer + writer->buffered, data, take);
+        writer->buffered += take;
+        data += take;
+        bytes -= take;
+
+        if (writer->buffered == WAV_WRITE_BUFFER_SIZE) {
+            if (write_all(writer->fd, writer->buffer, writer->buffered) != 0) {
+                return -1;
+            }
+            writer->buffered = 0;
+        }
+    }
+    return 0;
+}
+
+int wav_writer_close(WavWriter *writer) {
+    if (writer->fd < 0) {
+        return -1;
+    }
+
+    int result = write_all(writer->fd, writer->buffer, writer->buffered);
+
+    // Data of a partial frame would shift every channel after it, so the size is rounded down
+    uint64_t data_bytes = writer->data_bytes - writer->data_bytes % writer->block_align;
+    if (result == 0) {
+        uint8_t sizes[4];
+        write_le32(sizes, data_bytes > UINT32_MAX - 36 ? UINT32_MAX : (uint32_t)(36 + data_bytes));
+        if (pwrite(writer->fd, sizes, 4, 4) != 4) {
+            result = -1;
+        }
+        write_le32(sizes, data_bytes > UINT32_MAX - 36 ? UINT32_MAX - 36 : (uint32_t)data_bytes);
+        if (pwrite(writer->fd, sizes, 4, 40) != 4) {
+            result = -1;
+        }
+    }
+
+    if (close(writer->fd) != 0) {
+        result = -1;
+    }
+    free(writer->buffer);
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+    return result;
+}
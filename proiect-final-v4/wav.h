@@ -0,0 +1,48 @@
+#ifndef WAV_H
+#define WAV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// PCM data is written out in blocks of this size
+#define WAV_WRITE_BUFFER_SIZE (1 << 20)
+
+typedef enum {
+    WAV_SAMPLE_INT = 0,     // unsigned for 8 bits, signed above
+    WAV_SAMPLE_FLOAT
+} WavSampleType;
+
+// A memory-mapped RIFF/WAVE file with interleaved PCM samples
+typedef struct {
+    const uint8_t *map;
+    size_t map_size;
+    int channels;
+    int sample_rate;
+    int bits_per_sample;
+    WavSampleType sample_type;
+    int block_align;            // bytes per frame (one sample of every channel)
+    const uint8_t *data;        // first frame
+    size_t frames;
+} WavReader;
+
+// Maps the file and validates its fmt and data chunks; returns 0 on success, -1 when the
+// file isn't a WAV file this reader understands (compressed, truncated, ...)
+int wav_open(WavReader *reader, const char *path);
+void wav_close(WavReader *reader);
+
+// Writes a canonical 44-byte header up front and fills in the sizes on close
+typedef struct {
+    int fd;
+    int block_align;
+    uint64_t data_bytes;
+    uint8_t *buffer;
+    size_t buffered;
+} WavWriter;
+
+int wav_writer_open(WavWriter *writer, const char *path, int channels, int sample_rate, int bits_per_sample);
+int wav_writer_write(WavWriter *writer, const void *samples, size_t bytes);
+
+// Flushes the remaining samples and completes the header; returns 0 if everything was written
+int wav_writer_close(WavWriter *writer);
+
+#endif // WAV_H